@@ -19,7 +19,15 @@ typedef png_libpng_version_1_5_7 Your_png_h_is_not_version_1_5_7;
 
 /* Override standards-compliant mode for Apple's CgBI "optimized" format */
 #ifdef PNG_APPLE_MODE_SUPPORTED
+/* Per thread, so that reads and writes on different threads can't switch
+ * each other's mode. */
+#if defined(_MSC_VER)
+static __declspec(thread) png_byte _png_apple_mode = 0;
+#elif defined(__GNUC__)
+static __thread png_byte _png_apple_mode = 0;
+#else
 static png_byte _png_apple_mode = 0;
+#endif
 void PNGAPI
 png_set_apple_mode(png_byte enabled)
 {
@@ -35,6 +43,176 @@ png_get_apple_mode(void)
 #endif
 
 
+/* Allow the vectorized row transformations in pngsimd.c */
+#ifdef PNG_SIMD_SUPPORTED
+/* Per thread, like the Apple mode above. */
+#if defined(_MSC_VER)
+static __declspec(thread) png_byte _png_simd_mode = 1;
+#elif defined(__GNUC__)
+static __thread png_byte _png_simd_mode = 1;
+#else
+static png_byte _png_simd_mode = 1;
+#endif
+void PNGAPI
+png_set_simd_mode(png_byte enabled)
+{
+	_png_simd_mode = enabled;
+}
+
+
+png_byte PNGAPI
+png_get_simd_mode(void)
+{
+	return _png_simd_mode;
+}
+#endif
+
+
+png_uint_32 PNGAPI
+png_crc32(png_uint_32 crc, png_const_bytep buf, png_size_t length)
+{
+   uLong c;
+
+#ifdef PNG_SIMD_SUPPORTED
+   if (_png_simd_mode)
+   {
+      png_size_t done = png_simd_crc32(&crc, buf, length);
+      buf += done;
+      length -= done;
+   }
+#endif
+
+   /* zlib takes at most a uInt at a time. */
+   c = crc;
+   while (length > 0)
+   {
+      uInt n = length > 0x40000000 ? 0x40000000 : (uInt)length;
+      c = crc32(c, buf, n);
+      buf += n;
+      length -= n;
+   }
+
+   return (png_uint_32)c;
+}
+
+png_uint_32 PNGAPI
+png_adler32(png_uint_32 adler, png_const_bytep buf, png_size_t length)
+{
+   uLong a;
+
+#ifdef PNG_SIMD_SUPPORTED
+   if (_png_simd_mode)
+   {
+      png_size_t done = png_simd_adler32(&adler, buf, length);
+      buf += done;
+      length -= done;
+   }
+#endif
+
+   a = adler;
+   while (length > 0)
+   {
+      uInt n = length > 0x40000000 ? 0x40000000 : (uInt)length;
+      a = adler32(a, buf, n);
+      buf += n;
+      length -= n;
+   }
+
+   return (png_uint_32)a;
+}
+
+
+/* Stage timing, see png_stats in png.h */
+#ifdef PNG_STATS_SUPPORTED
+#if defined(__APPLE__)
+#  include <mach/mach_time.h>
+#elif defined(_WIN32)
+#  include <windows.h>
+#else
+#  include <time.h>
+#endif
+
+void PNGAPI
+png_set_stats(png_structp png_ptr, png_statsp stats)
+{
+	if (png_ptr != NULL)
+		png_ptr->stats = stats;
+}
+
+
+png_stats_uint PNGAPI
+png_stats_clock(void)
+{
+#if defined(__APPLE__)
+	static mach_timebase_info_data_t timebase;
+	if (timebase.denom == 0)
+		mach_timebase_info( &timebase );
+	return (png_stats_uint)mach_absolute_time() * timebase.numer / timebase.denom;
+#elif defined(_WIN32)
+	LARGE_INTEGER now, frequency;
+	QueryPerformanceCounter( &now );
+	QueryPerformanceFrequency( &frequency );
+	return (png_stats_uint)( (double)now.QuadPart * 1e9 / (double)frequency.QuadPart );
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (png_stats_uint)now.tv_sec * 1000000000u + (png_stats_uint)now.tv_nsec;
+#else
+	return (png_stats_uint)clock() * ( 1000000000u / CLOCKS_PER_SEC );
+#endif
+}
+#endif
+
+
+/* Trace callback, see PNG_TRACE_SUPPORTED in png.h */
+#ifdef PNG_TRACE_SUPPORTED
+void PNGAPI
+png_set_trace_fn(png_structp png_ptr, png_voidp trace_ptr,
+    png_trace_ptr trace_fn)
+{
+	if (png_ptr == NULL)
+		return;
+
+	png_ptr->trace_ptr = trace_ptr;
+	png_ptr->trace_fn = trace_fn;
+}
+
+
+png_voidp PNGAPI
+png_get_trace_ptr(png_const_structp png_ptr)
+{
+	if (png_ptr == NULL)
+		return NULL;
+
+	return png_ptr->trace_ptr;
+}
+#endif
+
+
+/* IDAT data callback, see PNG_IDAT_FN_SUPPORTED in png.h */
+#ifdef PNG_IDAT_FN_SUPPORTED
+void PNGAPI
+png_set_idat_fn(png_structp png_ptr, png_voidp idat_ptr, png_idat_ptr idat_fn)
+{
+	if (png_ptr == NULL)
+		return;
+
+	png_ptr->idat_ptr = idat_ptr;
+	png_ptr->idat_fn = idat_fn;
+}
+
+
+png_voidp PNGAPI
+png_get_idat_ptr(png_const_structp png_ptr)
+{
+	if (png_ptr == NULL)
+		return NULL;
+
+	return png_ptr->idat_ptr;
+}
+#endif
+
+
 /* Tells libpng that we have already handled the first "num_bytes" bytes
  * of the PNG file signature.  If the PNG data is embedded into another
  * stream we can set num_bytes = 8 so that libpng will not attempt to read
@@ -153,35 +331,8 @@ png_calculate_crc(png_structp png_ptr, png_const_bytep ptr, png_size_t length)
          need_crc = 0;
    }
 
-   /* 'uLong' is defined as unsigned long, this means that on some systems it is
-    * a 64 bit value.  crc32, however, returns 32 bits so the following cast is
-    * safe.  'uInt' may be no more than 16 bits, so it is necessary to perform a
-    * loop here.
-    */
    if (need_crc && length > 0)
-   {
-      uLong crc = png_ptr->crc; /* Should never issue a warning */
-
-      do
-      {
-         uInt safeLength = (uInt)length;
-         if (safeLength == 0)
-            safeLength = (uInt)-1; /* evil, but safe */
-
-         crc = crc32(crc, ptr, safeLength);
-
-         /* The following should never issue compiler warnings, if they do the
-          * target system has characteristics that will probably violate other
-          * assumptions within the libpng code.
-          */
-         ptr += safeLength;
-         length -= safeLength;
-      }
-      while (length > 0);
-
-      /* And the following is always safe because the crc is only 32 bits. */
-      png_ptr->crc = (png_uint_32)crc;
-   }
+      png_ptr->crc = png_crc32(png_ptr->crc, ptr, length);
 }
 
 /* Check a user supplied version number, called from both read and write
@@ -982,6 +982,118 @@ PNG_EXPORT(998, void, png_set_apple_mode, (png_byte enabled));
 PNG_EXPORT(999, png_byte, png_get_apple_mode, (void));
 #endif
 
+/* Use the vectorized row transformations in pngsimd.c where the CPU allows.
+ * On by default; turning it off forces the C versions. The setting is per
+ * thread, and threads the library starts itself keep the default.
+ */
+#define PNG_SIMD_SUPPORTED
+#ifdef PNG_SIMD_SUPPORTED
+PNG_EXPORT(996, void, png_set_simd_mode, (png_byte enabled));
+PNG_EXPORT(997, png_byte, png_get_simd_mode, (void));
+#endif
+
+/* zlib's crc32 and adler32, taking a png_size_t length, using the vector
+ * versions in pngsimd.c when SIMD mode is on and the CPU has them.  Chunk
+ * CRCs are computed the same way.
+ */
+PNG_EXPORT(988, png_uint_32, png_crc32, (png_uint_32 crc, png_const_bytep buf,
+    png_size_t length));
+PNG_EXPORT(987, png_uint_32, png_adler32, (png_uint_32 adler,
+    png_const_bytep buf, png_size_t length));
+
+/* Per-stage counters, updated while a png_struct reads or writes when
+ * png_set_stats has been given somewhere to put them.  Times are in
+ * nanoseconds from png_stats_clock and are taken once per row or chunk,
+ * never per pixel.  Counters are only ever added to, so a single png_stats
+ * can collect several png_structs.
+ */
+#define PNG_STATS_SUPPORTED
+#ifdef PNG_STATS_SUPPORTED
+typedef unsigned long long png_stats_uint;
+typedef struct png_stats_struct
+{
+   png_stats_uint bytes_read;        /* everything through png_read_data */
+   png_stats_uint idat_bytes;        /* compressed image data */
+   png_stats_uint rows;              /* rows read or written, all passes */
+   png_stats_uint inflate_ns;
+   png_stats_uint unfilter_ns[5];    /* by filter type, NONE to PAETH */
+   png_stats_uint unfilter_rows[5];
+   png_stats_uint transform_ns;      /* not counting the user transform */
+   png_stats_uint user_transform_ns;
+   png_stats_uint filter_ns;         /* write side filter selection */
+   png_stats_uint deflate_ns;
+   png_stats_uint bytes_written;     /* everything through png_write_data */
+} png_stats;
+typedef png_stats FAR * png_statsp;
+
+PNG_EXPORT(994, void, png_set_stats, (png_structp png_ptr, png_statsp stats));
+PNG_EXPORT(995, png_stats_uint, png_stats_clock, (void));
+#endif
+
+/* Trace points at each IDAT chunk, interlace pass and band of rows.  Each
+ * is a USDT probe in the "libpng" provider when <sys/sdt.h> is found at
+ * build time (Linux), and a call to the function given to png_set_trace_fn.
+ */
+#define PNG_TRACE_SUPPORTED
+#ifdef PNG_TRACE_SUPPORTED
+#define PNG_TRACE_IDAT      1   /* arg: chunk length, as each chunk starts */
+#define PNG_TRACE_PASS      2   /* arg: pass number, at its first row */
+#define PNG_TRACE_ROW_BAND  3   /* arg: row number, every PNG_TRACE_BAND_ROWS */
+#define PNG_TRACE_BAND_ROWS 64
+
+typedef PNG_CALLBACK(void, *png_trace_ptr, (png_structp, int, png_uint_32));
+
+PNG_EXPORT(992, void, png_set_trace_fn, (png_structp png_ptr,
+    png_voidp trace_ptr, png_trace_ptr trace_fn));
+PNG_EXPORT(993, png_voidp, png_get_trace_ptr, (png_const_structp png_ptr));
+#endif
+
+/* A function given the IDAT data as the chunk reader takes it in: the
+ * contents of each chunk in turn, each piece passed on as it is fed to the
+ * CRC and before inflate sees it.  That includes IDAT data skipped rather
+ * than inflated, such as what png_finish_idat reads.
+ */
+#define PNG_IDAT_FN_SUPPORTED
+#ifdef PNG_IDAT_FN_SUPPORTED
+typedef PNG_CALLBACK(void, *png_idat_ptr, (png_structp, png_const_bytep,
+    png_size_t));
+
+PNG_EXPORT(986, void, png_set_idat_fn, (png_structp png_ptr,
+    png_voidp idat_ptr, png_idat_ptr idat_fn));
+PNG_EXPORT(985, png_voidp, png_get_idat_ptr, (png_const_structp png_ptr));
+#endif
+
+/* For applications that take over reading the image data after
+ * png_read_info(): the bytes of the first IDAT chunk not yet consumed (its
+ * header has been read and its CRC started over the chunk name), and the
+ * unfiltering libpng applies to one row of a non-interlaced image.  'row'
+ * points past the filter byte; 'prev_row' is the previous unfiltered row, or
+ * zeros for the first row.  The first call sets up libpng's unfilter table,
+ * so make one (a PNG_FILTER_VALUE_NONE row will do) before sharing png_ptr
+ * between threads that unfilter different rows.  png_finish_idat reads
+ * through what is left of the IDAT chunks once the rows are in, checking
+ * their CRCs, and stops after the header of the chunk that follows.
+ */
+#define PNG_READ_TAKEOVER_SUPPORTED
+#ifdef PNG_READ_TAKEOVER_SUPPORTED
+PNG_EXPORT(990, png_uint_32, png_get_idat_remaining,
+    (png_const_structp png_ptr));
+PNG_EXPORT(991, void, png_unfilter_row, (png_structp png_ptr, png_bytep row,
+    png_const_bytep prev_row, int filter));
+PNG_EXPORT(984, void, png_finish_idat, (png_structp png_ptr));
+#endif
+
+/* Ends the compressed data so far with a full flush, so that a decoder can
+ * start inflating at the next row without any of the data before it, and
+ * filters that row with None or Sub only.  Returns the offset of the next
+ * row's data in the IDAT stream (the IDAT chunk data concatenated), or 0
+ * once all rows have been written.  Not for interlaced images.
+ */
+#if defined(PNG_WRITE_FLUSH_SUPPORTED) && defined(PNG_WRITE_FILTER_SUPPORTED)
+#define PNG_WRITE_RESTART_SUPPORTED
+PNG_EXPORT(989, png_alloc_size_t, png_write_restart, (png_structp png_ptr));
+#endif
+
 
 /* Returns the version number of the library */
 PNG_EXPORT(1, png_uint_32, png_access_version_number, (void));
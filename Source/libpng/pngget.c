@@ -1121,4 +1121,12 @@ png_get_io_chunk_name (png_structp png_ptr)
 }
 #endif /* ?PNG_IO_STATE_SUPPORTED */
 
+#ifdef PNG_READ_TAKEOVER_SUPPORTED
+png_uint_32 PNGAPI
+png_get_idat_remaining (png_const_structp png_ptr)
+{
+   return (png_ptr ? png_ptr->idat_size : 0);
+}
+#endif
+
 #endif /* PNG_READ_SUPPORTED || PNG_WRITE_SUPPORTED */
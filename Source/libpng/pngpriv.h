@@ -1121,6 +1121,95 @@ PNG_EXTERN void png_do_expand_16 PNGARG((png_row_infop row_info,
     png_bytep row));
 #endif
 
+/* Counting for png_set_stats.  Nothing is timed or counted unless a
+ * png_stats has been attached, so png_stats_start gives 0 without one.
+ */
+#ifdef PNG_STATS_SUPPORTED
+#  define png_stats_start(pp) ((pp)->stats != NULL ? png_stats_clock() : 0)
+#  define png_stats_count(pp, field, n) \
+      do { if ((pp)->stats != NULL) (pp)->stats->field += (n); } while (0)
+#  define png_stats_stop(pp, field, start) \
+      png_stats_count(pp, field, png_stats_clock() - (start))
+#endif
+
+/* Trace points.  The USDT probe costs a nop until a tracer attaches, the
+ * callback a test of trace_fn.
+ */
+#ifdef PNG_TRACE_SUPPORTED
+#  if defined(__linux__) && defined(__has_include)
+#    if __has_include(<sys/sdt.h>)
+#      include <sys/sdt.h>
+#      define PNG_USDT_SUPPORTED
+#    endif
+#  endif
+#  ifdef PNG_USDT_SUPPORTED
+#    define png_trace_probe(pp, name, arg) DTRACE_PROBE2(libpng, name, pp, arg)
+#  else
+#    define png_trace_probe(pp, name, arg)
+#  endif
+#  define png_trace(pp, name, event, arg) \
+      do { png_trace_probe(pp, name, arg); if ((pp)->trace_fn != NULL) \
+         (*(pp)->trace_fn)(pp, event, (png_uint_32)(arg)); } while (0)
+
+   /* Pass and row band boundaries, shared by png_read_row and png_write_row */
+#  define png_trace_row(pp) \
+      do { if ((pp)->row_number == 0) \
+              png_trace(pp, pass, PNG_TRACE_PASS, (pp)->pass); \
+           if ((pp)->row_number % PNG_TRACE_BAND_ROWS == 0) \
+              png_trace(pp, row_band, PNG_TRACE_ROW_BAND, (pp)->row_number); \
+      } while (0)
+#endif
+
+/* Vectorized versions of some of the above, in pngsimd.c.  Each returns 0,
+ * leaving the row alone, if it cannot handle the row on this CPU.
+ */
+#ifdef PNG_SIMD_SUPPORTED
+#if defined(PNG_READ_PACK_SUPPORTED) || defined(PNG_READ_EXPAND_SUPPORTED)
+PNG_EXTERN int png_simd_unpack PNGARG((png_bytep row, png_uint_32 row_width,
+    int bit_depth, unsigned int scale));
+#endif
+
+#ifdef PNG_READ_GRAY_TO_RGB_SUPPORTED
+PNG_EXTERN int png_simd_do_gray_to_rgb PNGARG((png_row_infop row_info,
+    png_bytep row));
+#endif
+
+#ifdef PNG_READ_FILLER_SUPPORTED
+PNG_EXTERN int png_simd_do_read_filler PNGARG((png_row_infop row_info,
+    png_bytep row, png_uint_32 filler, png_uint_32 flags));
+#endif
+
+#ifdef PNG_READ_SCALE_16_TO_8_SUPPORTED
+PNG_EXTERN int png_simd_do_scale_16_to_8 PNGARG((png_row_infop row_info,
+    png_bytep row));
+#endif
+
+#ifdef PNG_READ_STRIP_16_TO_8_SUPPORTED
+PNG_EXTERN int png_simd_do_chop PNGARG((png_row_infop row_info,
+    png_bytep row));
+#endif
+
+/* These update *crc or *adler over a leading part of buf and return its
+ * length, which may be 0.
+ */
+PNG_EXTERN png_size_t png_simd_crc32 PNGARG((png_uint_32p crc,
+    png_const_bytep buf, png_size_t length));
+PNG_EXTERN png_size_t png_simd_adler32 PNGARG((png_uint_32p adler,
+    png_const_bytep buf, png_size_t length));
+
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+/* Filters row bytes start onward into out_row (skipped when NULL) with the
+ * given PNG_FILTER_VALUE_, adding to *sum (when not NULL) the sum of
+ * absolute values png_write_find_filter uses, and stops before the sum would
+ * pass limit.  Returns the index of the first byte it left to the caller.
+ */
+PNG_EXTERN png_size_t png_simd_filter_row PNGARG((int filter,
+    png_bytep out_row, png_const_bytep row, png_const_bytep prev_row,
+    png_size_t start, png_size_t row_bytes, png_size_t bpp, png_uint_32p sum,
+    png_uint_32 limit));
+#endif
+#endif /* PNG_SIMD_SUPPORTED */
+
 /* The following decodes the appropriate chunks, and does error correction,
  * then calls the appropriate callback for the chunk if it is valid.
  */
@@ -247,6 +247,9 @@ png_read_info(png_structp png_ptr, png_infop info_ptr)
 
          png_ptr->idat_size = length;
          png_ptr->mode |= PNG_HAVE_IDAT;
+#ifdef PNG_TRACE_SUPPORTED
+         png_trace(png_ptr, idat, PNG_TRACE_IDAT, length);
+#endif
          break;
       }
 
@@ -383,6 +386,10 @@ png_read_row(png_structp png_ptr, png_bytep row, png_bytep dsp_row)
 
    png_row_info row_info;
 
+#ifdef PNG_STATS_SUPPORTED
+   png_stats_uint stats_start;
+#endif
+
    if (png_ptr == NULL)
       return;
 
@@ -443,6 +450,10 @@ png_read_row(png_structp png_ptr, png_bytep row, png_bytep dsp_row)
 #endif
    }
 
+#ifdef PNG_TRACE_SUPPORTED
+   png_trace_row(png_ptr);
+#endif
+
 #ifdef PNG_READ_INTERLACING_SUPPORTED
    /* If interlaced and we do not need a new row, combine row and return.
     * Notice that the pixels we have from previous rows have been transformed
@@ -549,6 +560,9 @@ png_read_row(png_structp png_ptr, png_bytep row, png_bytep dsp_row)
             png_ptr->idat_size = png_read_chunk_header(png_ptr);
             if (png_ptr->chunk_name != png_IDAT)
                png_error(png_ptr, "Not enough image data");
+#ifdef PNG_TRACE_SUPPORTED
+            png_trace(png_ptr, idat, PNG_TRACE_IDAT, png_ptr->idat_size);
+#endif
          }
          png_ptr->zstream.avail_in = (uInt)png_ptr->zbuf_size;
          png_ptr->zstream.next_in = png_ptr->zbuf;
@@ -557,9 +571,18 @@ png_read_row(png_structp png_ptr, png_bytep row, png_bytep dsp_row)
          png_crc_read(png_ptr, png_ptr->zbuf,
              (png_size_t)png_ptr->zstream.avail_in);
          png_ptr->idat_size -= png_ptr->zstream.avail_in;
+#ifdef PNG_STATS_SUPPORTED
+         png_stats_count(png_ptr, idat_bytes, png_ptr->zstream.avail_in);
+#endif
       }
 
+#ifdef PNG_STATS_SUPPORTED
+      stats_start = png_stats_start(png_ptr);
+#endif
       ret = inflate(&png_ptr->zstream, Z_PARTIAL_FLUSH);
+#ifdef PNG_STATS_SUPPORTED
+      png_stats_stop(png_ptr, inflate_ns, stats_start);
+#endif
 
       if (ret == Z_STREAM_END)
       {
@@ -577,6 +600,10 @@ png_read_row(png_structp png_ptr, png_bytep row, png_bytep dsp_row)
 
    } while (png_ptr->zstream.avail_out);
 
+#ifdef PNG_STATS_SUPPORTED
+   stats_start = png_stats_start(png_ptr);
+#endif
+
    if (png_ptr->row_buf[0] > PNG_FILTER_VALUE_NONE)
    {
       if (png_ptr->row_buf[0] < PNG_FILTER_VALUE_LAST)
@@ -586,6 +613,12 @@ png_read_row(png_structp png_ptr, png_bytep row, png_bytep dsp_row)
          png_error(png_ptr, "bad adaptive filter value");
    }
 
+#ifdef PNG_STATS_SUPPORTED
+   png_stats_stop(png_ptr, unfilter_ns[png_ptr->row_buf[0]], stats_start);
+   png_stats_count(png_ptr, unfilter_rows[png_ptr->row_buf[0]], 1);
+   png_stats_count(png_ptr, rows, 1);
+#endif
+
    /* libpng 1.5.6: the following line was copying png_ptr->rowbytes before
     * 1.5.6, while the buffer really is this big in current versions of libpng
     * it may not be in the future, so this was changed just to copy the
@@ -605,7 +638,21 @@ png_read_row(png_structp png_ptr, png_bytep row, png_bytep dsp_row)
 
 #ifdef PNG_READ_TRANSFORMS_SUPPORTED
    if (png_ptr->transformations)
+   {
+#ifdef PNG_STATS_SUPPORTED
+      /* The user transform is timed on its own, inside, so leave it out */
+      png_stats_uint user_ns = png_ptr->stats != NULL ?
+         png_ptr->stats->user_transform_ns : 0;
+
+      stats_start = png_stats_start(png_ptr);
+#endif
       png_do_read_transformations(png_ptr, &row_info);
+#ifdef PNG_STATS_SUPPORTED
+      if (png_ptr->stats != NULL)
+         png_ptr->stats->transform_ns += png_stats_clock() - stats_start -
+            (png_ptr->stats->user_transform_ns - user_ns);
+#endif
+   }
 #endif
 
    /* The transformed pixel depth should match the depth now in row_info. */
@@ -33,6 +33,10 @@ png_read_data(png_structp png_ptr, png_bytep data, png_size_t length)
 {
    png_debug1(4, "reading %d bytes", (int)length);
 
+#ifdef PNG_STATS_SUPPORTED
+   png_stats_count(png_ptr, bytes_read, length);
+#endif
+
    if (png_ptr->read_data_fn != NULL)
       (*(png_ptr->read_data_fn))(png_ptr, data, length);
 
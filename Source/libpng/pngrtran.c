@@ -2332,6 +2332,9 @@ png_do_read_transformations(png_structp png_ptr, png_row_infop row_info)
 #ifdef PNG_READ_USER_TRANSFORM_SUPPORTED
    if (png_ptr->transformations & PNG_USER_TRANSFORM)
     {
+#ifdef PNG_STATS_SUPPORTED
+      png_stats_uint stats_start = png_stats_start(png_ptr);
+#endif
       if (png_ptr->read_user_transform_fn != NULL)
          (*(png_ptr->read_user_transform_fn)) /* User read transform function */
              (png_ptr,     /* png_ptr */
@@ -2343,6 +2346,9 @@ png_do_read_transformations(png_structp png_ptr, png_row_infop row_info)
                 /*  png_byte channels;       number of channels (1-4) */
                 /*  png_byte pixel_depth;    bits per pixel (depth*channels) */
              png_ptr->row_buf + 1);    /* start of pixel data for row */
+#ifdef PNG_STATS_SUPPORTED
+      png_stats_stop(png_ptr, user_transform_ns, stats_start);
+#endif
 #ifdef PNG_USER_TRANSFORM_PTR_SUPPORTED
       if (png_ptr->user_transform_depth)
          row_info->bit_depth = png_ptr->user_transform_depth;
@@ -2375,6 +2381,9 @@ png_do_unpack(png_row_infop row_info, png_bytep row)
       png_uint_32 i;
       png_uint_32 row_width=row_info->width;
 
+#ifdef PNG_SIMD_SUPPORTED
+      if (!png_simd_unpack(row, row_width, row_info->bit_depth, 1))
+#endif
       switch (row_info->bit_depth)
       {
          case 1:
@@ -2607,6 +2616,11 @@ png_do_scale_16_to_8(png_row_infop row_info, png_bytep row)
 {
    png_debug(1, "in png_do_scale_16_to_8");
 
+#ifdef PNG_SIMD_SUPPORTED
+   if (png_simd_do_scale_16_to_8(row_info, row))
+      return;
+#endif
+
    if (row_info->bit_depth == 16)
    {
       png_bytep sp = row; /* source */
@@ -2668,6 +2682,11 @@ png_do_chop(png_row_infop row_info, png_bytep row)
 {
    png_debug(1, "in png_do_chop");
 
+#ifdef PNG_SIMD_SUPPORTED
+   if (png_simd_do_chop(row_info, row))
+      return;
+#endif
+
    if (row_info->bit_depth == 16)
    {
       png_bytep sp = row; /* source */
@@ -2901,6 +2920,11 @@ png_do_read_filler(png_row_infop row_info, png_bytep row,
 
    png_debug(1, "in png_do_read_filler");
 
+#ifdef PNG_SIMD_SUPPORTED
+   if (png_simd_do_read_filler(row_info, row, filler, flags))
+      return;
+#endif
+
    if (
        row_info->color_type == PNG_COLOR_TYPE_GRAY)
    {
@@ -3082,6 +3106,11 @@ png_do_gray_to_rgb(png_row_infop row_info, png_bytep row)
 
    png_debug(1, "in png_do_gray_to_rgb");
 
+#ifdef PNG_SIMD_SUPPORTED
+   if (png_simd_do_gray_to_rgb(row_info, row))
+      return;
+#endif
+
    if (row_info->bit_depth >= 8 &&
        !(row_info->color_type & PNG_COLOR_MASK_COLOR))
    {
@@ -4628,6 +4657,10 @@ png_do_expand(png_row_infop row_info, png_bytep row,
                case 1:
                {
                   gray = (png_uint_16)((gray & 0x01) * 0xff);
+#ifdef PNG_SIMD_SUPPORTED
+                  if (png_simd_unpack(row, row_width, 1, 0xff))
+                     break;
+#endif
                   sp = row + (png_size_t)((row_width - 1) >> 3);
                   dp = row + (png_size_t)row_width - 1;
                   shift = 7 - (int)((row_width + 7) & 0x07);
@@ -4656,6 +4689,10 @@ png_do_expand(png_row_infop row_info, png_bytep row,
                case 2:
                {
                   gray = (png_uint_16)((gray & 0x03) * 0x55);
+#ifdef PNG_SIMD_SUPPORTED
+                  if (png_simd_unpack(row, row_width, 2, 0x55))
+                     break;
+#endif
                   sp = row + (png_size_t)((row_width - 1) >> 2);
                   dp = row + (png_size_t)row_width - 1;
                   shift = (int)((3 - ((row_width + 3) & 0x03)) << 1);
@@ -4681,6 +4718,10 @@ png_do_expand(png_row_infop row_info, png_bytep row,
                case 4:
                {
                   gray = (png_uint_16)((gray & 0x0f) * 0x11);
+#ifdef PNG_SIMD_SUPPORTED
+                  if (png_simd_unpack(row, row_width, 4, 0x11))
+                     break;
+#endif
                   sp = row + (png_size_t)((row_width - 1) >> 1);
                   dp = row + (png_size_t)row_width - 1;
                   shift = (int)((1 - ((row_width + 1) & 0x01)) << 2);
@@ -193,6 +193,10 @@ png_crc_read(png_structp png_ptr, png_bytep buf, png_size_t length)
 
    png_read_data(png_ptr, buf, length);
    png_calculate_crc(png_ptr, buf, length);
+#ifdef PNG_IDAT_FN_SUPPORTED
+   if (png_ptr->idat_fn != NULL && png_ptr->chunk_name == png_IDAT)
+      (*(png_ptr->idat_fn))(png_ptr, buf, length);
+#endif
 }
 
 /* Optionally skip data and then check the CRC.  Depending on whether we
@@ -3751,6 +3755,39 @@ png_read_filter_row(png_structp pp, png_row_infop row_info, png_bytep row,
       pp->read_filter[filter-1](row_info, row, prev_row);
 }
 
+#ifdef PNG_READ_TAKEOVER_SUPPORTED
+void PNGAPI
+png_unfilter_row(png_structp png_ptr, png_bytep row, png_const_bytep prev_row,
+   int filter)
+{
+   png_row_info row_info;
+
+   if (png_ptr == NULL || row == NULL || prev_row == NULL)
+      return;
+
+   row_info.width = png_ptr->width;
+   row_info.color_type = png_ptr->color_type;
+   row_info.bit_depth = png_ptr->bit_depth;
+   row_info.channels = png_ptr->channels;
+   row_info.pixel_depth = png_ptr->pixel_depth;
+   row_info.rowbytes = PNG_ROWBYTES(row_info.pixel_depth, row_info.width);
+
+   png_read_filter_row(png_ptr, &row_info, row, prev_row, filter);
+}
+
+void PNGAPI
+png_finish_idat(png_structp png_ptr)
+{
+   if (png_ptr == NULL || png_ptr->chunk_name != png_IDAT)
+      return;
+
+   png_crc_finish(png_ptr, png_ptr->idat_size);
+   png_ptr->idat_size = 0;
+   while (png_ptr->chunk_name == png_IDAT)
+      png_crc_finish(png_ptr, png_read_chunk_header(png_ptr));
+}
+#endif
+
 #ifdef PNG_SEQUENTIAL_READ_SUPPORTED
 void /* PRIVATE */
 png_read_finish_row(png_structp png_ptr)
@@ -0,0 +1,1120 @@
+
+/* pngsimd.c - vectorized versions of the read row expansions, write filters
+ *             and checksums
+ *
+ * The routines in this file take over from png_do_unpack, png_do_expand
+ * (gray at bit depths below 8), png_do_gray_to_rgb, png_do_read_filler,
+ * png_do_chop and png_do_scale_16_to_8 in pngrtran.c, from the filter loops
+ * of png_write_find_filter in pngwutil.c, and from zlib's crc32 and adler32,
+ * when the CPU has the instructions they need.  The instruction set is
+ * checked at run time on x86 (SSSE3 for the byte shuffles and sums, BMI2 for
+ * the sub-byte unpacking, PCLMUL and SSE4.1 for the CRC, AVX2 for the wider
+ * write filters over SSE2's); on AArch64 NEON is always present and the CRC
+ * instructions are used when the compiler targets them.
+ *
+ * Every routine must produce exactly the bytes the C version does.  Each one
+ * returns 0 without touching the row if it cannot handle the case, and the
+ * caller then falls through to the C version.  The checksums return how many
+ * bytes they took, leaving the rest to zlib, and the write filters where they
+ * stopped, leaving the rest of the row to the C loop.
+ */
+
+#include "pngpriv.h"
+
+#ifdef PNG_SIMD_SUPPORTED
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#  define PNG_SIMD_X86
+#  include <immintrin.h>
+#  define PNG_SIMD_TARGET(isa) __attribute__((target(isa)))
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#  define PNG_SIMD_NEON
+#  include <arm_neon.h>
+#  ifdef __ARM_FEATURE_CRC32
+#    include <arm_acle.h>
+#  endif
+#endif
+
+#if defined(PNG_SIMD_X86) || defined(PNG_SIMD_NEON)
+
+/* Describes an in-place expansion of every pixel in a row.  Byte i of an
+ * output pixel is byte map[i] of the input pixel, or the constant fill[i] when
+ * map[i] is PNG_SIMD_FILL.  The maps below mirror the byte order produced by
+ * the C loops in pngrtran.c exactly, including the low-byte-first order that
+ * png_do_read_filler uses for 16 bit filler.
+ */
+#define PNG_SIMD_FILL 0xff
+
+typedef struct png_simd_expansion
+{
+   unsigned int in_bytes;
+   unsigned int out_bytes;
+   png_byte map[8];
+   png_byte fill[8];
+} png_simd_expansion;
+
+/* C version of an expansion, used for the pixels at the end of a row that do
+ * not fill a whole vector.  Pixels are processed last to first so the row can
+ * be expanded in place.
+ */
+static void
+png_simd_expand_pixels(png_bytep row, png_uint_32 start, png_uint_32 end,
+    const png_simd_expansion *e)
+{
+   png_uint_32 i = end;
+
+   while (i > start)
+   {
+      png_byte pixel[8];
+      png_bytep dp;
+      unsigned int b;
+
+      --i;
+      png_memcpy(pixel, row + (png_size_t)i * e->in_bytes, e->in_bytes);
+      dp = row + (png_size_t)i * e->out_bytes;
+
+      for (b = 0; b < e->out_bytes; b++)
+         dp[b] = e->map[b] == PNG_SIMD_FILL ? e->fill[b] : pixel[e->map[b]];
+   }
+}
+
+/* Expands 'blocks' groups of pixels, last to first.  Each group is read with
+ * one 16 byte load at 'in_step' bytes per group and written as 'chunks' 16 byte
+ * vectors, each the shuffle of the load by mask[c] or'ed with fill[c].  The
+ * load happens before any store of the same group and every earlier group
+ * lies below it in memory, so the expansion is safe in place.
+ */
+#ifdef PNG_SIMD_X86
+PNG_SIMD_TARGET("ssse3") static void
+png_simd_shuffle_blocks(png_bytep row, png_uint_32 blocks,
+    unsigned int in_step, unsigned int chunks, png_const_bytep mask,
+    png_const_bytep fill)
+{
+   __m128i m[3], f[3];
+   unsigned int c;
+
+   for (c = 0; c < chunks; c++)
+   {
+      m[c] = _mm_loadu_si128((const __m128i *)(mask + 16 * c));
+      f[c] = _mm_loadu_si128((const __m128i *)(fill + 16 * c));
+   }
+
+   while (blocks-- > 0)
+   {
+      png_bytep sp = row + (png_size_t)blocks * in_step;
+      png_bytep dp = row + (png_size_t)blocks * chunks * 16;
+      __m128i v = _mm_loadu_si128((const __m128i *)sp);
+
+      for (c = 0; c < chunks; c++)
+         _mm_storeu_si128((__m128i *)(dp + 16 * c),
+             _mm_or_si128(_mm_shuffle_epi8(v, m[c]), f[c]));
+   }
+}
+#else
+static void
+png_simd_shuffle_blocks(png_bytep row, png_uint_32 blocks,
+    unsigned int in_step, unsigned int chunks, png_const_bytep mask,
+    png_const_bytep fill)
+{
+   uint8x16_t m[3], f[3];
+   unsigned int c;
+
+   for (c = 0; c < chunks; c++)
+   {
+      m[c] = vld1q_u8(mask + 16 * c);
+      f[c] = vld1q_u8(fill + 16 * c);
+   }
+
+   while (blocks-- > 0)
+   {
+      png_bytep sp = row + (png_size_t)blocks * in_step;
+      png_bytep dp = row + (png_size_t)blocks * chunks * 16;
+      uint8x16_t v = vld1q_u8(sp);
+
+      /* TBL yields zero for out-of-range indices, like PSHUFB with the top
+       * bit set, so the same masks work for both.
+       */
+      for (c = 0; c < chunks; c++)
+         vst1q_u8(dp + 16 * c, vorrq_u8(vqtbl1q_u8(v, m[c]), f[c]));
+   }
+}
+#endif
+
+static int
+png_simd_have_shuffle(void)
+{
+#ifdef PNG_SIMD_X86
+   return __builtin_cpu_supports("ssse3");
+#else
+   return 1;
+#endif
+}
+
+static int
+png_simd_expand_row(png_bytep row, png_uint_32 row_width,
+    const png_simd_expansion *e)
+{
+   png_byte mask[48], fill[48];
+   unsigned int pixels, chunks, j;
+   png_uint_32 blocks;
+
+   if (!png_get_simd_mode() || !png_simd_have_shuffle())
+      return 0;
+
+   /* Whole pixels per 16 byte load, rounded down to a power of two so that a
+    * group always expands to a whole number of vectors.
+    */
+   for (pixels = 16; pixels * e->in_bytes > 16; pixels >>= 1)
+      /* do nothing */ ;
+
+   if ((pixels * e->out_bytes) % 16 != 0 || pixels * e->out_bytes > 48)
+      return 0;
+
+   chunks = pixels * e->out_bytes / 16;
+
+   for (j = 0; j < chunks * 16; j++)
+   {
+      unsigned int p = j / e->out_bytes;
+      unsigned int b = j % e->out_bytes;
+
+      if (e->map[b] == PNG_SIMD_FILL)
+      {
+         mask[j] = 0x80;
+         fill[j] = e->fill[b];
+      }
+
+      else
+      {
+         mask[j] = (png_byte)(p * e->in_bytes + e->map[b]);
+         fill[j] = 0;
+      }
+   }
+
+   /* The pixels past the last whole group go first, they are at the end. */
+   blocks = row_width / pixels;
+   png_simd_expand_pixels(row, blocks * pixels, row_width, e);
+   png_simd_shuffle_blocks(row, blocks, pixels * e->in_bytes, chunks, mask,
+       fill);
+
+   return 1;
+}
+
+#ifdef PNG_READ_GRAY_TO_RGB_SUPPORTED
+int /* PRIVATE */
+png_simd_do_gray_to_rgb(png_row_infop row_info, png_bytep row)
+{
+   static const png_simd_expansion g8 = { 1, 3, {0, 0, 0}, {0} };
+   static const png_simd_expansion g16 = { 2, 6, {0, 1, 0, 1, 0, 1}, {0} };
+   static const png_simd_expansion ga8 = { 2, 4, {0, 0, 0, 1}, {0} };
+   static const png_simd_expansion ga16 =
+      { 4, 8, {0, 1, 0, 1, 0, 1, 2, 3}, {0} };
+   const png_simd_expansion *e;
+
+   if (row_info->color_type == PNG_COLOR_TYPE_GRAY)
+      e = row_info->bit_depth == 8 ? &g8 :
+          row_info->bit_depth == 16 ? &g16 : NULL;
+
+   else if (row_info->color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+      e = row_info->bit_depth == 8 ? &ga8 :
+          row_info->bit_depth == 16 ? &ga16 : NULL;
+
+   else
+      e = NULL;
+
+   if (e == NULL || !png_simd_expand_row(row, row_info->width, e))
+      return 0;
+
+   row_info->channels = (png_byte)(row_info->channels + 2);
+   row_info->color_type |= PNG_COLOR_MASK_COLOR;
+   row_info->pixel_depth = (png_byte)(row_info->channels *
+       row_info->bit_depth);
+   row_info->rowbytes = PNG_ROWBYTES(row_info->pixel_depth, row_info->width);
+   return 1;
+}
+#endif
+
+#ifdef PNG_READ_FILLER_SUPPORTED
+int /* PRIVATE */
+png_simd_do_read_filler(png_row_infop row_info, png_bytep row,
+    png_uint_32 filler, png_uint_32 flags)
+{
+   png_simd_expansion e;
+   png_byte lo = (png_byte)(filler & 0xff);
+   png_byte hi = (png_byte)((filler >> 8) & 0xff);
+   unsigned int colors, b;
+
+   if (row_info->color_type == PNG_COLOR_TYPE_GRAY)
+      colors = 1;
+
+   else if (row_info->color_type == PNG_COLOR_TYPE_RGB)
+      colors = 3;
+
+   else
+      return 0;
+
+   if (row_info->bit_depth != 8 && row_info->bit_depth != 16)
+      return 0;
+
+   e.in_bytes = colors * (row_info->bit_depth >> 3);
+   e.out_bytes = (colors + 1) * (row_info->bit_depth >> 3);
+   png_memset(e.fill, 0, sizeof e.fill);
+
+   {
+      unsigned int at = (flags & PNG_FLAG_FILLER_AFTER) ? e.in_bytes : 0;
+      unsigned int first = (flags & PNG_FLAG_FILLER_AFTER) ? 0 :
+          e.out_bytes - e.in_bytes;
+
+      for (b = 0; b < e.in_bytes; b++)
+         e.map[first + b] = (png_byte)b;
+
+      e.map[at] = PNG_SIMD_FILL;
+      e.fill[at] = lo;
+
+      if (row_info->bit_depth == 16)
+      {
+         e.map[at + 1] = PNG_SIMD_FILL;
+         e.fill[at + 1] = hi;
+      }
+   }
+
+   if (!png_simd_expand_row(row, row_info->width, &e))
+      return 0;
+
+   row_info->channels = (png_byte)(colors + 1);
+   row_info->pixel_depth = (png_byte)(row_info->channels *
+       row_info->bit_depth);
+   row_info->rowbytes = (png_size_t)row_info->width * e.out_bytes;
+   return 1;
+}
+#endif
+
+#if defined(PNG_READ_STRIP_16_TO_8_SUPPORTED) || \
+    defined(PNG_READ_SCALE_16_TO_8_SUPPORTED)
+/* Narrows 'count' big-endian 16 bit samples to 8 bits in place, either by
+ * keeping the high byte or by the exact rounding of png_do_scale_16_to_8.
+ * That rounding is hi + 1 when lo - hi > 128, hi - 1 when hi - lo > 128 and
+ * hi otherwise, which is what its (vlo-vhi+128)*65535 >> 24 correction works
+ * out to over the possible range of vlo-vhi.
+ */
+static png_size_t
+png_simd_narrow_16(png_bytep row, png_size_t count, int scale)
+{
+   png_size_t i = 0;
+
+#ifdef PNG_SIMD_X86
+   const __m128i low = _mm_set1_epi16(0xff);
+   const __m128i up = _mm_set1_epi16(128);
+   const __m128i down = _mm_set1_epi16(-128);
+
+   for (; i + 16 <= count; i += 16)
+   {
+      __m128i a = _mm_loadu_si128((const __m128i *)(row + 2 * i));
+      __m128i b = _mm_loadu_si128((const __m128i *)(row + 2 * i + 16));
+      __m128i ah = _mm_and_si128(a, low);
+      __m128i bh = _mm_and_si128(b, low);
+
+      if (scale)
+      {
+         __m128i ad = _mm_sub_epi16(_mm_srli_epi16(a, 8), ah);
+         __m128i bd = _mm_sub_epi16(_mm_srli_epi16(b, 8), bh);
+
+         ah = _mm_add_epi16(_mm_sub_epi16(ah, _mm_cmpgt_epi16(ad, up)),
+             _mm_cmplt_epi16(ad, down));
+         bh = _mm_add_epi16(_mm_sub_epi16(bh, _mm_cmpgt_epi16(bd, up)),
+             _mm_cmplt_epi16(bd, down));
+      }
+
+      _mm_storeu_si128((__m128i *)(row + i), _mm_packus_epi16(ah, bh));
+   }
+#else
+   const int16x8_t up = vdupq_n_s16(128);
+   const int16x8_t down = vdupq_n_s16(-128);
+
+   for (; i + 16 <= count; i += 16)
+   {
+      uint8x16x2_t v = vld2q_u8(row + 2 * i);
+
+      if (scale)
+      {
+         int16x8_t hl = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v.val[0])));
+         int16x8_t hh = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v.val[0])));
+         int16x8_t dl = vsubq_s16(
+             vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v.val[1]))), hl);
+         int16x8_t dh = vsubq_s16(
+             vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v.val[1]))), hh);
+
+         /* The comparisons give all ones (-1) where true. */
+         hl = vaddq_s16(vsubq_s16(hl,
+             vreinterpretq_s16_u16(vcgtq_s16(dl, up))),
+             vreinterpretq_s16_u16(vcltq_s16(dl, down)));
+         hh = vaddq_s16(vsubq_s16(hh,
+             vreinterpretq_s16_u16(vcgtq_s16(dh, up))),
+             vreinterpretq_s16_u16(vcltq_s16(dh, down)));
+         vst1q_u8(row + i, vcombine_u8(vqmovun_s16(hl), vqmovun_s16(hh)));
+      }
+
+      else
+         vst1q_u8(row + i, v.val[0]);
+   }
+#endif
+
+   return i;
+}
+
+static int
+png_simd_do_16_to_8(png_row_infop row_info, png_bytep row, int scale)
+{
+   png_size_t count, i;
+
+   if (row_info->bit_depth != 16 || !png_get_simd_mode())
+      return 0;
+
+   count = row_info->rowbytes >> 1;
+   i = png_simd_narrow_16(row, count, scale);
+
+   for (; i < count; i++)
+   {
+      png_int_32 tmp = row[2 * i]; /* must be signed! */
+
+      if (scale)
+         tmp += (((int)row[2 * i + 1] - tmp + 128) * 65535) >> 24;
+
+      row[i] = (png_byte)tmp;
+   }
+
+   row_info->bit_depth = 8;
+   row_info->pixel_depth = (png_byte)(8 * row_info->channels);
+   row_info->rowbytes = row_info->width * row_info->channels;
+   return 1;
+}
+#endif
+
+#ifdef PNG_READ_STRIP_16_TO_8_SUPPORTED
+int /* PRIVATE */
+png_simd_do_chop(png_row_infop row_info, png_bytep row)
+{
+   return png_simd_do_16_to_8(row_info, row, 0);
+}
+#endif
+
+#ifdef PNG_READ_SCALE_16_TO_8_SUPPORTED
+int /* PRIVATE */
+png_simd_do_scale_16_to_8(png_row_infop row_info, png_bytep row)
+{
+   return png_simd_do_16_to_8(row_info, row, 1);
+}
+#endif
+
+#if defined(PNG_READ_PACK_SUPPORTED) || defined(PNG_READ_EXPAND_SUPPORTED)
+/* Unpacks a row of 1, 2 or 4 bit samples to one byte each, multiplying every
+ * sample by 'scale' (1 to keep the values, or 0xff, 0x55 or 0x11 to stretch
+ * them to the full 8 bit range as png_do_expand does).  Works eight samples at
+ * a time, last to first: the 'bit_depth' bytes holding them are gathered big
+ * endian, PDEP spreads each sample into the low bits of its own byte, and a
+ * byte swap puts the first sample first.
+ */
+#ifdef PNG_SIMD_X86
+PNG_SIMD_TARGET("bmi2") static void
+png_simd_unpack_groups(png_bytep row, png_uint_32 groups, int bit_depth,
+    unsigned int scale)
+{
+   const unsigned long long spread = bit_depth == 1 ? 0x0101010101010101ULL :
+       bit_depth == 2 ? 0x0303030303030303ULL : 0x0f0f0f0f0f0f0f0fULL;
+
+   while (groups-- > 0)
+   {
+      png_const_bytep sp = row + (png_size_t)groups * bit_depth;
+      unsigned long long v = 0;
+      int b;
+
+      for (b = 0; b < bit_depth; b++)
+         v = (v << 8) | sp[b];
+
+      v = __builtin_bswap64(_pdep_u64(v, spread)) * scale;
+      png_memcpy(row + (png_size_t)groups * 8, &v, 8);
+   }
+}
+
+static int
+png_simd_have_unpack(void)
+{
+   return __builtin_cpu_supports("bmi2");
+}
+#else
+/* On NEON the samples of sixteen bytes are split out by shifts and written
+ * back interleaved.  1 bit rows are left to the C code.
+ */
+static void
+png_simd_unpack_groups(png_bytep row, png_uint_32 groups, int bit_depth,
+    unsigned int scale)
+{
+   const uint8x16_t s = vdupq_n_u8((png_byte)scale);
+
+   while (groups-- > 0)
+   {
+      uint8x16_t v = vld1q_u8(row + (png_size_t)groups * 16);
+
+      if (bit_depth == 4)
+      {
+         uint8x16x2_t out;
+
+         out.val[0] = vmulq_u8(vshrq_n_u8(v, 4), s);
+         out.val[1] = vmulq_u8(vandq_u8(v, vdupq_n_u8(0x0f)), s);
+         vst2q_u8(row + (png_size_t)groups * 32, out);
+      }
+
+      else
+      {
+         const uint8x16_t m = vdupq_n_u8(0x03);
+         uint8x16x4_t out;
+
+         out.val[0] = vmulq_u8(vshrq_n_u8(v, 6), s);
+         out.val[1] = vmulq_u8(vandq_u8(vshrq_n_u8(v, 4), m), s);
+         out.val[2] = vmulq_u8(vandq_u8(vshrq_n_u8(v, 2), m), s);
+         out.val[3] = vmulq_u8(vandq_u8(v, m), s);
+         vst4q_u8(row + (png_size_t)groups * 64, out);
+      }
+   }
+}
+
+static int
+png_simd_have_unpack(void)
+{
+   return 1;
+}
+#endif
+
+int /* PRIVATE */
+png_simd_unpack(png_bytep row, png_uint_32 row_width, int bit_depth,
+    unsigned int scale)
+{
+   png_uint_32 per_group, groups, i;
+   unsigned int max = (1U << bit_depth) - 1;
+
+   if (!png_get_simd_mode() || !png_simd_have_unpack())
+      return 0;
+
+   if (bit_depth != 1 && bit_depth != 2 && bit_depth != 4)
+      return 0;
+
+#ifdef PNG_SIMD_X86
+   per_group = 8;
+#else
+   if (bit_depth == 1)
+      return 0;
+
+   per_group = 128 / bit_depth;
+#endif
+
+   /* Samples past the last whole group, done first since they are last. */
+   groups = row_width / per_group;
+
+   for (i = row_width; i > groups * per_group; )
+   {
+      png_size_t bit;
+
+      --i;
+      bit = (png_size_t)i * bit_depth;
+      row[i] = (png_byte)(((row[bit >> 3] >> (8 - bit_depth - (bit & 7))) &
+          max) * scale);
+   }
+
+   png_simd_unpack_groups(row, groups, bit_depth, scale);
+   return 1;
+}
+#endif
+
+/* CRC-32 by folding 64 bytes at a time with carry-less multiplies, then
+ * down to 128 and 64 bits and a Barrett reduction to 32, as in Intel's "Fast
+ * CRC Computation for Generic Polynomials Using PCLMULQDQ".  The constants
+ * are the bit-reflected ones the paper gives for the zlib polynomial.  On
+ * AArch64 the CRC32X instruction does the same eight bytes at a time.
+ */
+#ifdef PNG_SIMD_X86
+PNG_SIMD_TARGET("pclmul,sse4.1") static png_uint_32
+png_simd_crc32_fold(png_uint_32 crc, png_const_bytep buf, png_size_t length)
+{
+   const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+   const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+   const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+   const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+   const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+   __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+   x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+   x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+   x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+   x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+   x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+   buf += 64;
+   length -= 64;
+
+   while (length >= 64)
+   {
+      x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+      x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+      x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+      x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+      x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+      x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+      x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+          _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+      x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+          _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+      x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+          _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+      x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+          _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+      buf += 64;
+      length -= 64;
+   }
+
+   /* Fold the four lanes into one, then any 16 byte blocks left. */
+   x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+   x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+   x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+   while (length >= 16)
+   {
+      x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1,
+          _mm_loadu_si128((const __m128i *)buf)), x5);
+      buf += 16;
+      length -= 16;
+   }
+
+   /* 128 bits to 64. */
+   x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+   x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+   x2 = _mm_srli_si128(x1, 4);
+   x1 = _mm_and_si128(x1, low32);
+   x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+
+   /* Barrett reduction to 32. */
+   x2 = _mm_and_si128(x1, low32);
+   x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+   x2 = _mm_and_si128(x2, low32);
+   x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+
+   return (png_uint_32)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+png_size_t /* PRIVATE */
+png_simd_crc32(png_uint_32p crc, png_const_bytep buf, png_size_t length)
+{
+#if defined(PNG_SIMD_X86)
+   png_size_t done = length & ~(png_size_t)15;
+
+   if (done < 64 || !__builtin_cpu_supports("pclmul") ||
+       !__builtin_cpu_supports("sse4.1"))
+      return 0;
+
+   *crc = ~png_simd_crc32_fold(~*crc, buf, done);
+   return done;
+#elif defined(__ARM_FEATURE_CRC32)
+   png_uint_32 c = ~*crc;
+   png_size_t done = length & ~(png_size_t)7;
+   png_size_t i;
+
+   for (i = 0; i < done; i += 8)
+   {
+      uint64_t v;
+      png_memcpy(&v, buf + i, 8);
+      c = __crc32d(c, v);
+   }
+
+   *crc = ~c;
+   return done;
+#else
+   PNG_UNUSED(crc)
+   PNG_UNUSED(buf)
+   PNG_UNUSED(length)
+   return 0;
+#endif
+}
+
+/* Adler-32 sixteen bytes at a time.  Over a run of n blocks, s1 gains the
+ * sum of the bytes and s2 gains 16 * n * s1 at the start, 16 times the sum
+ * of s1's partial totals before each block, and each block's bytes weighted
+ * 16 down to 1.  Runs stop short of zlib's NMAX, 5552 bytes, so none of it
+ * can overflow before the modulo.
+ */
+#define PNG_ADLER_BASE 65521U
+#define PNG_ADLER_RUN 5536
+
+#ifdef PNG_SIMD_X86
+static png_uint_32
+png_simd_sum_32(__m128i v)
+{
+   v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4e));
+   v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xb1));
+   return (png_uint_32)_mm_cvtsi128_si32(v);
+}
+
+PNG_SIMD_TARGET("ssse3") static void
+png_simd_adler32_run(png_uint_32 *s1, png_uint_32 *s2, png_const_bytep buf,
+    png_size_t blocks)
+{
+   const __m128i weights = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7,
+       6, 5, 4, 3, 2, 1);
+   const __m128i ones = _mm_set1_epi16(1);
+   const __m128i zero = _mm_setzero_si128();
+   __m128i sums = zero, weighted = zero, partials = zero;
+   png_size_t i;
+
+   for (i = 0; i < blocks; i++)
+   {
+      const __m128i v = _mm_loadu_si128((const __m128i *)(buf + 16 * i));
+      partials = _mm_add_epi32(partials, sums);
+      sums = _mm_add_epi32(sums, _mm_sad_epu8(v, zero));
+      weighted = _mm_add_epi32(weighted,
+          _mm_madd_epi16(_mm_maddubs_epi16(v, weights), ones));
+   }
+
+   *s2 += (png_uint_32)(16 * blocks) * *s1 + 16 * png_simd_sum_32(partials) +
+       png_simd_sum_32(weighted);
+   *s1 += png_simd_sum_32(sums);
+}
+#else
+static void
+png_simd_adler32_run(png_uint_32 *s1, png_uint_32 *s2, png_const_bytep buf,
+    png_size_t blocks)
+{
+   static const png_byte w[16] =
+      { 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 };
+   const uint8x16_t weights = vld1q_u8(w);
+   uint32x4_t sums = vdupq_n_u32(0), weighted = sums, partials = sums;
+   png_size_t i;
+
+   for (i = 0; i < blocks; i++)
+   {
+      const uint8x16_t v = vld1q_u8(buf + 16 * i);
+      uint16x8_t products = vmull_u8(vget_low_u8(v), vget_low_u8(weights));
+
+      products = vmlal_u8(products, vget_high_u8(v), vget_high_u8(weights));
+      partials = vaddq_u32(partials, sums);
+      sums = vpadalq_u16(sums, vpaddlq_u8(v));
+      weighted = vpadalq_u16(weighted, products);
+   }
+
+   *s2 += (png_uint_32)(16 * blocks) * *s1 + 16 * vaddvq_u32(partials) +
+       vaddvq_u32(weighted);
+   *s1 += vaddvq_u32(sums);
+}
+#endif
+
+png_size_t /* PRIVATE */
+png_simd_adler32(png_uint_32p adler, png_const_bytep buf, png_size_t length)
+{
+   png_uint_32 s1 = *adler & 0xffff;
+   png_uint_32 s2 = *adler >> 16;
+   png_size_t done = 0;
+
+   if (!png_simd_have_shuffle())
+      return 0;
+
+   while (length - done >= 16)
+   {
+      png_size_t run = length - done < PNG_ADLER_RUN ? length - done :
+          PNG_ADLER_RUN;
+
+      run &= ~(png_size_t)15;
+      png_simd_adler32_run(&s1, &s2, buf + done, run / 16);
+      s1 %= PNG_ADLER_BASE;
+      s2 %= PNG_ADLER_BASE;
+      done += run;
+   }
+
+   *adler = (s2 << 16) | s1;
+   return done;
+}
+
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+/* Write filters for png_write_find_filter.  On the write side every
+ * prediction is from unfiltered bytes, so a whole vector of a row is
+ * filtered at once.  Avg's (a + b) / 2 is the rounded up average less the
+ * bit that rounding added, and Paeth works in 16 bit lanes, where a + b - 2c
+ * cannot overflow.  Each vector's share of the sum of absolute values, bytes
+ * of 128 and over counting as negative, is min(v, -v) added up.
+ *
+ * A vector is only stored once the running sum is known to stay within the
+ * limit.  If it would not, the C loop takes over at that vector and gives up
+ * at the same byte it always has, so the filter chosen and the bytes left in
+ * the candidate rows are exactly the C version's.
+ */
+#ifdef PNG_SIMD_X86
+static __m128i
+png_simd_paeth_8(__m128i a, __m128i b, __m128i c)
+{
+   const __m128i zero = _mm_setzero_si128();
+   __m128i p = _mm_sub_epi16(b, c);
+   __m128i q = _mm_sub_epi16(a, c);
+   __m128i pc = _mm_add_epi16(p, q);
+   __m128i pa = _mm_max_epi16(p, _mm_sub_epi16(zero, p));
+   __m128i pb = _mm_max_epi16(q, _mm_sub_epi16(zero, q));
+   __m128i not_a, use_c, r;
+
+   pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+   not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+   use_c = _mm_cmpgt_epi16(pb, pc);
+   r = _mm_or_si128(_mm_and_si128(use_c, c), _mm_andnot_si128(use_c, b));
+   return _mm_or_si128(_mm_and_si128(not_a, r), _mm_andnot_si128(not_a, a));
+}
+
+static png_size_t
+png_simd_filter_16(int filter, png_bytep dp, png_const_bytep rp,
+    png_const_bytep pp, png_size_t i, png_size_t row_bytes, png_size_t bpp,
+    png_uint_32p sum, png_uint_32 limit)
+{
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i one = _mm_set1_epi8(1);
+
+   for (; i + 16 <= row_bytes; i += 16)
+   {
+      __m128i x = _mm_loadu_si128((const __m128i *)(rp + i));
+      __m128i a, b, c, d;
+
+      switch (filter)
+      {
+         case PNG_FILTER_VALUE_SUB:
+            x = _mm_sub_epi8(x, _mm_loadu_si128((const __m128i *)(rp + i - bpp)));
+            break;
+
+         case PNG_FILTER_VALUE_UP:
+            x = _mm_sub_epi8(x, _mm_loadu_si128((const __m128i *)(pp + i)));
+            break;
+
+         case PNG_FILTER_VALUE_AVG:
+            a = _mm_loadu_si128((const __m128i *)(rp + i - bpp));
+            b = _mm_loadu_si128((const __m128i *)(pp + i));
+            x = _mm_sub_epi8(x, _mm_sub_epi8(_mm_avg_epu8(a, b),
+                _mm_and_si128(_mm_xor_si128(a, b), one)));
+            break;
+
+         case PNG_FILTER_VALUE_PAETH:
+            a = _mm_loadu_si128((const __m128i *)(rp + i - bpp));
+            b = _mm_loadu_si128((const __m128i *)(pp + i));
+            c = _mm_loadu_si128((const __m128i *)(pp + i - bpp));
+            d = _mm_packus_epi16(
+                png_simd_paeth_8(_mm_unpacklo_epi8(a, zero),
+                    _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+                png_simd_paeth_8(_mm_unpackhi_epi8(a, zero),
+                    _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
+            x = _mm_sub_epi8(x, d);
+            break;
+
+         default:
+            break;
+      }
+
+      if (sum != NULL)
+      {
+         __m128i s = _mm_sad_epu8(_mm_min_epu8(x, _mm_sub_epi8(zero, x)), zero);
+         png_uint_32 n = (png_uint_32)(_mm_cvtsi128_si32(s) +
+             _mm_extract_epi16(s, 4));
+
+         if (*sum + n > limit || *sum + n < n)
+            break;
+
+         *sum += n;
+      }
+
+      if (dp != NULL)
+         _mm_storeu_si128((__m128i *)(dp + i), x);
+   }
+
+   return i;
+}
+
+/* The same with AVX2, 32 bytes at a time.  The unpacks and the pack work
+ * within each 128 bit lane, so they undo each other as they do above.
+ */
+PNG_SIMD_TARGET("avx2") static __m256i
+png_simd_paeth_16(__m256i a, __m256i b, __m256i c)
+{
+   __m256i p = _mm256_sub_epi16(b, c);
+   __m256i q = _mm256_sub_epi16(a, c);
+   __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(p, q));
+   __m256i pa = _mm256_abs_epi16(p);
+   __m256i pb = _mm256_abs_epi16(q);
+   __m256i not_a = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb),
+       _mm256_cmpgt_epi16(pa, pc));
+
+   return _mm256_blendv_epi8(a, _mm256_blendv_epi8(b, c,
+       _mm256_cmpgt_epi16(pb, pc)), not_a);
+}
+
+PNG_SIMD_TARGET("avx2") static png_size_t
+png_simd_filter_32(int filter, png_bytep dp, png_const_bytep rp,
+    png_const_bytep pp, png_size_t i, png_size_t row_bytes, png_size_t bpp,
+    png_uint_32p sum, png_uint_32 limit)
+{
+   const __m256i zero = _mm256_setzero_si256();
+   const __m256i one = _mm256_set1_epi8(1);
+
+   for (; i + 32 <= row_bytes; i += 32)
+   {
+      __m256i x = _mm256_loadu_si256((const __m256i *)(rp + i));
+      __m256i a, b, c, d;
+
+      switch (filter)
+      {
+         case PNG_FILTER_VALUE_SUB:
+            x = _mm256_sub_epi8(x,
+                _mm256_loadu_si256((const __m256i *)(rp + i - bpp)));
+            break;
+
+         case PNG_FILTER_VALUE_UP:
+            x = _mm256_sub_epi8(x,
+                _mm256_loadu_si256((const __m256i *)(pp + i)));
+            break;
+
+         case PNG_FILTER_VALUE_AVG:
+            a = _mm256_loadu_si256((const __m256i *)(rp + i - bpp));
+            b = _mm256_loadu_si256((const __m256i *)(pp + i));
+            x = _mm256_sub_epi8(x, _mm256_sub_epi8(_mm256_avg_epu8(a, b),
+                _mm256_and_si256(_mm256_xor_si256(a, b), one)));
+            break;
+
+         case PNG_FILTER_VALUE_PAETH:
+            a = _mm256_loadu_si256((const __m256i *)(rp + i - bpp));
+            b = _mm256_loadu_si256((const __m256i *)(pp + i));
+            c = _mm256_loadu_si256((const __m256i *)(pp + i - bpp));
+            d = _mm256_packus_epi16(
+                png_simd_paeth_16(_mm256_unpacklo_epi8(a, zero),
+                    _mm256_unpacklo_epi8(b, zero),
+                    _mm256_unpacklo_epi8(c, zero)),
+                png_simd_paeth_16(_mm256_unpackhi_epi8(a, zero),
+                    _mm256_unpackhi_epi8(b, zero),
+                    _mm256_unpackhi_epi8(c, zero)));
+            x = _mm256_sub_epi8(x, d);
+            break;
+
+         default:
+            break;
+      }
+
+      if (sum != NULL)
+      {
+         __m256i s = _mm256_sad_epu8(_mm256_min_epu8(x,
+             _mm256_sub_epi8(zero, x)), zero);
+         __m128i t = _mm_add_epi64(_mm256_castsi256_si128(s),
+             _mm256_extracti128_si256(s, 1));
+         png_uint_32 n = (png_uint_32)(_mm_cvtsi128_si32(t) +
+             _mm_extract_epi16(t, 4));
+
+         if (*sum + n > limit || *sum + n < n)
+            break;
+
+         *sum += n;
+      }
+
+      if (dp != NULL)
+         _mm256_storeu_si256((__m256i *)(dp + i), x);
+   }
+
+   return i;
+}
+#else
+static uint8x16_t
+png_simd_paeth_16(uint8x16_t a, uint8x16_t b, uint8x16_t c)
+{
+   uint16x8_t pa_lo = vabdl_u8(vget_low_u8(b), vget_low_u8(c));
+   uint16x8_t pa_hi = vabdl_u8(vget_high_u8(b), vget_high_u8(c));
+   uint16x8_t pb_lo = vabdl_u8(vget_low_u8(a), vget_low_u8(c));
+   uint16x8_t pb_hi = vabdl_u8(vget_high_u8(a), vget_high_u8(c));
+   uint16x8_t pc_lo = vabdq_u16(vaddl_u8(vget_low_u8(a), vget_low_u8(b)),
+       vaddl_u8(vget_low_u8(c), vget_low_u8(c)));
+   uint16x8_t pc_hi = vabdq_u16(vaddl_u8(vget_high_u8(a), vget_high_u8(b)),
+       vaddl_u8(vget_high_u8(c), vget_high_u8(c)));
+   uint8x16_t use_a = vcombine_u8(
+       vmovn_u16(vandq_u16(vcleq_u16(pa_lo, pb_lo), vcleq_u16(pa_lo, pc_lo))),
+       vmovn_u16(vandq_u16(vcleq_u16(pa_hi, pb_hi), vcleq_u16(pa_hi, pc_hi))));
+   uint8x16_t use_b = vcombine_u8(vmovn_u16(vcleq_u16(pb_lo, pc_lo)),
+       vmovn_u16(vcleq_u16(pb_hi, pc_hi)));
+
+   return vbslq_u8(use_a, a, vbslq_u8(use_b, b, c));
+}
+
+static png_size_t
+png_simd_filter_16(int filter, png_bytep dp, png_const_bytep rp,
+    png_const_bytep pp, png_size_t i, png_size_t row_bytes, png_size_t bpp,
+    png_uint_32p sum, png_uint_32 limit)
+{
+   for (; i + 16 <= row_bytes; i += 16)
+   {
+      uint8x16_t x = vld1q_u8(rp + i);
+
+      switch (filter)
+      {
+         case PNG_FILTER_VALUE_SUB:
+            x = vsubq_u8(x, vld1q_u8(rp + i - bpp));
+            break;
+
+         case PNG_FILTER_VALUE_UP:
+            x = vsubq_u8(x, vld1q_u8(pp + i));
+            break;
+
+         case PNG_FILTER_VALUE_AVG:
+            x = vsubq_u8(x, vhaddq_u8(vld1q_u8(rp + i - bpp), vld1q_u8(pp + i)));
+            break;
+
+         case PNG_FILTER_VALUE_PAETH:
+            x = vsubq_u8(x, png_simd_paeth_16(vld1q_u8(rp + i - bpp),
+                vld1q_u8(pp + i), vld1q_u8(pp + i - bpp)));
+            break;
+
+         default:
+            break;
+      }
+
+      if (sum != NULL)
+      {
+         uint8x16_t m = vminq_u8(x,
+             vreinterpretq_u8_s8(vnegq_s8(vreinterpretq_s8_u8(x))));
+         png_uint_32 n = vaddlvq_u8(m);
+
+         if (*sum + n > limit || *sum + n < n)
+            break;
+
+         *sum += n;
+      }
+
+      if (dp != NULL)
+         vst1q_u8(dp + i, x);
+   }
+
+   return i;
+}
+#endif
+
+png_size_t /* PRIVATE */
+png_simd_filter_row(int filter, png_bytep out_row, png_const_bytep row,
+    png_const_bytep prev_row, png_size_t start, png_size_t row_bytes,
+    png_size_t bpp, png_uint_32p sum, png_uint_32 limit)
+{
+   png_bytep dp = out_row != NULL ? out_row + 1 : NULL;
+   png_const_bytep pp = prev_row != NULL ? prev_row + 1 : NULL;
+
+   if (!png_get_simd_mode())
+      return start;
+
+#ifdef PNG_SIMD_X86
+   if (__builtin_cpu_supports("avx2"))
+      start = png_simd_filter_32(filter, dp, row + 1, pp, start, row_bytes,
+          bpp, sum, limit);
+#endif
+
+   return png_simd_filter_16(filter, dp, row + 1, pp, start, row_bytes, bpp,
+       sum, limit);
+}
+#endif /* PNG_WRITE_FILTER_SUPPORTED */
+
+#else /* no vector unit */
+
+png_size_t /* PRIVATE */
+png_simd_crc32(png_uint_32p crc, png_const_bytep buf, png_size_t length)
+{
+   PNG_UNUSED(crc)
+   PNG_UNUSED(buf)
+   PNG_UNUSED(length)
+   return 0;
+}
+
+png_size_t /* PRIVATE */
+png_simd_adler32(png_uint_32p adler, png_const_bytep buf, png_size_t length)
+{
+   PNG_UNUSED(adler)
+   PNG_UNUSED(buf)
+   PNG_UNUSED(length)
+   return 0;
+}
+
+#ifdef PNG_READ_GRAY_TO_RGB_SUPPORTED
+int /* PRIVATE */
+png_simd_do_gray_to_rgb(png_row_infop row_info, png_bytep row)
+{
+   PNG_UNUSED(row_info)
+   PNG_UNUSED(row)
+   return 0;
+}
+#endif
+
+#ifdef PNG_READ_FILLER_SUPPORTED
+int /* PRIVATE */
+png_simd_do_read_filler(png_row_infop row_info, png_bytep row,
+    png_uint_32 filler, png_uint_32 flags)
+{
+   PNG_UNUSED(row_info)
+   PNG_UNUSED(row)
+   PNG_UNUSED(filler)
+   PNG_UNUSED(flags)
+   return 0;
+}
+#endif
+
+#ifdef PNG_READ_STRIP_16_TO_8_SUPPORTED
+int /* PRIVATE */
+png_simd_do_chop(png_row_infop row_info, png_bytep row)
+{
+   PNG_UNUSED(row_info)
+   PNG_UNUSED(row)
+   return 0;
+}
+#endif
+
+#ifdef PNG_READ_SCALE_16_TO_8_SUPPORTED
+int /* PRIVATE */
+png_simd_do_scale_16_to_8(png_row_infop row_info, png_bytep row)
+{
+   PNG_UNUSED(row_info)
+   PNG_UNUSED(row)
+   return 0;
+}
+#endif
+
+#if defined(PNG_READ_PACK_SUPPORTED) || defined(PNG_READ_EXPAND_SUPPORTED)
+int /* PRIVATE */
+png_simd_unpack(png_bytep row, png_uint_32 row_width, int bit_depth,
+    unsigned int scale)
+{
+   PNG_UNUSED(row)
+   PNG_UNUSED(row_width)
+   PNG_UNUSED(bit_depth)
+   PNG_UNUSED(scale)
+   return 0;
+}
+#endif
+
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+png_size_t /* PRIVATE */
+png_simd_filter_row(int filter, png_bytep out_row, png_const_bytep row,
+    png_const_bytep prev_row, png_size_t start, png_size_t row_bytes,
+    png_size_t bpp, png_uint_32p sum, png_uint_32 limit)
+{
+   PNG_UNUSED(filter)
+   PNG_UNUSED(out_row)
+   PNG_UNUSED(row)
+   PNG_UNUSED(prev_row)
+   PNG_UNUSED(row_bytes)
+   PNG_UNUSED(bpp)
+   PNG_UNUSED(sum)
+   PNG_UNUSED(limit)
+   return start;
+}
+#endif
+
+#endif /* vector unit */
+#endif /* PNG_SIMD_SUPPORTED */
@@ -356,5 +356,23 @@ struct png_struct_def
 
    void (*read_filter[PNG_FILTER_VALUE_LAST-1])(png_row_infop row_info,
       png_bytep row, png_const_bytep prev_row);
+
+#ifdef PNG_STATS_SUPPORTED
+   png_statsp stats;      /* where to count stage times, or NULL */
+#endif
+
+#ifdef PNG_TRACE_SUPPORTED
+   png_trace_ptr trace_fn;  /* called at each trace point, or NULL */
+   png_voidp trace_ptr;     /* for png_get_trace_ptr */
+#endif
+
+#ifdef PNG_IDAT_FN_SUPPORTED
+   png_idat_ptr idat_fn;    /* given the IDAT data as it is read, or NULL */
+   png_voidp idat_ptr;      /* for png_get_idat_ptr */
+#endif
+
+#ifdef PNG_WRITE_RESTART_SUPPORTED
+   png_byte restart_row;    /* next row may not use the row above */
+#endif
 };
 #endif /* PNGSTRUCT_H */
@@ -666,6 +666,10 @@ png_write_row(png_structp png_ptr, png_const_bytep row)
       png_write_start_row(png_ptr);
    }
 
+#ifdef PNG_TRACE_SUPPORTED
+   png_trace_row(png_ptr);
+#endif
+
 #ifdef PNG_WRITE_INTERLACING_SUPPORTED
    /* If interlaced and not interested in row, return */
    if (png_ptr->interlaced && (png_ptr->transformations & PNG_INTERLACE))
@@ -806,6 +810,8 @@ png_write_row(png_structp png_ptr, png_const_bytep row)
 }
 
 #ifdef PNG_WRITE_FLUSH_SUPPORTED
+static void png_write_flush_mode(png_structp png_ptr, int flush); /* forward decl */
+
 /* Set the automatic flush interval or 0 to turn flushing off */
 void PNGAPI
 png_set_flush(png_structp png_ptr, int nrows)
@@ -822,8 +828,6 @@ png_set_flush(png_structp png_ptr, int nrows)
 void PNGAPI
 png_write_flush(png_structp png_ptr)
 {
-   int wrote_IDAT;
-
    png_debug(1, "in png_write_flush");
 
    if (png_ptr == NULL)
@@ -833,12 +837,47 @@ png_write_flush(png_structp png_ptr)
    if (png_ptr->row_number >= png_ptr->num_rows)
       return;
 
+   png_write_flush_mode(png_ptr, Z_SYNC_FLUSH);
+}
+
+#ifdef PNG_WRITE_RESTART_SUPPORTED
+png_alloc_size_t PNGAPI
+png_write_restart(png_structp png_ptr)
+{
+   png_debug(1, "in png_write_restart");
+
+   if (png_ptr == NULL || png_ptr->row_number >= png_ptr->num_rows)
+      return 0;
+
+   /* Before the first row the stream has not been started. */
+   if (png_ptr->row_number == 0)
+      return 0;
+
+   png_write_flush_mode(png_ptr, Z_FULL_FLUSH);
+   png_ptr->restart_row = 1;
+
+   return (png_alloc_size_t)png_ptr->zstream.total_out;
+}
+#endif
+
+/* Compress and write out everything given to zlib so far */
+static void
+png_write_flush_mode(png_structp png_ptr, int flush)
+{
+   int wrote_IDAT;
+
    do
    {
       int ret;
+#ifdef PNG_STATS_SUPPORTED
+      png_stats_uint stats_start = png_stats_start(png_ptr);
+#endif
 
       /* Compress the data */
-      ret = deflate(&png_ptr->zstream, Z_SYNC_FLUSH);
+      ret = deflate(&png_ptr->zstream, flush);
+#ifdef PNG_STATS_SUPPORTED
+      png_stats_stop(png_ptr, deflate_ns, stats_start);
+#endif
       wrote_IDAT = 0;
 
       /* Check for compression errors */
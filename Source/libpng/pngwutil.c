@@ -966,6 +966,10 @@ png_write_IDAT(png_structp png_ptr, png_bytep data, png_size_t length)
 {
    png_debug(1, "in png_write_IDAT");
 
+#ifdef PNG_TRACE_SUPPORTED
+   png_trace(png_ptr, idat, PNG_TRACE_IDAT, length);
+#endif
+
 #ifdef PNG_WRITE_OPTIMIZE_CMF_SUPPORTED
    if (!(png_ptr->mode & PNG_HAVE_IDAT) &&
        png_ptr->compression_type == PNG_COMPRESSION_TYPE_BASE)
@@ -2129,6 +2133,9 @@ png_write_finish_row(png_structp png_ptr)
 #endif
 
    int ret;
+#ifdef PNG_STATS_SUPPORTED
+   png_stats_uint stats_start;
+#endif
 
    png_debug(1, "in png_write_finish_row");
 
@@ -2194,7 +2201,13 @@ png_write_finish_row(png_structp png_ptr)
    do
    {
       /* Tell the compressor we are done */
+#ifdef PNG_STATS_SUPPORTED
+      stats_start = png_stats_start(png_ptr);
+#endif
       ret = deflate(&png_ptr->zstream, Z_FINISH);
+#ifdef PNG_STATS_SUPPORTED
+      png_stats_stop(png_ptr, deflate_ns, stats_start);
+#endif
 
       /* Check for an error */
       if (ret == Z_OK)
@@ -2425,6 +2438,9 @@ void /* PRIVATE */
 png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
 {
    png_bytep best_row;
+#ifdef PNG_STATS_SUPPORTED
+   png_stats_uint stats_start = png_stats_start(png_ptr);
+#endif
 #ifdef PNG_WRITE_FILTER_SUPPORTED
    png_bytep prev_row, row_buf;
    png_uint_32 mins, bpp;
@@ -2444,6 +2460,15 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
   }
 #endif
 
+#ifdef PNG_WRITE_RESTART_SUPPORTED
+   /* A decoder starting at a restart point has no row above this one. */
+   if (png_ptr->restart_row)
+   {
+      filter_to_do &= PNG_FILTER_NONE | PNG_FILTER_SUB;
+      png_ptr->restart_row = 0;
+   }
+#endif
+
    /* Find out how many bytes offset each pixel is */
    bpp = (row_info->pixel_depth + 7) >> 3;
 
@@ -2489,7 +2514,13 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
       png_size_t i;
       int v;
 
-      for (i = 0, rp = row_buf + 1; i < row_bytes; i++, rp++)
+      i = 0;
+#ifdef PNG_SIMD_SUPPORTED
+      i = png_simd_filter_row(PNG_FILTER_VALUE_NONE, NULL, row_buf, NULL, i,
+          row_bytes, bpp, &sum, PNG_MAXSUM);
+#endif
+
+      for (rp = row_buf + 1 + i; i < row_bytes; i++, rp++)
       {
          v = *rp;
          sum += (v < 128) ? v : 256 - v;
@@ -2549,7 +2580,14 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
          *dp = *rp;
       }
 
-      for (lp = row_buf + 1; i < row_bytes;
+#ifdef PNG_SIMD_SUPPORTED
+      i = png_simd_filter_row(PNG_FILTER_VALUE_SUB, png_ptr->sub_row, row_buf,
+          NULL, i, row_bytes, bpp, NULL, 0);
+      rp = row_buf + 1 + i;
+      dp = png_ptr->sub_row + 1 + i;
+#endif
+
+      for (lp = rp - bpp; i < row_bytes;
          i++, rp++, lp++, dp++)
       {
          *dp = (png_byte)(((int)*rp - (int)*lp) & 0xff);
@@ -2611,7 +2649,14 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
          sum += (v < 128) ? v : 256 - v;
       }
 
-      for (lp = row_buf + 1; i < row_bytes;
+#ifdef PNG_SIMD_SUPPORTED
+      i = png_simd_filter_row(PNG_FILTER_VALUE_SUB, png_ptr->sub_row, row_buf,
+          NULL, i, row_bytes, bpp, &sum, lmins);
+      rp = row_buf + 1 + i;
+      dp = png_ptr->sub_row + 1 + i;
+#endif
+
+      for (lp = rp - bpp; i < row_bytes;
          i++, rp++, lp++, dp++)
       {
          v = *dp = (png_byte)(((int)*rp - (int)*lp) & 0xff);
@@ -2656,7 +2701,10 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
       }
 #endif
 
-      if (sum < mins)
+      /* A row given up on part way is stale past that point, and with the
+       * weighted heuristic's rounding its sum can still come out lowest.
+       */
+      if (i == row_bytes && sum < mins)
       {
          mins = sum;
          best_row = png_ptr->sub_row;
@@ -2669,8 +2717,14 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
       png_bytep rp, dp, pp;
       png_size_t i;
 
-      for (i = 0, rp = row_buf + 1, dp = png_ptr->up_row + 1,
-          pp = prev_row + 1; i < row_bytes;
+      i = 0;
+#ifdef PNG_SIMD_SUPPORTED
+      i = png_simd_filter_row(PNG_FILTER_VALUE_UP, png_ptr->up_row, row_buf,
+          prev_row, i, row_bytes, bpp, NULL, 0);
+#endif
+
+      for (rp = row_buf + 1 + i, dp = png_ptr->up_row + 1 + i,
+          pp = prev_row + 1 + i; i < row_bytes;
           i++, rp++, pp++, dp++)
       {
          *dp = (png_byte)(((int)*rp - (int)*pp) & 0xff);
@@ -2721,8 +2775,14 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
       }
 #endif
 
-      for (i = 0, rp = row_buf + 1, dp = png_ptr->up_row + 1,
-          pp = prev_row + 1; i < row_bytes; i++)
+      i = 0;
+#ifdef PNG_SIMD_SUPPORTED
+      i = png_simd_filter_row(PNG_FILTER_VALUE_UP, png_ptr->up_row, row_buf,
+          prev_row, i, row_bytes, bpp, &sum, lmins);
+#endif
+
+      for (rp = row_buf + 1 + i, dp = png_ptr->up_row + 1 + i,
+          pp = prev_row + 1 + i; i < row_bytes; i++)
       {
          v = *dp++ = (png_byte)(((int)*rp++ - (int)*pp++) & 0xff);
 
@@ -2766,7 +2826,7 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
       }
 #endif
 
-      if (sum < mins)
+      if (i == row_bytes && sum < mins)
       {
          mins = sum;
          best_row = png_ptr->up_row;
@@ -2777,7 +2837,7 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
    if (filter_to_do == PNG_FILTER_AVG)
    {
       png_bytep rp, dp, pp, lp;
-      png_uint_32 i;
+      png_size_t i;
 
       for (i = 0, rp = row_buf + 1, dp = png_ptr->avg_row + 1,
            pp = prev_row + 1; i < bpp; i++)
@@ -2785,7 +2845,15 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
          *dp++ = (png_byte)(((int)*rp++ - ((int)*pp++ / 2)) & 0xff);
       }
 
-      for (lp = row_buf + 1; i < row_bytes; i++)
+#ifdef PNG_SIMD_SUPPORTED
+      i = png_simd_filter_row(PNG_FILTER_VALUE_AVG, png_ptr->avg_row, row_buf,
+          prev_row, i, row_bytes, bpp, NULL, 0);
+      rp = row_buf + 1 + i;
+      pp = prev_row + 1 + i;
+      dp = png_ptr->avg_row + 1 + i;
+#endif
+
+      for (lp = rp - bpp; i < row_bytes; i++)
       {
          *dp++ = (png_byte)(((int)*rp++ - (((int)*pp++ + (int)*lp++) / 2))
                  & 0xff);
@@ -2842,7 +2910,15 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
          sum += (v < 128) ? v : 256 - v;
       }
 
-      for (lp = row_buf + 1; i < row_bytes; i++)
+#ifdef PNG_SIMD_SUPPORTED
+      i = png_simd_filter_row(PNG_FILTER_VALUE_AVG, png_ptr->avg_row, row_buf,
+          prev_row, i, row_bytes, bpp, &sum, lmins);
+      rp = row_buf + 1 + i;
+      pp = prev_row + 1 + i;
+      dp = png_ptr->avg_row + 1 + i;
+#endif
+
+      for (lp = rp - bpp; i < row_bytes; i++)
       {
          v = *dp++ =
              (png_byte)(((int)*rp++ - (((int)*pp++ + (int)*lp++) / 2)) & 0xff);
@@ -2887,7 +2963,7 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
       }
 #endif
 
-      if (sum < mins)
+      if (i == row_bytes && sum < mins)
       {
          mins = sum;
          best_row = png_ptr->avg_row;
@@ -2906,7 +2982,15 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
          *dp++ = (png_byte)(((int)*rp++ - (int)*pp++) & 0xff);
       }
 
-      for (lp = row_buf + 1, cp = prev_row + 1; i < row_bytes; i++)
+#ifdef PNG_SIMD_SUPPORTED
+      i = png_simd_filter_row(PNG_FILTER_VALUE_PAETH, png_ptr->paeth_row,
+          row_buf, prev_row, i, row_bytes, bpp, NULL, 0);
+      rp = row_buf + 1 + i;
+      pp = prev_row + 1 + i;
+      dp = png_ptr->paeth_row + 1 + i;
+#endif
+
+      for (lp = rp - bpp, cp = pp - bpp; i < row_bytes; i++)
       {
          int a, b, c, pa, pb, pc, p;
 
@@ -2983,7 +3067,15 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
          sum += (v < 128) ? v : 256 - v;
       }
 
-      for (lp = row_buf + 1, cp = prev_row + 1; i < row_bytes; i++)
+#ifdef PNG_SIMD_SUPPORTED
+      i = png_simd_filter_row(PNG_FILTER_VALUE_PAETH, png_ptr->paeth_row,
+          row_buf, prev_row, i, row_bytes, bpp, &sum, lmins);
+      rp = row_buf + 1 + i;
+      pp = prev_row + 1 + i;
+      dp = png_ptr->paeth_row + 1 + i;
+#endif
+
+      for (lp = rp - bpp, cp = pp - bpp; i < row_bytes; i++)
       {
          int a, b, c, pa, pb, pc, p;
 
@@ -3062,13 +3154,18 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
       }
 #endif
 
-      if (sum < mins)
+      if (i == row_bytes && sum < mins)
       {
          best_row = png_ptr->paeth_row;
       }
    }
 #endif /* PNG_WRITE_FILTER_SUPPORTED */
 
+#ifdef PNG_STATS_SUPPORTED
+   png_stats_stop(png_ptr, filter_ns, stats_start);
+   png_stats_count(png_ptr, rows, 1);
+#endif
+
    /* Do the actual writing of the filtered row data from the chosen filter. */
    png_write_filtered_row(png_ptr, best_row, row_info->rowbytes+1);
 
@@ -3079,12 +3176,15 @@ png_write_find_filter(png_structp png_ptr, png_row_infop row_info)
    {
       int j;
 
-      for (j = 1; j < num_p_filters; j++)
+      /* Newest first: shift the history along and put this row's filter
+       * at the front, inside the num_weights bytes allocated for it.
+       */
+      for (j = num_p_filters - 1; j > 0; j--)
       {
          png_ptr->prev_filters[j] = png_ptr->prev_filters[j - 1];
       }
 
-      png_ptr->prev_filters[j] = best_row[0];
+      png_ptr->prev_filters[0] = best_row[0];
    }
 #endif
 #endif /* PNG_WRITE_FILTER_SUPPORTED */
@@ -3107,6 +3207,9 @@ png_write_filtered_row(png_structp png_ptr, png_bytep filtered_row,
    do
    {
       int ret; /* Return of zlib */
+#ifdef PNG_STATS_SUPPORTED
+      png_stats_uint stats_start;
+#endif
 
       /* Record the number of bytes available - zlib supports at least 65535
        * bytes at one step, depending on the size of the zlib type 'uInt', the
@@ -3133,7 +3236,13 @@ png_write_filtered_row(png_structp png_ptr, png_bytep filtered_row,
       }
 
       /* Compress the data */
+#ifdef PNG_STATS_SUPPORTED
+      stats_start = png_stats_start(png_ptr);
+#endif
       ret = deflate(&png_ptr->zstream, Z_NO_FLUSH);
+#ifdef PNG_STATS_SUPPORTED
+      png_stats_stop(png_ptr, deflate_ns, stats_start);
+#endif
 
       /* Check for compression errors */
       if (ret != Z_OK)
@@ -0,0 +1,564 @@
+// pngio-convert: loads, transforms and saves PNGs on every core.
+//
+//	pngio-convert [-fparv] [-s factor] [-c stored|fast|small] [-t threads]
+//	              [-m megabytes] [-o directory] input ...
+//
+// Inputs are PNG files or directories, searched for .png files. Results go
+// to the output directory under the same names (with the directories below
+// an input directory kept), or replace the inputs when there isn't one.
+// Either format loads; -a saves Apple's CgBI format and otherwise the
+// standard one, so a run with or without it converts whole trees. Files are
+// converted as threads come free, while the pixels held in memory stay
+// under -m megabytes; a file bigger than that on its own waits until it can
+// be the only one. Runs that only change the format stream each file
+// through, holding a few rows rather than the image. Progress goes to
+// stderr and a summary to stdout, as one line of JSON.
+
+#include "pngio.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+
+static void usage( void )
+{
+	fprintf( stderr, "usage: pngio-convert [-fparv] [-s factor] [-c stored|fast|small] [-t threads] [-m megabytes] [-o directory] input ...\n" );
+	fprintf( stderr, "  -f  flip vertically\n" );
+	fprintf( stderr, "  -p  premultiply alpha\n" );
+	fprintf( stderr, "  -a  save in Apple's CgBI format (either format loads)\n" );
+	fprintf( stderr, "  -r  swap red and blue\n" );
+	fprintf( stderr, "  -s  downscale by a whole factor, averaging each square of pixels\n" );
+	fprintf( stderr, "  -c  compression: stored, fast or small (default: zlib's default)\n" );
+	fprintf( stderr, "  -t  threads to convert on (default: one per CPU)\n" );
+	fprintf( stderr, "  -m  megabytes of pixels to hold at once (default: 512)\n" );
+	fprintf( stderr, "  -o  directory to write to (default: replace the inputs)\n" );
+	fprintf( stderr, "  -v  a line for each file instead of a progress count\n" );
+	exit( 2 );
+}
+
+
+static double now( void )
+{
+	struct timespec time;
+	clock_gettime( CLOCK_MONOTONIC, & time );
+	return (double) time.tv_sec + ((double) time.tv_nsec / 1e9);
+}
+
+
+static long file_size( const char * path )
+{
+	struct stat info;
+	return stat( path, & info ) == 0 ? (long) info.st_size : -1;
+}
+
+
+static uint8_t ends_with_png( const char * name )
+{
+	const size_t length = strlen( name );
+	return length > 4 && strcasecmp( name + length - 4, ".png" ) == 0;
+}
+
+
+struct job
+{
+	std::string input;
+	std::string name;			// under the output directory
+	long        size;
+	uint32_t    width;
+	uint32_t    height;
+	uint8_t     interlaced;
+	uint8_t     ok;
+	const char * error;
+};
+
+
+// Adds the .png files below directory, in name order so runs are repeatable.
+// Symlinked directories are skipped, so a link back up the tree can't loop.
+static void add_directory( std::vector<job> & jobs, const std::string & directory, const std::string & prefix )
+{
+	DIR * dir = opendir( directory.c_str() );
+	if (!dir)
+	{
+		return;
+	}
+	std::vector<std::string> names;
+	struct dirent * entry;
+	while ((entry = readdir( dir )) != NULL)
+	{
+		if (entry->d_name[0] != '.')
+		{
+			names.push_back( entry->d_name );
+		}
+	}
+	closedir( dir );
+	std::sort( names.begin(), names.end() );
+	
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		const std::string path = directory + "/" + names[i];
+		struct stat info;
+		if (lstat( path.c_str(), & info ) != 0)
+		{
+			continue;
+		}
+		const uint8_t linked = S_ISLNK( info.st_mode );
+		if (linked && stat( path.c_str(), & info ) != 0)
+		{
+			continue;
+		}
+		if (S_ISDIR( info.st_mode ))
+		{
+			if (!linked)
+			{
+				add_directory( jobs, path, prefix + names[i] + "/" );
+			}
+		}
+		else if (ends_with_png( names[i].c_str() ))
+		{
+			job added = { path, prefix + names[i], 0, 0, 0, 0, 0, NULL };
+			jobs.push_back( added );
+		}
+	}
+}
+
+
+// The size from the IHDR chunk, which follows the CgBI chunk in Apple's
+// files, so the memory a load will need is known before starting it.
+static uint8_t read_dimensions( job & item )
+{
+	FILE * file = fopen( item.input.c_str(), "rb" );
+	if (!file)
+	{
+		item.error = "can't be opened";
+		return 0;
+	}
+	
+	static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	uint8_t header[8];
+	item.error = "isn't a PNG";
+	if (fread( header, 8, 1, file ) == 1 && memcmp( header, signature, 8 ) == 0)
+	{
+		for (int chunk = 0; chunk < 2 && fread( header, 8, 1, file ) == 1; chunk++)
+		{
+			const uint32_t length = ((uint32_t) header[0] << 24) | ((uint32_t) header[1] << 16) | ((uint32_t) header[2] << 8) | header[3];
+			uint8_t ihdr[13];
+			if (memcmp( header + 4, "IHDR", 4 ) == 0 && length >= 13 && fread( ihdr, 13, 1, file ) == 1)
+			{
+				item.width = ((uint32_t) ihdr[0] << 24) | ((uint32_t) ihdr[1] << 16) | ((uint32_t) ihdr[2] << 8) | ihdr[3];
+				item.height = ((uint32_t) ihdr[4] << 24) | ((uint32_t) ihdr[5] << 16) | ((uint32_t) ihdr[6] << 8) | ihdr[7];
+				item.interlaced = ihdr[12] != 0;
+				item.error = NULL;
+				break;
+			}
+			if (memcmp( header + 4, "CgBI", 4 ) != 0 || fseek( file, (long) length + 4, SEEK_CUR ) != 0)
+			{
+				break;
+			}
+		}
+	}
+	fclose( file );
+	return item.error == NULL;
+}
+
+
+// Averages factor by factor squares into a new image, the last row and
+// column of squares being smaller when the size doesn't divide. Straight
+// alpha is weighted by alpha so transparent pixels don't bleed their color.
+// Returns 0 if the new image can't be allocated.
+static uint8_t downscale( const png_image * image, png_image * scaled, uint32_t factor, uint8_t premultiplied )
+{
+	const uint32_t width = (image->width + factor - 1) / factor;
+	const uint32_t height = (image->height + factor - 1) / factor;
+	png_image_alloc( scaled, width, height );
+	if (!scaled->data)
+	{
+		return 0;
+	}
+	for (uint32_t y = 0; y < height; y++)
+	{
+		for (uint32_t x = 0; x < width; x++)
+		{
+			uint64_t sum[4] = { 0, 0, 0, 0 };
+			uint32_t count = 0;
+			for (uint32_t sy = y * factor; sy < image->height && sy < (y + 1) * factor; sy++)
+			{
+				const uint8_t * pixel = image->data + ((((size_t) sy * image->width) + (x * factor)) * 4);
+				for (uint32_t sx = x * factor; sx < image->width && sx < (x + 1) * factor; sx++, pixel += 4)
+				{
+					const uint32_t weight = premultiplied ? 1 : pixel[3];
+					sum[0] += pixel[0] * weight;
+					sum[1] += pixel[1] * weight;
+					sum[2] += pixel[2] * weight;
+					sum[3] += pixel[3];
+					count++;
+				}
+			}
+			
+			uint8_t * out = scaled->data + ((((size_t) y * width) + x) * 4);
+			const uint64_t total = premultiplied ? count : sum[3];
+			for (int c = 0; c < 3; c++)
+			{
+				out[c] = total ? (uint8_t) ((sum[c] + (total / 2)) / total) : 0;
+			}
+			out[3] = (uint8_t) ((sum[3] + (count / 2)) / count);
+		}
+	}
+	return 1;
+}
+
+
+// Makes the directories leading up to path, ignoring those already there.
+static void make_parents( const std::string & path )
+{
+	for (size_t slash = path.find( '/', 1 ); slash != std::string::npos; slash = path.find( '/', slash + 1 ))
+	{
+		mkdir( path.substr( 0, slash ).c_str(), 0777 );
+	}
+}
+
+
+struct converter
+{
+	std::vector<job> * jobs;
+	const char * output;
+	uint32_t load_flags;
+	uint32_t save_flags;
+	uint32_t factor;
+	uint8_t  swap;
+	uint8_t  verbose;
+	
+	pthread_mutex_t lock;
+	pthread_cond_t  freed;
+	size_t   next;
+	size_t   done;
+	uint64_t budget;
+	uint64_t in_flight;
+	uint64_t peak;
+	uint64_t pixels;
+	long     written;
+	double   start;
+	double   reported;
+};
+
+
+// Changing only the format needs no pixels held: png_image_transcode takes
+// the rows through a few at a time, unless they're interlaced.
+static uint8_t streams( const converter * state, const job & item )
+{
+	return state->load_flags == PNG_IMAGE_NONE && state->factor <= 1 && !state->swap && !item.interlaced;
+}
+
+
+// What a conversion holds at its peak: a band of rows when streaming, or
+// else the loaded pixels and the scaled copy.
+static uint64_t bytes_needed( const converter * state, const job & item )
+{
+	if (streams( state, item ))
+	{
+		return (uint64_t) item.width * 4 * 16;
+	}
+	const uint64_t loaded = (uint64_t) item.width * item.height * 4;
+	if (state->factor <= 1)
+	{
+		return loaded;
+	}
+	return loaded + ((uint64_t) ((item.width + state->factor - 1) / state->factor) * ((item.height + state->factor - 1) / state->factor) * 4);
+}
+
+
+// A size that can't be found is left out of the total rather than taken
+// off it.
+static void finished( converter * state, uint64_t pixels, const std::string & target )
+{
+	const long size = file_size( target.c_str() );
+	pthread_mutex_lock( & state->lock );
+	state->pixels += pixels;
+	state->written += size >= 0 ? size : 0;
+	pthread_mutex_unlock( & state->lock );
+}
+
+
+static uint8_t transcode( converter * state, job & item, const std::string & target, const std::string & temporary )
+{
+	if (!png_image_transcode_path( item.input.c_str(), temporary.c_str(), state->save_flags, NULL ) || rename( temporary.c_str(), target.c_str() ) != 0)
+	{
+		remove( temporary.c_str() );
+		item.error = "couldn't be converted";
+		return 0;
+	}
+	
+	finished( state, (uint64_t) item.width * item.height, target );
+	return 1;
+}
+
+
+static uint8_t convert( converter * state, job & item )
+{
+	const std::string target = state->output ? std::string( state->output ) + "/" + item.name : item.input;
+	const std::string temporary = target + ".tmp";
+	if (state->output)
+	{
+		make_parents( target );
+	}
+	if (streams( state, item ))
+	{
+		return transcode( state, item, target, temporary );
+	}
+	
+	png_image image;
+	if (!png_image_load_path( & image, item.input.c_str(), state->load_flags ))
+	{
+		item.error = "couldn't be loaded";
+		return 0;
+	}
+	
+	png_image scaled;
+	const png_image * result = & image;
+	if (state->factor > 1)
+	{
+		const uint8_t downscaled = downscale( & image, & scaled, state->factor, (state->load_flags & PNG_IMAGE_PREMULTIPLY_ALPHA) != 0 );
+		png_image_free( & image );
+		if (!downscaled)
+		{
+			item.error = "couldn't be downscaled";
+			return 0;
+		}
+		result = & scaled;
+	}
+	
+	// Red and blue swap by saving the pixels as a BGRA view.
+	png_image_view view = png_image_get_view( result );
+	view.format = state->swap ? PNG_VIEW_BGRA : PNG_VIEW_RGBA;
+	if (!png_image_save_view_path( & view, temporary.c_str(), state->save_flags, NULL ) || rename( temporary.c_str(), target.c_str() ) != 0)
+	{
+		remove( temporary.c_str() );
+		item.error = "couldn't be saved";
+		return 0;
+	}
+	
+	finished( state, (uint64_t) view.width * view.height, target );
+	return 1;
+}
+
+
+static void report( converter * state, const job & item )
+{
+	if (state->verbose)
+	{
+		if (item.ok)
+		{
+			fprintf( stderr, "%s\n", item.input.c_str() );
+		}
+		return;
+	}
+	const double time = now();
+	if (isatty( 2 ) && (time - state->reported >= 0.1 || state->done == state->jobs->size()))
+	{
+		state->reported = time;
+		fprintf( stderr, "\r%lu/%lu files, %.1f s", (unsigned long) state->done, (unsigned long) state->jobs->size(), time - state->start );
+		if (state->done == state->jobs->size())
+		{
+			fprintf( stderr, "\n" );
+		}
+	}
+}
+
+
+static void * convert_files( void * context )
+{
+	converter * state = (converter *) context;
+	pthread_mutex_lock( & state->lock );
+	while (state->next < state->jobs->size())
+	{
+		job & item = (* state->jobs)[state->next++];
+		const uint64_t needed = bytes_needed( state, item );
+		while (state->in_flight > 0 && state->in_flight + needed > state->budget)
+		{
+			pthread_cond_wait( & state->freed, & state->lock );
+		}
+		state->in_flight += needed;
+		state->peak = std::max( state->peak, state->in_flight );
+		pthread_mutex_unlock( & state->lock );
+		
+		item.ok = convert( state, item );
+		
+		pthread_mutex_lock( & state->lock );
+		state->in_flight -= needed;
+		pthread_cond_broadcast( & state->freed );
+		state->done++;
+		if (!item.ok)
+		{
+			fprintf( stderr, "%s%s: %s\n", state->verbose || !isatty( 2 ) ? "" : "\n", item.input.c_str(), item.error );
+		}
+		report( state, item );
+	}
+	pthread_mutex_unlock( & state->lock );
+	return NULL;
+}
+
+
+int main( int argc, const char * argv[] )
+{
+	converter state;
+	state.output = NULL;
+	state.load_flags = PNG_IMAGE_NONE;
+	state.save_flags = PNG_IMAGE_NONE;
+	state.factor = 1;
+	state.swap = 0;
+	state.verbose = 0;
+	uint32_t threads = 0;
+	uint64_t megabytes = 512;
+	
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++)
+	{
+		const char * option = argv[i] + 1;
+		if (strchr( "sctmo", option[0] ))
+		{
+			if (option[1] || i + 1 >= argc)
+			{
+				usage();
+			}
+			const char * value = argv[++i];
+			switch (option[0])
+			{
+				case 's': state.factor = (uint32_t) atoi( value ); break;
+				case 't': threads = (uint32_t) atoi( value ); break;
+				case 'm': megabytes = (uint64_t) atoll( value ); break;
+				case 'o': state.output = value; break;
+				default:
+					if (strcmp( value, "stored" ) == 0)
+					{
+						state.save_flags |= PNG_IMAGE_STORED;
+					}
+					else if (strcmp( value, "fast" ) == 0)
+					{
+						state.save_flags |= PNG_IMAGE_FAST;
+					}
+					else if (strcmp( value, "small" ) == 0)
+					{
+						state.save_flags |= PNG_IMAGE_SMALL;
+					}
+					else
+					{
+						usage();
+					}
+			}
+			continue;
+		}
+		for (; * option; option++)
+		{
+			switch (* option)
+			{
+				case 'f': state.load_flags |= PNG_IMAGE_FLIP_VERTICAL; break;
+				case 'p': state.load_flags |= PNG_IMAGE_PREMULTIPLY_ALPHA; break;
+				case 'a': state.save_flags |= PNG_IMAGE_OPTIMIZE_FOR_IOS; break;
+				case 'r': state.swap = 1; break;
+				case 'v': state.verbose = 1; break;
+				default: usage();
+			}
+		}
+	}
+	if (i == argc || state.factor == 0 || megabytes == 0)
+	{
+		usage();
+	}
+	
+	std::vector<job> jobs;
+	for (; i < argc; i++)
+	{
+		struct stat info;
+		if (stat( argv[i], & info ) == 0 && S_ISDIR( info.st_mode ))
+		{
+			add_directory( jobs, argv[i], "" );
+		}
+		else
+		{
+			const char * slash = strrchr( argv[i], '/' );
+			job added = { argv[i], slash ? slash + 1 : argv[i], 0, 0, 0, 0, 0, NULL };
+			jobs.push_back( added );
+		}
+	}
+	
+	// Files that aren't PNGs fail here rather than take a thread.
+	long bytes_read = 0;
+	size_t failed = 0;
+	std::vector<job> valid;
+	for (size_t n = 0; n < jobs.size(); n++)
+	{
+		jobs[n].size = file_size( jobs[n].input.c_str() );
+		if (!read_dimensions( jobs[n] ))
+		{
+			fprintf( stderr, "%s: %s\n", jobs[n].input.c_str(), jobs[n].error );
+			failed++;
+			continue;
+		}
+		bytes_read += jobs[n].size >= 0 ? jobs[n].size : 0;
+		valid.push_back( jobs[n] );
+	}
+	
+	if (threads == 0)
+	{
+		const long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+		threads = cpus > 0 ? (uint32_t) cpus : 1;
+	}
+	threads = (uint32_t) std::min( (size_t) threads, std::max( valid.size(), (size_t) 1 ) );
+	
+	state.jobs = & valid;
+	state.next = 0;
+	state.done = 0;
+	state.budget = megabytes << 20;
+	state.in_flight = 0;
+	state.peak = 0;
+	state.pixels = 0;
+	state.written = 0;
+	state.start = now();
+	state.reported = 0;
+	pthread_mutex_init( & state.lock, NULL );
+	pthread_cond_init( & state.freed, NULL );
+	
+	std::vector<pthread_t> workers( threads - 1 );
+	uint32_t started = 0;
+	for (; started < threads - 1; started++)
+	{
+		if (pthread_create( & workers[started], NULL, convert_files, & state ) != 0)
+		{
+			break;
+		}
+	}
+	convert_files( & state );
+	for (uint32_t n = 0; n < started; n++)
+	{
+		pthread_join( workers[n], NULL );
+	}
+	const double seconds = std::max( now() - state.start, 1e-9 );
+	pthread_cond_destroy( & state.freed );
+	pthread_mutex_destroy( & state.lock );
+	
+	size_t converted = 0;
+	for (size_t n = 0; n < valid.size(); n++)
+	{
+		if (valid[n].ok)
+		{
+			converted++;
+		}
+		else
+		{
+			failed++;
+		}
+	}
+	printf( "{\"files\": %lu, \"converted\": %lu, \"failed\": %lu, \"threads\": %u, \"seconds\": %.3f, "
+		"\"bytes_read\": %ld, \"bytes_written\": %ld, \"megapixels\": %.3f, \"files_per_second\": %.1f, "
+		"\"megapixels_per_second\": %.1f, \"megabytes_per_second\": %.1f, \"peak_megabytes_in_flight\": %.1f}\n",
+		(unsigned long) jobs.size(), (unsigned long) converted, (unsigned long) failed, threads, seconds,
+		bytes_read, state.written, (double) state.pixels / 1e6, (double) converted / seconds,
+		(double) state.pixels / 1e6 / seconds, (double) bytes_read / 1048576.0 / seconds, (double) state.peak / 1048576.0 );
+	return failed ? 1 : 0;
+}
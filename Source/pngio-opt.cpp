@@ -0,0 +1,195 @@
+// pngio-opt: makes PNGs smaller without changing a pixel.
+//
+//	pngio-opt [-t threads] [-b milliseconds] [-o output] file ...
+//
+// Each file is decoded and handed to png_image_optimize, and replaced by
+// what comes back if that is smaller (or written to output, with a single
+// file). Files it couldn't rewrite exactly are left alone: 16 bit samples,
+// animations and Apple's CgBI format. Other ancillary chunks are dropped.
+
+#include "pngio.h"
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+
+
+static void usage( void )
+{
+	fprintf( stderr, "usage: pngio-opt [-t threads] [-b milliseconds] [-o output] file ...\n" );
+	fprintf( stderr, "  -t  threads to encode on (default: one per CPU)\n" );
+	fprintf( stderr, "  -b  time to spend on each file (default: no limit)\n" );
+	fprintf( stderr, "  -o  where to write the result, for a single file\n" );
+	exit( 2 );
+}
+
+
+static long file_size( const char * path )
+{
+	struct stat info;
+	return stat( path, & info ) == 0 ? (long) info.st_size : -1;
+}
+
+
+// Why a file can't be rewritten from 8 bit RGBA pixels, or NULL if it can.
+static const char * unsupported( const char * path )
+{
+	FILE * file = fopen( path, "rb" );
+	if (!file)
+	{
+		return "can't be opened";
+	}
+	
+	static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	const char * reason = NULL;
+	uint8_t header[8];
+	if (fread( header, 8, 1, file ) != 1 || memcmp( header, signature, 8 ) != 0)
+	{
+		reason = "isn't a PNG";
+	}
+	while (!reason && fread( header, 8, 1, file ) == 1)
+	{
+		const uint32_t length = ((uint32_t) header[0] << 24) | ((uint32_t) header[1] << 16) | ((uint32_t) header[2] << 8) | header[3];
+		if (memcmp( header + 4, "IDAT", 4 ) == 0)
+		{
+			break;
+		}
+		if (memcmp( header + 4, "CgBI", 4 ) == 0)
+		{
+			reason = "is in Apple's format";
+		}
+		else if (memcmp( header + 4, "acTL", 4 ) == 0)
+		{
+			reason = "is animated";
+		}
+		else if (memcmp( header + 4, "IHDR", 4 ) == 0 && length >= 9)
+		{
+			uint8_t ihdr[9];
+			if (fread( ihdr, 9, 1, file ) != 1)
+			{
+				reason = "is truncated";
+			}
+			else if (ihdr[8] == 16)
+			{
+				reason = "has 16 bit samples";
+			}
+			fseek( file, (long) length - 9 + 4, SEEK_CUR );
+			continue;
+		}
+		fseek( file, (long) length + 4, SEEK_CUR );
+	}
+	fclose( file );
+	return reason;
+}
+
+
+static const char * color_type_name( uint8_t colorType )
+{
+	switch (colorType)
+	{
+		case 0:  return "gray";
+		case 2:  return "RGB";
+		case 3:  return "palette";
+		case 4:  return "gray+alpha";
+		default: return "RGBA";
+	}
+}
+
+
+int main( int argc, const char * argv[] )
+{
+	png_image_options options;
+	png_image_options_init( & options );
+	uint32_t budget = 0;
+	const char * output = NULL;
+	
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++)
+	{
+		if (i + 1 >= argc)
+		{
+			usage();
+		}
+		if (strcmp( argv[i], "-t" ) == 0)
+		{
+			options.threads = (uint32_t) atoi( argv[++i] );
+		}
+		else if (strcmp( argv[i], "-b" ) == 0)
+		{
+			budget = (uint32_t) atoi( argv[++i] );
+		}
+		else if (strcmp( argv[i], "-o" ) == 0)
+		{
+			output = argv[++i];
+		}
+		else
+		{
+			usage();
+		}
+	}
+	if (i == argc || (output && argc - i != 1))
+	{
+		usage();
+	}
+	
+	const int files = argc - i;
+	int failures = 0;
+	long before = 0, after = 0;
+	for (; i < argc; i++)
+	{
+		const char * path = argv[i];
+		const char * reason = unsupported( path );
+		if (reason)
+		{
+			fprintf( stderr, "%s: skipped, %s\n", path, reason );
+			failures++;
+			continue;
+		}
+		
+		png_image image;
+		const long size = file_size( path );
+		const std::string temporary = std::string( output ? output : path ) + ".tmp";
+		png_optimize_result result;
+		uint8_t ok = png_image_load_path( & image, path, PNG_IMAGE_NONE );
+		if (ok)
+		{
+			const png_image_view view = png_image_get_view( & image );
+			ok = png_image_optimize_path( & view, temporary.c_str(), PNG_IMAGE_NONE, budget, & options, & result );
+		}
+		png_image_free( & image );
+		if (!ok)
+		{
+			fprintf( stderr, "%s: failed\n", path );
+			remove( temporary.c_str() );
+			failures++;
+			continue;
+		}
+		
+		const uint8_t smaller = (long) result.size < size;
+		const char * target = output ? output : path;
+		if ((smaller || output) && rename( temporary.c_str(), target ) != 0)
+		{
+			fprintf( stderr, "%s: couldn't replace %s\n", path, target );
+			remove( temporary.c_str() );
+			failures++;
+			continue;
+		}
+		if (!smaller && !output)
+		{
+			remove( temporary.c_str() );
+		}
+		
+		const long kept = smaller || output ? (long) result.size : size;
+		before += size;
+		after += kept;
+		printf( "%s: %ld -> %ld bytes, %s %u bit, filters 0x%02x, level %d, strategy %d, window %d, %u trials (%u abandoned)%s\n",
+			path, size, kept, color_type_name( result.color_type ), result.bit_depth, result.filters, result.level, result.strategy,
+			result.window_bits, result.trials, result.abandoned, smaller || output ? "" : ", kept the original" );
+	}
+	
+	if (files > 1)
+	{
+		printf( "total: %ld -> %ld bytes\n", before, after );
+	}
+	return failures ? 1 : 0;
+}
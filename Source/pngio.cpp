@@ -1,26 +1,248 @@
 #include "pngio.h"
 #include "libpng/png.h"
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <zlib.h>
 
+#ifdef PNGIO_FUTURES
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+
+// USDT probes in the "pngio" provider, for bpftrace or perf on Linux.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PNGIO_PROBE2( name, a, b )	DTRACE_PROBE2( pngio, name, a, b )
+#endif
+#endif
+#ifndef PNGIO_PROBE2
+#define PNGIO_PROBE2( name, a, b )
+#endif
+
+// Batch loads read through io_uring where the kernel headers have it, using
+// the raw system calls rather than liburing.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#define PNGIO_URING 1
+#endif
+#endif
+
+
+// Pixel loops are vectorized with the GCC and Clang vector extensions, which
+// become SSE2 on x86-64 and NEON on ARM. Loads and stores go through memcpy,
+// so rows need no particular alignment.
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 12)
+#define PNGIO_VECTOR 1
+typedef uint8_t  png_v4u8  __attribute__(( vector_size( 4 ) ));
+typedef uint8_t  png_v16u8 __attribute__(( vector_size( 16 ) ));
+typedef uint32_t png_v4u32 __attribute__(( vector_size( 16 ) ));
+typedef float    png_v4f   __attribute__(( vector_size( 16 ) ));
+
+static inline png_v4u32 png_load4( const png_pixel * p )
+{
+	png_v4u32 v;
+	memcpy( & v, p, sizeof v );
+	return v;
+}
+
+
+static inline void png_store4( png_pixel * p, png_v4u32 v )
+{
+	memcpy( p, & v, sizeof v );
+}
+
+
+static inline png_v4u32 png_swap_rb4( png_v4u32 v )
+{
+	const png_v16u8 b = (png_v16u8) v;
+	return (png_v4u32) __builtin_shufflevector( b, b, 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15 );
+}
+
+
+static inline png_v4u32 png_reverse4( png_v4u32 v )
+{
+	return __builtin_shufflevector( v, v, 3, 2, 1, 0 );
+}
+
+
+static inline void png_transpose4( png_v4u32 & r0, png_v4u32 & r1, png_v4u32 & r2, png_v4u32 & r3 )
+{
+	const png_v4u32 t0 = __builtin_shufflevector( r0, r1, 0, 4, 1, 5 );
+	const png_v4u32 t1 = __builtin_shufflevector( r0, r1, 2, 6, 3, 7 );
+	const png_v4u32 t2 = __builtin_shufflevector( r2, r3, 0, 4, 1, 5 );
+	const png_v4u32 t3 = __builtin_shufflevector( r2, r3, 2, 6, 3, 7 );
+	r0 = __builtin_shufflevector( t0, t2, 0, 1, 4, 5 );
+	r1 = __builtin_shufflevector( t0, t2, 2, 3, 6, 7 );
+	r2 = __builtin_shufflevector( t1, t3, 0, 1, 4, 5 );
+	r3 = __builtin_shufflevector( t1, t3, 2, 3, 6, 7 );
+}
+#endif
+
+
+static size_t png_pull_file( void * io, uint8_t * data, size_t size )
+{
+	return fread( data, 1, size, (FILE *) io );
+}
+
+
+static size_t png_push_file( void * io, const uint8_t * data, size_t size )
+{
+	return fwrite( data, 1, size, (FILE *) io );
+}
+
+
+static void png_unread_file( void * io, size_t size )
+{
+	fseek( (FILE *) io, -(long) size, SEEK_CUR );
+}
+
+
+// Buffering between libpng and a file or stream. libpng asks for a chunk
+// header, a CRC or a zbuf's worth of data at a time; those are served from
+// one large read ahead, and its writes collect until the buffer fills.
+// Requests at least as large as the buffer go straight through, as does
+// everything if the buffer couldn't be allocated or doesn't fit the call's
+// memory budget.
+#define PNG_IO_BUFFER_SIZE		262144
+
+struct png_io_call;
+static uint8_t png_call_charge( png_io_call * call, uint64_t size );
+static void png_call_release( png_io_call * call, uint64_t size );
+
+struct png_io_buffer
+{
+	size_t (* read)( void * io, uint8_t * data, size_t size );
+	size_t (* write)( void * io, const uint8_t * data, size_t size );
+	void   (* unread)( void * io, size_t size );
+	void    * io;
+	uint8_t * data;
+	size_t    capacity;
+	size_t    start;
+	size_t    end;
+	png_io_call * call;		// the buffer counts against it
+};
+
+
+static void png_io_buffer_init( png_io_buffer * buffer, void * io, size_t capacity, png_io_call * call )
+{
+	memset( buffer, 0, sizeof (png_io_buffer) );
+	buffer->io = io;
+	const uint8_t fits = png_call_charge( call, capacity );
+	buffer->data = fits ? (uint8_t *) malloc( capacity ) : NULL;
+	buffer->capacity = buffer->data ? capacity : 0;
+	buffer->call = call;
+	png_call_release( call, fits && !buffer->data ? capacity : 0 );
+}
+
+
+static size_t png_io_buffer_read( png_io_buffer * buffer, uint8_t * data, size_t size )
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		if (buffer->start == buffer->end)
+		{
+			if (size - done >= buffer->capacity)
+			{
+				return done + buffer->read( buffer->io, data + done, size - done );
+			}
+			buffer->start = 0;
+			buffer->end = buffer->read( buffer->io, buffer->data, buffer->capacity );
+			if (buffer->end == 0)
+			{
+				break;
+			}
+		}
+		const size_t n = size - done < buffer->end - buffer->start ? size - done : buffer->end - buffer->start;
+		memcpy( data + done, buffer->data + buffer->start, n );
+		buffer->start += n;
+		done += n;
+	}
+	return done;
+}
 
-static void png_read_file_data( png_structp readPtr, png_bytep data, png_size_t size ) 
+
+static uint8_t png_io_buffer_drain( png_io_buffer * buffer )
+{
+	const size_t size = buffer->end;
+	buffer->end = 0;
+	return size == 0 || buffer->write( buffer->io, buffer->data, size ) == size;
+}
+
+
+static uint8_t png_io_buffer_write( png_io_buffer * buffer, const uint8_t * data, size_t size )
+{
+	if (size > buffer->capacity - buffer->end)
+	{
+		if (!png_io_buffer_drain( buffer ))
+		{
+			return 0;
+		}
+		if (size >= buffer->capacity)
+		{
+			return buffer->write( buffer->io, data, size ) == size;
+		}
+	}
+	memcpy( buffer->data + buffer->end, data, size );
+	buffer->end += size;
+	return 1;
+}
+
+
+// Gives back what was read ahead but not used, so the source is left where
+// libpng stopped, then frees the buffer.
+static void png_io_buffer_release( png_io_buffer * buffer )
 {
-	FILE * file = (FILE *) png_get_io_ptr( readPtr );
-	fread( (char *) data, size, 1, file );
+	if (buffer->end > buffer->start && buffer->unread)
+	{
+		buffer->unread( buffer->io, buffer->end - buffer->start );
+	}
+	free( buffer->data );
+	png_call_release( buffer->call, buffer->capacity );
+	buffer->data = NULL;
+	buffer->capacity = 0;
+}
+
+
+static void png_read_buffered_data( png_structp readPtr, png_bytep data, png_size_t size ) 
+{
+	png_io_buffer * buffer = (png_io_buffer *) png_get_io_ptr( readPtr );
+	if (png_io_buffer_read( buffer, data, size ) != size)
+	{
+		png_error( readPtr, "Read Error" );
+	}
 }
 
 
-static void png_write_file_data( png_structp writePtr, png_bytep data, png_size_t size ) 
+static void png_write_buffered_data( png_structp writePtr, png_bytep data, png_size_t size ) 
 {
-	FILE * file = (FILE *) png_get_io_ptr( writePtr );
-	fwrite( (char *) data, size, 1, file );
+	png_io_buffer * buffer = (png_io_buffer *) png_get_io_ptr( writePtr );
+	if (!png_io_buffer_write( buffer, data, size ))
+	{
+		png_error( writePtr, "Write Error" );
+	}
 }
 
 
-static void png_flush_file_data( png_structp writePtr ) 
+// libpng flushes at each restart point as well as at the end; the data only
+// has to reach the file once the save is done, which the caller sees to.
+static void png_flush_buffered_data( png_structp ) 
 {
-	FILE * file = (FILE *) png_get_io_ptr( writePtr );
-	fflush( file );
 }
 
 
@@ -67,14 +289,134 @@ void png_image_init( png_image * image )
 	image->width = 0;
 	image->height = 0;
 	image->data = NULL;
+	image->mapped = 0;
+	image->mip_levels = 0;
+}
+
+
+static uint64_t png_image_bytes( uint32_t width, uint32_t height )
+{
+	return (uint64_t) width * height * 4;
+}
+
+
+// Levels in a full mip chain below width by height, each half the one
+// before, rounded down but at least 1.
+static uint32_t png_mip_levels( uint32_t width, uint32_t height )
+{
+	uint32_t levels = 0;
+	for (uint32_t size = width > height ? width : height; size > 1; size >>= 1)
+	{
+		levels++;
+	}
+	return levels;
+}
+
+
+static uint32_t png_mip_size( uint32_t size, uint32_t level )
+{
+	return (size >> level) ? (size >> level) : 1;
+}
+
+
+// The pixels and the first levels of their mip chain.
+static uint64_t png_chain_bytes( uint32_t width, uint32_t height, uint32_t levels )
+{
+	uint64_t size = 0;
+	for (uint32_t level = 0; level <= levels; level++)
+	{
+		size += png_image_bytes( png_mip_size( width, level ), png_mip_size( height, level ) );
+	}
+	return size;
+}
+
+
+// Room for the pixels and levels of their mip chain after them. Mapped, it's
+// backed by an unlinked sparse file in $TMPDIR, so untouched pages cost
+// nothing and written ones can be paged out to disk rather than counting
+// against memory.
+static void png_image_alloc_chain( png_image * image, uint32_t width, uint32_t height, uint32_t levels, uint8_t mapped )
+{
+	image->width = 0;
+	image->height = 0;
+	image->data = NULL;
+	image->mapped = 0;
+	image->mip_levels = 0;
+	
+	const uint64_t size = png_chain_bytes( width, height, levels );
+	if (!mapped)
+	{
+		image->data = size > SIZE_MAX ? NULL : (uint8_t *) pngio_malloc( (size_t) size );
+		image->width = image->data ? width : 0;
+		image->height = image->data ? height : 0;
+		image->mip_levels = image->data ? (uint8_t) levels : 0;
+		return;
+	}
+	if (size == 0 || size > SIZE_MAX)
+	{
+		return;
+	}
+	
+	const char * dir = getenv( "TMPDIR" );
+	char path[1024];
+	snprintf( path, sizeof path, "%s/pngio.XXXXXX", dir ? dir : "/tmp" );
+	const int fd = mkstemp( path );
+	if (fd < 0)
+	{
+		return;
+	}
+	unlink( path );
+	
+	void * data = MAP_FAILED;
+	if (ftruncate( fd, (off_t) size ) == 0)
+	{
+		data = mmap( NULL, (size_t) size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	}
+	close( fd );
+	
+	if (data != MAP_FAILED)
+	{
+		image->width = width;
+		image->height = height;
+		image->data = (uint8_t *) data;
+		image->mapped = 1;
+		image->mip_levels = (uint8_t) levels;
+	}
+}
+
+
+// Lets go of the mip chain once the pixels have changed under it. Mapped,
+// the pages past the pixels are unmapped, so freeing the image later, with
+// no levels, unmaps all that's left.
+static void png_image_drop_mips( png_image * image )
+{
+	if (!image->mip_levels)
+	{
+		return;
+	}
+	if (image->mapped)
+	{
+		const uint64_t page = (uint64_t) sysconf( _SC_PAGESIZE );
+		const uint64_t keep = ((png_image_bytes( image->width, image->height ) + page - 1) / page) * page;
+		const uint64_t size = png_chain_bytes( image->width, image->height, image->mip_levels );
+		if (size > keep)
+		{
+			munmap( image->data + keep, (size_t) (size - keep) );
+		}
+	}
+	image->mip_levels = 0;
 }
 
 
 void png_image_alloc( png_image * image, uint32_t width, uint32_t height )
 {
-	image->width = width;
-	image->height = height;
-	image->data = (uint8_t *) pngio_malloc( width * height * 4 );
+	png_image_alloc_chain( image, width, height, 0, 0 );
+}
+
+
+void png_image_alloc_mapped( png_image * image, uint32_t width, uint32_t height )
+{
+	png_image_alloc_chain( image, width, height, 0, 1 );
 }
 
 
@@ -82,20 +424,41 @@ void png_image_free( png_image * image )
 {
 	if (image->data != NULL) 
 	{
-		pngio_free( image->data );
+		if (image->mapped)
+		{
+			munmap( image->data, (size_t) png_chain_bytes( image->width, image->height, image->mip_levels ) );
+		}
+		else
+		{
+			pngio_free( image->data );
+		}
 		image->data = NULL;
 	}
 	image->width = 0;
 	image->height = 0;
+	image->mapped = 0;
+	image->mip_levels = 0;
 }
 
 
 uint8_t * png_image_take( png_image * image )
+{
+	return png_image_take_ex( image, NULL );
+}
+
+
+uint8_t * png_image_take_ex( png_image * image, size_t * mapped_size )
 {
 	uint8_t * data = image->data;
+	if (mapped_size)
+	{
+		* mapped_size = data && image->mapped ? (size_t) png_chain_bytes( image->width, image->height, image->mip_levels ) : 0;
+	}
 	image->width = 0;
 	image->height = 0;
 	image->data = NULL;
+	image->mapped = 0;
+	image->mip_levels = 0;
 	return data;
 }
 
@@ -185,215 +548,6853 @@ static void pngio_error( const char * error )
 //} 
 
 
-static uint8_t png_read( png_structp readPtr, png_image * image, uint32_t flags )
+// XXH64 (xxHash's 64-bit hash, seed 0) taken a piece at a time: 32 byte
+// stripes go through four lanes, and what is left over waits in pending
+// for more data or the end.
+struct png_hash
 {
-//	png_set_error_fn( readPtr, NULL, png_user_error, NULL );
+	uint64_t lanes[4];
+	uint64_t total;
+	uint8_t  pending[32];
+	uint32_t pendingSize;
+};
 
-	png_infop infoPtr = png_create_info_struct( readPtr );
-	if (!infoPtr) 
+static const uint64_t png_hash_prime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t png_hash_prime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t png_hash_prime3 = 0x165667B19E3779F9ULL;
+static const uint64_t png_hash_prime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t png_hash_prime5 = 0x27D4EB2F165667C5ULL;
+
+
+static inline uint64_t png_hash_rotl( uint64_t x, int r )
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+
+static inline uint64_t png_hash_read64( const uint8_t * p )
+{
+	return (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24) |
+		((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+
+static inline uint64_t png_hash_round( uint64_t lane, uint64_t input )
+{
+	return png_hash_rotl( lane + (input * png_hash_prime2), 31 ) * png_hash_prime1;
+}
+
+
+static void png_hash_init( png_hash * hash )
+{
+	hash->lanes[0] = png_hash_prime1 + png_hash_prime2;
+	hash->lanes[1] = png_hash_prime2;
+	hash->lanes[2] = 0;
+	hash->lanes[3] = 0 - png_hash_prime1;
+	hash->total = 0;
+	hash->pendingSize = 0;
+}
+
+
+static inline void png_hash_stripe( uint64_t * lanes, const uint8_t * p )
+{
+	lanes[0] = png_hash_round( lanes[0], png_hash_read64( p ) );
+	lanes[1] = png_hash_round( lanes[1], png_hash_read64( p + 8 ) );
+	lanes[2] = png_hash_round( lanes[2], png_hash_read64( p + 16 ) );
+	lanes[3] = png_hash_round( lanes[3], png_hash_read64( p + 24 ) );
+}
+
+
+static void png_hash_update( png_hash * hash, const uint8_t * data, size_t size )
+{
+	hash->total += size;
+	if (hash->pendingSize + size < 32)
 	{
-		pngio_error( "Couldn't initialize PNG info struct." );
-		png_destroy_read_struct( & readPtr, NULL, NULL );
-		return 0;
+		memcpy( hash->pending + hash->pendingSize, data, size );
+		hash->pendingSize += (uint32_t) size;
+		return;
+	}
+	if (hash->pendingSize)
+	{
+		const size_t n = 32 - hash->pendingSize;
+		memcpy( hash->pending + hash->pendingSize, data, n );
+		png_hash_stripe( hash->lanes, hash->pending );
+		data += n;
+		size -= n;
+		hash->pendingSize = 0;
 	}
 	
-	if (setjmp( png_jmpbuf( readPtr ) ))
+	// Lanes in locals so the compiler keeps them in registers.
+	uint64_t lanes[4] = { hash->lanes[0], hash->lanes[1], hash->lanes[2], hash->lanes[3] };
+	for (; size >= 32; data += 32, size -= 32)
 	{
-		pngio_error( "An error occured while reading the PNG file." );
-		png_destroy_read_struct( & readPtr, & infoPtr, NULL );
-		png_image_free( image );
-		return 0;
+		png_hash_stripe( lanes, data );
 	}
+	memcpy( hash->lanes, lanes, sizeof lanes );
+	memcpy( hash->pending, data, size );
+	hash->pendingSize = (uint32_t) size;
+}
 
-	png_set_sig_bytes( readPtr, 8 );
-	
-	#ifdef PNG_APPLE_MODE_SUPPORTED 
-	if (png_get_apple_mode())
+
+static uint64_t png_hash_final( const png_hash * hash )
+{
+	uint64_t h;
+	if (hash->total >= 32)
 	{
-		png_set_keep_unknown_chunks( readPtr, PNG_HANDLE_CHUNK_ALWAYS, NULL, 0 );
-		png_set_read_user_chunk_fn( readPtr, NULL, png_read_user_chunk );
+		const uint64_t * lanes = hash->lanes;
+		h = png_hash_rotl( lanes[0], 1 ) + png_hash_rotl( lanes[1], 7 ) + png_hash_rotl( lanes[2], 12 ) + png_hash_rotl( lanes[3], 18 );
+		for (int i = 0; i < 4; i++)
+		{
+			h = ((h ^ png_hash_round( 0, lanes[i] )) * png_hash_prime1) + png_hash_prime4;
+		}
 	}
-	#endif
-	
-	png_read_info( readPtr, infoPtr );
-	
-	png_uint_32 w = png_get_image_width( readPtr, infoPtr );
-	png_uint_32 h = png_get_image_height( readPtr, infoPtr );
-	png_uint_32 bitDepth = png_get_bit_depth( readPtr, infoPtr );
-	png_uint_32 channels = png_get_channels( readPtr, infoPtr );
-	png_uint_32 interlaceType = png_get_interlace_type( readPtr, infoPtr );
-	png_uint_32 colorType = png_get_color_type( readPtr, infoPtr );
-	
-	switch (colorType) 
+	else
 	{
-		case PNG_COLOR_TYPE_PALETTE:
-			png_set_palette_to_rgb( readPtr );
-			channels = 3;           
-			break;
-		case PNG_COLOR_TYPE_GRAY:
-			if (bitDepth < 8)
-			{
-				png_set_expand_gray_1_2_4_to_8( readPtr );
-				bitDepth = 8;
-			}
-			png_set_gray_to_rgb( readPtr );
-			break;
+		h = png_hash_prime5;
 	}
+	h += hash->total;
 	
-	if (png_get_valid( readPtr, infoPtr, PNG_INFO_tRNS )) 
+	const uint8_t * p = hash->pending;
+	uint32_t left = hash->pendingSize;
+	for (; left >= 8; p += 8, left -= 8)
 	{
-		png_set_tRNS_to_alpha( readPtr );
-		channels += 1;
+		h = (png_hash_rotl( h ^ png_hash_round( 0, png_hash_read64( p ) ), 27 ) * png_hash_prime1) + png_hash_prime4;
 	}
-	else if (!(colorType & PNG_COLOR_MASK_ALPHA)) 
+	if (left >= 4)
 	{
-		png_set_add_alpha( readPtr, 0xff, PNG_FILLER_AFTER );
+		const uint64_t word = (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24);
+		h = (png_hash_rotl( h ^ (word * png_hash_prime1), 23 ) * png_hash_prime2) + png_hash_prime3;
+		p += 4;
+		left -= 4;
 	}
-	
-	if (bitDepth == 16)
+	for (; left > 0; p++, left--)
 	{
-		png_set_strip_16( readPtr );
+		h = png_hash_rotl( h ^ (* p * png_hash_prime5), 11 ) * png_hash_prime1;
 	}
+	
+	h ^= h >> 33;
+	h *= png_hash_prime2;
+	h ^= h >> 29;
+	h *= png_hash_prime3;
+	h ^= h >> 32;
+	return h;
+}
 
-	#ifdef PNG_APPLE_MODE_SUPPORTED
-	if (png_get_apple_mode())
+
+// Per call state behind png_image_options. libpng times its own stages
+// into a png_stats; allocations are seen through its user memory hooks,
+// each block carrying its size in a small header so frees can be counted.
+// When tracing, libpng's trace points are turned into slices for the pass
+// and band of rows in progress. When hashing, png_read feeds the pixel hash
+// and the reader's IDAT data goes to the other; hashed marks a finished load.
+
+struct png_io_call
+{
+	png_stats         stages;
+	png_image_stats * stats;
+	png_trace *       trace;
+	const char *      name;
+	const png_image_options * options;
+	png_stats_uint    start;
+	uint64_t          allocCount;
+	uint64_t          allocBytes;
+	uint64_t          allocPeak;
+	png_stats_uint    passStart;
+	png_stats_uint    bandStart;
+	uint32_t          pass;
+	uint32_t          bandRow;
+	uint8_t           passOpen;
+	uint8_t           bandOpen;
+	png_hash          pixelHash;
+	png_hash          idatHash;
+	uint8_t           hashed;
+};
+
+
+struct png_trace_event
+{
+	const char * name;
+	const char * argName;
+	uint64_t     ts;
+	uint64_t     dur;
+	uint64_t     tid;
+	uint32_t     arg;
+	char         phase;		// 'X' for a slice, 'i' for an instant
+};
+
+
+struct png_trace
+{
+	pthread_mutex_t   lock;
+	png_trace_event * events;
+	size_t            count;
+	size_t            capacity;
+};
+
+
+static void png_trace_record( png_trace * trace, const char * name, char phase, uint64_t ts, uint64_t dur, const char * argName, uint32_t arg )
+{
+	pthread_mutex_lock( & trace->lock );
+	if (trace->count == trace->capacity)
 	{
-		if (flags & PNG_IMAGE_PREMULTIPLY_ALPHA)
+		const size_t capacity = trace->capacity ? trace->capacity * 2 : 256;
+		png_trace_event * events = (png_trace_event *) realloc( trace->events, capacity * sizeof (png_trace_event) );
+		if (!events)
 		{
-			png_set_read_user_transform_fn( readPtr, png_read_swap_transform );
+			pthread_mutex_unlock( & trace->lock );
+			return;
 		}
-		else
-		{
+		trace->events = events;
+		trace->capacity = capacity;
+	}
+	
+	png_trace_event & event = trace->events[ trace->count++ ];
+	event.name = name;
+	event.argName = argName;
+	event.ts = ts;
+	event.dur = dur;
+	event.tid = (uint64_t) (uintptr_t) pthread_self();
+	event.arg = arg;
+	event.phase = phase;
+	pthread_mutex_unlock( & trace->lock );
+}
+
+
+static void png_call_close_slices( png_io_call * call, png_stats_uint now, uint8_t closePass )
+{
+	if (call->bandOpen)
+	{
+		png_trace_record( call->trace, "rows", 'X', call->bandStart, now - call->bandStart, "first_row", call->bandRow );
+		call->bandOpen = 0;
+	}
+	if (closePass && call->passOpen)
+	{
+		png_trace_record( call->trace, "pass", 'X', call->passStart, now - call->passStart, "pass", call->pass );
+		call->passOpen = 0;
+	}
+}
+
+
+static void png_call_trace_event( png_structp ptr, int event, png_uint_32 arg )
+{
+	png_io_call * call = (png_io_call *) png_get_trace_ptr( ptr );
+	const png_stats_uint now = png_stats_clock();
+	switch (event)
+	{
+		case PNG_TRACE_IDAT:
+			png_trace_record( call->trace, "IDAT", 'i', now, 0, "length", arg );
+			break;
+			
+		case PNG_TRACE_PASS:
+			png_call_close_slices( call, now, 1 );
+			call->pass = arg;
+			call->passStart = now;
+			call->passOpen = 1;
+			break;
+			
+		case PNG_TRACE_ROW_BAND:
+			png_call_close_slices( call, now, 0 );
+			call->bandRow = arg;
+			call->bandStart = now;
+			call->bandOpen = 1;
+			break;
+	}
+}
+
+
+static const size_t png_counted_header = 16;
+
+
+static uint8_t png_call_fits( const png_io_call * call, uint64_t size )
+{
+	const uint64_t budget = call->options->max_bytes;
+	return budget == 0 || (call->allocBytes <= budget && size <= budget - call->allocBytes);
+}
+
+
+static void png_count_alloc( png_io_call * call, uint64_t size )
+{
+	call->allocCount++;
+	call->allocBytes += size;
+	if (call->allocBytes > call->allocPeak)
+	{
+		call->allocPeak = call->allocBytes;
+	}
+}
+
+
+// Counts size against the call if it fits, for memory not allocated through
+// libpng. Without a call everything fits.
+static uint8_t png_call_charge( png_io_call * call, uint64_t size )
+{
+	if (!call)
+	{
+		return 1;
+	}
+	if (!png_call_fits( call, size ))
+	{
+		return 0;
+	}
+	png_count_alloc( call, size );
+	return 1;
+}
+
+
+// Gives back what png_call_charge counted once the memory is freed.
+static void png_call_release( png_io_call * call, uint64_t size )
+{
+	if (call)
+	{
+		call->allocBytes -= size;
+	}
+}
+
+
+static png_voidp png_counted_malloc( png_structp ptr, png_alloc_size_t size )
+{
+	png_io_call * call = (png_io_call *) png_get_mem_ptr( ptr );
+	if (!png_call_fits( call, size ))
+	{
+		return NULL;
+	}
+	uint8_t * block = (uint8_t *) malloc( size + png_counted_header );
+	if (!block)
+	{
+		return NULL;
+	}
+	*(png_alloc_size_t *) block = size;
+	png_count_alloc( call, size );
+	return block + png_counted_header;
+}
+
+
+static void png_counted_free( png_structp ptr, png_voidp data )
+{
+	png_io_call * call = (png_io_call *) png_get_mem_ptr( ptr );
+	uint8_t * block = (uint8_t *) data - png_counted_header;
+	call->allocBytes -= *(png_alloc_size_t *) block;
+	free( block );
+}
+
+
+static png_io_call * png_call_begin( png_io_call * call, const char * name, const png_image_options * options )
+{
+	if (!options || (!options->stats && !options->trace && !options->hashes && !options->max_bytes && !options->max_width && !options->max_height && 
+		!options->threads && !options->restart_rows && !options->io_buffer_size && !options->zbuf_size))
+	{
+		return NULL;
+	}
+	memset( call, 0, sizeof (png_io_call) );
+	call->options = options;
+	call->stats = options->stats;
+	call->trace = options->trace;
+	call->name = name;
+	call->start = png_stats_clock();
+	png_hash_init( & call->pixelHash );
+	png_hash_init( & call->idatHash );
+	return call;
+}
+
+
+static void png_call_end( png_io_call * call, uint8_t result )
+{
+	if (!call)
+	{
+		return;
+	}
+	
+	const png_stats_uint end = png_stats_clock();
+	if (call->trace)
+	{
+		png_call_close_slices( call, end, 1 );
+		png_trace_record( call->trace, call->name, 'X', call->start, end - call->start, "ok", result );
+	}
+	
+	if (call->options->hashes)
+	{
+		const uint8_t hashed = result && call->hashed;
+		call->options->hashes->pixels = hashed ? png_hash_final( & call->pixelHash ) : 0;
+		call->options->hashes->idat = hashed ? png_hash_final( & call->idatHash ) : 0;
+	}
+	
+	if (!call->stats)
+	{
+		return;
+	}
+	
+	const png_stats & stages = call->stages;
+	png_image_stats * stats = call->stats;
+	memset( stats, 0, sizeof (png_image_stats) );
+	stats->calls = 1;
+	stats->total_ns = end - call->start;
+	stats->rows = stages.rows;
+	stats->bytes_read = stages.bytes_read;
+	stats->idat_bytes = stages.idat_bytes;
+	stats->inflate_ns = stages.inflate_ns;
+	for (size_t i = 0; i < 5; i++)
+	{
+		stats->unfilter_ns[i] = stages.unfilter_ns[i];
+		stats->unfilter_rows[i] = stages.unfilter_rows[i];
+	}
+	stats->transform_ns = stages.transform_ns;
+	stats->user_transform_ns = stages.user_transform_ns;
+	stats->filter_ns = stages.filter_ns;
+	stats->deflate_ns = stages.deflate_ns;
+	stats->bytes_written = stages.bytes_written;
+	stats->alloc_count = call->allocCount;
+	stats->alloc_peak_bytes = call->allocPeak;
+}
+
+
+static void png_call_attach( png_structp ptr, png_io_call * call )
+{
+	if (!ptr || !call)
+	{
+		return;
+	}
+	if (call->stats)
+	{
+		png_set_stats( ptr, & call->stages );
+	}
+	if (call->trace)
+	{
+		png_set_trace_fn( ptr, call, png_call_trace_event );
+	}
+}
+
+
+static const png_image_options * png_call_options( const png_io_call * call )
+{
+	return call ? call->options : NULL;
+}
+
+
+static size_t png_call_buffer_size( const png_io_call * call )
+{
+	return call && call->options->io_buffer_size ? call->options->io_buffer_size : PNG_IO_BUFFER_SIZE;
+}
+
+
+// Whether libpng allocates through the call, which also makes it the
+// struct's mem_ptr, where png_read finds it.
+static uint8_t png_call_counts( const png_io_call * call )
+{
+	return call && (call->stats || call->options->max_bytes || call->options->hashes);
+}
+
+
+static png_hash * png_call_pixel_hash( png_io_call * call )
+{
+	return call && call->options->hashes ? & call->pixelHash : NULL;
+}
+
+
+static void png_call_hash_idat( png_structp readPtr, png_const_bytep data, png_size_t size )
+{
+	png_hash_update( & ((png_io_call *) png_get_idat_ptr( readPtr ))->idatHash, data, size );
+}
+
+
+static png_structp png_create_reader( png_io_call * call )
+{
+	png_structp readPtr = png_call_counts( call ) ?
+		png_create_read_struct_2( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, call, png_counted_malloc, png_counted_free ) :
+		png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+	png_call_attach( readPtr, call );
+	
+	if (readPtr && call)
+	{
+		const png_image_options * options = call->options;
+		if (options->max_width || options->max_height)
+		{
+			png_set_user_limits( readPtr,
+				options->max_width ? options->max_width : PNG_USER_WIDTH_MAX,
+				options->max_height ? options->max_height : PNG_USER_HEIGHT_MAX );
+		}
+		if (options->max_bytes)
+		{
+			png_set_chunk_malloc_max( readPtr, (png_alloc_size_t) (options->max_bytes < PNG_SIZE_MAX ? options->max_bytes : PNG_SIZE_MAX) );
+		}
+		if (options->zbuf_size)
+		{
+			png_set_compression_buffer_size( readPtr, options->zbuf_size );
+		}
+		if (options->hashes)
+		{
+			png_set_idat_fn( readPtr, call, png_call_hash_idat );
+		}
+	}
+	return readPtr;
+}
+
+
+static png_structp png_create_writer( png_io_call * call )
+{
+	png_structp writePtr = png_call_counts( call ) ?
+		png_create_write_struct_2( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, call, png_counted_malloc, png_counted_free ) :
+		png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+	png_call_attach( writePtr, call );
+	
+	if (writePtr && call && call->options->zbuf_size)
+	{
+		png_set_compression_buffer_size( writePtr, call->options->zbuf_size );
+	}
+	return writePtr;
+}
+
+
+// Fused read pipeline. For non-interlaced images, rather than letting libpng
+// walk each row once per transform (expand, tRNS, gray to RGB, filler, strip
+// 16, then our user transform), rows are read untransformed and converted to
+// RGBA8 in one pass by a kernel specialized for the source format and output
+// operation. Anything the planner does not cover uses the generic chain.
+
+enum
+{
+	PNG_FUSED_LUT_1,		// palette or gray below 16 bits, through plan->lut
+	PNG_FUSED_LUT_2,
+	PNG_FUSED_LUT_4,
+	PNG_FUSED_LUT_8,
+	PNG_FUSED_GRAY_16,
+	PNG_FUSED_GRAY_16_KEY,
+	PNG_FUSED_GRAY_ALPHA_8,
+	PNG_FUSED_GRAY_ALPHA_16,
+	PNG_FUSED_RGB_8,
+	PNG_FUSED_RGB_8_KEY,
+	PNG_FUSED_RGB_16,
+	PNG_FUSED_RGB_16_KEY,
+	PNG_FUSED_RGBA_8,
+	PNG_FUSED_RGBA_16,
+	PNG_FUSED_SOURCE_COUNT
+};
+
+
+enum
+{
+	PNG_FUSED_NONE,
+	PNG_FUSED_PREMULTIPLY,
+	PNG_FUSED_SWAP,
+	PNG_FUSED_SWAP_AND_UNPREMULTIPLY,
+	PNG_FUSED_OP_COUNT
+};
+
+
+struct png_read_plan;
+typedef void (* png_row_kernel)( const png_read_plan * plan, png_const_bytep s, png_pixel * d, uint32_t width );
+
+
+struct png_read_plan
+{
+	png_row_kernel kernel;
+	png_uint_16    key[3];
+	png_pixel      lut[256];
+};
+
+
+template <int Depth>
+static inline png_byte png_fused_index( png_const_bytep s, uint32_t x )
+{
+	if (Depth == 8)
+	{
+		return s[x];
+	}
+	const uint32_t bit = x * Depth;
+	return (png_byte) ((s[bit >> 3] >> (8 - Depth - (bit & 7))) & ((1 << Depth) - 1));
+}
+
+
+static inline png_uint_16 png_fused_16( png_const_bytep s )
+{
+	return (png_uint_16) ((s[0] << 8) | s[1]);
+}
+
+
+template <int Source>
+static inline png_pixel png_fused_fetch( const png_read_plan * plan, png_const_bytep s, uint32_t x )
+{
+	png_pixel p;
+	switch (Source)
+	{
+		case PNG_FUSED_LUT_1: return plan->lut[ png_fused_index<1>( s, x ) ];
+		case PNG_FUSED_LUT_2: return plan->lut[ png_fused_index<2>( s, x ) ];
+		case PNG_FUSED_LUT_4: return plan->lut[ png_fused_index<4>( s, x ) ];
+		case PNG_FUSED_LUT_8: return plan->lut[ s[x] ];
+		
+		case PNG_FUSED_GRAY_16:
+		case PNG_FUSED_GRAY_16_KEY:
+			s += x * 2;
+			p.r = p.g = p.b = s[0];
+			p.a = (Source == PNG_FUSED_GRAY_16_KEY && png_fused_16( s ) == plan->key[0]) ? 0x00 : 0xFF;
+			return p;
+		
+		case PNG_FUSED_GRAY_ALPHA_8:
+			s += x * 2;
+			p.r = p.g = p.b = s[0];
+			p.a = s[1];
+			return p;
+		
+		case PNG_FUSED_GRAY_ALPHA_16:
+			s += x * 4;
+			p.r = p.g = p.b = s[0];
+			p.a = s[2];
+			return p;
+		
+		case PNG_FUSED_RGB_8:
+		case PNG_FUSED_RGB_8_KEY:
+			s += x * 3;
+			p.r = s[0];
+			p.g = s[1];
+			p.b = s[2];
+			p.a = (Source == PNG_FUSED_RGB_8_KEY && s[0] == plan->key[0] && s[1] == plan->key[1] && s[2] == plan->key[2]) ? 0x00 : 0xFF;
+			return p;
+		
+		case PNG_FUSED_RGB_16:
+		case PNG_FUSED_RGB_16_KEY:
+			s += x * 6;
+			p.r = s[0];
+			p.g = s[2];
+			p.b = s[4];
+			p.a = (Source == PNG_FUSED_RGB_16_KEY && png_fused_16( s ) == plan->key[0] && png_fused_16( s + 2 ) == plan->key[1] && png_fused_16( s + 4 ) == plan->key[2]) ? 0x00 : 0xFF;
+			return p;
+		
+		case PNG_FUSED_RGBA_8:
+			s += x * 4;
+			p.r = s[0];
+			p.g = s[1];
+			p.b = s[2];
+			p.a = s[3];
+			return p;
+		
+		default:
+			s += x * 8;
+			p.r = s[0];
+			p.g = s[2];
+			p.b = s[4];
+			p.a = s[6];
+			return p;
+	}
+}
+
+
+// These reproduce png_read_premultiply_transform, png_read_swap_transform and
+// png_read_swap_and_unpremultiply_transform exactly, including the byte
+// truncation when unpremultiplying.
+template <int Op>
+static inline png_pixel png_fused_apply( png_pixel p )
+{
+	png_pixel q = p;
+	if (Op == PNG_FUSED_PREMULTIPLY)
+	{
+		png_byte a = p.a ? p.a : 1;
+		q.r = (p.r * a) / 0xFF;
+		q.g = (p.g * a) / 0xFF;
+		q.b = (p.b * a) / 0xFF;
+	}
+	else if (Op == PNG_FUSED_SWAP)
+	{
+		q.r = p.b;
+		q.b = p.r;
+	}
+	else if (Op == PNG_FUSED_SWAP_AND_UNPREMULTIPLY)
+	{
+		png_byte a = p.a ? p.a : 1;
+		q.r = (png_byte) ((p.b * 0xFF) / a);
+		q.g = (png_byte) ((p.g * 0xFF) / a);
+		q.b = (png_byte) ((p.r * 0xFF) / a);
+	}
+	return q;
+}
+
+
+template <int Source, int Op>
+static void png_fused_row( const png_read_plan * plan, png_const_bytep s, png_pixel * d, uint32_t width )
+{
+	for (uint32_t x = 0; x < width; x++)
+	{
+		d[x] = png_fused_apply<Op>( png_fused_fetch<Source>( plan, s, x ) );
+	}
+}
+
+
+#define PNG_FUSED_KERNELS( source ) \
+	{ png_fused_row<source, PNG_FUSED_NONE>, png_fused_row<source, PNG_FUSED_PREMULTIPLY>, \
+	  png_fused_row<source, PNG_FUSED_SWAP>, png_fused_row<source, PNG_FUSED_SWAP_AND_UNPREMULTIPLY> }
+
+static const png_row_kernel png_fused_kernels[PNG_FUSED_SOURCE_COUNT][PNG_FUSED_OP_COUNT] =
+{
+	PNG_FUSED_KERNELS( PNG_FUSED_LUT_1 ),
+	PNG_FUSED_KERNELS( PNG_FUSED_LUT_2 ),
+	PNG_FUSED_KERNELS( PNG_FUSED_LUT_4 ),
+	PNG_FUSED_KERNELS( PNG_FUSED_LUT_8 ),
+	PNG_FUSED_KERNELS( PNG_FUSED_GRAY_16 ),
+	PNG_FUSED_KERNELS( PNG_FUSED_GRAY_16_KEY ),
+	PNG_FUSED_KERNELS( PNG_FUSED_GRAY_ALPHA_8 ),
+	PNG_FUSED_KERNELS( PNG_FUSED_GRAY_ALPHA_16 ),
+	PNG_FUSED_KERNELS( PNG_FUSED_RGB_8 ),
+	PNG_FUSED_KERNELS( PNG_FUSED_RGB_8_KEY ),
+	PNG_FUSED_KERNELS( PNG_FUSED_RGB_16 ),
+	PNG_FUSED_KERNELS( PNG_FUSED_RGB_16_KEY ),
+	PNG_FUSED_KERNELS( PNG_FUSED_RGBA_8 ),
+	PNG_FUSED_KERNELS( PNG_FUSED_RGBA_16 ),
+};
+
+
+// Plans the kernel for rows as they're stored, with the passes of interlaced
+// images already combined, and converted by op.
+static uint8_t png_plan_rows( png_structp readPtr, png_infop infoPtr, int op, png_read_plan * plan )
+{
+	const png_uint_32 bitDepth = png_get_bit_depth( readPtr, infoPtr );
+	const png_uint_32 colorType = png_get_color_type( readPtr, infoPtr );
+	
+	png_bytep transAlpha = NULL;
+	int transCount = 0;
+	png_color_16p transColor = NULL;
+	const uint8_t hasKey = png_get_tRNS( readPtr, infoPtr, & transAlpha, & transCount, & transColor ) != 0;
+	
+	int source;
+	if (colorType == PNG_COLOR_TYPE_PALETTE || (colorType == PNG_COLOR_TYPE_GRAY && bitDepth <= 8))
+	{
+		source = bitDepth == 1 ? PNG_FUSED_LUT_1 : bitDepth == 2 ? PNG_FUSED_LUT_2 : bitDepth == 4 ? PNG_FUSED_LUT_4 : PNG_FUSED_LUT_8;
+		
+		const int count = 1 << bitDepth;
+		if (colorType == PNG_COLOR_TYPE_PALETTE)
+		{
+			png_colorp palette = NULL;
+			int paletteCount = 0;
+			if (!png_get_PLTE( readPtr, infoPtr, & palette, & paletteCount ))
+			{
+				return 0;
+			}
+			for (int i = 0; i < count; i++)
+			{
+				// libpng keeps a zeroed 256 entry palette, so indices past the
+				// end come out black.
+				png_color c = { 0, 0, 0 };
+				if (i < paletteCount)
+				{
+					c = palette[i];
+				}
+				png_pixel pixel = { c.red, c.green, c.blue, (png_byte) ((hasKey && i < transCount) ? transAlpha[i] : 0xFF) };
+				plan->lut[i] = pixel;
+			}
+		}
+		else
+		{
+			const int scale = 0xFF / (count - 1);
+			for (int i = 0; i < count; i++)
+			{
+				png_byte g = (png_byte) (i * scale);
+				png_pixel pixel = { g, g, g, (png_byte) ((hasKey && i == (transColor->gray & (count - 1))) ? 0x00 : 0xFF) };
+				plan->lut[i] = pixel;
+			}
+		}
+	}
+	else if (colorType == PNG_COLOR_TYPE_GRAY)
+	{
+		source = hasKey ? PNG_FUSED_GRAY_16_KEY : PNG_FUSED_GRAY_16;
+		if (hasKey)
+		{
+			plan->key[0] = transColor->gray;
+		}
+	}
+	else if (colorType == PNG_COLOR_TYPE_RGB)
+	{
+		if (bitDepth == 8)
+		{
+			source = hasKey ? PNG_FUSED_RGB_8_KEY : PNG_FUSED_RGB_8;
+		}
+		else
+		{
+			source = hasKey ? PNG_FUSED_RGB_16_KEY : PNG_FUSED_RGB_16;
+		}
+		if (hasKey)
+		{
+			const png_uint_16 mask = bitDepth == 8 ? 0xFF : 0xFFFF;
+			plan->key[0] = transColor->red & mask;
+			plan->key[1] = transColor->green & mask;
+			plan->key[2] = transColor->blue & mask;
+		}
+	}
+	else if (colorType == PNG_COLOR_TYPE_GRAY_ALPHA)
+	{
+		source = bitDepth == 8 ? PNG_FUSED_GRAY_ALPHA_8 : PNG_FUSED_GRAY_ALPHA_16;
+	}
+	else if (colorType == PNG_COLOR_TYPE_RGB_ALPHA)
+	{
+		source = bitDepth == 8 ? PNG_FUSED_RGBA_8 : PNG_FUSED_RGBA_16;
+	}
+	else
+	{
+		return 0;
+	}
+	
+	plan->kernel = png_fused_kernels[source][op];
+	return 1;
+}
+
+
+static uint8_t png_plan_read( png_structp readPtr, png_infop infoPtr, uint32_t flags, png_read_plan * plan )
+{
+	if (png_get_interlace_type( readPtr, infoPtr ) != PNG_INTERLACE_NONE)
+	{
+		return 0;
+	}
+	
+	int op = (flags & PNG_IMAGE_PREMULTIPLY_ALPHA) ? PNG_FUSED_PREMULTIPLY : PNG_FUSED_NONE;
+	#ifdef PNG_APPLE_MODE_SUPPORTED
+	if (png_get_apple_mode())
+	{
+		op = (flags & PNG_IMAGE_PREMULTIPLY_ALPHA) ? PNG_FUSED_SWAP : PNG_FUSED_SWAP_AND_UNPREMULTIPLY;
+	}
+	#endif
+	return png_plan_rows( readPtr, infoPtr, op, plan );
+}
+
+
+static void png_read_generic_transforms( png_structp readPtr, png_infop infoPtr, uint32_t flags )
+{
+	png_uint_32 bitDepth = png_get_bit_depth( readPtr, infoPtr );
+	png_uint_32 channels = png_get_channels( readPtr, infoPtr );
+	png_uint_32 colorType = png_get_color_type( readPtr, infoPtr );
+	
+	switch (colorType) 
+	{
+		case PNG_COLOR_TYPE_PALETTE:
+			png_set_palette_to_rgb( readPtr );
+			channels = 3;           
+			break;
+		case PNG_COLOR_TYPE_GRAY:
+		case PNG_COLOR_TYPE_GRAY_ALPHA:
+			if (bitDepth < 8)
+			{
+				png_set_expand_gray_1_2_4_to_8( readPtr );
+				bitDepth = 8;
+			}
+			png_set_gray_to_rgb( readPtr );
+			break;
+	}
+	
+	if (png_get_valid( readPtr, infoPtr, PNG_INFO_tRNS )) 
+	{
+		png_set_tRNS_to_alpha( readPtr );
+		channels += 1;
+	}
+	else if (!(colorType & PNG_COLOR_MASK_ALPHA)) 
+	{
+		png_set_add_alpha( readPtr, 0xff, PNG_FILLER_AFTER );
+	}
+	
+	if (bitDepth == 16)
+	{
+		png_set_strip_16( readPtr );
+	}
+
+	#ifdef PNG_APPLE_MODE_SUPPORTED
+	if (png_get_apple_mode())
+	{
+		if (flags & PNG_IMAGE_PREMULTIPLY_ALPHA)
+		{
+			png_set_read_user_transform_fn( readPtr, png_read_swap_transform );
+		}
+		else
+		{
 			png_set_read_user_transform_fn( readPtr, png_read_swap_and_unpremultiply_transform );
 		}
-		png_set_user_transform_info( readPtr, NULL, bitDepth, channels );
-		png_read_update_info( readPtr, infoPtr );
+		png_set_user_transform_info( readPtr, NULL, bitDepth, channels );
+		png_read_update_info( readPtr, infoPtr );
+	}
+	else
+	#endif
+	{
+		if (flags & PNG_IMAGE_PREMULTIPLY_ALPHA)
+		{
+			png_set_read_user_transform_fn( readPtr, png_read_premultiply_transform );
+		}
+	}
+}
+
+
+static uint32_t png_thread_count( const png_image_options * options )
+{
+	if (options && options->threads)
+	{
+		return options->threads;
+	}
+	const long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+	return cpus > 0 ? (uint32_t) cpus : 1;
+}
+
+
+// Runs job( jobs + i ) for every i below count on up to threads threads, in
+// batches of threads, calling done( jobs + i ) in order after each batch.
+static uint8_t png_run_batched( void * jobs, size_t jobSize, size_t count, uint32_t threads, void * (* job)( void * ), uint8_t (* done)( void *, void * ), void * context )
+{
+	pthread_t * workers = (pthread_t *) malloc( sizeof (pthread_t) * threads );
+	if (!workers)
+	{
+		return 0;
+	}
+	
+	uint8_t result = 1;
+	for (size_t first = 0; first < count && result; first += threads)
+	{
+		const size_t n = count - first < threads ? count - first : threads;
+		size_t started = 0;
+		for (; started < n; started++)
+		{
+			void * arg = (uint8_t *) jobs + (jobSize * (first + started));
+			if (n == 1 || pthread_create( & workers[started], NULL, job, arg ) != 0)
+			{
+				break;
+			}
+		}
+		for (size_t i = started; i < n; i++)
+		{
+			job( (uint8_t *) jobs + (jobSize * (first + i)) );
+		}
+		for (size_t i = 0; i < started; i++)
+		{
+			pthread_join( workers[i], NULL );
+		}
+		for (size_t i = 0; i < n && result; i++)
+		{
+			result = done( (uint8_t *) jobs + (jobSize * (first + i)), context );
+		}
+	}
+	
+	free( workers );
+	return result;
+}
+
+
+// Loads that turn the image put each row where it belongs as it's decoded.
+// Any combination of flags comes down to an optional transpose followed by
+// flips of the turned image's axes. Without a transpose a row lands whole,
+// reversed in place for a horizontal flip. With one, each row becomes a
+// column, so rows are gathered PNG_ORIENT_ROWS at a time, while they're
+// still in cache, and written out by png_transpose_pixels a tile at a time.
+#define PNG_ORIENT_ROWS			32
+
+static void png_reverse_pixels( png_pixel * p, size_t n );
+static void png_transpose_pixels( const png_pixel * s, ptrdiff_t sStride, uint32_t width, uint32_t height, png_pixel * d, ptrdiff_t dStride );
+
+
+struct png_orient
+{
+	png_pixel * pixels;
+	uint32_t    width;		// as stored
+	uint32_t    height;
+	uint8_t     transpose;
+	uint8_t     flipX;		// of the turned image
+	uint8_t     flipY;
+};
+
+
+static void png_orient_transpose( png_orient * orient )
+{
+	const uint8_t flipX = orient->flipX;
+	orient->flipX = orient->flipY;
+	orient->flipY = flipX;
+	orient->transpose ^= 1;
+}
+
+
+// Flips, then the transpose, then the rotations, clockwise.
+static void png_orient_init( png_orient * orient, uint32_t flags, png_bytep pixels, uint32_t w, uint32_t h )
+{
+	orient->pixels = (png_pixel *) pixels;
+	orient->width = w;
+	orient->height = h;
+	orient->transpose = 0;
+	orient->flipX = (flags & PNG_IMAGE_FLIP_HORIZONTAL) != 0;
+	orient->flipY = (flags & PNG_IMAGE_FLIP_VERTICAL) != 0;
+	if (flags & PNG_IMAGE_TRANSPOSE)
+	{
+		png_orient_transpose( orient );
+	}
+	if (flags & PNG_IMAGE_ROTATE_90)
+	{
+		png_orient_transpose( orient );
+		orient->flipX ^= 1;
+	}
+	if (flags & PNG_IMAGE_ROTATE_180)
+	{
+		orient->flipX ^= 1;
+		orient->flipY ^= 1;
+	}
+	if (flags & PNG_IMAGE_ROTATE_270)
+	{
+		png_orient_transpose( orient );
+		orient->flipY ^= 1;
+	}
+}
+
+
+static size_t png_orient_band_bytes( const png_orient * orient )
+{
+	return orient->transpose ? (size_t) orient->width * 4 * PNG_ORIENT_ROWS : 0;
+}
+
+
+// One decoding thread's rows, taken in order. band holds PNG_ORIENT_ROWS
+// rows when transposing; first is the image row in band[0].
+struct png_orient_rows
+{
+	const png_orient * orient;
+	png_pixel *        band;
+	uint32_t           first;
+	uint32_t           count;
+};
+
+
+// Rows first onwards as columns of the turned image, which is height wide.
+// Its horizontal flip takes the rows bottom up, its vertical one the columns.
+static void png_orient_columns( const png_orient * orient, const png_pixel * s, uint32_t first, uint32_t count )
+{
+	const uint32_t w = orient->width;
+	const uint32_t h = orient->height;
+	const ptrdiff_t sStride = orient->flipX ? -(ptrdiff_t) w : (ptrdiff_t) w;
+	const ptrdiff_t dStride = orient->flipY ? -(ptrdiff_t) h : (ptrdiff_t) h;
+	png_pixel * d = orient->pixels + (orient->flipX ? h - first - count : first);
+	if (orient->flipX)
+	{
+		s += (size_t) w * (count - 1);
+	}
+	if (orient->flipY)
+	{
+		d += (size_t) h * (w - 1);
+	}
+	png_transpose_pixels( s, sStride, w, count, d, dStride );
+}
+
+
+static void png_orient_flush( png_orient_rows * rows )
+{
+	if (rows->count)
+	{
+		png_orient_columns( rows->orient, rows->band, rows->first, rows->count );
+		rows->count = 0;
+	}
+}
+
+
+// Where the kernel should put row i.
+static png_pixel * png_orient_row( png_orient_rows * rows, uint32_t i )
+{
+	const png_orient * o = rows->orient;
+	if (o->transpose)
+	{
+		if (rows->count == 0)
+		{
+			rows->first = i;
+		}
+		return rows->band + ((size_t) o->width * rows->count);
+	}
+	return o->pixels + ((size_t) o->width * (o->flipY ? o->height - 1 - i : i));
+}
+
+
+static void png_orient_done( png_orient_rows * rows, png_pixel * row )
+{
+	const png_orient * o = rows->orient;
+	if (o->transpose)
+	{
+		if (++rows->count == PNG_ORIENT_ROWS)
+		{
+			png_orient_flush( rows );
+		}
+	}
+	else if (o->flipX)
+	{
+		png_reverse_pixels( row, o->width );
+	}
+}
+
+
+// Puts a whole image decoded as stored in place, for the interlaced files
+// whose rows are only finished by the last pass.
+static void png_orient_image( const png_orient * orient, png_pixel * source )
+{
+	const uint32_t w = orient->width;
+	const uint32_t h = orient->height;
+	if (orient->transpose)
+	{
+		png_orient_columns( orient, source, 0, h );
+		return;
+	}
+	png_orient_rows rows = { orient, NULL, 0, 0 };
+	for (uint32_t i = 0; i < h; i++)
+	{
+		png_pixel * row = png_orient_row( & rows, i );
+		memcpy( row, source + ((size_t) w * i), (size_t) w * 4 );
+		png_orient_done( & rows, row );
+	}
+}
+
+
+// A row of a turned image as it's stored, into scratch unless the row is
+// still there as it was.
+static const png_pixel * png_orient_source_row( const png_orient * orient, uint32_t i, png_pixel * scratch )
+{
+	const uint32_t w = orient->width;
+	const uint32_t h = orient->height;
+	if (!orient->transpose && !orient->flipX)
+	{
+		return orient->pixels + ((size_t) w * (orient->flipY ? h - 1 - i : i));
+	}
+	for (uint32_t x = 0; x < w; x++)
+	{
+		const uint32_t u = orient->transpose ? i : x;
+		const uint32_t v = orient->transpose ? x : i;
+		const uint32_t turnedWidth = orient->transpose ? h : w;
+		const uint32_t turnedHeight = orient->transpose ? w : h;
+		const size_t dx = orient->flipX ? turnedWidth - 1 - u : u;
+		const size_t dy = orient->flipY ? turnedHeight - 1 - v : v;
+		scratch[x] = orient->pixels[(turnedWidth * dy) + dx];
+	}
+	return scratch;
+}
+
+
+// Mip chains for PNG_IMAGE_MIPMAPS. Each level below the image is filtered
+// from the one above in linear light, weighted by alpha: a pixel goes in as
+// (r, g, b) * a, a, its colors through a table for the sRGB curve, and
+// comes out divided by the summed alpha and back through a table for the
+// curve's inverse. The box filter sums 2 by 2 pixels straight into the
+// level. The Kaiser filter is separable, 8 rows of the level above summed
+// down their columns and the sums then across; it's a sinc windowed by a
+// Kaiser window of alpha 4, reaching 2 pixels of the smaller level either
+// side, and its negative lobes can overshoot, so results are clamped. Rows
+// it reads are kept in linear light in a ring, as each is read by 4 rows of
+// the level below. Edges repeat their last pixel.
+#define PNG_MIP_TAPS			8
+#define PNG_MIP_ENCODE_STEPS	16384				// linear values are looked up to 1 / this
+#define PNG_MIP_THREAD_PIXELS	(1 << 18)			// levels with fewer aren't split between threads
+
+#ifdef PNGIO_VECTOR
+typedef png_v4f png_mip_sample;
+#else
+struct png_mip_sample
+{
+	float v[4];
+	
+	float operator[]( int i ) const { return v[i]; }
+	png_mip_sample operator*( float k ) const
+	{
+		png_mip_sample r = { { v[0] * k, v[1] * k, v[2] * k, v[3] * k } };
+		return r;
+	}
+	png_mip_sample operator+( const png_mip_sample & o ) const
+	{
+		png_mip_sample r = { { v[0] + o.v[0], v[1] + o.v[1], v[2] + o.v[2], v[3] + o.v[3] } };
+		return r;
+	}
+	png_mip_sample & operator+=( const png_mip_sample & o )
+	{
+		return * this = * this + o;
+	}
+};
+#endif
+
+struct png_mip_filter
+{
+	int   first;						// the first tap, from twice the pixel's position
+	int   count;
+	float weights[PNG_MIP_TAPS];
+};
+
+
+// The modified Bessel function of the first kind, of order 0.
+static double png_bessel_i0( double x )
+{
+	double sum = 1;
+	double term = 1;
+	for (int k = 1; k < 32; k++)
+	{
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+
+struct png_mip_tables
+{
+	float          linear[256];
+	uint8_t        encoded[PNG_MIP_ENCODE_STEPS + 1];
+	png_mip_filter box;
+	png_mip_filter kaiser;
+	
+	png_mip_tables( void )
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			const double c = i / 255.0;
+			linear[i] = (float) (c <= 0.04045 ? c / 12.92 : pow( (c + 0.055) / 1.055, 2.4 ));
+		}
+		for (int i = 0; i <= PNG_MIP_ENCODE_STEPS; i++)
+		{
+			const double l = (double) i / PNG_MIP_ENCODE_STEPS;
+			const double c = l <= 0.0031308 ? l * 12.92 : (1.055 * pow( l, 1 / 2.4 )) - 0.055;
+			encoded[i] = (uint8_t) ((c * 255) + 0.5);
+		}
+		
+		box.first = 0;
+		box.count = 2;
+		box.weights[0] = box.weights[1] = 0.5f;
+		
+		// Tap k sits k - 3.5 pixels from the center of the two it halves,
+		// which is half that in pixels of the level being made.
+		kaiser.first = -3;
+		kaiser.count = PNG_MIP_TAPS;
+		double weights[PNG_MIP_TAPS];
+		double sum = 0;
+		for (int k = 0; k < PNG_MIP_TAPS; k++)
+		{
+			const double pi = 3.14159265358979323846;
+			const double x = (k - 3.5) / 2;
+			const double window = x / 2;
+			weights[k] = (sin( pi * x ) / (pi * x)) * png_bessel_i0( 4 * sqrt( 1 - (window * window) ) ) / png_bessel_i0( 4 );
+			sum += weights[k];
+		}
+		for (int k = 0; k < PNG_MIP_TAPS; k++)
+		{
+			kaiser.weights[k] = (float) (weights[k] / sum);
+		}
+	}
+};
+
+
+static const png_mip_tables & png_mip_get_tables( void )
+{
+	static const png_mip_tables tables;
+	return tables;
+}
+
+
+// A premultiplied pixel is first taken back to its color as pngio does.
+static inline png_mip_sample png_mip_load( const png_mip_tables & tables, png_pixel p, uint8_t premultiplied )
+{
+	if (premultiplied && p.a != 0xFF)
+	{
+		const unsigned a = p.a ? p.a : 1;
+		const unsigned r = (p.r * 0xFFu) / a;
+		const unsigned g = (p.g * 0xFFu) / a;
+		const unsigned b = (p.b * 0xFFu) / a;
+		p.r = (png_byte) (r < 0xFF ? r : 0xFF);
+		p.g = (png_byte) (g < 0xFF ? g : 0xFF);
+		p.b = (png_byte) (b < 0xFF ? b : 0xFF);
+	}
+	const float a = p.a * (1.0f / 255);
+	const png_mip_sample s = { tables.linear[p.r] * a, tables.linear[p.g] * a, tables.linear[p.b] * a, a };
+	return s;
+}
+
+
+static inline png_byte png_mip_encode( const png_mip_tables & tables, float x )
+{
+	x = x < PNG_MIP_ENCODE_STEPS ? x : PNG_MIP_ENCODE_STEPS;
+	return tables.encoded[x > 0.0f ? (int) (x + 0.5f) : 0];
+}
+
+
+static inline png_pixel png_mip_store( const png_mip_tables & tables, png_mip_sample s, uint8_t premultiplied )
+{
+	png_pixel p = { 0, 0, 0, 0 };
+	const float a = s[3] < 1.0f ? s[3] : 1.0f;
+	p.a = (png_byte) (a > 0.0f ? (a * 255) + 0.5f : 0.0f);
+	if (p.a == 0)
+	{
+		return p;
+	}
+	
+	const float scale = PNG_MIP_ENCODE_STEPS / s[3];
+	p.r = png_mip_encode( tables, s[0] * scale );
+	p.g = png_mip_encode( tables, s[1] * scale );
+	p.b = png_mip_encode( tables, s[2] * scale );
+	if (premultiplied)
+	{
+		p.r = (png_byte) ((p.r * p.a) / 0xFF);
+		p.g = (png_byte) ((p.g * p.a) / 0xFF);
+		p.b = (png_byte) ((p.b * p.a) / 0xFF);
+	}
+	return p;
+}
+
+
+struct png_mips
+{
+	png_pixel *            pixels;		// the image, with the chain after it
+	uint32_t               width;
+	uint32_t               height;
+	uint32_t               levels;		// after the image
+	const png_mip_filter * filter;
+	uint8_t                premultiplied;
+	uint8_t                upward;		// the image's rows arrive bottom up
+	uint32_t               built;		// level 1 rows so far, from the end they arrive at
+	png_bytep              scratch;		// for building on this thread; see png_mip_scratch_bytes
+};
+
+
+static const png_mip_filter * png_mip_get_filter( uint32_t flags )
+{
+	if (flags & PNG_IMAGE_MIPMAPS_KAISER)
+	{
+		return & png_mip_get_tables().kaiser;
+	}
+	return (flags & PNG_IMAGE_MIPMAPS) ? & png_mip_get_tables().box : NULL;
+}
+
+
+// The Kaiser filter's column sums and ring of rows, each a row of the image
+// wide, then which row of which level each slot in the ring holds.
+static uint64_t png_mip_scratch_bytes( const png_mip_filter * filter, uint32_t width )
+{
+	if (!filter || filter->count == 2)
+	{
+		return 0;
+	}
+	return ((uint64_t) width * sizeof (png_mip_sample) * (PNG_MIP_TAPS + 1)) + (sizeof (int64_t) * PNG_MIP_TAPS * 2);
+}
+
+
+static void png_mip_scratch_reset( const png_mips * mips, png_bytep scratch )
+{
+	const uint64_t bytes = png_mip_scratch_bytes( mips->filter, mips->width );
+	if (scratch && bytes)
+	{
+		memset( scratch + bytes - (sizeof (int64_t) * PNG_MIP_TAPS * 2), 0xFF, sizeof (int64_t) * PNG_MIP_TAPS * 2 );
+	}
+}
+
+
+static void png_mips_init( png_mips * mips, uint32_t flags, png_pixel * pixels, uint32_t width, uint32_t height, uint8_t upward )
+{
+	mips->pixels = pixels;
+	mips->width = width;
+	mips->height = height;
+	mips->levels = png_mip_levels( width, height );
+	mips->filter = png_mip_get_filter( flags );
+	mips->premultiplied = (flags & PNG_IMAGE_PREMULTIPLY_ALPHA) != 0;
+	mips->upward = upward;
+	mips->built = 0;
+	mips->scratch = NULL;
+}
+
+
+static png_pixel * png_mips_level( const png_mips * mips, uint32_t level )
+{
+	const uint64_t before = png_chain_bytes( mips->width, mips->height, level ) - png_image_bytes( png_mip_size( mips->width, level ), png_mip_size( mips->height, level ) );
+	return mips->pixels + (before / 4);
+}
+
+
+static inline uint32_t png_mip_clamp( int64_t i, uint32_t size )
+{
+	return i < 0 ? 0 : (i >= size ? size - 1 : (uint32_t) i);
+}
+
+
+// Row y of level + 1, from level.
+static void png_mips_row( const png_mips * mips, uint32_t level, uint32_t y, png_bytep scratch )
+{
+	const png_mip_tables & tables = png_mip_get_tables();
+	const png_mip_filter * f = mips->filter;
+	const uint8_t premultiplied = mips->premultiplied;
+	const uint32_t sw = png_mip_size( mips->width, level );
+	const uint32_t sh = png_mip_size( mips->height, level );
+	const uint32_t dw = png_mip_size( mips->width, level + 1 );
+	const png_pixel * s = png_mips_level( mips, level );
+	png_pixel * d = png_mips_level( mips, level + 1 ) + ((size_t) dw * y);
+	
+	if (f->count == 2)
+	{
+		const png_pixel * r0 = s + ((size_t) sw * png_mip_clamp( (int64_t) y * 2, sh ));
+		const png_pixel * r1 = s + ((size_t) sw * png_mip_clamp( ((int64_t) y * 2) + 1, sh ));
+		const uint32_t pairs = sw / 2;
+		for (uint32_t x = 0; x < pairs; x++)
+		{
+			const png_mip_sample v = png_mip_load( tables, r0[x * 2], premultiplied ) + png_mip_load( tables, r0[(x * 2) + 1], premultiplied ) +
+				png_mip_load( tables, r1[x * 2], premultiplied ) + png_mip_load( tables, r1[(x * 2) + 1], premultiplied );
+			d[x] = png_mip_store( tables, v * 0.25f, premultiplied );
+		}
+		if (pairs == 0)
+		{
+			d[0] = png_mip_store( tables, (png_mip_load( tables, r0[0], premultiplied ) + png_mip_load( tables, r1[0], premultiplied )) * 0.5f, premultiplied );
+		}
+		return;
+	}
+	
+	// Each row of the level above goes into the ring once, at its index
+	// modulo the taps, which a row's taps never share.
+	png_mip_sample * sums = (png_mip_sample *) scratch;
+	png_mip_sample * ring = sums + sw;
+	int64_t * held = (int64_t *) (ring + ((size_t) mips->width * PNG_MIP_TAPS));
+	const png_mip_sample * taps[PNG_MIP_TAPS];
+	for (int k = 0; k < f->count; k++)
+	{
+		const uint32_t r = png_mip_clamp( ((int64_t) y * 2) + f->first + k, sh );
+		png_mip_sample * row = ring + ((size_t) mips->width * (r % PNG_MIP_TAPS));
+		if (held[(r % PNG_MIP_TAPS) * 2] != level || held[((r % PNG_MIP_TAPS) * 2) + 1] != r)
+		{
+			const png_pixel * p = s + ((size_t) sw * r);
+			for (uint32_t x = 0; x < sw; x++)
+			{
+				row[x] = png_mip_load( tables, p[x], premultiplied );
+			}
+			held[(r % PNG_MIP_TAPS) * 2] = level;
+			held[((r % PNG_MIP_TAPS) * 2) + 1] = r;
+		}
+		taps[k] = row;
+	}
+	for (uint32_t x = 0; x < sw; x++)
+	{
+		png_mip_sample v = taps[0][x] * f->weights[0];
+		for (int k = 1; k < PNG_MIP_TAPS; k++)
+		{
+			v += taps[k][x] * f->weights[k];
+		}
+		sums[x] = v;
+	}
+	
+	for (uint32_t x = 0; x < dw; x++)
+	{
+		const int64_t first = ((int64_t) x * 2) + f->first;
+		png_mip_sample v = sums[png_mip_clamp( first, sw )] * f->weights[0];
+		if (first >= 0 && first + PNG_MIP_TAPS <= sw)
+		{
+			for (int k = 1; k < PNG_MIP_TAPS; k++)
+			{
+				v += sums[first + k] * f->weights[k];
+			}
+		}
+		else
+		{
+			for (int k = 1; k < PNG_MIP_TAPS; k++)
+			{
+				v += sums[png_mip_clamp( first + k, sw )] * f->weights[k];
+			}
+		}
+		d[x] = png_mip_store( tables, v, premultiplied );
+	}
+}
+
+
+// Builds the level 1 rows whose rows of the image are all in, given how many
+// have arrived, so each is filtered while its rows are still in cache.
+static void png_mips_advance( png_mips * mips, uint32_t arrived )
+{
+	const png_mip_filter * f = mips->filter;
+	const uint32_t h = mips->height;
+	const uint32_t dh = png_mip_size( h, 1 );
+	while (mips->levels && mips->built < dh)
+	{
+		const uint32_t y = mips->upward ? dh - 1 - mips->built : mips->built;
+		const uint32_t first = png_mip_clamp( ((int64_t) y * 2) + f->first, h );
+		const uint32_t last = png_mip_clamp( ((int64_t) y * 2) + f->first + f->count - 1, h );
+		if (mips->upward ? first < h - arrived : last >= arrived)
+		{
+			break;
+		}
+		png_mips_row( mips, 0, y, mips->scratch );
+		mips->built++;
+	}
+}
+
+
+// A band of rows of one level, on a thread with scratch of its own.
+struct png_mip_job
+{
+	const png_mips * mips;
+	uint32_t         level;		// made from
+	uint32_t         first;
+	uint32_t         count;
+	uint8_t          ok;
+};
+
+
+static void * png_mip_band( void * arg )
+{
+	png_mip_job * job = (png_mip_job *) arg;
+	const uint64_t bytes = png_mip_scratch_bytes( job->mips->filter, job->mips->width );
+	png_bytep scratch = bytes ? (png_bytep) malloc( (size_t) bytes ) : NULL;
+	job->ok = !bytes || scratch;
+	png_mip_scratch_reset( job->mips, scratch );
+	for (uint32_t y = job->first; y < job->first + job->count && job->ok; y++)
+	{
+		png_mips_row( job->mips, job->level, y, scratch );
+	}
+	free( scratch );
+	return NULL;
+}
+
+
+// Bands whose scratch couldn't be allocated are built here instead.
+static uint8_t png_mip_band_done( void * arg, void * )
+{
+	png_mip_job * job = (png_mip_job *) arg;
+	for (uint32_t y = job->first; y < job->first + job->count && !job->ok; y++)
+	{
+		png_mips_row( job->mips, job->level, y, job->mips->scratch );
+	}
+	return 1;
+}
+
+
+// Builds rows first to first + count of level + 1, split between up to
+// threads threads if there are enough pixels.
+static void png_mips_rows( const png_mips * mips, uint32_t level, uint32_t first, uint32_t count, uint32_t threads, png_mip_job * jobs )
+{
+	const uint64_t pixels = (uint64_t) png_mip_size( mips->width, level + 1 ) * count;
+	const uint32_t n = pixels < PNG_MIP_THREAD_PIXELS ? 1 : (threads < count ? threads : count);
+	for (uint32_t i = 0; i < n; i++)
+	{
+		jobs[i].mips = mips;
+		jobs[i].level = level;
+		jobs[i].first = first + (uint32_t) (((uint64_t) count * i) / n);
+		jobs[i].count = first + (uint32_t) (((uint64_t) count * (i + 1)) / n) - jobs[i].first;
+		jobs[i].ok = 0;
+	}
+	if (n == 1)
+	{
+		png_mip_band_done( jobs, NULL );
+	}
+	else
+	{
+		png_run_batched( jobs, sizeof (png_mip_job), n, threads, png_mip_band, png_mip_band_done, NULL );
+	}
+}
+
+
+// Whatever is left of level 1, then the rest of the chain. Each thread's
+// scratch counts against the call's budget; the levels are built on this
+// thread alone when there isn't room for it.
+static void png_mips_finish( png_mips * mips, uint32_t threads, png_io_call * call )
+{
+	if (!mips->levels)
+	{
+		return;
+	}
+	const uint64_t scratchBytes = threads > 1 ? png_mip_scratch_bytes( mips->filter, mips->width ) * threads : 0;
+	threads = png_call_charge( call, scratchBytes ) ? threads : 1;
+	png_mip_job single;
+	png_mip_job * jobs = threads > 1 ? (png_mip_job *) malloc( sizeof (png_mip_job) * threads ) : NULL;
+	const uint32_t n = jobs ? threads : 1;
+	jobs = jobs ? jobs : & single;
+	
+	const uint32_t h = png_mip_size( mips->height, 1 );
+	png_mips_rows( mips, 0, mips->upward ? 0 : mips->built, h - mips->built, n, jobs );
+	mips->built = h;
+	for (uint32_t level = 1; level < mips->levels; level++)
+	{
+		png_mips_rows( mips, level, 0, png_mip_size( mips->height, level + 1 ), n, jobs );
+	}
+	
+	if (jobs != & single)
+	{
+		free( jobs );
+	}
+	png_call_release( call, threads > 1 ? scratchBytes : 0 );
+}
+
+
+// Raw reads from the source, for the pipelined decoder's reader thread. It
+// can't go through libpng, whose errors longjmp on the caller's stack.
+struct png_pull
+{
+	size_t (* read)( void * io, uint8_t * data, size_t size );
+	void * io;
+};
+
+
+static size_t png_pull_buffered( void * io, uint8_t * data, size_t size )
+{
+	return png_io_buffer_read( (png_io_buffer *) io, data, size );
+}
+
+
+#define PNG_PIPE_BLOCKS			8
+#define PNG_PIPE_BLOCK_SIZE		65536
+#define PNG_PIPE_ROWS			16
+
+
+// Pipelined decode of a non-interlaced image: a reader thread pulls IDAT
+// data and checks its CRCs, an inflater thread decompresses it into a ring
+// of filtered rows, and the calling thread unfilters each row and runs the
+// fused kernel on it. Blocks and rows are handed over through single
+// producer, single consumer rings whose counters only their owner writes.
+struct png_pipe
+{
+	const png_pull * pull;
+	uint32_t   idatRemaining;
+	uint64_t   idatBytes;
+	png_hash * idatHash;		// the reader's alone until it's joined
+	
+	uint8_t  * blocks;
+	uint32_t   blockSize[PNG_PIPE_BLOCKS];
+	uint32_t   blocksIn;		// published by the reader
+	uint32_t   blocksOut;		// released by the inflater
+	uint32_t   readerDone;		// no blocks will follow blocksIn
+	
+	uint8_t  * rows;			// filter byte, then the filtered row
+	size_t     rowSize;
+	uint32_t   height;
+	uint32_t   rowsIn;			// published by the inflater
+	uint32_t   rowsOut;			// released by the caller
+	
+	uint32_t   stop;			// set by any stage to end the others
+};
+
+
+static inline uint32_t png_pipe_load( const uint32_t * counter )
+{
+	return __atomic_load_n( counter, __ATOMIC_ACQUIRE );
+}
+
+
+static inline void png_pipe_store( uint32_t * counter, uint32_t value )
+{
+	__atomic_store_n( counter, value, __ATOMIC_RELEASE );
+}
+
+
+static uint8_t png_pipe_pull( png_pipe * pipe, uint8_t * data, size_t size )
+{
+	while (size)
+	{
+		const size_t n = pipe->pull->read( pipe->pull->io, data, size );
+		if (n == 0)
+		{
+			return 0;
+		}
+		data += n;
+		size -= n;
+	}
+	return 1;
+}
+
+
+static void * png_pipe_reader( void * arg )
+{
+	png_pipe * pipe = (png_pipe *) arg;
+	uint32_t remaining = pipe->idatRemaining;
+	uLong crc = crc32( 0, (const Bytef *) "IDAT", 4 );
+	uint32_t in = 0;
+	
+	for (;;)
+	{
+		while (remaining == 0)
+		{
+			uint8_t tail[12];
+			if (!png_pipe_pull( pipe, tail, 12 ) || png_get_uint_32( tail ) != (png_uint_32) crc)
+			{
+				png_pipe_store( & pipe->stop, 1 );
+				return NULL;
+			}
+			if (memcmp( tail + 8, "IDAT", 4 ) != 0)
+			{
+				png_pipe_store( & pipe->readerDone, 1 );
+				return NULL;
+			}
+			remaining = png_get_uint_32( tail + 4 );
+			crc = crc32( 0, tail + 8, 4 );
+		}
+		
+		while (in - png_pipe_load( & pipe->blocksOut ) == PNG_PIPE_BLOCKS)
+		{
+			if (png_pipe_load( & pipe->stop ))
+			{
+				return NULL;
+			}
+			sched_yield();
+		}
+		
+		const uint32_t slot = in % PNG_PIPE_BLOCKS;
+		uint8_t * block = pipe->blocks + ((size_t) slot * PNG_PIPE_BLOCK_SIZE);
+		const uint32_t n = remaining < PNG_PIPE_BLOCK_SIZE ? remaining : PNG_PIPE_BLOCK_SIZE;
+		if (!png_pipe_pull( pipe, block, n ))
+		{
+			png_pipe_store( & pipe->stop, 1 );
+			return NULL;
+		}
+		crc = png_crc32( (png_uint_32) crc, block, n );
+		if (pipe->idatHash)
+		{
+			png_hash_update( pipe->idatHash, block, n );
+		}
+		remaining -= n;
+		pipe->idatBytes += n;
+		pipe->blockSize[slot] = n;
+		png_pipe_store( & pipe->blocksIn, ++in );
+	}
+}
+
+
+// Waits for the next block after the first out, or returns 0 if the data
+// ran out or another stage gave up.
+static uint8_t png_pipe_next_block( png_pipe * pipe, uint32_t out )
+{
+	while (png_pipe_load( & pipe->blocksIn ) == out)
+	{
+		if (png_pipe_load( & pipe->stop ))
+		{
+			return 0;
+		}
+		if (png_pipe_load( & pipe->readerDone ) && png_pipe_load( & pipe->blocksIn ) == out)
+		{
+			return 0;
+		}
+		sched_yield();
+	}
+	return 1;
+}
+
+
+static void * png_pipe_inflater( void * arg )
+{
+	png_pipe * pipe = (png_pipe *) arg;
+	z_stream zs;
+	memset( & zs, 0, sizeof zs );
+	if (inflateInit( & zs ) != Z_OK)
+	{
+		png_pipe_store( & pipe->stop, 1 );
+		return NULL;
+	}
+	
+	uint32_t out = 0;
+	uint8_t ok = 1;
+	uint8_t ended = 0;
+	for (uint32_t row = 0; row < pipe->height && ok; row++)
+	{
+		while (row - png_pipe_load( & pipe->rowsOut ) == PNG_PIPE_ROWS)
+		{
+			if (png_pipe_load( & pipe->stop ))
+			{
+				ok = 0;
+				break;
+			}
+			sched_yield();
+		}
+		
+		zs.next_out = pipe->rows + (pipe->rowSize * (row % PNG_PIPE_ROWS));
+		zs.avail_out = (uInt) pipe->rowSize;
+		while (ok && zs.avail_out)
+		{
+			if (ended)
+			{
+				ok = 0;
+				break;
+			}
+			if (zs.avail_in == 0)
+			{
+				if (zs.next_in)
+				{
+					png_pipe_store( & pipe->blocksOut, ++out );
+				}
+				if (!png_pipe_next_block( pipe, out ))
+				{
+					ok = 0;
+					break;
+				}
+				const uint32_t slot = out % PNG_PIPE_BLOCKS;
+				zs.next_in = pipe->blocks + ((size_t) slot * PNG_PIPE_BLOCK_SIZE);
+				zs.avail_in = pipe->blockSize[slot];
+			}
+			const int ret = inflate( & zs, Z_NO_FLUSH );
+			if (ret == Z_STREAM_END)
+			{
+				ended = 1;
+			}
+			else if (ret != Z_OK)
+			{
+				ok = 0;
+			}
+		}
+		if (ok)
+		{
+			png_pipe_store( & pipe->rowsIn, row + 1 );
+		}
+	}
+	
+	inflateEnd( & zs );
+	if (!ok)
+	{
+		png_pipe_store( & pipe->stop, 1 );
+	}
+	return NULL;
+}
+
+
+// Returns 1 when the image was decoded, 0 when the data was bad and 2 when
+// the threads couldn't be started, before anything was read.
+static uint8_t png_read_pipelined( png_structp readPtr, png_infop infoPtr, const png_pull * pull, const png_read_plan * plan, const png_orient * orient, png_mips * mips )
+{
+	const png_uint_32 w = png_get_image_width( readPtr, infoPtr );
+	const png_uint_32 h = png_get_image_height( readPtr, infoPtr );
+	const size_t bytesPerRow = (size_t) w * 4;
+	
+	png_io_call * call = (png_io_call *) png_get_mem_ptr( readPtr );
+	png_hash * pixelHash = png_call_pixel_hash( call );
+	
+	png_pipe pipe;
+	memset( & pipe, 0, sizeof pipe );
+	pipe.pull = pull;
+	pipe.idatHash = pixelHash ? & call->idatHash : NULL;
+	pipe.idatRemaining = png_get_idat_remaining( readPtr );
+	pipe.rowSize = png_get_rowbytes( readPtr, infoPtr ) + 1;
+	pipe.height = h;
+	pipe.blocks = (uint8_t *) png_malloc_warn( readPtr, (png_alloc_size_t) PNG_PIPE_BLOCKS * PNG_PIPE_BLOCK_SIZE );
+	pipe.rows = (uint8_t *) png_malloc_warn( readPtr, pipe.rowSize * (PNG_PIPE_ROWS + 1) );
+	png_orient_rows placed = { orient, NULL, 0, 0 };
+	if (orient->transpose)
+	{
+		placed.band = (png_pixel *) png_malloc_warn( readPtr, png_orient_band_bytes( orient ) );
+	}
+	if (!pipe.blocks || !pipe.rows || (orient->transpose && !placed.band))
+	{
+		png_free( readPtr, placed.band );
+		png_free( readPtr, pipe.rows );
+		png_free( readPtr, pipe.blocks );
+		return 2;
+	}
+	
+	// The slot past the ring stands in for the row above the first.
+	png_bytep zeros = pipe.rows + (pipe.rowSize * PNG_PIPE_ROWS);
+	memset( zeros, 0, pipe.rowSize );
+	
+	pthread_t inflater, reader;
+	if (pthread_create( & inflater, NULL, png_pipe_inflater, & pipe ) != 0)
+	{
+		png_free( readPtr, placed.band );
+		png_free( readPtr, pipe.rows );
+		png_free( readPtr, pipe.blocks );
+		return 2;
+	}
+	if (pthread_create( & reader, NULL, png_pipe_reader, & pipe ) != 0)
+	{
+		png_pipe_store( & pipe.stop, 1 );
+		pthread_join( inflater, NULL );
+		png_free( readPtr, placed.band );
+		png_free( readPtr, pipe.rows );
+		png_free( readPtr, pipe.blocks );
+		return 2;
+	}
+	
+	uint8_t result = 1;
+	png_bytep prev = zeros;
+	for (uint32_t i = 0; i < h && result; i++)
+	{
+		while (png_pipe_load( & pipe.rowsIn ) == i)
+		{
+			if (png_pipe_load( & pipe.stop ))
+			{
+				result = 0;
+				break;
+			}
+			sched_yield();
+		}
+		if (!result)
+		{
+			break;
+		}
+		
+		png_bytep row = pipe.rows + (pipe.rowSize * (i % PNG_PIPE_ROWS));
+		if (row[0] >= PNG_FILTER_VALUE_LAST)
+		{
+			result = 0;
+			break;
+		}
+		png_unfilter_row( readPtr, row + 1, prev + 1, row[0] );
+		
+		png_pixel * target = png_orient_row( & placed, i );
+		plan->kernel( plan, row + 1, target, w );
+		if (pixelHash)
+		{
+			png_hash_update( pixelHash, (png_const_bytep) target, bytesPerRow );
+		}
+		png_orient_done( & placed, target );
+		if (mips)
+		{
+			png_mips_advance( mips, i + 1 );
+		}
+		
+		// Row i stays put as the previous row for i + 1; i - 1 can go.
+		png_pipe_store( & pipe.rowsOut, i );
+		prev = row;
+	}
+	
+	png_pipe_store( & pipe.stop, 1 );
+	pthread_join( reader, NULL );
+	pthread_join( inflater, NULL );
+	png_orient_flush( & placed );
+	png_free( readPtr, placed.band );
+	png_free( readPtr, pipe.rows );
+	png_free( readPtr, pipe.blocks );
+	
+	if (call && result)
+	{
+		call->stages.idat_bytes += pipe.idatBytes;
+		call->stages.rows += h;
+	}
+	return result;
+}
+
+
+// Where a file's IDAT stream can be picked up without what came before it,
+// from its restart point chunk. Band i starts at rows[i] and at offsets[i]
+// in the IDAT data; band 0 is the top of the image and start of the stream.
+struct png_restarts
+{
+	const uint8_t * stream;		// the IDAT chunk data, concatenated
+	size_t          size;
+	uint32_t        count;
+	const uint32_t * rows;
+	const uint32_t * offsets;
+	uint32_t        threads;
+};
+
+
+// A band's three rows, rounded up so the orient band after them is aligned.
+// What zlib allocates for an inflate: its state and a 32 KB window.
+#define PNG_INFLATE_BYTES		((1 << 15) + 7168)
+
+
+static size_t png_band_rows_bytes( size_t rowSize )
+{
+	return ((rowSize * 3) + 15) & ~(size_t) 15;
+}
+
+
+struct png_band_job
+{
+	png_structp           readPtr;	// only for png_unfilter_row
+	const png_read_plan * plan;
+	const png_restarts *  restarts;
+	uint32_t              band;
+	const png_orient *    orient;
+	uint32_t              width;
+	uint32_t              height;
+	size_t                rowSize;	// filter byte included
+	png_bytep             scratch;	// three rows, then the orient band
+	uint8_t               result;
+};
+
+
+static void * png_decode_band( void * arg )
+{
+	png_band_job * job = (png_band_job *) arg;
+	const png_restarts * restarts = job->restarts;
+	const uint32_t w = job->width;
+	const uint32_t h = job->height;
+	const size_t rowSize = job->rowSize;
+	const uint32_t band = job->band;
+	const uint32_t first = restarts->rows[band];
+	const uint32_t last = band + 1 < restarts->count ? restarts->rows[band + 1] : h;
+	const size_t end = band + 1 < restarts->count ? restarts->offsets[band + 1] : restarts->size;
+	
+	job->result = 0;
+	png_bytep rows = job->scratch;
+	memset( rows + (rowSize * 2), 0, rowSize );
+	png_orient_rows placed = { job->orient, job->orient->transpose ? (png_pixel *) (rows + png_band_rows_bytes( rowSize )) : NULL, 0, 0 };
+	z_stream zs;
+	memset( & zs, 0, sizeof zs );
+	// Bands after the first start mid-stream, past the zlib header.
+	if ((band ? inflateInit2( & zs, -15 ) : inflateInit( & zs )) != Z_OK)
+	{
+		return NULL;
+	}
+	zs.next_in = (Bytef *) restarts->stream + restarts->offsets[band];
+	zs.avail_in = (uInt) (end - restarts->offsets[band]);
+	
+	png_bytep prev = rows + (rowSize * 2);		// zeros
+	uint8_t ok = 1;
+	for (uint32_t i = first; i < last && ok; i++)
+	{
+		png_bytep row = rows + (rowSize * (i & 1));
+		zs.next_out = row;
+		zs.avail_out = (uInt) rowSize;
+		const int ret = inflate( & zs, Z_NO_FLUSH );
+		ok = zs.avail_out == 0 && (ret == Z_OK || (ret == Z_STREAM_END && i + 1 == h));
+		
+		// A restart row that reads the row above was written by something
+		// that didn't know about restart points.
+		const int filter = row[0];
+		ok = ok && filter < PNG_FILTER_VALUE_LAST && (i != first || band == 0 || filter <= PNG_FILTER_VALUE_SUB);
+		if (ok)
+		{
+			png_unfilter_row( job->readPtr, row + 1, prev + 1, filter );
+			png_pixel * target = png_orient_row( & placed, i );
+			job->plan->kernel( job->plan, row + 1, target, w );
+			png_orient_done( & placed, target );
+			prev = row;
+		}
+	}
+	
+	png_orient_flush( & placed );
+	inflateEnd( & zs );
+	job->result = ok;
+	return NULL;
+}
+
+
+static uint8_t png_band_done( void * arg, void * )
+{
+	return ((png_band_job *) arg)->result;
+}
+
+
+// Decodes the bands between restart points on threads. Returns 0 if any of
+// them turned out not to match the image data.
+static uint8_t png_read_restarts( png_structp readPtr, png_infop infoPtr, const png_restarts * restarts, const png_read_plan * plan, const png_orient * orient )
+{
+	png_band_job * jobs = (png_band_job *) calloc( restarts->count, sizeof (png_band_job) );
+	if (!jobs)
+	{
+		return 0;
+	}
+	
+	// Each thread's rows, and its turned band when transposing, come from
+	// one block allocated here, so they count against the memory budget, as
+	// does the inflate state each thread has from zlib. The sequential
+	// decode is the fallback when they don't fit. A batch is joined before
+	// the next reuses the block.
+	png_io_call * call = (png_io_call *) png_get_mem_ptr( readPtr );
+	const uint32_t slots = restarts->threads < restarts->count ? restarts->threads : restarts->count;
+	const size_t slotBytes = png_band_rows_bytes( png_get_rowbytes( readPtr, infoPtr ) + 1 ) + png_orient_band_bytes( orient );
+	const uint8_t fits = png_call_charge( call, (uint64_t) PNG_INFLATE_BYTES * slots );
+	png_bytep scratch = fits ? (png_bytep) png_malloc_warn( readPtr, (png_alloc_size_t) (slotBytes * slots) ) : NULL;
+	if (!scratch)
+	{
+		png_call_release( call, fits ? (uint64_t) PNG_INFLATE_BYTES * slots : 0 );
+		free( jobs );
+		return 0;
+	}
+	for (uint32_t i = 0; i < restarts->count; i++)
+	{
+		jobs[i].readPtr = readPtr;
+		jobs[i].plan = plan;
+		jobs[i].restarts = restarts;
+		jobs[i].band = i;
+		jobs[i].orient = orient;
+		jobs[i].width = png_get_image_width( readPtr, infoPtr );
+		jobs[i].height = png_get_image_height( readPtr, infoPtr );
+		jobs[i].rowSize = png_get_rowbytes( readPtr, infoPtr ) + 1;
+		jobs[i].scratch = scratch + (slotBytes * (i % slots));
+	}
+	
+	// Set up libpng's unfilter table before the bands share it.
+	png_byte none = 0;
+	png_unfilter_row( readPtr, & none, & none, PNG_FILTER_VALUE_NONE );
+	
+	const uint8_t result = png_run_batched( jobs, sizeof (png_band_job), restarts->count, restarts->threads, png_decode_band, png_band_done, NULL );
+	png_free( readPtr, scratch );
+	png_call_release( call, (uint64_t) PNG_INFLATE_BYTES * slots );
+	free( jobs );
+	return result;
+}
+
+
+// Hashes a decoded image's rows in the order the file has them, as stored.
+static void png_hash_rows( png_structp readPtr, png_hash * hash, const png_orient * orient )
+{
+	const size_t bytesPerRow = (size_t) orient->width * 4;
+	png_pixel * scratch = orient->transpose || orient->flipX ? (png_pixel *) png_malloc( readPtr, bytesPerRow ) : NULL;
+	for (uint32_t i = 0; i < orient->height; i++)
+	{
+		png_hash_update( hash, (png_const_bytep) png_orient_source_row( orient, i, scratch ), bytesPerRow );
+	}
+	png_free( readPtr, scratch );
+}
+
+
+static uint8_t png_read( png_structp readPtr, png_image * image, uint32_t flags, const png_pull * pull, const png_restarts * restarts )
+{
+//	png_set_error_fn( readPtr, NULL, png_user_error, NULL );
+
+	png_infop infoPtr = png_create_info_struct( readPtr );
+	if (!infoPtr) 
+	{
+		pngio_error( "Couldn't initialize PNG info struct." );
+		png_destroy_read_struct( & readPtr, NULL, NULL );
+		return 0;
+	}
+	
+	png_bytep volatile rowBuffer = NULL;
+	png_bytep volatile scratch = NULL;
+	png_bytep volatile mipScratch = NULL;
+	if (setjmp( png_jmpbuf( readPtr ) ))
+	{
+		pngio_error( "An error occured while reading the PNG file." );
+		png_free( readPtr, rowBuffer );
+		png_free( readPtr, scratch );
+		png_free( readPtr, mipScratch );
+		png_destroy_read_struct( & readPtr, & infoPtr, NULL );
+		png_image_free( image );
+		return 0;
+	}
+
+	png_set_sig_bytes( readPtr, 8 );
+	
+	#ifdef PNG_APPLE_MODE_SUPPORTED 
+	if (png_get_apple_mode())
+	{
+		png_set_keep_unknown_chunks( readPtr, PNG_HANDLE_CHUNK_ALWAYS, NULL, 0 );
+		png_set_read_user_chunk_fn( readPtr, NULL, png_read_user_chunk );
+	}
+	#endif
+	
+	png_read_info( readPtr, infoPtr );
+	
+	png_uint_32 w = png_get_image_width( readPtr, infoPtr );
+	png_uint_32 h = png_get_image_height( readPtr, infoPtr );
+	png_uint_32 interlaceType = png_get_interlace_type( readPtr, infoPtr );
+	
+	// Turn away anything over the caller's budget before the pixel buffer or
+	// libpng's row buffers exist. Rows are costed at 16-bit RGBA, the widest
+	// libpng keeps, for the row, previous row and fused read buffers, plus a
+	// band of them when transposing. That is what a sequential decode needs;
+	// a parallel one charges rows, a band and an inflate per thread once the
+	// pixels are in place, and falls back when those don't fit. Interlaced
+	// images that are turned are decoded to a copy first. A mip chain comes with the pixels, and a row
+	// of sums to build it. Mapped pixels live in the page cache, so only
+	// rows count against it.
+	const uint8_t mapped = (flags & PNG_IMAGE_MAPPED) != 0;
+	const uint32_t mipLevels = (flags & (PNG_IMAGE_MIPMAPS | PNG_IMAGE_MIPMAPS_KAISER)) ? png_mip_levels( w, h ) : 0;
+	const uint64_t pixelBytes = png_image_bytes( w, h );
+	const uint64_t chainBytes = png_chain_bytes( w, h, mipLevels );
+	const uint64_t rowBytes = (uint64_t) w * 8 + 64;
+	png_io_call * call = (png_io_call *) png_get_mem_ptr( readPtr );
+	png_hash * pixelHash = png_call_pixel_hash( call );
+	png_orient orient;
+	png_orient_init( & orient, flags, NULL, w, h );
+	const uint8_t turned = orient.transpose || orient.flipX;
+	const uint64_t orientBytes = png_orient_band_bytes( & orient ) + ((turned && interlaceType != PNG_INTERLACE_NONE) ? pixelBytes : 0);
+	const uint64_t mipBytes = mipLevels ? png_mip_scratch_bytes( png_mip_get_filter( flags ), orient.transpose ? h : w ) : 0;
+	if (chainBytes > SIZE_MAX || (call && !png_call_fits( call, (mapped ? 0 : chainBytes) + (rowBytes * 3) + orientBytes + mipBytes )))
+	{
+		pngio_error( "Image is too large for the memory budget." );
+		png_destroy_read_struct( & readPtr, & infoPtr, NULL );
+		png_image_free( image );
+		return 0;
+	}
+	
+	png_read_plan plan;
+	const uint8_t fused = png_plan_read( readPtr, infoPtr, flags, & plan );
+	if (!fused)
+	{
+		png_read_generic_transforms( readPtr, infoPtr, flags );
+	}
+
+	const uint32_t turnedWidth = orient.transpose ? h : w;
+	const uint32_t turnedHeight = orient.transpose ? w : h;
+	png_image_alloc_chain( image, turnedWidth, turnedHeight, mipLevels, mapped );
+	png_bytep p = image->data;
+	orient.pixels = (png_pixel *) p;
+	if (!p)
+	{
+		pngio_error( "Couldn't allocate image data." );
+		png_destroy_read_struct( & readPtr, & infoPtr, NULL );
+		return 0;
+	}
+	
+	if (call && !mapped)
+	{
+		png_count_alloc( call, chainBytes );
+	}
+	
+	// Level 1 follows the rows as they're finished, in whichever direction
+	// they're placed; rows that are turned or decoded in bands are only
+	// finished at the end.
+	png_mips mips;
+	png_mips * const rowMips = mipLevels && !orient.transpose ? & mips : NULL;
+	if (mipLevels)
+	{
+		png_mips_init( & mips, flags, (png_pixel *) p, turnedWidth, turnedHeight, !orient.transpose && orient.flipY );
+		mipScratch = mipBytes ? (png_bytep) png_malloc( readPtr, (png_alloc_size_t) mipBytes ) : NULL;
+		mips.scratch = mipScratch;
+		png_mip_scratch_reset( & mips, mips.scratch );
+	}
+	
+	const size_t passCount = interlaceType == PNG_INTERLACE_NONE ? 1 : png_set_interlace_handling( readPtr );
+	const size_t bytesPerRow = (size_t) w * 4;
+	#ifdef PNG_APPLE_MODE_SUPPORTED 
+	const uint8_t apple = png_get_apple_mode();
+	#else
+	const uint8_t apple = 0;
+	#endif
+	uint8_t takenOver = 0;	// the rows didn't come through png_read_row
+	if (fused)
+	{
+		// 1 once the rows are in, 2 while they're still to be read. A bad
+		// restart point index just means reading them the usual way.
+		uint8_t decoded = (restarts && !apple && png_read_restarts( readPtr, infoPtr, restarts, & plan, & orient )) ? 1 : 2;
+		takenOver = decoded == 1;
+		if (decoded == 1 && pixelHash)
+		{
+			png_hash_update( & call->idatHash, restarts->stream, restarts->size );
+			png_hash_rows( readPtr, pixelHash, & orient );
+		}
+		if (decoded == 2 && pull && (flags & PNG_IMAGE_PIPELINED) && !apple)
+		{
+			decoded = png_read_pipelined( readPtr, infoPtr, pull, & plan, & orient, rowMips );
+			takenOver = decoded != 2;
+		}
+		if (decoded == 0)
+		{
+			png_error( readPtr, "Pipelined decode failed" );
+		}
+		if (decoded == 2)
+		{
+			rowBuffer = (png_bytep) png_malloc( readPtr, png_get_rowbytes( readPtr, infoPtr ) );
+			png_orient_rows placed = { & orient, NULL, 0, 0 };
+			if (orient.transpose)
+			{
+				scratch = (png_bytep) png_malloc( readPtr, png_orient_band_bytes( & orient ) );
+				placed.band = (png_pixel *) scratch;
+			}
+			for (uint32_t i = 0; i < h; i++) 
+			{
+				png_read_row( readPtr, rowBuffer, NULL );
+				const png_stats_uint start = call ? png_stats_clock() : 0;
+				png_pixel * row = png_orient_row( & placed, i );
+				plan.kernel( & plan, rowBuffer, row, w );
+				if (pixelHash)
+				{
+					png_hash_update( pixelHash, (png_const_bytep) row, bytesPerRow );
+				}
+				png_orient_done( & placed, row );
+				if (rowMips)
+				{
+					png_mips_advance( rowMips, i + 1 );
+				}
+				if (call)
+				{
+					call->stages.transform_ns += png_stats_clock() - start;
+				}
+			}
+			png_orient_flush( & placed );
+			png_free( readPtr, rowBuffer );
+			png_free( readPtr, scratch );
+		}
+	}
+	else if (turned)
+	{
+		// The rows are only finished by the last pass, so they're turned
+		// afterwards, from a copy.
+		scratch = (png_bytep) png_malloc( readPtr, (png_alloc_size_t) pixelBytes );
+		for (size_t pass = 0; pass < passCount; pass++)
+		{
+			for (size_t i = 0; i < h; i++) 
+			{
+				png_read_row( readPtr, scratch + (bytesPerRow * i), NULL );
+			}
+		}
+		png_orient stored;
+		png_orient_init( & stored, PNG_IMAGE_NONE, scratch, w, h );
+		if (pixelHash)
+		{
+			png_hash_rows( readPtr, pixelHash, & stored );
+		}
+		png_orient_image( & orient, (png_pixel *) scratch );
+		png_free( readPtr, scratch );
+	}
+	else if (orient.flipY)
+	{
+		for (size_t pass = 0; pass < passCount; pass++)
+		{
+			for (size_t i = 0; i < h; i++) 
+			{
+				png_read_row( readPtr, p + (bytesPerRow * (h - i - 1)), NULL );
+				if (rowMips && pass + 1 == passCount)
+				{
+					png_mips_advance( rowMips, (uint32_t) i + 1 );
+				}
+			}
+		}
+	}
+	else
+	{
+//		png_bytep rp[h];
+//		for (size_t i = 0; i < h; i++) 
+//		{
+//			rp[i] = p + (bytesPerRow * i);
+//		}
+//		png_read_image( readPtr, rp );
+		for (size_t pass = 0; pass < passCount; pass++)
+		{
+			for (size_t i = 0; i < h; i++) 
+			{
+				png_read_row( readPtr, p + (bytesPerRow * i), NULL );
+				if (rowMips && pass + 1 == passCount)
+				{
+					png_mips_advance( rowMips, (uint32_t) i + 1 );
+				}
+			}
+		}
+	}
+	
+	if (mipLevels)
+	{
+		png_mips_finish( & mips, (flags & PNG_IMAGE_PARALLEL) ? png_thread_count( png_call_options( call ) ) : 1, call );
+		png_free( readPtr, mipScratch );
+		mipScratch = NULL;
+	}
+	
+	// Rows that came out of order, or over several passes, are hashed now.
+	// The IDAT hash takes in any data after the end of the zlib stream, as
+	// it does when the rows weren't read through libpng.
+	if (!fused && !turned && pixelHash)
+	{
+		png_hash_rows( readPtr, pixelHash, & orient );
+	}
+	if (pixelHash && !takenOver)
+	{
+		png_finish_idat( readPtr );
+	}
+	if (call)
+	{
+		call->hashed = 1;
+	}
+	png_destroy_read_struct( & readPtr, & infoPtr, NULL );
+	
+	return 1;
+}
+
+
+// Fills a band of rows from a png_image_source, one tile column at a time.
+// band holds bandHeight rows of the full width, for source rows y onwards.
+static void png_fill_band( png_structp writePtr, const png_image_source * source, uint32_t y, uint32_t bandHeight, png_bytep band )
+{
+	const uint32_t w = source->width;
+	const uint32_t tileWidth = source->tile_width ? source->tile_width : w;
+	const size_t stride = (size_t) w * 4;
+	for (uint32_t x = 0; x < w; x += tileWidth)
+	{
+		const uint32_t width = w - x < tileWidth ? w - x : tileWidth;
+		if (!source->fill( source->context, x, y, width, bandHeight, (png_pixel *) (band + ((size_t) x * 4)), stride ))
+		{
+			png_error( writePtr, "Image source failed." );
+		}
+	}
+}
+
+
+// The restart point chunk: ancillary, private and unsafe to copy, since its
+// offsets only hold for the IDAT data it was written with. Each entry is a
+// row number and the offset of that row's data in the IDAT stream, both
+// 32 bits, big-endian.
+static const png_byte png_restart_chunk[5] = { 'r', 's', 'P', 'T', '\0' };
+
+
+struct png_restart_index
+{
+	uint32_t  rows;			// between restart points, 0 for none
+	uint32_t  count;
+	png_bytep entries;
+};
+
+
+// Writes one row, starting a restart point first when one falls due.
+static void png_write_indexed_row( png_structp writePtr, png_const_bytep row, png_restart_index * index )
+{
+	const png_uint_32 y = png_get_current_row_number( writePtr );
+	if (index->rows && y > 0 && y % index->rows == 0)
+	{
+		const png_alloc_size_t offset = png_write_restart( writePtr );
+		if (offset > PNG_UINT_31_MAX)
+		{
+			png_error( writePtr, "Restart point past the index's reach" );
+		}
+		png_save_uint_32( index->entries + (8 * index->count), y );
+		png_save_uint_32( index->entries + (8 * index->count) + 4, (png_uint_32) offset );
+		index->count++;
+	}
+	png_write_row( writePtr, row );
+}
+
+
+// Stored saves leave zlib out: rows go out as they are behind filter None,
+// in stored deflate blocks, one to an IDAT chunk, with the Adler-32 and chunk
+// CRCs computed by the vectorized png_adler32 and png_crc32.
+#define PNG_STORED_BLOCK		65535
+
+struct png_stored_writer
+{
+	uint64_t remaining;		// bytes of filtered rows still to come
+	uint32_t block;			// bytes left in the current block
+	uint32_t adler;
+	uint8_t  started;
+};
+
+
+static void png_stored_put( png_structp writePtr, png_stored_writer * writer, png_const_bytep data, size_t size )
+{
+	static const png_byte idat[5] = { 'I', 'D', 'A', 'T', '\0' };
+	while (size)
+	{
+		if (writer->block == 0)
+		{
+			const uint32_t n = writer->remaining < PNG_STORED_BLOCK ? (uint32_t) writer->remaining : PNG_STORED_BLOCK;
+			const uint8_t last = writer->remaining == n;
+			png_write_chunk_start( writePtr, idat, 5 + n + (writer->started ? 0 : 2) + (last ? 4 : 0) );
+			if (!writer->started)
+			{
+				static const png_byte header[2] = { 0x78, 0x01 };
+				png_write_chunk_data( writePtr, header, 2 );
+				writer->started = 1;
+			}
+			const png_byte block[5] = { last, (png_byte) n, (png_byte) (n >> 8), (png_byte) ~n, (png_byte) (~n >> 8) };
+			png_write_chunk_data( writePtr, block, 5 );
+			writer->block = n;
+		}
+		
+		const uint32_t n = size < writer->block ? (uint32_t) size : writer->block;
+		png_write_chunk_data( writePtr, data, n );
+		writer->adler = png_adler32( writer->adler, data, n );
+		data += n;
+		size -= n;
+		writer->block -= n;
+		writer->remaining -= n;
+		if (writer->block == 0)
+		{
+			if (writer->remaining == 0)
+			{
+				png_byte adler[4];
+				png_save_uint_32( adler, writer->adler );
+				png_write_chunk_data( writePtr, adler, 4 );
+			}
+			png_write_chunk_end( writePtr );
+		}
+	}
+}
+
+
+// Fast encoder for PNG_IMAGE_FAST saves, in place of zlib. Each row is
+// filtered Sub or Up, whichever leaves the smaller bytes, onto a window of
+// the last 32 KB. Once enough rows are pending they are coded as one deflate
+// block: greedy LZ77 through a single hash of four bytes with no chains,
+// then Huffman codes built for the block, or stored if that comes out
+// smaller. The compressed data goes straight into IDAT chunks.
+#define PNG_FAST_WINDOW			32768
+#define PNG_FAST_BLOCK			131072
+#define PNG_FAST_HASH_BITS		15
+#define PNG_FAST_OUT			65536
+
+static const uint16_t png_length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t  png_length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t png_dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t  png_dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t  png_clen_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+struct png_fast_symbol
+{
+	uint16_t litlen;		// literal byte, or match length
+	uint16_t dist;			// 0 for a literal
+};
+
+struct png_fast_encoder
+{
+	uint8_t         * window;		// history, then the rows pending
+	size_t            start;		// first pending byte
+	size_t            end;
+	uint32_t          base;			// stream position of window[0]
+	uint32_t        * hash;			// stream positions
+	png_fast_symbol * symbols;
+	uint8_t         * out;
+	size_t            outSize;
+	uint64_t          bits;
+	uint32_t          bitCount;
+	uint32_t          adler;
+	uint8_t         * prior;		// the previous row, unfiltered
+	uint8_t         * up;
+	size_t            rowBytes;
+	uint32_t          rows;
+	uint8_t           lengthCode[259];
+	uint8_t           distCode[512];
+};
+
+
+static void png_fast_destroy( png_structp writePtr, png_fast_encoder * e )
+{
+	if (e)
+	{
+		png_free( writePtr, e->window );
+		png_free( writePtr, e->hash );
+		png_free( writePtr, e->symbols );
+		png_free( writePtr, e->out );
+		png_free( writePtr, e->prior );
+		png_free( writePtr, e->up );
+		png_free( writePtr, e );
+	}
+}
+
+
+// Allocates through libpng, so failures longjmp; the caller keeps hold of
+// the encoder before anything else is allocated.
+static png_fast_encoder * png_fast_create( png_structp writePtr, png_fast_encoder * volatile * holder, size_t rowBytes )
+{
+	png_fast_encoder * e = (png_fast_encoder *) png_calloc( writePtr, sizeof (png_fast_encoder) );
+	*holder = e;
+	const size_t pending = PNG_FAST_BLOCK + rowBytes + 1;
+	e->window = (uint8_t *) png_malloc( writePtr, PNG_FAST_WINDOW + pending );
+	e->hash = (uint32_t *) png_calloc( writePtr, sizeof (uint32_t) << PNG_FAST_HASH_BITS );
+	e->symbols = (png_fast_symbol *) png_malloc( writePtr, sizeof (png_fast_symbol) * pending );
+	e->out = (uint8_t *) png_malloc( writePtr, PNG_FAST_OUT );
+	e->prior = (uint8_t *) png_malloc( writePtr, rowBytes );
+	e->up = (uint8_t *) png_malloc( writePtr, rowBytes );
+	e->rowBytes = rowBytes;
+	e->adler = 1;
+	
+	for (uint32_t c = 0; c < 29; c++)
+	{
+		const uint32_t top = c < 28 ? png_length_base[c + 1] : 259;
+		for (uint32_t length = png_length_base[c]; length < top; length++)
+		{
+			e->lengthCode[length] = (uint8_t) c;
+		}
+	}
+	for (uint32_t c = 0; c < 30; c++)
+	{
+		const uint32_t top = c < 29 ? png_dist_base[c + 1] : 32769;
+		for (uint32_t dist = png_dist_base[c]; dist < top; dist++)
+		{
+			if (dist <= 256)
+			{
+				e->distCode[dist - 1] = (uint8_t) c;
+			}
+			else
+			{
+				e->distCode[256 + ((dist - 1) >> 7)] = (uint8_t) c;
+			}
+		}
+	}
+	
+	// The zlib header: deflate with a 32 KB window, no dictionary.
+	e->out[0] = 0x78;
+	e->out[1] = 0x01;
+	e->outSize = 2;
+	return e;
+}
+
+
+static inline uint32_t png_fast_dist_code( const png_fast_encoder * e, uint32_t dist )
+{
+	return dist <= 256 ? e->distCode[dist - 1] : e->distCode[256 + ((dist - 1) >> 7)];
+}
+
+
+static void png_fast_flush( png_structp writePtr, png_fast_encoder * e )
+{
+	static const png_byte idat[5] = { 'I', 'D', 'A', 'T', '\0' };
+	if (e->outSize)
+	{
+		png_write_chunk( writePtr, idat, e->out, e->outSize );
+		e->outSize = 0;
+	}
+}
+
+
+// Adds count bits of value, count at most 32, least significant first.
+static inline void png_fast_put( png_structp writePtr, png_fast_encoder * e, uint32_t value, uint32_t count )
+{
+	e->bits |= (uint64_t) value << e->bitCount;
+	e->bitCount += count;
+	if (e->bitCount >= 32)
+	{
+		if (e->outSize + 4 > PNG_FAST_OUT)
+		{
+			png_fast_flush( writePtr, e );
+		}
+		for (uint32_t i = 0; i < 4; i++)
+		{
+			e->out[e->outSize + i] = (uint8_t) (e->bits >> (8 * i));
+		}
+		e->outSize += 4;
+		e->bits >>= 32;
+		e->bitCount -= 32;
+	}
+}
+
+
+// Pads to a byte boundary and moves the whole bytes out.
+static void png_fast_align( png_structp writePtr, png_fast_encoder * e )
+{
+	e->bitCount = (e->bitCount + 7) & ~7u;
+	while (e->bitCount)
+	{
+		if (e->outSize == PNG_FAST_OUT)
+		{
+			png_fast_flush( writePtr, e );
+		}
+		e->out[e->outSize++] = (uint8_t) e->bits;
+		e->bits >>= 8;
+		e->bitCount -= 8;
+	}
+}
+
+
+static void png_fast_bytes( png_structp writePtr, png_fast_encoder * e, const uint8_t * data, size_t size )
+{
+	while (size)
+	{
+		if (e->outSize == PNG_FAST_OUT)
+		{
+			png_fast_flush( writePtr, e );
+		}
+		const size_t n = size < PNG_FAST_OUT - e->outSize ? size : PNG_FAST_OUT - e->outSize;
+		memcpy( e->out + e->outSize, data, n );
+		e->outSize += n;
+		data += n;
+		size -= n;
+	}
+}
+
+
+// Code lengths for the n symbols' frequencies, none longer than limit: a
+// Huffman tree built from two queues over the symbols sorted by frequency,
+// then, if too deep, the lengths redistributed until they fit, as miniz
+// does. A lone symbol is given a partner, since inflate wants complete codes.
+static void png_fast_lengths( const uint32_t * freq, uint32_t n, uint32_t limit, uint8_t * lengths )
+{
+	uint16_t order[288];
+	uint32_t used = 0;
+	for (uint32_t i = 0; i < n; i++)
+	{
+		lengths[i] = 0;
+		if (freq[i])
+		{
+			uint32_t j = used++;
+			for (; j > 0 && freq[order[j - 1]] > freq[i]; j--)
+			{
+				order[j] = order[j - 1];
+			}
+			order[j] = (uint16_t) i;
+		}
+	}
+	if (used < 2)
+	{
+		const uint32_t only = used ? order[0] : 0;
+		lengths[only] = 1;
+		lengths[only ? 0 : 1] = 1;
+		return;
+	}
+	
+	uint32_t weight[576];
+	uint16_t parent[576];
+	uint32_t leaf = 0;
+	uint32_t inner = used;
+	uint32_t next = used;
+	for (uint32_t k = 0; k + 1 < used; k++, next++)
+	{
+		uint32_t pick[2];
+		for (uint32_t m = 0; m < 2; m++)
+		{
+			if (leaf < used && (inner == next || freq[order[leaf]] <= weight[inner]))
+			{
+				weight[leaf] = freq[order[leaf]];
+				pick[m] = leaf++;
+			}
+			else
+			{
+				pick[m] = inner++;
+			}
+		}
+		weight[next] = weight[pick[0]] + weight[pick[1]];
+		parent[pick[0]] = (uint16_t) next;
+		parent[pick[1]] = (uint16_t) next;
+	}
+	
+	// Depths from the root down; parents always come after their children.
+	uint8_t depth[576];
+	uint32_t count[33] = { 0 };
+	depth[next - 1] = 0;
+	for (uint32_t i = next - 1; i-- > 0;)
+	{
+		const uint32_t d = depth[parent[i]] + 1u;
+		depth[i] = (uint8_t) (d < 32 ? d : 32);
+		if (i < used)
+		{
+			count[depth[i]]++;
+		}
+	}
+	
+	for (uint32_t i = limit + 1; i <= 32; i++)
+	{
+		count[limit] += count[i];
+		count[i] = 0;
+	}
+	uint32_t total = 0;
+	for (uint32_t i = limit; i > 0; i--)
+	{
+		total += count[i] << (limit - i);
+	}
+	while (total != (1u << limit))
+	{
+		count[limit]--;
+		for (uint32_t i = limit - 1; i > 0; i--)
+		{
+			if (count[i])
+			{
+				count[i]--;
+				count[i + 1] += 2;
+				break;
+			}
+		}
+		total--;
+	}
+	
+	// The rarest symbols get the longest codes.
+	uint32_t at = 0;
+	for (uint32_t length = limit; length > 0; length--)
+	{
+		for (uint32_t i = 0; i < count[length]; i++)
+		{
+			lengths[order[at++]] = (uint8_t) length;
+		}
+	}
+}
+
+
+// Canonical codes for the lengths, bit reversed since deflate sends Huffman
+// codes most significant bit first.
+static void png_fast_codes( const uint8_t * lengths, uint32_t n, uint16_t * codes )
+{
+	uint32_t count[16] = { 0 };
+	uint32_t next[16];
+	for (uint32_t i = 0; i < n; i++)
+	{
+		count[lengths[i]]++;
+	}
+	count[0] = 0;
+	uint32_t code = 0;
+	for (uint32_t bits = 1; bits < 16; bits++)
+	{
+		code = (code + count[bits - 1]) << 1;
+		next[bits] = code;
+	}
+	for (uint32_t i = 0; i < n; i++)
+	{
+		const uint32_t length = lengths[i];
+		uint32_t reversed = 0;
+		if (length)
+		{
+			const uint32_t c = next[length]++;
+			for (uint32_t b = 0; b < length; b++)
+			{
+				reversed |= ((c >> b) & 1) << (length - 1 - b);
+			}
+		}
+		codes[i] = (uint16_t) reversed;
+	}
+}
+
+
+// Run-length codes the code lengths in deflate's code length alphabet: 16
+// repeats the previous length 3 to 6 times, 17 and 18 stand for 3 to 10 and
+// 11 to 138 zeros. Each entry is the symbol plus its extra bits' value << 5.
+static uint32_t png_fast_rle( const uint8_t * lengths, uint32_t n, uint16_t * out, uint32_t * freq )
+{
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < n;)
+	{
+		const uint8_t length = lengths[i];
+		uint32_t run = 1;
+		while (i + run < n && lengths[i + run] == length)
+		{
+			run++;
+		}
+		i += run;
+		if (length == 0)
+		{
+			while (run >= 11)
+			{
+				const uint32_t r = run < 138 ? run : 138;
+				out[count++] = (uint16_t) (18 | ((r - 11) << 5));
+				freq[18]++;
+				run -= r;
+			}
+			if (run >= 3)
+			{
+				out[count++] = (uint16_t) (17 | ((run - 3) << 5));
+				freq[17]++;
+				run = 0;
+			}
+		}
+		else
+		{
+			out[count++] = length;
+			freq[length]++;
+			run--;
+			while (run >= 3)
+			{
+				const uint32_t r = run < 6 ? run : 6;
+				out[count++] = (uint16_t) (16 | ((r - 3) << 5));
+				freq[16]++;
+				run -= r;
+			}
+		}
+		for (; run > 0; run--)
+		{
+			out[count++] = length;
+			freq[length]++;
+		}
+	}
+	return count;
+}
+
+
+// How many of the bytes at a and b match, up to limit.
+static inline size_t png_fast_match( const uint8_t * a, const uint8_t * b, size_t limit )
+{
+	size_t n = 0;
+	#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; n + 8 <= limit; n += 8)
+	{
+		uint64_t x, y;
+		memcpy( & x, a + n, 8 );
+		memcpy( & y, b + n, 8 );
+		if (x != y)
+		{
+			return n + (__builtin_ctzll( x ^ y ) >> 3);
+		}
+	}
+	#endif
+	while (n < limit && a[n] == b[n])
+	{
+		n++;
+	}
+	return n;
+}
+
+
+// Codes the pending rows as a block, then slides the window along.
+static void png_fast_block( png_structp writePtr, png_fast_encoder * e, uint8_t last )
+{
+	const uint8_t * w = e->window;
+	const size_t end = e->end;
+	png_fast_symbol * symbols = e->symbols;
+	uint32_t litFreq[286] = { 0 };
+	uint32_t distFreq[30] = { 0 };
+	size_t count = 0;
+	
+	for (size_t p = e->start; p < end;)
+	{
+		if (end - p >= 4)
+		{
+			uint32_t v;
+			memcpy( & v, w + p, 4 );
+			const uint32_t h = (v * 2654435761u) >> (32 - PNG_FAST_HASH_BITS);
+			const uint32_t here = e->base + (uint32_t) p;
+			const uint32_t dist = here - e->hash[h];
+			e->hash[h] = here;
+			uint32_t u;
+			if (dist - 1 < PNG_FAST_WINDOW && dist <= p && (memcpy( & u, w + p - dist, 4 ), u == v))
+			{
+				const size_t limit = end - p < 258 ? end - p : 258;
+				const uint32_t length = (uint32_t) (4 + png_fast_match( w + p + 4, w + p - dist + 4, limit - 4 ));
+				symbols[count].litlen = (uint16_t) length;
+				symbols[count].dist = (uint16_t) dist;
+				count++;
+				litFreq[257 + e->lengthCode[length]]++;
+				distFreq[png_fast_dist_code( e, dist )]++;
+				p += length;
+				continue;
+			}
+		}
+		symbols[count].litlen = w[p];
+		symbols[count].dist = 0;
+		count++;
+		litFreq[w[p]]++;
+		p++;
+	}
+	litFreq[256] = 1;
+	
+	uint8_t litLengths[286];
+	uint8_t distLengths[30];
+	png_fast_lengths( litFreq, 286, 15, litLengths );
+	png_fast_lengths( distFreq, 30, 15, distLengths );
+	uint32_t litCount = 286;
+	while (litCount > 257 && litLengths[litCount - 1] == 0)
+	{
+		litCount--;
+	}
+	uint32_t distCount = 30;
+	while (distCount > 1 && distLengths[distCount - 1] == 0)
+	{
+		distCount--;
+	}
+	
+	uint8_t lengths[316];
+	memcpy( lengths, litLengths, litCount );
+	memcpy( lengths + litCount, distLengths, distCount );
+	uint16_t rle[316];
+	uint32_t clenFreq[19] = { 0 };
+	const uint32_t rleCount = png_fast_rle( lengths, litCount + distCount, rle, clenFreq );
+	uint8_t clenLengths[19];
+	png_fast_lengths( clenFreq, 19, 7, clenLengths );
+	uint32_t clenCount = 19;
+	while (clenCount > 4 && clenLengths[png_clen_order[clenCount - 1]] == 0)
+	{
+		clenCount--;
+	}
+	
+	// Compare with storing the block as it is.
+	static const uint8_t rleExtra[3] = { 2, 3, 7 };
+	uint64_t cost = 17 + (3 * clenCount);
+	for (uint32_t i = 0; i < 19; i++)
+	{
+		cost += (uint64_t) clenFreq[i] * (clenLengths[i] + (i >= 16 ? rleExtra[i - 16] : 0));
+	}
+	for (uint32_t i = 0; i < 286; i++)
+	{
+		cost += (uint64_t) litFreq[i] * (litLengths[i] + (i >= 257 ? png_length_extra[i - 257] : 0));
+	}
+	for (uint32_t i = 0; i < 30; i++)
+	{
+		cost += (uint64_t) distFreq[i] * (distLengths[i] + png_dist_extra[i]);
+	}
+	const size_t size = end - e->start;
+	const uint64_t storedCost = 8 * ((uint64_t) size + (5 * ((size + 65534) / 65535)) + 1);
+	
+	if (storedCost <= cost)
+	{
+		for (size_t p = e->start; p < end;)
+		{
+			const uint32_t n = end - p < 65535 ? (uint32_t) (end - p) : 65535;
+			png_fast_put( writePtr, e, last && p + n == end, 3 );
+			png_fast_align( writePtr, e );
+			const uint8_t header[4] = { (uint8_t) n, (uint8_t) (n >> 8), (uint8_t) ~n, (uint8_t) (~n >> 8) };
+			png_fast_bytes( writePtr, e, header, 4 );
+			png_fast_bytes( writePtr, e, w + p, n );
+			p += n;
+		}
+	}
+	else
+	{
+		uint16_t litCodes[286];
+		uint16_t distCodes[30];
+		uint16_t clenCodes[19];
+		png_fast_codes( litLengths, 286, litCodes );
+		png_fast_codes( distLengths, 30, distCodes );
+		png_fast_codes( clenLengths, 19, clenCodes );
+		
+		png_fast_put( writePtr, e, (last ? 1 : 0) | (2 << 1), 3 );
+		png_fast_put( writePtr, e, (litCount - 257) | ((distCount - 1) << 5) | ((clenCount - 4) << 10), 14 );
+		for (uint32_t i = 0; i < clenCount; i++)
+		{
+			png_fast_put( writePtr, e, clenLengths[png_clen_order[i]], 3 );
+		}
+		for (uint32_t i = 0; i < rleCount; i++)
+		{
+			const uint32_t symbol = rle[i] & 31;
+			png_fast_put( writePtr, e, clenCodes[symbol], clenLengths[symbol] );
+			if (symbol >= 16)
+			{
+				png_fast_put( writePtr, e, rle[i] >> 5, rleExtra[symbol - 16] );
+			}
+		}
+		
+		for (size_t i = 0; i < count; i++)
+		{
+			const png_fast_symbol s = symbols[i];
+			if (s.dist == 0)
+			{
+				png_fast_put( writePtr, e, litCodes[s.litlen], litLengths[s.litlen] );
+			}
+			else
+			{
+				const uint32_t lc = e->lengthCode[s.litlen];
+				png_fast_put( writePtr, e, litCodes[257 + lc] | ((s.litlen - png_length_base[lc]) << litLengths[257 + lc]), litLengths[257 + lc] + png_length_extra[lc] );
+				const uint32_t dc = png_fast_dist_code( e, s.dist );
+				png_fast_put( writePtr, e, distCodes[dc] | ((s.dist - png_dist_base[dc]) << distLengths[dc]), distLengths[dc] + png_dist_extra[dc] );
+			}
+		}
+		png_fast_put( writePtr, e, litCodes[256], litLengths[256] );
+	}
+	
+	e->start = end;
+	if (end > PNG_FAST_WINDOW)
+	{
+		memmove( e->window, e->window + end - PNG_FAST_WINDOW, PNG_FAST_WINDOW );
+		e->base += (uint32_t) (end - PNG_FAST_WINDOW);
+		e->start = PNG_FAST_WINDOW;
+		e->end = PNG_FAST_WINDOW;
+	}
+}
+
+
+// Filters a row onto the window, Sub for the first row and then Sub or Up,
+// whichever bytes are nearer zero taken as signed.
+static void png_fast_row( png_structp writePtr, png_fast_encoder * e, png_const_bytep row )
+{
+	const size_t n = e->rowBytes;
+	uint8_t * sub = e->window + e->end + 1;
+	uint8_t * up = e->up;
+	const uint8_t * prior = e->prior;
+	uint64_t subCost = 0;
+	uint64_t upCost = 0;
+	size_t i = 0;
+	for (; i < 4 && i < n; i++)
+	{
+		sub[i] = row[i];
+		up[i] = (uint8_t) (row[i] - prior[i]);
+		subCost += sub[i] < 128 ? sub[i] : 256 - sub[i];
+		upCost += up[i] < 128 ? up[i] : 256 - up[i];
+	}
+	#ifdef PNGIO_VECTOR
+	typedef uint16_t png_v8u16 __attribute__(( vector_size( 16 ) ));
+	while (i + 16 <= n)
+	{
+		// Sixteen bit lanes take 128 rounds of two bytes before they could wrap.
+		png_v8u16 subSum = { 0 };
+		png_v8u16 upSum = { 0 };
+		for (uint32_t k = 0; k < 128 && i + 16 <= n; k++, i += 16)
+		{
+			png_v16u8 x, left, above;
+			memcpy( & x, row + i, 16 );
+			memcpy( & left, row + i - 4, 16 );
+			memcpy( & above, prior + i, 16 );
+			const png_v16u8 s = x - left;
+			const png_v16u8 u = x - above;
+			memcpy( sub + i, & s, 16 );
+			memcpy( up + i, & u, 16 );
+			const png_v16u8 sn = (png_v16u8) (s > 127);
+			const png_v16u8 un = (png_v16u8) (u > 127);
+			const png_v16u8 sa = (s ^ sn) - sn;
+			const png_v16u8 ua = (u ^ un) - un;
+			subSum += ((png_v8u16) sa & 0xFF) + ((png_v8u16) sa >> 8);
+			upSum += ((png_v8u16) ua & 0xFF) + ((png_v8u16) ua >> 8);
+		}
+		for (uint32_t k = 0; k < 8; k++)
+		{
+			subCost += subSum[k];
+			upCost += upSum[k];
+		}
+	}
+	#endif
+	for (; i < n; i++)
+	{
+		sub[i] = (uint8_t) (row[i] - row[i - 4]);
+		up[i] = (uint8_t) (row[i] - prior[i]);
+		subCost += sub[i] < 128 ? sub[i] : 256 - sub[i];
+		upCost += up[i] < 128 ? up[i] : 256 - up[i];
+	}
+	
+	uint8_t * filtered = e->window + e->end;
+	filtered[0] = PNG_FILTER_VALUE_SUB;
+	if (e->rows > 0 && upCost < subCost)
+	{
+		filtered[0] = PNG_FILTER_VALUE_UP;
+		memcpy( sub, up, n );
+	}
+	e->adler = png_adler32( e->adler, filtered, n + 1 );
+	e->end += n + 1;
+	e->rows++;
+	memcpy( e->prior, row, n );
+	
+	if (e->end - e->start >= PNG_FAST_BLOCK)
+	{
+		png_fast_block( writePtr, e, 0 );
+	}
+}
+
+
+// Codes what is left as the final block, then the Adler-32.
+static void png_fast_finish( png_structp writePtr, png_fast_encoder * e )
+{
+	if (e->end > e->start)
+	{
+		png_fast_block( writePtr, e, 1 );
+	}
+	else
+	{
+		// An empty final block with the fixed codes: just end of block.
+		png_fast_put( writePtr, e, 1 | (1 << 1), 3 );
+		png_fast_put( writePtr, e, 0, 7 );
+	}
+	png_fast_align( writePtr, e );
+	uint8_t adler[4];
+	png_save_uint_32( adler, e->adler );
+	png_fast_bytes( writePtr, e, adler, 4 );
+	png_fast_flush( writePtr, e );
+}
+
+
+// Writes a row through libpng, uncompressed when stored is set, or through
+// the fast encoder.
+static void png_write_image_row( png_structp writePtr, png_const_bytep row, png_restart_index * index, png_stored_writer * stored, png_fast_encoder * fast, size_t bytesPerRow )
+{
+	if (fast)
+	{
+		png_fast_row( writePtr, fast, row );
+	}
+	else if (stored)
+	{
+		static const png_byte filter = PNG_FILTER_VALUE_NONE;
+		png_stored_put( writePtr, stored, & filter, 1 );
+		png_stored_put( writePtr, stored, row, bytesPerRow );
+	}
+	else
+	{
+		png_write_indexed_row( writePtr, row, index );
+	}
+}
+
+
+// Everything up to the first row of an 8 bit RGBA image: the signature,
+// compression settings and the chunks before IDAT. In apple mode that's
+// Apple's layout, with the CgBI chunk ahead of IHDR and a raw deflate stream.
+static void png_write_header( png_structp writePtr, png_infop infoPtr, uint32_t w, uint32_t h, uint32_t flags )
+{
+	if (flags & PNG_IMAGE_SMALL)
+	{
+		png_set_filter( writePtr, 0, PNG_ALL_FILTERS );
+		png_set_compression_level( writePtr, Z_BEST_COMPRESSION );
+	}
+	else
+	{
+		png_set_filter( writePtr, 0, PNG_FILTER_NONE );
+	}
+	
+	#ifdef PNG_APPLE_MODE_SUPPORTED
+	if (png_get_apple_mode())
+	{
+		png_write_sig( writePtr );
+		png_set_sig_bytes( writePtr, 8 );
+		png_set_compression_window_bits( writePtr, -15 );
+	}
+	#endif
+	
+	png_set_IHDR( writePtr, infoPtr, w, h, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT );
+	png_set_gAMA( writePtr, infoPtr, 0.45455 );
+	png_set_cHRM( writePtr, infoPtr, 0.312700, 0.329, 0.64, 0.33, 0.3, 0.6, 0.15, 0.06 );
+	png_set_sRGB( writePtr, infoPtr, 0);
+	
+	#ifdef PNG_APPLE_MODE_SUPPORTED
+	if (png_get_apple_mode())
+	{
+		png_byte cname[] = { 'C', 'g', 'B', 'I', '\0' };
+		png_byte cdata[] = { 0x50, 0x00, 0x20, 0x02 };
+		png_write_chunk( writePtr, cname, cdata, 4 );
+	}
+	#endif
+
+	png_write_info( writePtr, infoPtr );
+}
+
+
+// Writes either a resident image or, when image is NULL, rows pulled from a
+// source band by band, so that only one band is ever held in memory. With
+// restartRows, a restart point is recorded every that many rows.
+static uint8_t png_write( png_structp writePtr, png_image * image, const png_image_source * source, uint32_t flags, uint32_t restartRows )
+{
+	// Read the image through a volatile copy so nothing of the argument is
+	// kept in a register across the setjmp below.
+	const png_image * volatile resident = image;
+	const uint32_t  h = resident ? resident->height : source->height;
+	const uint32_t  w = resident ? resident->width : source->width;
+	const uint8_t * p = resident ? resident->data : NULL;
+	const uint32_t  bitDepth = 8;
+	const uint32_t  channels = 4;
+	
+	png_infop infoPtr = png_create_info_struct( writePtr );
+	if (!infoPtr) 
+	{
+		pngio_error( "Couldn't initialize PNG info struct" );
+		png_destroy_write_struct( & writePtr, NULL );
+		return 0;
+	}
+	
+	png_bytep volatile band = NULL;
+	png_bytep volatile entries = NULL;
+	png_fast_encoder * volatile fastEncoder = NULL;
+	if (setjmp( png_jmpbuf( writePtr ) )) 
+	{
+		png_free( writePtr, band );
+		png_free( writePtr, entries );
+		png_fast_destroy( writePtr, fastEncoder );
+		png_destroy_write_struct( & writePtr, & infoPtr );
+		pngio_error( "An error occured while writing the PNG file." );
+		return 0;
+	}
+
+	png_write_header( writePtr, infoPtr, w, h, flags );
+	
+	#ifdef PNG_APPLE_MODE_SUPPORTED
+	if (png_get_apple_mode())
+	{
+		png_set_write_user_transform_fn( writePtr, png_write_swap_and_premultiply_transform );
+		png_set_user_transform_info( writePtr, NULL, bitDepth, channels );
+	}
+	#endif
+
+	png_restart_index index = { 0, 0, NULL };
+	uint8_t stored = (flags & PNG_IMAGE_STORED) != 0;
+	uint8_t fast = !stored && (flags & PNG_IMAGE_FAST) != 0;
+	#ifdef PNG_APPLE_MODE_SUPPORTED
+	if (png_get_apple_mode())
+	{
+		restartRows = 0;
+		stored = 0;
+		fast = 0;
+	}
+	#endif
+	const size_t bytesPerRow = (size_t) w * 4;
+	png_stored_writer writer = { (uint64_t) h * (bytesPerRow + 1), 0, 1, 0 };
+	png_stored_writer * storedWriter = stored ? & writer : NULL;
+	restartRows = stored || fast ? 0 : restartRows;
+	if (fast)
+	{
+		png_fast_create( writePtr, & fastEncoder, bytesPerRow );
+	}
+	if (restartRows && restartRows < h)
+	{
+		index.rows = restartRows;
+		entries = (png_bytep) png_malloc( writePtr, (png_alloc_size_t) ((h - 1) / restartRows) * 8 );
+		index.entries = entries;
+	}
+	
+	if (!p)
+	{
+		const uint32_t bandRows = source->band_rows ? source->band_rows : 64;
+		band = (png_bytep) png_malloc( writePtr, bytesPerRow * (bandRows < h ? bandRows : h) );
+		for (uint32_t i = 0; i < h; i += bandRows)
+		{
+			const uint32_t n = h - i < bandRows ? h - i : bandRows;
+			if (flags & PNG_IMAGE_FLIP_VERTICAL)
+			{
+				png_fill_band( writePtr, source, h - i - n, n, band );
+				for (uint32_t j = n; j > 0; j--)
+				{
+					png_write_image_row( writePtr, band + (bytesPerRow * (j - 1)), & index, storedWriter, fastEncoder, bytesPerRow );
+				}
+			}
+			else
+			{
+				png_fill_band( writePtr, source, i, n, band );
+				for (uint32_t j = 0; j < n; j++)
+				{
+					png_write_image_row( writePtr, band + (bytesPerRow * j), & index, storedWriter, fastEncoder, bytesPerRow );
+				}
+			}
+		}
+		png_free( writePtr, band );
+		band = NULL;
+	}
+	else if (flags & PNG_IMAGE_FLIP_VERTICAL)
+	{
+		for (size_t i = 0; i < h; i++) 
+		{
+			png_write_image_row( writePtr, p + (bytesPerRow * (h - i - 1)), & index, storedWriter, fastEncoder, bytesPerRow );
+		}
+	}
+	else
+	{
+		for (size_t i = 0; i < h; i++) 
+		{
+			png_write_image_row( writePtr, p + (bytesPerRow * i), & index, storedWriter, fastEncoder, bytesPerRow );
+		}
+	}
+	
+	if (index.count)
+	{
+		png_write_chunk( writePtr, png_restart_chunk, index.entries, (png_size_t) index.count * 8 );
+	}
+	png_free( writePtr, entries );
+	entries = NULL;
+	
+	if (fast)
+	{
+		png_fast_finish( writePtr, fastEncoder );
+		png_fast_destroy( writePtr, fastEncoder );
+		fastEncoder = NULL;
+	}
+	
+	if (stored || fast)
+	{
+		static const png_byte iend[5] = { 'I', 'E', 'N', 'D', '\0' };
+		png_write_chunk( writePtr, iend, NULL, 0 );
+	}
+	else
+	{
+		png_write_end( writePtr, infoPtr );
+	}
+	png_destroy_write_struct( & writePtr, & infoPtr );
+	
+	return 1;
+}
+
+
+static uint8_t png_file_has_restarts( FILE * file, uint64_t * size );
+static uint8_t png_load_file_parallel( png_image * image, FILE * file, uint64_t size, uint32_t flags, png_io_call * call );
+
+
+static uint8_t png_load_file( png_image * image, FILE * file, uint32_t flags, png_io_call * call )
+{
+	uint64_t size = 0;
+	if ((flags & PNG_IMAGE_PARALLEL) && png_file_has_restarts( file, & size ))
+	{
+		return png_load_file_parallel( image, file, size, flags, call );
+	}
+	
+	uint32_t format = png_read_file_format( file );
+	if (format == PNG_FORMAT_INVALID)
+	{
+		pngio_error( "Not a valid PNG file." );
+		return 0;
+	}
+	
+	#ifdef PNG_APPLE_MODE_SUPPORTED 
+	png_set_apple_mode( format == PNG_FORMAT_APPLE );
+	#endif
+	
+	png_structp readPtr = png_create_reader( call );
+	if (!readPtr) 
+	{
+		pngio_error( "Couldn't initialize PNG read struct." );
+		return 0;
+	}
+	
+	png_io_buffer buffer;
+	png_io_buffer_init( & buffer, file, png_call_buffer_size( call ), call );
+	buffer.read = png_pull_file;
+	buffer.unread = png_unread_file;
+	png_set_read_fn( readPtr, (png_voidp) & buffer, png_read_buffered_data );
+	
+	const png_pull pull = { png_pull_buffered, & buffer };
+	const uint8_t result = png_read( readPtr, image, flags, & pull, NULL );
+	png_io_buffer_release( & buffer );
+	return result;
+}
+
+
+
+static uint8_t png_save_file( png_image * image, const png_image_source * source, FILE * file, uint32_t flags, png_io_call * call )
+{
+	if (image ? png_image_is_empty( image ) : (!source->fill || source->width == 0 || source->height == 0))
+	{
+		return 0;
+	}
+
+	#ifdef PNG_APPLE_MODE_SUPPORTED
+	png_set_apple_mode( flags & PNG_IMAGE_OPTIMIZE_FOR_IOS );
+	#endif
+	
+	png_structp writePtr = png_create_writer( call );
+	if (!writePtr) 
+	{
+		pngio_error( "Couldn't initialize PNG write struct." );
+		return 0;
+	}
+	
+	png_io_buffer buffer;
+	png_io_buffer_init( & buffer, file, png_call_buffer_size( call ), call );
+	buffer.write = png_push_file;
+	png_set_write_fn( writePtr, (png_voidp) & buffer, png_write_buffered_data, png_flush_buffered_data );
+	
+	uint8_t result = png_write( writePtr, image, source, flags, png_call_options( call ) ? call->options->restart_rows : 0 );
+	result = png_io_buffer_drain( & buffer ) && fflush( file ) == 0 && result;
+	png_io_buffer_release( & buffer );
+	return result;
+}
+
+
+// Transcoding: a reader feeding the writer as a png_image_source, so rows
+// go from one file to the other a band at a time. The reader is set up in
+// the input's format and the writer in the one flags ask for; apple mode
+// is only consulted while each is being set up, so they can run together.
+#define PNG_TRANSCODE_BAND_ROWS	8
+
+struct png_transcoder
+{
+	png_structp   readPtr;
+	png_bytep     rowBuffer;
+	png_read_plan plan;
+	uint8_t       fused;
+	png_io_call * call;
+};
+
+
+// Bands are asked for top to bottom, full width, so the next rows the
+// reader has are the band's.
+static uint8_t png_transcode_fill( void * context, uint32_t, uint32_t, uint32_t width, uint32_t height, png_pixel * pixels, size_t stride )
+{
+	png_transcoder * transcoder = (png_transcoder *) context;
+	if (setjmp( png_jmpbuf( transcoder->readPtr ) ))
+	{
+		pngio_error( "An error occured while reading the PNG file." );
+		return 0;
+	}
+	
+	for (uint32_t i = 0; i < height; i++)
+	{
+		png_pixel * row = (png_pixel *) ((uint8_t *) pixels + (stride * i));
+		if (!transcoder->fused)
+		{
+			png_read_row( transcoder->readPtr, (png_bytep) row, NULL );
+			continue;
+		}
+		png_read_row( transcoder->readPtr, transcoder->rowBuffer, NULL );
+		const png_stats_uint start = transcoder->call ? png_stats_clock() : 0;
+		transcoder->plan.kernel( & transcoder->plan, transcoder->rowBuffer, row, width );
+		if (transcoder->call)
+		{
+			transcoder->call->stages.transform_ns += png_stats_clock() - start;
+		}
+	}
+	return 1;
+}
+
+
+// Interlaced rows, and flipped output, can't be had in order; those files
+// are loaded whole and saved as usual.
+static uint8_t png_transcode_file( FILE * input, FILE * output, uint32_t flags, png_io_call * call )
+{
+	uint32_t format = png_read_file_format( input );
+	if (format == PNG_FORMAT_INVALID)
+	{
+		pngio_error( "Not a valid PNG file." );
+		return 0;
+	}
+	
+	#ifdef PNG_APPLE_MODE_SUPPORTED 
+	png_set_apple_mode( format == PNG_FORMAT_APPLE );
+	#endif
+	
+	png_transcoder transcoder;
+	transcoder.readPtr = png_create_reader( call );
+	transcoder.rowBuffer = NULL;
+	transcoder.call = call;
+	png_structp readPtr = transcoder.readPtr;
+	if (!readPtr) 
+	{
+		pngio_error( "Couldn't initialize PNG read struct." );
+		return 0;
+	}
+	png_infop infoPtr = png_create_info_struct( readPtr );
+	if (!infoPtr) 
+	{
+		pngio_error( "Couldn't initialize PNG info struct." );
+		png_destroy_read_struct( & readPtr, NULL, NULL );
+		return 0;
+	}
+	
+	png_io_buffer buffer;
+	png_io_buffer_init( & buffer, input, png_call_buffer_size( call ), call );
+	buffer.read = png_pull_file;
+	buffer.unread = png_unread_file;
+	png_set_read_fn( readPtr, (png_voidp) & buffer, png_read_buffered_data );
+	png_bytep volatile rowBuffer = NULL;
+	if (setjmp( png_jmpbuf( readPtr ) ))
+	{
+		pngio_error( "An error occured while reading the PNG file." );
+		png_free( readPtr, rowBuffer );
+		png_destroy_read_struct( & readPtr, & infoPtr, NULL );
+		png_io_buffer_release( & buffer );
+		return 0;
+	}
+	
+	png_set_sig_bytes( readPtr, 8 );
+	#ifdef PNG_APPLE_MODE_SUPPORTED 
+	if (png_get_apple_mode())
+	{
+		png_set_keep_unknown_chunks( readPtr, PNG_HANDLE_CHUNK_ALWAYS, NULL, 0 );
+		png_set_read_user_chunk_fn( readPtr, NULL, png_read_user_chunk );
+	}
+	#endif
+	png_read_info( readPtr, infoPtr );
+	
+	const png_uint_32 w = png_get_image_width( readPtr, infoPtr );
+	const png_uint_32 h = png_get_image_height( readPtr, infoPtr );
+	if (png_get_interlace_type( readPtr, infoPtr ) != PNG_INTERLACE_NONE || (flags & PNG_IMAGE_FLIP_VERTICAL))
+	{
+		png_destroy_read_struct( & readPtr, & infoPtr, NULL );
+		png_io_buffer_release( & buffer );
+		png_image image;
+		png_image_init( & image );
+		const uint8_t result = fseek( input, 0, SEEK_SET ) == 0 && png_load_file( & image, input, PNG_IMAGE_NONE, call ) && png_save_file( & image, NULL, output, flags, call );
+		png_image_free( & image );
+		return result;
+	}
+	
+	// Costed as png_read costs its rows, plus the writer's band.
+	const uint64_t rowBytes = (uint64_t) w * 8 + 64;
+	if (call && !png_call_fits( call, (rowBytes * 3) + ((uint64_t) w * 4 * PNG_TRANSCODE_BAND_ROWS) ))
+	{
+		pngio_error( "Image is too large for the memory budget." );
+		png_destroy_read_struct( & readPtr, & infoPtr, NULL );
+		png_io_buffer_release( & buffer );
+		return 0;
+	}
+	
+	transcoder.fused = png_plan_read( readPtr, infoPtr, PNG_IMAGE_NONE, & transcoder.plan );
+	if (!transcoder.fused)
+	{
+		png_read_generic_transforms( readPtr, infoPtr, PNG_IMAGE_NONE );
+	}
+	else
+	{
+		rowBuffer = (png_bytep) png_malloc( readPtr, png_get_rowbytes( readPtr, infoPtr ) );
+		transcoder.rowBuffer = rowBuffer;
+	}
+	
+	// From here the fill sets the reader's jump target for each band.
+	const png_image_source source = { w, h, PNG_TRANSCODE_BAND_ROWS, 0, png_transcode_fill, & transcoder };
+	const uint8_t result = png_save_file( NULL, & source, output, flags, call );
+	png_free( readPtr, rowBuffer );
+	png_destroy_read_struct( & readPtr, & infoPtr, NULL );
+	png_io_buffer_release( & buffer );
+	return result;
+}
+
+
+void png_image_options_init( png_image_options * options )
+{
+	options->stats = NULL;
+	options->trace = NULL;
+	options->hashes = NULL;
+	options->max_width = 0;
+	options->max_height = 0;
+	options->max_bytes = 0;
+	options->threads = 0;
+	options->restart_rows = 0;
+	options->io_buffer_size = 0;
+	options->zbuf_size = 0;
+}
+
+
+png_trace * png_trace_create( void )
+{
+	png_trace * trace = (png_trace *) calloc( 1, sizeof (png_trace) );
+	if (trace)
+	{
+		pthread_mutex_init( & trace->lock, NULL );
+	}
+	return trace;
+}
+
+
+void png_trace_destroy( png_trace * trace )
+{
+	if (trace)
+	{
+		pthread_mutex_destroy( & trace->lock );
+		free( trace->events );
+		free( trace );
+	}
+}
+
+
+uint8_t png_trace_write( png_trace * trace, FILE * file )
+{
+	pthread_mutex_lock( & trace->lock );
+	fprintf( file, "{\"traceEvents\":[" );
+	for (size_t i = 0; i < trace->count; i++)
+	{
+		const png_trace_event & event = trace->events[i];
+		fprintf( file, "%s\n{\"name\":\"%s\",\"cat\":\"pngio\",\"ph\":\"%c\",\"ts\":%llu.%03u,", 
+			i ? "," : "", event.name, event.phase, (unsigned long long) (event.ts / 1000), (unsigned) (event.ts % 1000) );
+		if (event.phase == 'X')
+		{
+			fprintf( file, "\"dur\":%llu.%03u,", (unsigned long long) (event.dur / 1000), (unsigned) (event.dur % 1000) );
+		}
+		else
+		{
+			fprintf( file, "\"s\":\"t\"," );
+		}
+		fprintf( file, "\"pid\":1,\"tid\":%llu,\"args\":{\"%s\":%u}}", (unsigned long long) event.tid, event.argName, event.arg );
+	}
+	fprintf( file, "\n],\"displayTimeUnit\":\"ns\"}\n" );
+	pthread_mutex_unlock( & trace->lock );
+	return ferror( file ) == 0;
+}
+
+
+void png_image_stats_add( png_image_stats * total, const png_image_stats * stats )
+{
+	total->calls += stats->calls;
+	total->total_ns += stats->total_ns;
+	total->rows += stats->rows;
+	total->bytes_read += stats->bytes_read;
+	total->idat_bytes += stats->idat_bytes;
+	total->inflate_ns += stats->inflate_ns;
+	for (size_t i = 0; i < 5; i++)
+	{
+		total->unfilter_ns[i] += stats->unfilter_ns[i];
+		total->unfilter_rows[i] += stats->unfilter_rows[i];
+	}
+	total->transform_ns += stats->transform_ns;
+	total->user_transform_ns += stats->user_transform_ns;
+	total->filter_ns += stats->filter_ns;
+	total->deflate_ns += stats->deflate_ns;
+	total->bytes_written += stats->bytes_written;
+	total->alloc_count += stats->alloc_count;
+	if (stats->alloc_peak_bytes > total->alloc_peak_bytes)
+	{
+		total->alloc_peak_bytes = stats->alloc_peak_bytes;
+	}
+}
+
+
+uint8_t png_image_load( png_image * image, FILE * file, uint32_t flags )
+{
+	return png_image_load_ex( image, file, flags, NULL );
+}
+
+
+uint8_t png_image_save( png_image * image, FILE * file, uint32_t flags )
+{
+	return png_image_save_ex( image, file, flags, NULL );
+}
+
+
+uint8_t png_image_load_ex( png_image * image, FILE * file, uint32_t flags, const png_image_options * options )
+{
+	PNGIO_PROBE2( load__start, image, flags );
+	png_io_call storage;
+	png_io_call * call = png_call_begin( & storage, "load", options );
+	uint8_t result = png_load_file( image, file, flags, call );
+	png_call_end( call, result );
+	PNGIO_PROBE2( load__done, image, result );
+	return result;
+}
+
+
+uint8_t png_image_save_ex( png_image * image, FILE * file, uint32_t flags, const png_image_options * options )
+{
+	PNGIO_PROBE2( save__start, image, flags );
+	png_io_call storage;
+	png_io_call * call = png_call_begin( & storage, "save", options );
+	uint8_t result = png_save_file( image, NULL, file, flags, call );
+	png_call_end( call, result );
+	PNGIO_PROBE2( save__done, image, result );
+	return result;
+}
+
+
+uint8_t png_image_save_source( const png_image_source * source, FILE * file, uint32_t flags, const png_image_options * options )
+{
+	PNGIO_PROBE2( save__start, source, flags );
+	png_io_call storage;
+	png_io_call * call = png_call_begin( & storage, "save", options );
+	uint8_t result = png_save_file( NULL, source, file, flags, call );
+	png_call_end( call, result );
+	PNGIO_PROBE2( save__done, source, result );
+	return result;
+}
+
+
+uint8_t png_image_transcode( FILE * input, FILE * output, uint32_t flags, const png_image_options * options )
+{
+	PNGIO_PROBE2( transcode__start, input, flags );
+	png_io_call storage;
+	png_io_call * call = png_call_begin( & storage, "transcode", options );
+	uint8_t result = png_transcode_file( input, output, flags, call );
+	png_call_end( call, result );
+	PNGIO_PROBE2( transcode__done, input, result );
+	return result;
+}
+
+
+uint8_t png_image_load_path( png_image * image, const char * path, uint32_t flags )
+{	
+	return png_image_load_path_ex( image, path, flags, NULL );
+}
+
+
+uint8_t png_image_save_path( png_image * image, const char * path, uint32_t flags )
+{	
+	return png_image_save_path_ex( image, path, flags, NULL );
+}
+
+
+uint8_t png_image_load_path_ex( png_image * image, const char * path, uint32_t flags, const png_image_options * options )
+{	
+	FILE * ifile = fopen( path, "r" );
+	if (!ifile) 
+	{
+		pngio_error( "Could not open file." );
+		return false;
+	}
+	uint8_t result = png_image_load_ex( image, ifile, flags, options );
+	fclose( ifile );
+	return result;
+}
+
+
+
+uint8_t png_image_save_source_path( const png_image_source * source, const char * path, uint32_t flags, const png_image_options * options )
+{	
+	FILE * ofile = fopen( path, "w" );
+	if (!ofile) 
+	{
+		pngio_error( "Could not open file." );
+		return false;
+	}
+	uint8_t result = png_image_save_source( source, ofile, flags, options );
+	fclose( ofile );
+	return result;
+}
+
+
+uint8_t png_image_save_path_ex( png_image * image, const char * path, uint32_t flags, const png_image_options * options )
+{	
+	FILE * ofile = fopen( path, "w" );
+	if (!ofile) 
+	{
+		pngio_error( "Could not open file." );
+		return false;
+	}
+	uint8_t result = png_image_save_ex( image, ofile, flags, options );
+	fclose( ofile );
+	return result;
+}
+
+
+uint8_t png_image_transcode_path( const char * input, const char * output, uint32_t flags, const png_image_options * options )
+{	
+	FILE * ifile = fopen( input, "r" );
+	if (!ifile) 
+	{
+		pngio_error( "Could not open file." );
+		return false;
+	}
+	FILE * ofile = fopen( output, "w" );
+	if (!ofile) 
+	{
+		pngio_error( "Could not open file." );
+		fclose( ifile );
+		return false;
+	}
+	uint8_t result = png_image_transcode( ifile, ofile, flags, options );
+	fclose( ofile );
+	fclose( ifile );
+	return result;
+}
+
+
+// Rows for pngio.hpp. The reader plans a kernel only for files whose rows
+// aren't already 8 bit RGB or RGBA, and always without an operation, so
+// Apple's files come out in their own channel order.
+struct png_image_reader
+{
+	png_structp   readPtr;
+	png_infop     infoPtr;
+	png_io_buffer buffer;
+	png_read_plan plan;
+	png_bytep     rowBuffer;	// a row as stored, for the kernel
+	png_bytep     rows;			// interlaced images, combined but as stored
+	size_t        rowBytes;
+	uint32_t      width;
+	uint32_t      height;
+	uint32_t      y;
+	uint8_t       direct;
+};
+
+
+struct png_image_writer
+{
+	png_structp   writePtr;
+	png_infop     infoPtr;
+	png_io_buffer buffer;
+	uint32_t      height;
+	uint32_t      y;
+	uint8_t       apple;
+	uint8_t       failed;
+};
+
+
+png_image_reader * png_image_reader_open( FILE * file, png_row_layout * layout )
+{
+	uint32_t format = png_read_file_format( file );
+	if (format == PNG_FORMAT_INVALID)
+	{
+		pngio_error( "Not a valid PNG file." );
+		return NULL;
+	}
+	
+	#ifdef PNG_APPLE_MODE_SUPPORTED 
+	png_set_apple_mode( format == PNG_FORMAT_APPLE );
+	#endif
+	
+	png_image_reader * volatile reader = (png_image_reader *) calloc( 1, sizeof (png_image_reader) );
+	if (!reader)
+	{
+		return NULL;
+	}
+	png_io_buffer_init( & reader->buffer, file, PNG_IO_BUFFER_SIZE, NULL );
+	reader->buffer.read = png_pull_file;
+	reader->buffer.unread = png_unread_file;
+	reader->readPtr = png_create_reader( NULL );
+	reader->infoPtr = reader->readPtr ? png_create_info_struct( reader->readPtr ) : NULL;
+	if (!reader->infoPtr)
+	{
+		pngio_error( "Couldn't initialize PNG read struct." );
+		png_image_reader_close( reader );
+		return NULL;
+	}
+	
+	png_structp readPtr = reader->readPtr;
+	png_infop infoPtr = reader->infoPtr;
+	png_set_read_fn( readPtr, (png_voidp) & reader->buffer, png_read_buffered_data );
+	if (setjmp( png_jmpbuf( readPtr ) ))
+	{
+		pngio_error( "An error occured while reading the PNG file." );
+		png_image_reader_close( reader );
+		return NULL;
+	}
+	
+	png_set_sig_bytes( readPtr, 8 );
+	#ifdef PNG_APPLE_MODE_SUPPORTED 
+	if (png_get_apple_mode())
+	{
+		png_set_keep_unknown_chunks( readPtr, PNG_HANDLE_CHUNK_ALWAYS, NULL, 0 );
+		png_set_read_user_chunk_fn( readPtr, NULL, png_read_user_chunk );
+	}
+	#endif
+	png_read_info( readPtr, infoPtr );
+	
+	const png_uint_32 bitDepth = png_get_bit_depth( readPtr, infoPtr );
+	const png_uint_32 colorType = png_get_color_type( readPtr, infoPtr );
+	const uint8_t keyed = png_get_valid( readPtr, infoPtr, PNG_INFO_tRNS ) != 0;
+	reader->width = png_get_image_width( readPtr, infoPtr );
+	reader->height = png_get_image_height( readPtr, infoPtr );
+	reader->rowBytes = png_get_rowbytes( readPtr, infoPtr );
+	reader->direct = bitDepth == 8 && ((colorType == PNG_COLOR_TYPE_RGB && !keyed) || colorType == PNG_COLOR_TYPE_RGB_ALPHA);
+	if (!reader->direct)
+	{
+		if (!png_plan_rows( readPtr, infoPtr, PNG_FUSED_NONE, & reader->plan ))
+		{
+			png_error( readPtr, "Missing palette" );
+		}
+		reader->rowBuffer = (png_bytep) png_malloc( readPtr, reader->rowBytes );
+	}
+	
+	if (png_get_interlace_type( readPtr, infoPtr ) != PNG_INTERLACE_NONE)
+	{
+		const uint64_t size = (uint64_t) reader->rowBytes * reader->height;
+		if (size > SIZE_MAX)
+		{
+			png_error( readPtr, "Image too large" );
+		}
+		reader->rows = (png_bytep) png_malloc( readPtr, (png_alloc_size_t) size );
+		for (int pass = png_set_interlace_handling( readPtr ); pass > 0; pass--)
+		{
+			for (uint32_t y = 0; y < reader->height; y++)
+			{
+				png_read_row( readPtr, reader->rows + (reader->rowBytes * y), NULL );
+			}
+		}
+	}
+	
+	layout->width = reader->width;
+	layout->height = reader->height;
+	layout->channels = reader->direct && colorType == PNG_COLOR_TYPE_RGB ? 3 : 4;
+	layout->apple = format == PNG_FORMAT_APPLE;
+	return reader;
+}
+
+
+uint8_t png_image_reader_read( png_image_reader * reader, uint8_t * row )
+{
+	if (reader->y >= reader->height)
+	{
+		return 0;
+	}
+	if (setjmp( png_jmpbuf( reader->readPtr ) ))
+	{
+		pngio_error( "An error occured while reading the PNG file." );
+		return 0;
+	}
+	
+	png_bytep stored = reader->direct ? row : reader->rowBuffer;
+	if (reader->rows)
+	{
+		stored = reader->rows + (reader->rowBytes * reader->y);
+	}
+	else
+	{
+		png_read_row( reader->readPtr, stored, NULL );
+	}
+	
+	if (!reader->direct)
+	{
+		reader->plan.kernel( & reader->plan, stored, (png_pixel *) row, reader->width );
+	}
+	else if (stored != row)
+	{
+		memcpy( row, stored, reader->rowBytes );
+	}
+	reader->y++;
+	return 1;
+}
+
+
+void png_image_reader_close( png_image_reader * reader )
+{
+	if (reader->readPtr)
+	{
+		png_free( reader->readPtr, reader->rowBuffer );
+		png_free( reader->readPtr, reader->rows );
+		png_destroy_read_struct( & reader->readPtr, reader->infoPtr ? & reader->infoPtr : NULL, NULL );
+	}
+	png_io_buffer_release( & reader->buffer );
+	free( reader );
+}
+
+
+// libpng looks at apple mode as IDAT is written, so each call sets it again.
+png_image_writer * png_image_writer_open( FILE * file, uint32_t width, uint32_t height, uint32_t flags )
+{
+	if (width == 0 || height == 0)
+	{
+		return NULL;
+	}
+	
+	png_image_writer * volatile writer = (png_image_writer *) calloc( 1, sizeof (png_image_writer) );
+	if (!writer)
+	{
+		return NULL;
+	}
+	writer->height = height;
+	writer->apple = (flags & PNG_IMAGE_OPTIMIZE_FOR_IOS) != 0;
+	#ifdef PNG_APPLE_MODE_SUPPORTED
+	png_set_apple_mode( writer->apple );
+	#endif
+	
+	png_io_buffer_init( & writer->buffer, file, PNG_IO_BUFFER_SIZE, NULL );
+	writer->buffer.write = png_push_file;
+	writer->writePtr = png_create_writer( NULL );
+	writer->infoPtr = writer->writePtr ? png_create_info_struct( writer->writePtr ) : NULL;
+	if (!writer->infoPtr)
+	{
+		pngio_error( "Couldn't initialize PNG write struct." );
+		writer->failed = 1;
+		png_image_writer_close( writer );
+		return NULL;
+	}
+	
+	png_structp writePtr = writer->writePtr;
+	png_set_write_fn( writePtr, (png_voidp) & writer->buffer, png_write_buffered_data, png_flush_buffered_data );
+	if (setjmp( png_jmpbuf( writePtr ) ))
+	{
+		pngio_error( "An error occured while writing the PNG file." );
+		writer->failed = 1;
+		png_image_writer_close( writer );
+		return NULL;
+	}
+	png_write_header( writePtr, writer->infoPtr, width, height, flags );
+	return writer;
+}
+
+
+uint8_t png_image_writer_write( png_image_writer * writer, const uint8_t * row )
+{
+	if (writer->failed || writer->y >= writer->height)
+	{
+		return 0;
+	}
+	#ifdef PNG_APPLE_MODE_SUPPORTED
+	png_set_apple_mode( writer->apple );
+	#endif
+	if (setjmp( png_jmpbuf( writer->writePtr ) ))
+	{
+		pngio_error( "An error occured while writing the PNG file." );
+		writer->failed = 1;
+		return 0;
+	}
+	
+	png_write_row( writer->writePtr, row );
+	writer->y++;
+	return 1;
+}
+
+
+uint8_t png_image_writer_close( png_image_writer * writer )
+{
+	uint8_t volatile result = !writer->failed && writer->y == writer->height;
+	if (result)
+	{
+		#ifdef PNG_APPLE_MODE_SUPPORTED
+		png_set_apple_mode( writer->apple );
+		#endif
+		if (setjmp( png_jmpbuf( writer->writePtr ) ))
+		{
+			pngio_error( "An error occured while writing the PNG file." );
+			result = 0;
+		}
+		else
+		{
+			png_write_end( writer->writePtr, writer->infoPtr );
+		}
+	}
+	if (writer->writePtr)
+	{
+		png_destroy_write_struct( & writer->writePtr, writer->infoPtr ? & writer->infoPtr : NULL );
+	}
+	result = png_io_buffer_drain( & writer->buffer ) && fflush( (FILE *) writer->buffer.io ) == 0 && result;
+	png_io_buffer_release( & writer->buffer );
+	free( writer );
+	return result;
+}
+
+
+
+void png_image_set_pixel( png_image * image, uint32_t x, uint32_t y, png_pixel pixel )
+{
+	const uint32_t w = image->width;
+	const uint32_t h = image->height;
+	if (x < w && y < h)
+	{
+		((png_pixel *) image->data)[ ((size_t) y * w) + x ] = pixel;
+		png_image_drop_mips( image );
+	}
+}
+
+
+png_pixel png_image_get_pixel( png_image * image, uint32_t x, uint32_t y )
+{
+	const uint32_t w = image->width;
+	const uint32_t h = image->height;
+	if (x < w && y < h)
+	{
+		return ((png_pixel *) image->data)[ ((size_t) y * w) + x ];
+	}
+	static const png_pixel blank = { 0, 0, 0, 0 };
+	return blank;
+}
+
+
+// Bulk pixel operations, vectorized where PNGIO_VECTOR is defined. Other
+// compilers and the pixels left over at the end of a run take the scalar
+// loops.
+
+static inline png_pixel png_swap_rb( png_pixel p )
+{
+	const png_pixel q = { p.b, p.g, p.r, p.a };
+	return q;
+}
+
+
+static void png_fill_pixels( png_pixel * d, uint32_t n, png_pixel pixel )
+{
+	uint32_t i = 0;
+	#ifdef PNGIO_VECTOR
+	uint32_t bits;
+	memcpy( & bits, & pixel, 4 );
+	const png_v4u32 v = { bits, bits, bits, bits };
+	for (; i + 4 <= n; i += 4)
+	{
+		png_store4( d + i, v );
+	}
+	#endif
+	for (; i < n; i++)
+	{
+		d[i] = pixel;
+	}
+}
+
+
+static void png_copy_swapped( png_pixel * d, const png_pixel * s, uint32_t n )
+{
+	uint32_t i = 0;
+	#ifdef PNGIO_VECTOR
+	for (; i + 4 <= n; i += 4)
+	{
+		png_store4( d + i, png_swap_rb4( png_load4( s + i ) ) );
+	}
+	#endif
+	for (; i < n; i++)
+	{
+		d[i] = png_swap_rb( s[i] );
+	}
+}
+
+
+// Straight alpha OVER, as APNG blends frames.
+static inline void png_blend_pixel( png_pixel * d, png_pixel s )
+{
+	if (s.a == 0xFF || d->a == 0)
+	{
+		*d = s;
+	}
+	else if (s.a != 0)
+	{
+		const uint32_t u = s.a * 0xFF;
+		const uint32_t v = (0xFF - s.a) * d->a;
+		const uint32_t a = u + v;
+		d->r = (png_byte) ((s.r * u + d->r * v) / a);
+		d->g = (png_byte) ((s.g * u + d->g * v) / a);
+		d->b = (png_byte) ((s.b * u + d->b * v) / a);
+		d->a = (png_byte) (a / 0xFF);
+	}
+}
+
+
+// Four pixels at a time in single precision, which holds every product and
+// sum exactly and truncates to the same bytes as png_blend_pixel. The
+// formula already gives the source where it is opaque or the destination
+// clear, and the destination where the source is clear; only both clear,
+// where it would divide by zero, is picked out.
+static void png_blend_pixels( png_pixel * d, const png_pixel * s, uint32_t n, uint8_t swap )
+{
+	uint32_t i = 0;
+	#ifdef PNGIO_VECTOR
+	for (; i + 4 <= n; i += 4)
+	{
+		png_v4u32 sw = png_load4( s + i );
+		sw = swap ? png_swap_rb4( sw ) : sw;
+		const uint8_t alphas = s[i].a & s[i + 1].a & s[i + 2].a & s[i + 3].a;
+		if (alphas == 0xFF)
+		{
+			png_store4( d + i, sw );
+			continue;
+		}
+		
+		const png_v16u8 sb = (png_v16u8) sw;
+		const png_v16u8 db = (png_v16u8) png_load4( d + i );
+		#define PNG_CHANNEL4( v, k )	__builtin_convertvector( (png_v4u8) __builtin_shufflevector( v, v, k, k + 4, k + 8, k + 12 ), png_v4f )
+		const png_v4f sa = PNG_CHANNEL4( sb, 3 );
+		const png_v4f da = PNG_CHANNEL4( db, 3 );
+		const png_v4f u = sa * 255.0f;
+		const png_v4f v = (255.0f - sa) * da;
+		const png_v4f a = u + v;
+		const png_v4u32 clear = (png_v4u32) (a == 0.0f);
+		const png_v4f divisor = a + (png_v4f) (clear & (png_v4u32) ((png_v4f) { 1.0f, 1.0f, 1.0f, 1.0f }));
+		
+		png_v4u8 c[4];
+		c[0] = __builtin_convertvector( (PNG_CHANNEL4( sb, 0 ) * u + PNG_CHANNEL4( db, 0 ) * v) / divisor, png_v4u8 );
+		c[1] = __builtin_convertvector( (PNG_CHANNEL4( sb, 1 ) * u + PNG_CHANNEL4( db, 1 ) * v) / divisor, png_v4u8 );
+		c[2] = __builtin_convertvector( (PNG_CHANNEL4( sb, 2 ) * u + PNG_CHANNEL4( db, 2 ) * v) / divisor, png_v4u8 );
+		#undef PNG_CHANNEL4
+		c[3] = __builtin_convertvector( a / 255.0f, png_v4u8 );
+		
+		typedef uint8_t png_v8u8 __attribute__(( vector_size( 8 ) ));
+		const png_v8u8 rg = __builtin_shufflevector( c[0], c[1], 0, 4, 1, 5, 2, 6, 3, 7 );
+		const png_v8u8 ba = __builtin_shufflevector( c[2], c[3], 0, 4, 1, 5, 2, 6, 3, 7 );
+		const png_v4u32 out = (png_v4u32) __builtin_shufflevector( rg, ba, 0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15 );
+		png_store4( d + i, (out & ~clear) | (sw & clear) );
+	}
+	#endif
+	for (; i < n; i++)
+	{
+		png_blend_pixel( d + i, swap ? png_swap_rb( s[i] ) : s[i] );
+	}
+}
+
+
+static void png_swap_pixels( png_pixel * a, png_pixel * b, uint32_t n )
+{
+	uint32_t i = 0;
+	#ifdef PNGIO_VECTOR
+	for (; i + 4 <= n; i += 4)
+	{
+		const png_v4u32 t = png_load4( a + i );
+		png_store4( a + i, png_load4( b + i ) );
+		png_store4( b + i, t );
+	}
+	#endif
+	for (; i < n; i++)
+	{
+		const png_pixel t = a[i];
+		a[i] = b[i];
+		b[i] = t;
+	}
+}
+
+
+static void png_reverse_pixels( png_pixel * p, size_t n )
+{
+	size_t i = 0;
+	size_t j = n;
+	#ifdef PNGIO_VECTOR
+	for (; j - i >= 8; i += 4, j -= 4)
+	{
+		const png_v4u32 l = png_load4( p + i );
+		png_store4( p + i, png_reverse4( png_load4( p + j - 4 ) ) );
+		png_store4( p + j - 4, png_reverse4( l ) );
+	}
+	#endif
+	for (; j - i >= 2; i++, j--)
+	{
+		const png_pixel t = p[i];
+		p[i] = p[j - 1];
+		p[j - 1] = t;
+	}
+}
+
+
+// Transposes are done a tile at a time, so the rows being read and the
+// columns being written both stay in cache.
+#define PNG_TILE_PIXELS		32
+
+// Copies the width by height pixels at s, rows sStride pixels apart, to d
+// transposed: d[x * dStride + y] = s[y * sStride + x]. Either stride may be
+// negative, to walk rows bottom up.
+static void png_transpose_pixels( const png_pixel * s, ptrdiff_t sStride, uint32_t width, uint32_t height, png_pixel * d, ptrdiff_t dStride )
+{
+	for (uint32_t ty = 0; ty < height; ty += PNG_TILE_PIXELS)
+	{
+		const uint32_t th = height - ty < PNG_TILE_PIXELS ? height - ty : PNG_TILE_PIXELS;
+		for (uint32_t tx = 0; tx < width; tx += PNG_TILE_PIXELS)
+		{
+			const uint32_t tw = width - tx < PNG_TILE_PIXELS ? width - tx : PNG_TILE_PIXELS;
+			uint32_t y = ty;
+			#ifdef PNGIO_VECTOR
+			for (; y + 4 <= ty + th; y += 4)
+			{
+				uint32_t x = tx;
+				for (; x + 4 <= tx + tw; x += 4)
+				{
+					const png_pixel * p = s + (sStride * y) + x;
+					png_v4u32 r0 = png_load4( p );
+					png_v4u32 r1 = png_load4( p + sStride );
+					png_v4u32 r2 = png_load4( p + (sStride * 2) );
+					png_v4u32 r3 = png_load4( p + (sStride * 3) );
+					png_transpose4( r0, r1, r2, r3 );
+					png_pixel * q = d + (dStride * x) + y;
+					png_store4( q, r0 );
+					png_store4( q + dStride, r1 );
+					png_store4( q + (dStride * 2), r2 );
+					png_store4( q + (dStride * 3), r3 );
+				}
+				for (; x < tx + tw; x++)
+				{
+					for (uint32_t k = 0; k < 4; k++)
+					{
+						d[(dStride * x) + y + k] = s[(sStride * (y + k)) + x];
+					}
+				}
+			}
+			#endif
+			for (; y < ty + th; y++)
+			{
+				for (uint32_t x = tx; x < tx + tw; x++)
+				{
+					d[(dStride * x) + y] = s[(sStride * y) + x];
+				}
+			}
+		}
+	}
+}
+
+
+// Transposes a square of size by size pixels where it lies, swapping each
+// 4 by 4 block above the diagonal with its mirror below.
+static void png_transpose_square( png_pixel * p, uint32_t size )
+{
+	uint32_t blocked = 0;
+	#ifdef PNGIO_VECTOR
+	blocked = size & ~3u;
+	const ptrdiff_t stride = size;
+	for (uint32_t ty = 0; ty < blocked; ty += PNG_TILE_PIXELS)
+	{
+		const uint32_t yEnd = blocked - ty < PNG_TILE_PIXELS ? blocked : ty + PNG_TILE_PIXELS;
+		for (uint32_t tx = ty; tx < blocked; tx += PNG_TILE_PIXELS)
+		{
+			const uint32_t xEnd = blocked - tx < PNG_TILE_PIXELS ? blocked : tx + PNG_TILE_PIXELS;
+			for (uint32_t y = ty; y < yEnd; y += 4)
+			{
+				for (uint32_t x = (tx > y ? tx : y); x < xEnd; x += 4)
+				{
+					png_pixel * a = p + (stride * y) + x;
+					png_pixel * b = p + (stride * x) + y;
+					png_v4u32 a0 = png_load4( a );
+					png_v4u32 a1 = png_load4( a + stride );
+					png_v4u32 a2 = png_load4( a + (stride * 2) );
+					png_v4u32 a3 = png_load4( a + (stride * 3) );
+					png_v4u32 b0 = png_load4( b );
+					png_v4u32 b1 = png_load4( b + stride );
+					png_v4u32 b2 = png_load4( b + (stride * 2) );
+					png_v4u32 b3 = png_load4( b + (stride * 3) );
+					png_transpose4( a0, a1, a2, a3 );
+					png_transpose4( b0, b1, b2, b3 );
+					png_store4( b, a0 );
+					png_store4( b + stride, a1 );
+					png_store4( b + (stride * 2), a2 );
+					png_store4( b + (stride * 3), a3 );
+					png_store4( a, b0 );
+					png_store4( a + stride, b1 );
+					png_store4( a + (stride * 2), b2 );
+					png_store4( a + (stride * 3), b3 );
+				}
+			}
+		}
+	}
+	#endif
+	for (uint32_t j = blocked; j < size; j++)
+	{
+		for (uint32_t i = 0; i < j; i++)
+		{
+			const png_pixel t = p[((size_t) i * size) + j];
+			p[((size_t) i * size) + j] = p[((size_t) j * size) + i];
+			p[((size_t) j * size) + i] = t;
+		}
+	}
+}
+
+
+static uint32_t png_channel_diff( uint8_t a, uint8_t b )
+{
+	return a > b ? a - b : b - a;
+}
+
+
+// Counts the pixels of a run that differ by more than tolerance in any
+// channel, noting where the first and last of them are.
+static uint32_t png_compare_pixels( const png_pixel * a, const png_pixel * b, uint32_t n, uint8_t swap, png_pixel tolerance, uint32_t * first, uint32_t * last )
+{
+	uint32_t count = 0;
+	uint32_t i = 0;
+	#ifdef PNGIO_VECTOR
+	uint32_t bits;
+	memcpy( & bits, & tolerance, 4 );
+	const png_v4u32 limits = { bits, bits, bits, bits };
+	const png_v16u8 limit = (png_v16u8) limits;
+	for (; i + 4 <= n; i += 4)
+	{
+		const png_v16u8 x = (png_v16u8) png_load4( a + i );
+		const png_v16u8 y = (png_v16u8) (swap ? png_swap_rb4( png_load4( b + i ) ) : png_load4( b + i ));
+		const png_v16u8 above = (png_v16u8) (x > y);
+		const png_v16u8 diff = ((x - y) & above) | ((y - x) & ~above);
+		const png_v4u32 over = (png_v4u32) (diff > limit);
+		if ((over[0] | over[1] | over[2] | over[3]) != 0)
+		{
+			for (uint32_t k = 0; k < 4; k++)
+			{
+				if (over[k])
+				{
+					*first = count ? *first : i + k;
+					*last = i + k;
+					count++;
+				}
+			}
+		}
+	}
+	#endif
+	for (; i < n; i++)
+	{
+		const png_pixel p = a[i];
+		const png_pixel q = swap ? png_swap_rb( b[i] ) : b[i];
+		if (png_channel_diff( p.r, q.r ) > tolerance.r || png_channel_diff( p.g, q.g ) > tolerance.g ||
+			png_channel_diff( p.b, q.b ) > tolerance.b || png_channel_diff( p.a, q.a ) > tolerance.a)
+		{
+			*first = count ? *first : i;
+			*last = i;
+			count++;
+		}
+	}
+	return count;
+}
+
+
+// Grows the rectangle from x0, y0 to x1, y1 (exclusive) to cover another.
+static void png_diff_extend( uint32_t * bounds, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1 )
+{
+	if (x0 < x1 && y0 < y1)
+	{
+		bounds[0] = x0 < bounds[0] ? x0 : bounds[0];
+		bounds[1] = y0 < bounds[1] ? y0 : bounds[1];
+		bounds[2] = x1 > bounds[2] ? x1 : bounds[2];
+		bounds[3] = y1 > bounds[3] ? y1 : bounds[3];
+	}
+}
+
+
+void png_image_fill_rect( png_image * image, uint32_t x, uint32_t y, uint32_t width, uint32_t height, png_pixel pixel )
+{
+	if (image->data == NULL || x >= image->width || y >= image->height)
+	{
+		return;
+	}
+	width = width < image->width - x ? width : image->width - x;
+	height = height < image->height - y ? height : image->height - y;
+	for (uint32_t j = 0; j < height; j++)
+	{
+		png_fill_pixels( (png_pixel *) image->data + ((size_t) (y + j) * image->width) + x, width, pixel );
+	}
+	png_image_drop_mips( image );
+}
+
+
+void png_image_blit( png_image * image, uint32_t x, uint32_t y, const png_image_view * source, uint32_t mode )
+{
+	if (image->data == NULL || source->data == NULL || x >= image->width || y >= image->height)
+	{
+		return;
+	}
+	const uint32_t width = source->width < image->width - x ? source->width : image->width - x;
+	const uint32_t height = source->height < image->height - y ? source->height : image->height - y;
+	const uint8_t swap = source->format == PNG_VIEW_BGRA;
+	
+	// A copy within the image goes bottom up when moving down, as memmove
+	// does, so no row is overwritten before it is read.
+	png_pixel * first = (png_pixel *) image->data + ((size_t) y * image->width) + x;
+	const uint8_t upwards = (const uint8_t *) first > source->data && mode == PNG_BLIT_COPY && !swap;
+	for (uint32_t j = 0; j < height; j++)
+	{
+		const uint32_t row = upwards ? height - j - 1 : j;
+		png_pixel * d = first + ((size_t) row * image->width);
+		const png_pixel * s = (const png_pixel *) (source->data + (source->stride * row));
+		if (mode == PNG_BLIT_BLEND)
+		{
+			png_blend_pixels( d, s, width, swap );
+		}
+		else if (swap)
+		{
+			png_copy_swapped( d, s, width );
+		}
+		else
+		{
+			memmove( d, s, (size_t) width * 4 );
+		}
+	}
+	
+	// Only now, as the source may be a level of the chain.
+	png_image_drop_mips( image );
+}
+
+
+void png_image_flip_vertical( png_image * image )
+{
+	const uint32_t w = image->width;
+	const uint32_t h = image->height;
+	png_pixel * pixels = (png_pixel *) image->data;
+	for (uint32_t y = 0; y < h / 2; y++)
+	{
+		png_swap_pixels( pixels + ((size_t) y * w), pixels + ((size_t) (h - y - 1) * w), w );
+	}
+	png_image_drop_mips( image );
+}
+
+
+void png_image_flip_horizontal( png_image * image )
+{
+	const uint32_t w = image->width;
+	png_pixel * pixels = (png_pixel *) image->data;
+	for (uint32_t y = 0; y < image->height; y++)
+	{
+		png_reverse_pixels( pixels + ((size_t) y * w), w );
+	}
+	png_image_drop_mips( image );
+}
+
+
+void png_image_rotate_180( png_image * image )
+{
+	png_reverse_pixels( (png_pixel *) image->data, (size_t) image->width * image->height );
+	png_image_drop_mips( image );
+}
+
+
+uint8_t png_image_rotate_90( png_image * image, uint8_t clockwise )
+{
+	const uint32_t w = image->width;
+	const uint32_t h = image->height;
+	if (image->data == NULL)
+	{
+		return 1;
+	}
+	
+	// Clockwise is the transpose mirrored left to right, anticlockwise the
+	// transpose mirrored top to bottom. The flips drop the mip chain.
+	if (w == h)
+	{
+		png_transpose_square( (png_pixel *) image->data, w );
+		if (clockwise)
+		{
+			png_image_flip_horizontal( image );
+		}
+		else
+		{
+			png_image_flip_vertical( image );
+		}
+		return 1;
+	}
+	
+	png_image rotated;
+	if (image->mapped)
+	{
+		png_image_alloc_mapped( & rotated, h, w );
+	}
+	else
+	{
+		png_image_alloc( & rotated, h, w );
+	}
+	if (rotated.data == NULL)
+	{
+		return 0;
+	}
+	
+	const png_pixel * s = (const png_pixel *) image->data;
+	png_pixel * d = (png_pixel *) rotated.data;
+	if (clockwise)
+	{
+		png_transpose_pixels( s + ((size_t) (h - 1) * w), -(ptrdiff_t) w, w, h, d, h );
+	}
+	else
+	{
+		png_transpose_pixels( s, w, w, h, d + ((size_t) (w - 1) * h), -(ptrdiff_t) h );
+	}
+	
+	// The old pixels, and their mip chain, leave with rotated.
+	uint8_t * data = image->data;
+	const uint8_t mapped = image->mapped;
+	const uint8_t levels = image->mip_levels;
+	image->width = h;
+	image->height = w;
+	image->data = rotated.data;
+	image->mapped = rotated.mapped;
+	image->mip_levels = 0;
+	rotated.width = w;
+	rotated.height = h;
+	rotated.data = data;
+	rotated.mapped = mapped;
+	rotated.mip_levels = levels;
+	return 1;
+}
+
+
+uint64_t png_image_compare( const png_image_view * a, const png_image_view * b, png_pixel tolerance, png_image_diff * diff )
+{
+	const uint32_t width = a->width < b->width ? a->width : b->width;
+	const uint32_t height = a->height < b->height ? a->height : b->height;
+	const uint8_t swap = a->format != b->format;
+	tolerance = a->format == PNG_VIEW_BGRA ? png_swap_rb( tolerance ) : tolerance;
+	
+	uint64_t mismatches = 0;
+	uint32_t bounds[4] = { UINT32_MAX, UINT32_MAX, 0, 0 };
+	if (a->data && b->data)
+	{
+		for (uint32_t y = 0; y < height; y++)
+		{
+			const png_pixel * p = (const png_pixel *) (a->data + (a->stride * y));
+			const png_pixel * q = (const png_pixel *) (b->data + (b->stride * y));
+			uint32_t first = 0;
+			uint32_t last = 0;
+			const uint32_t count = png_compare_pixels( p, q, width, swap, tolerance, & first, & last );
+			if (count)
+			{
+				mismatches += count;
+				png_diff_extend( bounds, first, y, last + 1, y + 1 );
+			}
+		}
+	}
+	
+	const png_image_view * views[2] = { a, b };
+	for (int i = 0; i < 2; i++)
+	{
+		const png_image_view * view = views[i];
+		mismatches += (uint64_t) (view->width - width) * view->height;
+		mismatches += (uint64_t) width * (view->height - height);
+		png_diff_extend( bounds, width, 0, view->width, view->height );
+		png_diff_extend( bounds, 0, height, width, view->height );
+	}
+	
+	if (diff)
+	{
+		const png_image_diff none = { 0, 0, 0, 0, 0 };
+		const png_image_diff some = { mismatches, bounds[0], bounds[1], bounds[2] - bounds[0], bounds[3] - bounds[1] };
+		*diff = mismatches ? some : none;
+	}
+	return mismatches;
+}
+
+
+png_image_view png_image_get_view( const png_image * image )
+{
+	png_image_view view = { image->data, image->width, image->height, (size_t) image->width * 4, PNG_VIEW_RGBA };
+	return view;
+}
+
+
+png_image_view png_image_get_mip_level( const png_image * image, uint32_t level )
+{
+	if (!image->data || level > image->mip_levels)
+	{
+		png_image_view empty = { NULL, 0, 0, 0, PNG_VIEW_RGBA };
+		return empty;
+	}
+	const uint32_t width = png_mip_size( image->width, level );
+	const uint32_t height = png_mip_size( image->height, level );
+	const uint64_t offset = png_chain_bytes( image->width, image->height, level ) - png_image_bytes( width, height );
+	png_image_view view = { image->data + offset, width, height, (size_t) width * 4, PNG_VIEW_RGBA };
+	return view;
+}
+
+
+png_image_view png_image_view_crop( const png_image_view * view, uint32_t x, uint32_t y, uint32_t width, uint32_t height )
+{
+	x = x < view->width ? x : view->width;
+	y = y < view->height ? y : view->height;
+	width = width < view->width - x ? width : view->width - x;
+	height = height < view->height - y ? height : view->height - y;
+	png_image_view crop = { view->data ? view->data + (view->stride * y) + ((size_t) x * 4) : NULL, width, height, view->stride, view->format };
+	return crop;
+}
+
+
+static uint8_t png_fill_from_view( void * context, uint32_t x, uint32_t y, uint32_t width, uint32_t height, png_pixel * pixels, size_t stride )
+{
+	const png_image_view * view = (const png_image_view *) context;
+	for (uint32_t j = 0; j < height; j++)
+	{
+		const png_pixel * s = (const png_pixel *) (view->data + (view->stride * (y + j))) + x;
+		png_pixel * d = (png_pixel *) ((uint8_t *) pixels + (stride * j));
+		if (view->format == PNG_VIEW_BGRA)
+		{
+			png_copy_swapped( d, s, width );
+		}
+		else
+		{
+			memcpy( d, s, (size_t) width * 4 );
+		}
+	}
+	return 1;
+}
+
+
+// Views are saved as sources, a band at a time, so their rows can be
+// anywhere and in either channel order without a copy of the whole image.
+static png_image_source png_view_source( const png_image_view * view )
+{
+	png_image_source source = { view->width, view->height, 0, 0, view->data ? png_fill_from_view : NULL, (void *) view };
+	return source;
+}
+
+
+uint8_t png_image_save_view( const png_image_view * view, FILE * file, uint32_t flags, const png_image_options * options )
+{
+	const png_image_source source = png_view_source( view );
+	return png_image_save_source( & source, file, flags, options );
+}
+
+
+uint8_t png_image_save_view_path( const png_image_view * view, const char * path, uint32_t flags, const png_image_options * options )
+{
+	const png_image_source source = png_view_source( view );
+	return png_image_save_source_path( & source, path, flags, options );
+}
+
+
+
+// Animated PNG. Each frame's image data is rewrapped as a standalone PNG in
+// memory (the file's IHDR resized to the frame, the chunks shared by every
+// frame, and the frame's IDAT or fdAT data as IDAT) and read through
+// png_read, so frames take the same fused paths as still images. Frames
+// decode independently on worker threads; only compositing, which depends
+// on the previous canvas, runs in order. Saving goes the other way, each
+// frame encoded by png_write on its own thread and its IDATs rewrapped.
+
+#define PNG_DISPOSE_OP_NONE			0
+#define PNG_DISPOSE_OP_BACKGROUND	1
+#define PNG_DISPOSE_OP_PREVIOUS		2
+
+#define PNG_BLEND_OP_SOURCE			0
+#define PNG_BLEND_OP_OVER			1
+
+
+struct png_buffer
+{
+	uint8_t * data;
+	size_t    size;
+	size_t    capacity;
+};
+
+
+static uint8_t png_buffer_append( png_buffer * buffer, const void * data, size_t size )
+{
+	if (size == 0)
+	{
+		return 1;
+	}
+	if (buffer->capacity - buffer->size < size)
+	{
+		size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+		while (capacity - buffer->size < size)
+		{
+			capacity *= 2;
+		}
+		uint8_t * grown = (uint8_t *) realloc( buffer->data, capacity );
+		if (!grown)
+		{
+			return 0;
+		}
+		buffer->data = grown;
+		buffer->capacity = capacity;
+	}
+	memcpy( buffer->data + buffer->size, data, size );
+	buffer->size += size;
+	return 1;
+}
+
+
+static uint8_t png_buffer_append_chunk( png_buffer * buffer, const char * name, const uint8_t * prefix, size_t prefixSize, const uint8_t * data, size_t size )
+{
+	uint8_t header[8], crc[4];
+	png_save_uint_32( header, (png_uint_32) (prefixSize + size) );
+	memcpy( header + 4, name, 4 );
+	// crc32 treats a NULL buffer as a request for the initial value
+	uLong sum = crc32( 0, header + 4, 4 );
+	sum = prefixSize ? crc32( sum, prefix, (uInt) prefixSize ) : sum;
+	sum = size ? crc32( sum, data, (uInt) size ) : sum;
+	png_save_uint_32( crc, (png_uint_32) sum );
+	return png_buffer_append( buffer, header, 8 ) && png_buffer_append( buffer, prefix, prefixSize ) && 
+		png_buffer_append( buffer, data, size ) && png_buffer_append( buffer, crc, 4 );
+}
+
+
+static void png_write_buffer_data( png_structp writePtr, png_bytep data, png_size_t size ) 
+{
+	if (!png_buffer_append( (png_buffer *) png_get_io_ptr( writePtr ), data, size ))
+	{
+		png_error( writePtr, "Out of memory." );
+	}
+}
+
+
+static void png_flush_buffer_data( png_structp ) 
+{
+}
+
+
+struct png_memory_source
+{
+	const uint8_t * data;
+	size_t          size;
+	size_t          offset;
+};
+
+
+static void png_read_memory_data( png_structp readPtr, png_bytep data, png_size_t size ) 
+{
+	png_memory_source * source = (png_memory_source *) png_get_io_ptr( readPtr );
+	if (source->size - source->offset < size)
+	{
+		png_error( readPtr, "Unexpected end of data." );
+	}
+	memcpy( data, source->data + source->offset, size );
+	source->offset += size;
+}
+
+
+struct png_apng_frame
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t x;
+	uint32_t y;
+	uint16_t delayNum;
+	uint16_t delayDen;
+	uint8_t  dispose;
+	uint8_t  blend;
+	size_t   firstData;
+	size_t   dataCount;
+};
+
+
+struct png_apng_range
+{
+	size_t   offset;
+	uint32_t length;
+};
+
+
+struct png_apng_decode_job
+{
+	png_buffer             stream;
+	const png_apng_frame * frame;
+	png_image              image;
+	png_io_call *          load;		// only read while no frame is composited
+	uint32_t               sharing;		// frames decoding at once
+	png_image_options      options;
+	png_io_call            call;
+	uint8_t                result;
+};
+
+
+static void * png_apng_decode( void * arg )
+{
+	png_apng_decode_job * job = (png_apng_decode_job *) arg;
+	png_memory_source source = { job->stream.data, job->stream.size, 8 };
+	
+	// Frames decoding on other threads can't count into the load's call, so
+	// each gets an equal part of what is left of its memory budget.
+	png_io_call * call = NULL;
+	const png_image_options * options = png_call_options( job->load );
+	if (options && options->max_bytes)
+	{
+		const uint64_t share = (options->max_bytes - job->load->allocBytes) / job->sharing;
+		png_image_options_init( & job->options );
+		job->options.max_bytes = share ? share : 1;
+		job->options.zbuf_size = options->zbuf_size;
+		call = png_call_begin( & job->call, "frame", & job->options );
+	}
+	png_structp readPtr = png_create_reader( call );
+	if (!readPtr)
+	{
+		job->result = 0;
+		return NULL;
+	}
+	png_set_read_fn( readPtr, (png_voidp) & source, png_read_memory_data );
+	job->result = png_read( readPtr, & job->image, PNG_IMAGE_NONE, NULL, NULL );
+	return NULL;
+}
+
+
+struct png_apng_canvas
+{
+	png_io_call   * call;
+	png_animation * animation;
+	png_pixel     * canvas;
+	png_pixel     * saved;		// the canvas under a frame disposed to previous
+	uint32_t        flags;
+	size_t          next;
+};
+
+
+static uint8_t png_apng_composite( void * arg, void * context )
+{
+	png_apng_decode_job * job = (png_apng_decode_job *) arg;
+	png_apng_canvas * state = (png_apng_canvas *) context;
+	const png_apng_frame & frame = *job->frame;
+	png_animation * animation = state->animation;
+	const uint32_t w = animation->width;
+	const uint32_t h = animation->height;
+	
+	uint8_t result = job->result && job->image.width == frame.width && job->image.height == frame.height;
+	if (result && png_call_options( job->load ) && png_call_options( job->load )->max_bytes)
+	{
+		// Let the load's peak include the frame's decode.
+		png_count_alloc( job->load, job->call.allocPeak );
+		job->load->allocBytes -= job->call.allocPeak;
+	}
+	if (result)
+	{
+		const uint8_t dispose = (frame.dispose == PNG_DISPOSE_OP_PREVIOUS && state->next == 0) ? PNG_DISPOSE_OP_BACKGROUND : frame.dispose;
+		if (dispose == PNG_DISPOSE_OP_PREVIOUS)
+		{
+			memcpy( state->saved, state->canvas, png_image_bytes( w, h ) );
+		}
+		
+		const png_pixel * s = (const png_pixel *) job->image.data;
+		for (uint32_t y = 0; y < frame.height; y++, s += frame.width)
+		{
+			png_pixel * d = state->canvas + ((size_t) (frame.y + y) * w) + frame.x;
+			if (frame.blend == PNG_BLEND_OP_OVER)
+			{
+				png_blend_pixels( d, s, frame.width, 0 );
+			}
+			else
+			{
+				memcpy( d, s, (size_t) frame.width * 4 );
+			}
+		}
+		
+		png_frame * out = animation->frames + state->next;
+		if (png_call_charge( state->call, png_image_bytes( w, h ) ))
+		{
+			png_image_alloc( & out->image, w, h );
+		}
+		else
+		{
+			pngio_error( "Image is too large for the memory budget." );
+		}
+		out->delay_num = frame.delayNum;
+		out->delay_den = frame.delayDen;
+		result = out->image.data != NULL;
+		if (result)
+		{
+			const size_t bytesPerRow = (size_t) w * 4;
+			png_row_info rowInfo;
+			rowInfo.width = w;
+			for (uint32_t y = 0; y < h; y++)
+			{
+				const size_t outY = (state->flags & PNG_IMAGE_FLIP_VERTICAL) ? h - y - 1 : y;
+				png_bytep row = out->image.data + (bytesPerRow * outY);
+				memcpy( row, state->canvas + ((size_t) y * w), bytesPerRow );
+				if (state->flags & PNG_IMAGE_PREMULTIPLY_ALPHA)
+				{
+					png_read_premultiply_transform( NULL, & rowInfo, row );
+				}
+			}
+			animation->frame_count = (uint32_t) ++state->next;
+		}
+		
+		if (dispose == PNG_DISPOSE_OP_BACKGROUND)
+		{
+			for (uint32_t y = 0; y < frame.height; y++)
+			{
+				memset( state->canvas + ((size_t) (frame.y + y) * w) + frame.x, 0, (size_t) frame.width * 4 );
+			}
+		}
+		else if (dispose == PNG_DISPOSE_OP_PREVIOUS)
+		{
+			memcpy( state->canvas, state->saved, png_image_bytes( w, h ) );
+		}
+	}
+	
+	png_image_free( & job->image );
+	free( job->stream.data );
+	job->stream.data = NULL;
+	return result;
+}
+
+
+static uint8_t png_read_whole_file( FILE * file, png_buffer * buffer )
+{
+	uint8_t block[65536];
+	size_t size;
+	while ((size = fread( block, 1, sizeof block, file )) > 0)
+	{
+		if (!png_buffer_append( buffer, block, size ))
+		{
+			return 0;
+		}
+	}
+	return !ferror( file );
+}
+
+
+static uint8_t png_animation_decode( png_animation * animation, const png_buffer * file, uint32_t flags, png_io_call * call )
+{
+	const png_image_options * options = png_call_options( call );
+	static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	const uint8_t * data = file->data;
+	const size_t size = file->size;
+	if (size < 8 || memcmp( data, signature, 8 ) != 0)
+	{
+		pngio_error( "Not a valid PNG file." );
+		return 0;
+	}
+	
+	// Walk the chunks: remember IHDR, the chunks every frame shares, and
+	// each frame's control and data chunks.
+	const uint8_t * ihdr = NULL;
+	png_buffer shared = { NULL, 0, 0 };
+	png_apng_frame * frames = NULL;
+	png_apng_range * ranges = NULL;
+	size_t frameCount = 0, rangeCount = 0, rangeCapacity = 0;
+	uint32_t declaredFrames = 0, plays = 0;
+	uint8_t animated = 0, seenIDAT = 0, ok = 1, done = 0;
+	
+	for (size_t offset = 8; ok && !done; )
+	{
+		if (size - offset < 12)
+		{
+			ok = 0;
+			break;
+		}
+		const uint32_t length = png_get_uint_32( data + offset );
+		const uint8_t * name = data + offset + 4;
+		const uint8_t * body = data + offset + 8;
+		if (length > PNG_UINT_31_MAX || size - offset - 12 < length || 
+			png_get_uint_32( body + length ) != png_crc32( 0, name, length + 4 ))
+		{
+			ok = 0;
+			break;
+		}
+		
+		if (memcmp( name, "IHDR", 4 ) == 0)
+		{
+			ok = length == 13 && !ihdr;
+			ihdr = body;
+		}
+		else if (memcmp( name, "acTL", 4 ) == 0)
+		{
+			ok = length == 8 && !seenIDAT && !animated;
+			if (ok)
+			{
+				declaredFrames = png_get_uint_32( body );
+				plays = png_get_uint_32( body + 4 );
+				animated = declaredFrames > 0;
+				ok = declaredFrames <= size / 38;		// each needs an fcTL
+				frames = ok ? (png_apng_frame *) calloc( declaredFrames, sizeof (png_apng_frame) ) : NULL;
+				ok = ok && frames != NULL;
+			}
+		}
+		else if (memcmp( name, "fcTL", 4 ) == 0)
+		{
+			ok = animated && length == 26 && frameCount < declaredFrames;
+			if (ok)
+			{
+				png_apng_frame & frame = frames[ frameCount++ ];
+				frame.width = png_get_uint_32( body + 4 );
+				frame.height = png_get_uint_32( body + 8 );
+				frame.x = png_get_uint_32( body + 12 );
+				frame.y = png_get_uint_32( body + 16 );
+				frame.delayNum = png_get_uint_16( body + 20 );
+				frame.delayDen = png_get_uint_16( body + 22 );
+				frame.dispose = body[24];
+				frame.blend = body[25];
+				frame.firstData = rangeCount;
+				ok = frame.dispose <= PNG_DISPOSE_OP_PREVIOUS && frame.blend <= PNG_BLEND_OP_OVER;
+			}
+		}
+		else if (memcmp( name, "IDAT", 4 ) == 0 || memcmp( name, "fdAT", 4 ) == 0)
+		{
+			const uint8_t isIDAT = name[0] == 'I';
+			seenIDAT |= isIDAT;
+			
+			// IDAT before any fcTL is the default image, which is not a
+			// frame; still images are read as a single frame of it.
+			const uint8_t belongs = animated ? (frameCount > 0 && (isIDAT ? frameCount == 1 : 1)) : isIDAT;
+			if (belongs)
+			{
+				if (rangeCount == rangeCapacity)
+				{
+					rangeCapacity = rangeCapacity ? rangeCapacity * 2 : 64;
+					png_apng_range * grown = (png_apng_range *) realloc( ranges, rangeCapacity * sizeof (png_apng_range) );
+					ok = grown != NULL;
+					ranges = grown ? grown : ranges;
+				}
+				if (ok && !isIDAT)
+				{
+					ok = length >= 4;
+				}
+				if (ok)
+				{
+					ranges[ rangeCount ].offset = offset + 8 + (isIDAT ? 0 : 4);
+					ranges[ rangeCount ].length = length - (isIDAT ? 0 : 4);
+					rangeCount++;
+					if (animated)
+					{
+						frames[ frameCount - 1 ].dataCount++;
+					}
+				}
+			}
+		}
+		else if (memcmp( name, "IEND", 4 ) == 0)
+		{
+			done = 1;
+		}
+		else if (!seenIDAT)
+		{
+			ok = png_buffer_append( & shared, data + offset, length + 12 );
+		}
+		
+		offset += length + 12;
+	}
+	
+	if (ok && !animated)
+	{
+		frames = (png_apng_frame *) calloc( 1, sizeof (png_apng_frame) );
+		ok = frames && ihdr;
+		if (ok)
+		{
+			frames[0].width = png_get_uint_32( ihdr );
+			frames[0].height = png_get_uint_32( ihdr + 4 );
+			frames[0].dataCount = rangeCount;
+			frameCount = 1;
+		}
+	}
+	
+	const uint32_t w = ihdr ? png_get_uint_32( ihdr ) : 0;
+	const uint32_t h = ihdr ? png_get_uint_32( ihdr + 4 ) : 0;
+	ok = ok && ihdr && frameCount > 0 && w > 0 && h > 0 && w <= PNG_UINT_31_MAX && h <= PNG_UINT_31_MAX;
+	if (ok && options)
+	{
+		ok = (!options->max_width || w <= options->max_width) && (!options->max_height || h <= options->max_height);
+	}
+	for (size_t i = 0; ok && i < frameCount; i++)
+	{
+		const png_apng_frame & frame = frames[i];
+		ok = frame.dataCount > 0 && frame.width > 0 && frame.height > 0 &&
+			frame.x <= w && frame.width <= w - frame.x && frame.y <= h && frame.height <= h - frame.y;
+	}
+	
+	// The canvas and the copy of it kept for dispose to previous count
+	// against the budget, as each frame handed back does.
+	const uint64_t canvasBytes = ok ? png_image_bytes( w, h ) : 0;
+	const uint8_t fits = !ok || (canvasBytes <= SIZE_MAX && png_call_charge( call, canvasBytes ) && png_call_charge( call, canvasBytes ));
+	ok = ok && fits;
+	png_pixel * canvas = ok ? (png_pixel *) calloc( (size_t) canvasBytes, 1 ) : NULL;
+	png_pixel * saved = ok ? (png_pixel *) malloc( (size_t) canvasBytes ) : NULL;
+	png_frame * outFrames = ok ? (png_frame *) calloc( frameCount, sizeof (png_frame) ) : NULL;
+	png_apng_decode_job * jobs = ok ? (png_apng_decode_job *) calloc( frameCount, sizeof (png_apng_decode_job) ) : NULL;
+	ok = ok && canvas && saved && outFrames && jobs;
+	
+	// Rewrap each frame as a standalone PNG.
+	const uint32_t threads = png_thread_count( options );
+	for (size_t i = 0; ok && i < frameCount; i++)
+	{
+		const png_apng_frame & frame = frames[i];
+		png_apng_decode_job & job = jobs[i];
+		uint8_t header[13];
+		memcpy( header, ihdr, 13 );
+		png_save_uint_32( header, frame.width );
+		png_save_uint_32( header + 4, frame.height );
+		job.frame = & frame;
+		job.load = call;
+		job.sharing = threads < frameCount ? threads : (uint32_t) frameCount;
+		png_image_init( & job.image );
+		ok = png_buffer_append( & job.stream, signature, 8 ) && 
+			png_buffer_append_chunk( & job.stream, "IHDR", header, 13, NULL, 0 ) &&
+			png_buffer_append( & job.stream, shared.data, shared.size );
+		for (size_t r = frame.firstData; ok && r < frame.firstData + frame.dataCount; r++)
+		{
+			ok = png_buffer_append_chunk( & job.stream, "IDAT", data + ranges[r].offset, ranges[r].length, NULL, 0 );
+		}
+		ok = ok && png_buffer_append_chunk( & job.stream, "IEND", NULL, 0, NULL, 0 );
+	}
+	
+	if (ok)
+	{
+		#ifdef PNG_APPLE_MODE_SUPPORTED 
+		png_set_apple_mode( 0 );
+		#endif
+		
+		animation->width = w;
+		animation->height = h;
+		animation->plays = plays;
+		animation->frames = outFrames;
+		animation->frame_count = 0;
+		outFrames = NULL;
+		png_apng_canvas state = { call, animation, canvas, saved, flags, 0 };
+		ok = png_run_batched( jobs, sizeof (png_apng_decode_job), frameCount, threads, png_apng_decode, png_apng_composite, & state );
+	}
+	else if (fits)
+	{
+		pngio_error( "Not a valid animated PNG file." );
+	}
+	else
+	{
+		pngio_error( "Image is too large for the memory budget." );
+	}
+	
+	for (size_t i = 0; jobs && i < frameCount; i++)
+	{
+		png_image_free( & jobs[i].image );
+		free( jobs[i].stream.data );
+	}
+	free( jobs );
+	free( outFrames );
+	free( canvas );
+	free( saved );
+	free( ranges );
+	free( frames );
+	free( shared.data );
+	return ok;
+}
+
+
+struct png_apng_encode_job
+{
+	png_image  image;
+	uint32_t   flags;
+	uint32_t   x;
+	uint32_t   y;
+	png_buffer stream;
+	uint8_t    result;
+};
+
+
+static void * png_apng_encode( void * arg )
+{
+	png_apng_encode_job * job = (png_apng_encode_job *) arg;
+	png_structp writePtr = png_create_writer( NULL );
+	if (!writePtr)
+	{
+		job->result = 0;
+		return NULL;
+	}
+	png_set_write_fn( writePtr, (png_voidp) & job->stream, png_write_buffer_data, png_flush_buffer_data );
+	job->result = png_write( writePtr, & job->image, NULL, job->flags, 0 );
+	return NULL;
+}
+
+
+struct png_apng_writer
+{
+	png_buffer                  * output;
+	const png_animation         * animation;
+	uint32_t                      sequence;
+	uint32_t                      frame;
+};
+
+
+static uint8_t png_apng_rewrap( void * arg, void * context )
+{
+	png_apng_encode_job * job = (png_apng_encode_job *) arg;
+	png_apng_writer * writer = (png_apng_writer *) context;
+	png_buffer * out = writer->output;
+	const png_frame & frame = writer->animation->frames[ writer->frame ];
+	const uint8_t first = writer->frame == 0;
+	uint8_t ok = job->result;
+	
+	png_image_free( & job->image );
+	const uint8_t * data = job->stream.data;
+	const size_t size = job->stream.size;
+	for (size_t offset = 8; ok && size - offset >= 12; )
+	{
+		const uint32_t length = png_get_uint_32( data + offset );
+		const uint8_t * name = data + offset + 4;
+		if (memcmp( name, "IHDR", 4 ) == 0)
+		{
+			// The first frame's header, resized to the canvas, and the chunks
+			// after it lead the file, followed by acTL and the first fcTL.
+			if (first)
+			{
+				uint8_t header[13], actl[8];
+				memcpy( header, name + 4, 13 );
+				png_save_uint_32( header, writer->animation->width );
+				png_save_uint_32( header + 4, writer->animation->height );
+				png_save_uint_32( actl, writer->animation->frame_count );
+				png_save_uint_32( actl + 4, writer->animation->plays );
+				ok = png_buffer_append_chunk( out, "IHDR", header, 13, NULL, 0 ) &&
+					png_buffer_append_chunk( out, "acTL", actl, 8, NULL, 0 );
+			}
+			
+			uint8_t fctl[26];
+			png_save_uint_32( fctl, writer->sequence++ );
+			memcpy( fctl + 4, name + 4, 8 );
+			png_save_uint_32( fctl + 12, job->x );
+			png_save_uint_32( fctl + 16, job->y );
+			png_save_uint_16( fctl + 20, frame.delay_num );
+			png_save_uint_16( fctl + 22, frame.delay_den );
+			fctl[24] = PNG_DISPOSE_OP_NONE;
+			fctl[25] = PNG_BLEND_OP_SOURCE;
+			
+			// Ancillary chunks for the first frame go before its fcTL.
+			size_t next = offset + length + 12;
+			while (first && ok && size - next >= 12 && memcmp( data + next + 4, "IDAT", 4 ) != 0)
+			{
+				const uint32_t chunkLength = png_get_uint_32( data + next );
+				ok = png_buffer_append( out, data + next, chunkLength + 12 );
+				next += chunkLength + 12;
+			}
+			ok = ok && png_buffer_append_chunk( out, "fcTL", fctl, 26, NULL, 0 );
+			offset = next;
+			continue;
+		}
+		if (memcmp( name, "IDAT", 4 ) == 0)
+		{
+			if (first)
+			{
+				ok = png_buffer_append( out, data + offset, length + 12 );
+			}
+			else
+			{
+				uint8_t sequence[4];
+				png_save_uint_32( sequence, writer->sequence++ );
+				ok = png_buffer_append_chunk( out, "fdAT", sequence, 4, name + 4, length );
+			}
+		}
+		offset += length + 12;
+	}
+	
+	free( job->stream.data );
+	job->stream.data = NULL;
+	writer->frame++;
+	return ok;
+}
+
+
+// The smallest rectangle outside which two canvases agree, or a single
+// pixel at the origin when they are identical.
+static void png_changed_rect( const png_image * a, const png_image * b, uint32_t * x, uint32_t * y, uint32_t * w, uint32_t * h )
+{
+	const uint32_t width = a->width, height = a->height;
+	const png_pixel * pa = (const png_pixel *) a->data;
+	const png_pixel * pb = (const png_pixel *) b->data;
+	uint32_t minX = width, minY = height, maxX = 0, maxY = 0;
+	for (uint32_t j = 0; j < height; j++)
+	{
+		const size_t row = (size_t) j * width;
+		if (memcmp( pa + row, pb + row, (size_t) width * 4 ) == 0)
+		{
+			continue;
+		}
+		for (uint32_t i = 0; i < width; i++)
+		{
+			if (memcmp( pa + row + i, pb + row + i, 4 ) != 0)
+			{
+				minX = i < minX ? i : minX;
+				maxX = i > maxX ? i : maxX;
+			}
+		}
+		minY = j < minY ? j : minY;
+		maxY = j;
+	}
+	if (minY == height)
+	{
+		*x = *y = 0;
+		*w = *h = 1;
+		return;
+	}
+	*x = minX;
+	*y = minY;
+	*w = maxX - minX + 1;
+	*h = maxY - minY + 1;
+}
+
+
+static uint8_t png_animation_encode( const png_animation * animation, png_buffer * output, uint32_t flags, const png_image_options * options )
+{
+	const uint32_t w = animation->width;
+	const uint32_t h = animation->height;
+	const size_t count = animation->frame_count;
+	if (count == 0 || w == 0 || h == 0)
+	{
+		return 0;
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		const png_image & image = animation->frames[i].image;
+		if (image.width != w || image.height != h || !image.data)
+		{
+			pngio_error( "Animation frames must all be the size of the animation." );
+			return 0;
+		}
+	}
+	
+	png_apng_encode_job * jobs = (png_apng_encode_job *) calloc( count, sizeof (png_apng_encode_job) );
+	if (!jobs)
+	{
+		return 0;
+	}
+	
+	// Frames are stored whole or, when cropping, as the part that changed
+	// since the previous frame; either way dispose none, blend source.
+	uint8_t ok = 1;
+	for (size_t i = 0; ok && i < count; i++)
+	{
+		png_apng_encode_job & job = jobs[i];
+		const png_image & image = animation->frames[i].image;
+		uint32_t x = 0, y = 0, cw = w, ch = h;
+		if (i > 0 && (flags & PNG_IMAGE_CROP_FRAMES))
+		{
+			png_changed_rect( & image, & animation->frames[i - 1].image, & x, & y, & cw, & ch );
+		}
+		
+		png_image_init( & job.image );
+		png_image_alloc( & job.image, cw, ch );
+		ok = job.image.data != NULL;
+		for (uint32_t j = 0; ok && j < ch; j++)
+		{
+			memcpy( job.image.data + ((size_t) j * cw * 4), image.data + ((((size_t) (y + j) * w) + x) * 4), (size_t) cw * 4 );
+		}
+		job.flags = flags & PNG_IMAGE_FLIP_VERTICAL;
+		job.x = x;
+		job.y = (flags & PNG_IMAGE_FLIP_VERTICAL) ? h - y - ch : y;
+	}
+	
+	if (ok)
+	{
+		#ifdef PNG_APPLE_MODE_SUPPORTED
+		png_set_apple_mode( 0 );
+		#endif
+		
+		static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+		png_apng_writer writer = { output, animation, 0, 0 };
+		ok = png_buffer_append( output, signature, 8 ) &&
+			png_run_batched( jobs, sizeof (png_apng_encode_job), count, png_thread_count( options ), png_apng_encode, png_apng_rewrap, & writer ) &&
+			png_buffer_append_chunk( output, "IEND", NULL, 0, NULL, 0 );
+	}
+	
+	for (size_t i = 0; i < count; i++)
+	{
+		png_image_free( & jobs[i].image );
+		free( jobs[i].stream.data );
+	}
+	free( jobs );
+	return ok;
+}
+
+
+void png_animation_init( png_animation * animation )
+{
+	animation->width = 0;
+	animation->height = 0;
+	animation->plays = 0;
+	animation->frame_count = 0;
+	animation->frames = NULL;
+}
+
+
+void png_animation_free( png_animation * animation )
+{
+	for (size_t i = 0; animation->frames && i < animation->frame_count; i++)
+	{
+		png_image_free( & animation->frames[i].image );
+	}
+	free( animation->frames );
+	png_animation_init( animation );
+}
+
+
+uint8_t png_animation_load( png_animation * animation, FILE * file, uint32_t flags, const png_image_options * options )
+{
+	png_animation_free( animation );
+	png_buffer contents = { NULL, 0, 0 };
+	png_io_call storage;
+	png_io_call * call = png_call_begin( & storage, "load", options );
+	uint8_t result = png_read_whole_file( file, & contents ) && png_animation_decode( animation, & contents, flags, call );
+	free( contents.data );
+	if (!result)
+	{
+		png_animation_free( animation );
+	}
+	png_call_end( call, result );
+	return result;
+}
+
+
+uint8_t png_animation_save( const png_animation * animation, FILE * file, uint32_t flags, const png_image_options * options )
+{
+	png_buffer contents = { NULL, 0, 0 };
+	uint8_t result = png_animation_encode( animation, & contents, flags, options ) &&
+		fwrite( contents.data, contents.size, 1, file ) == 1;
+	free( contents.data );
+	return result;
+}
+
+
+
+// Recompression. The view is read once into each representation its pixels
+// fit exactly, then a list of trials, each a representation with filters and
+// zlib settings, is worked through by a pool of threads. Trials encode into
+// memory, and their write callback gives up on them once they are larger
+// than the best finished so far or the time is up. Ties go to the earlier
+// trial, so without a budget the result doesn't depend on the threads.
+
+#define PNG_OPTIMIZE_MAX_REPS		3
+#define PNG_OPTIMIZE_MAX_TRIALS		(PNG_OPTIMIZE_MAX_REPS * 24)
+
+struct png_optimize_rep
+{
+	uint8_t   colorType;
+	uint8_t   bitDepth;
+	size_t    rowBytes;
+	uint8_t * rows;				// in file order
+	uint32_t  paletteSize;
+	uint32_t  alphaSize;		// palette entries that aren't opaque, which come first
+	png_color palette[256];
+	png_byte  alpha[256];
+};
+
+struct png_optimize_trial
+{
+	uint8_t rep;
+	uint8_t filters;
+	int8_t  level;
+	int8_t  strategy;
+	int8_t  windowBits;
+};
+
+struct png_optimizer
+{
+	pthread_mutex_t            lock;
+	uint32_t                   width;
+	uint32_t                   height;
+	const png_optimize_rep   * reps;
+	const png_optimize_trial * trials;
+	size_t                     trialCount;
+	size_t                     next;
+	png_stats_uint             deadline;	// 0 for none
+	png_buffer                 best;
+	size_t                     bestIndex;
+	uint32_t                   finished;
+	uint32_t                   abandoned;
+};
+
+struct png_optimize_output
+{
+	png_optimizer * optimizer;
+	size_t          index;
+	png_buffer      buffer;
+};
+
+
+static inline void png_optimize_pack( uint8_t * row, uint32_t x, uint32_t value, uint32_t depth )
+{
+	const size_t bit = (size_t) x * depth;
+	row[bit >> 3] |= (uint8_t) (value << (8 - depth - (bit & 7)));
+}
+
+
+// The palette slot of a color, adding it when there is room; -1 when the
+// palette is full and the color isn't in it.
+static int32_t png_optimize_lookup( int16_t * slots, png_pixel * colors, uint32_t * count, png_pixel color )
+{
+	uint32_t key;
+	memcpy( & key, & color, 4 );
+	for (uint32_t h = (key * 2654435761u) >> 22;; h = (h + 1) & 1023)
+	{
+		if (slots[h] < 0)
+		{
+			if (*count == 256)
+			{
+				return -1;
+			}
+			colors[*count] = color;
+			slots[h] = (int16_t) *count;
+			return (int32_t) (*count)++;
+		}
+		if (memcmp( & colors[slots[h]], & color, 4 ) == 0)
+		{
+			return slots[h];
+		}
+	}
+}
+
+
+// Fills reps, most compact first, from the view's pixels: gray (with alpha
+// unless opaque) at the lowest bit depth that holds every level, a palette
+// of up to 256 colors, and RGB or RGBA, which always fits.
+static uint32_t png_optimize_analyze( const png_image_view * view, uint32_t flags, png_optimize_rep * reps )
+{
+	const uint32_t w = view->width;
+	const uint32_t h = view->height;
+	png_pixel * pixels = (png_pixel *) malloc( (size_t) w * h * 4 );
+	if (!pixels)
+	{
+		return 0;
+	}
+	for (uint32_t y = 0; y < h; y++)
+	{
+		const png_pixel * s = (const png_pixel *) (view->data + (view->stride * ((flags & PNG_IMAGE_FLIP_VERTICAL) ? h - 1 - y : y)));
+		if (view->format == PNG_VIEW_BGRA)
+		{
+			png_copy_swapped( pixels + ((size_t) y * w), s, w );
+		}
+		else
+		{
+			memcpy( pixels + ((size_t) y * w), s, (size_t) w * 4 );
+		}
+	}
+	
+	uint8_t opaque = 1;
+	uint8_t gray = 1;
+	uint32_t grayDepth = 1;
+	int16_t slots[1024];
+	png_pixel colors[256];
+	uint32_t colorCount = 0;
+	uint8_t paletted = 1;
+	memset( slots, 0xff, sizeof slots );
+	for (size_t i = 0; i < (size_t) w * h; i++)
+	{
+		const png_pixel p = pixels[i];
+		opaque &= p.a == 255;
+		gray &= p.r == p.g && p.g == p.b;
+		while (gray && grayDepth < 8 && p.r % (255 / ((1u << grayDepth) - 1)) != 0)
+		{
+			grayDepth *= 2;
+		}
+		paletted = paletted && png_optimize_lookup( slots, colors, & colorCount, p ) >= 0;
+	}
+	
+	uint32_t count = 0;
+	if (gray)
+	{
+		png_optimize_rep & rep = reps[count++];
+		rep.colorType = opaque ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_GRAY_ALPHA;
+		rep.bitDepth = (uint8_t) (opaque ? grayDepth : 8);
+	}
+	if (paletted)
+	{
+		png_optimize_rep & rep = reps[count++];
+		rep.colorType = PNG_COLOR_TYPE_PALETTE;
+		rep.bitDepth = colorCount <= 2 ? 1 : colorCount <= 4 ? 2 : colorCount <= 16 ? 4 : 8;
+	}
+	png_optimize_rep & truecolor = reps[count++];
+	truecolor.colorType = opaque ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA;
+	truecolor.bitDepth = 8;
+	
+	// The palette in its file order: translucent colors first, so tRNS can
+	// stop after them.
+	uint8_t order[256];
+	if (paletted)
+	{
+		png_optimize_rep & rep = reps[count - 2];
+		rep.paletteSize = colorCount;
+		uint32_t next = 0;
+		for (uint32_t pass = 0; pass < 2; pass++)
+		{
+			for (uint32_t i = 0; i < colorCount; i++)
+			{
+				if ((colors[i].a != 255) == (pass == 0))
+				{
+					order[i] = (uint8_t) next++;
+				}
+			}
+			rep.alphaSize = pass == 0 ? next : rep.alphaSize;
+		}
+		for (uint32_t i = 0; i < colorCount; i++)
+		{
+			const png_color c = { colors[i].r, colors[i].g, colors[i].b };
+			rep.palette[order[i]] = c;
+			rep.alpha[order[i]] = colors[i].a;
+		}
+	}
+	
+	uint8_t ok = 1;
+	for (uint32_t r = 0; r < count; r++)
+	{
+		png_optimize_rep & rep = reps[r];
+		const uint32_t channels = rep.colorType == PNG_COLOR_TYPE_RGB_ALPHA ? 4 : rep.colorType == PNG_COLOR_TYPE_RGB ? 3 : rep.colorType == PNG_COLOR_TYPE_GRAY_ALPHA ? 2 : 1;
+		rep.rowBytes = (((size_t) w * channels * rep.bitDepth) + 7) / 8;
+		rep.rows = ok ? (uint8_t *) calloc( h, rep.rowBytes ) : NULL;
+		ok = rep.rows != NULL;
+		for (uint32_t y = 0; ok && y < h; y++)
+		{
+			const png_pixel * s = pixels + ((size_t) y * w);
+			uint8_t * d = rep.rows + (rep.rowBytes * y);
+			switch (rep.colorType)
+			{
+				case PNG_COLOR_TYPE_GRAY:
+					for (uint32_t x = 0; x < w; x++)
+					{
+						png_optimize_pack( d, x, (uint32_t) s[x].r >> (8 - rep.bitDepth), rep.bitDepth );
+					}
+					break;
+				case PNG_COLOR_TYPE_GRAY_ALPHA:
+					for (uint32_t x = 0; x < w; x++)
+					{
+						d[2 * x] = s[x].r;
+						d[(2 * x) + 1] = s[x].a;
+					}
+					break;
+				case PNG_COLOR_TYPE_PALETTE:
+					for (uint32_t x = 0; x < w; x++)
+					{
+						png_optimize_pack( d, x, order[png_optimize_lookup( slots, colors, & colorCount, s[x] )], rep.bitDepth );
+					}
+					break;
+				case PNG_COLOR_TYPE_RGB:
+					for (uint32_t x = 0; x < w; x++)
+					{
+						memcpy( d + (3 * x), s + x, 3 );
+					}
+					break;
+				default:
+					memcpy( d, s, (size_t) w * 4 );
+					break;
+			}
+		}
+	}
+	free( pixels );
+	
+	if (!ok)
+	{
+		for (uint32_t r = 0; r < count; r++)
+		{
+			free( reps[r].rows );
+		}
+		return 0;
+	}
+	return count;
+}
+
+
+// The trials in the order they are taken, cheapest guesses first: for every
+// representation the filter most likely to win (None for palettes and bit
+// depths below 8, the heuristic otherwise) at level 9, then the other
+// filters, zlib's filtered and run length strategies, lower levels and
+// smaller windows.
+static size_t png_optimize_plan( const png_optimize_rep * reps, uint32_t repCount, png_optimize_trial * trials )
+{
+	static const uint8_t filters[2][6] = 
+	{
+		{ PNG_ALL_FILTERS, PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH },
+		{ PNG_FILTER_NONE, PNG_ALL_FILTERS, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH },
+	};
+	static const struct { uint8_t first, last; int8_t level, strategy, windowBits; } phases[] = 
+	{
+		{ 0, 1, 9, Z_DEFAULT_STRATEGY, 15 },
+		{ 1, 6, 9, Z_DEFAULT_STRATEGY, 15 },
+		{ 0, 6, 9, Z_FILTERED, 15 },
+		{ 0, 6, 9, Z_RLE, 15 },
+		{ 0, 2, 8, Z_DEFAULT_STRATEGY, 15 },
+		{ 0, 2, 6, Z_DEFAULT_STRATEGY, 15 },
+		{ 0, 1, 9, Z_DEFAULT_STRATEGY, 14 },
+		{ 0, 1, 9, Z_DEFAULT_STRATEGY, 12 },
+	};
+	
+	size_t count = 0;
+	for (size_t p = 0; p < sizeof phases / sizeof phases[0]; p++)
+	{
+		for (uint32_t r = 0; r < repCount; r++)
+		{
+			const uint8_t packed = reps[r].colorType == PNG_COLOR_TYPE_PALETTE || reps[r].bitDepth < 8;
+			for (uint32_t f = phases[p].first; f < phases[p].last; f++)
+			{
+				png_optimize_trial & trial = trials[count++];
+				trial.rep = (uint8_t) r;
+				trial.filters = filters[packed][f];
+				trial.level = phases[p].level;
+				trial.strategy = phases[p].strategy;
+				trial.windowBits = phases[p].windowBits;
+			}
+		}
+	}
+	return count;
+}
+
+
+// Errors only ever end a trial, so they go unreported.
+static void png_optimize_error( png_structp writePtr, png_const_charp )
+{
+	png_longjmp( writePtr, 1 );
+}
+
+
+static void png_optimize_warning( png_structp, png_const_charp )
+{
+}
+
+
+static void png_optimize_write_data( png_structp writePtr, png_bytep data, png_size_t size )
+{
+	png_optimize_output * out = (png_optimize_output *) png_get_io_ptr( writePtr );
+	png_optimizer * optimizer = out->optimizer;
+	if (out->index > 0)
+	{
+		pthread_mutex_lock( & optimizer->lock );
+		const uint8_t behind = optimizer->best.data && out->buffer.size + size > optimizer->best.size;
+		pthread_mutex_unlock( & optimizer->lock );
+		if (behind || (optimizer->deadline && png_stats_clock() > optimizer->deadline))
+		{
+			png_error( writePtr, "Abandoned" );
+		}
+	}
+	if (!png_buffer_append( & out->buffer, data, size ))
+	{
+		png_error( writePtr, "Out of memory." );
+	}
+}
+
+
+static uint8_t png_optimize_encode( const png_optimizer * optimizer, png_optimize_output * out )
+{
+	const png_optimize_trial & trial = optimizer->trials[out->index];
+	const png_optimize_rep & rep = optimizer->reps[trial.rep];
+	png_structp writePtr = png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, png_optimize_error, png_optimize_warning );
+	if (!writePtr)
+	{
+		return 0;
+	}
+	png_infop infoPtr = png_create_info_struct( writePtr );
+	if (!infoPtr || setjmp( png_jmpbuf( writePtr ) ))
+	{
+		png_destroy_write_struct( & writePtr, infoPtr ? & infoPtr : NULL );
+		return 0;
+	}
+	
+	png_set_write_fn( writePtr, out, png_optimize_write_data, png_flush_buffer_data );
+	png_set_IHDR( writePtr, infoPtr, optimizer->width, optimizer->height, rep.bitDepth, rep.colorType, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT );
+	if (rep.colorType == PNG_COLOR_TYPE_PALETTE)
+	{
+		png_set_PLTE( writePtr, infoPtr, rep.palette, (int) rep.paletteSize );
+		if (rep.alphaSize)
+		{
+			png_set_tRNS( writePtr, infoPtr, rep.alpha, (int) rep.alphaSize, NULL );
+		}
+	}
+	png_set_sRGB( writePtr, infoPtr, 0 );
+	png_set_filter( writePtr, 0, trial.filters );
+	png_set_compression_level( writePtr, trial.level );
+	png_set_compression_strategy( writePtr, trial.strategy );
+	png_set_compression_window_bits( writePtr, trial.windowBits );
+	png_set_compression_mem_level( writePtr, 9 );
+	png_write_info( writePtr, infoPtr );
+	for (uint32_t y = 0; y < optimizer->height; y++)
+	{
+		png_write_row( writePtr, rep.rows + (rep.rowBytes * y) );
+	}
+	png_write_end( writePtr, NULL );
+	png_destroy_write_struct( & writePtr, & infoPtr );
+	return 1;
+}
+
+
+static void * png_optimize_worker( void * arg )
+{
+	png_optimizer * optimizer = (png_optimizer *) arg;
+	for (;;)
+	{
+		pthread_mutex_lock( & optimizer->lock );
+		const size_t index = optimizer->next++;
+		pthread_mutex_unlock( & optimizer->lock );
+		if (index >= optimizer->trialCount || (index > 0 && optimizer->deadline && png_stats_clock() > optimizer->deadline))
+		{
+			return NULL;
+		}
+		
+		png_optimize_output out = { optimizer, index, { NULL, 0, 0 } };
+		const uint8_t ok = png_optimize_encode( optimizer, & out );
+		pthread_mutex_lock( & optimizer->lock );
+		png_buffer & best = optimizer->best;
+		if (ok && (!best.data || out.buffer.size < best.size || (out.buffer.size == best.size && index < optimizer->bestIndex)))
+		{
+			const png_buffer previous = best;
+			best = out.buffer;
+			out.buffer = previous;
+			optimizer->bestIndex = index;
+		}
+		ok ? optimizer->finished++ : optimizer->abandoned++;
+		pthread_mutex_unlock( & optimizer->lock );
+		free( out.buffer.data );
+	}
+}
+
+
+uint8_t png_image_optimize( const png_image_view * view, FILE * file, uint32_t flags, uint32_t budget_ms, const png_image_options * options, png_optimize_result * result )
+{
+	if (!view->data || view->width == 0 || view->height == 0)
+	{
+		pngio_error( "Nothing to optimize." );
+		return 0;
+	}
+	
+	const png_stats_uint start = png_stats_clock();
+	png_optimize_rep reps[PNG_OPTIMIZE_MAX_REPS];
+	const uint32_t repCount = png_optimize_analyze( view, flags, reps );
+	if (repCount == 0)
+	{
+		pngio_error( "Out of memory." );
+		return 0;
+	}
+	png_optimize_trial trials[PNG_OPTIMIZE_MAX_TRIALS];
+	
+	png_optimizer optimizer;
+	pthread_mutex_init( & optimizer.lock, NULL );
+	optimizer.width = view->width;
+	optimizer.height = view->height;
+	optimizer.reps = reps;
+	optimizer.trials = trials;
+	optimizer.trialCount = png_optimize_plan( reps, repCount, trials );
+	optimizer.next = 0;
+	optimizer.deadline = budget_ms ? start + ((png_stats_uint) budget_ms * 1000000) : 0;
+	optimizer.best.data = NULL;
+	optimizer.best.size = 0;
+	optimizer.best.capacity = 0;
+	optimizer.bestIndex = 0;
+	optimizer.finished = 0;
+	optimizer.abandoned = 0;
+	
+	// Worker threads start out of Apple mode; this one joins them.
+	#ifdef PNG_APPLE_MODE_SUPPORTED
+	const png_byte apple = png_get_apple_mode();
+	png_set_apple_mode( 0 );
+	#endif
+	uint32_t threads = png_thread_count( options );
+	threads = threads < optimizer.trialCount ? threads : (uint32_t) optimizer.trialCount;
+	pthread_t * workers = (pthread_t *) malloc( sizeof (pthread_t) * threads );
+	uint32_t started = 0;
+	for (; workers && started + 1 < threads; started++)
+	{
+		if (pthread_create( & workers[started], NULL, png_optimize_worker, & optimizer ) != 0)
+		{
+			break;
+		}
+	}
+	png_optimize_worker( & optimizer );
+	for (uint32_t i = 0; i < started; i++)
+	{
+		pthread_join( workers[i], NULL );
+	}
+	free( workers );
+	#ifdef PNG_APPLE_MODE_SUPPORTED
+	png_set_apple_mode( apple );
+	#endif
+	pthread_mutex_destroy( & optimizer.lock );
+	
+	uint8_t ok = optimizer.best.data != NULL;
+	if (ok && result)
+	{
+		const png_optimize_trial & trial = trials[optimizer.bestIndex];
+		result->size = optimizer.best.size;
+		result->trials = optimizer.finished;
+		result->abandoned = optimizer.abandoned;
+		result->color_type = reps[trial.rep].colorType;
+		result->bit_depth = reps[trial.rep].bitDepth;
+		result->filters = trial.filters;
+		result->level = trial.level;
+		result->strategy = trial.strategy;
+		result->window_bits = trial.windowBits;
+	}
+	if (ok && fwrite( optimizer.best.data, optimizer.best.size, 1, file ) != 1)
+	{
+		pngio_error( "An error occured while writing the PNG file." );
+		ok = 0;
+	}
+	else if (!ok)
+	{
+		pngio_error( "An error occured while writing the PNG file." );
+	}
+	
+	free( optimizer.best.data );
+	for (uint32_t r = 0; r < repCount; r++)
+	{
+		free( reps[r].rows );
+	}
+	return ok;
+}
+
+
+uint8_t png_image_optimize_path( const png_image_view * view, const char * path, uint32_t flags, uint32_t budget_ms, const png_image_options * options, png_optimize_result * result )
+{
+	FILE * ofile = fopen( path, "w" );
+	if (!ofile) 
+	{
+		pngio_error( "Could not open file." );
+		return 0;
+	}
+	uint8_t ok = png_image_optimize( view, ofile, flags, budget_ms, options, result );
+	ok = fclose( ofile ) == 0 && ok;
+	return ok;
+}
+
+
+// Finds the restart points of a PNG held in memory, from a well formed rsPT
+// chunk whose offsets fit its IDAT data, and gathers that data into stream.
+// bands gets the band start rows followed by their offsets.
+static uint8_t png_find_restarts( const uint8_t * data, size_t size, png_restarts * restarts, png_buffer * stream, uint32_t ** bands, png_io_call * call )
+{
+	const uint8_t * index = NULL;
+	uint32_t entries = 0, height = 0;
+	size_t idatSize = 0;
+	for (size_t offset = 8; size - offset >= 12; )
+	{
+		const uint32_t length = png_get_uint_32( data + offset );
+		const uint8_t * name = data + offset + 4;
+		const uint8_t * body = data + offset + 8;
+		if (length > PNG_UINT_31_MAX || size - offset - 12 < length)
+		{
+			return 0;
+		}
+		if (memcmp( name, "IHDR", 4 ) == 0 && length == 13)
+		{
+			height = png_get_uint_32( body + 4 );
+		}
+		else if (memcmp( name, "IDAT", 4 ) == 0)
+		{
+			idatSize += length;
+		}
+		else if (memcmp( name, png_restart_chunk, 4 ) == 0 && length % 8 == 0 && length > 0 &&
+			png_get_uint_32( body + length ) == png_crc32( 0, name, length + 4 ))
+		{
+			index = body;
+			entries = length / 8;
+		}
+		else if (memcmp( name, "IEND", 4 ) == 0)
+		{
+			break;
+		}
+		offset += (size_t) length + 12;
+	}
+	if (!index || idatSize == 0)
+	{
+		return 0;
+	}
+	
+	uint32_t * b = (uint32_t *) malloc( sizeof (uint32_t) * 2 * (entries + 1) );
+	if (!b)
+	{
+		return 0;
+	}
+	uint32_t * rows = b;
+	uint32_t * offsets = b + entries + 1;
+	rows[0] = 0;
+	offsets[0] = 0;
+	for (uint32_t i = 1; i <= entries; i++)
+	{
+		rows[i] = png_get_uint_32( index + (8 * (i - 1)) );
+		offsets[i] = png_get_uint_32( index + (8 * (i - 1)) + 4 );
+		if (rows[i] <= rows[i - 1] || rows[i] >= height || offsets[i] <= offsets[i - 1] || offsets[i] >= idatSize)
+		{
+			free( b );
+			return 0;
+		}
+	}
+	
+	// The gathered data counts against the budget until png_load_memory is
+	// done with it; without room the image is decoded sequentially instead.
+	const uint8_t fits = png_call_charge( call, idatSize );
+	stream->data = fits ? (uint8_t *) malloc( idatSize ) : NULL;
+	stream->capacity = stream->data ? idatSize : 0;
+	if (!stream->data)
+	{
+		png_call_release( call, fits ? idatSize : 0 );
+		free( b );
+		return 0;
+	}
+	
+	// IDAT CRCs are checked here, as libpng never sees the data.
+	for (size_t offset = 8; size - offset >= 12; )
+	{
+		const uint32_t length = png_get_uint_32( data + offset );
+		const uint8_t * name = data + offset + 4;
+		if (memcmp( name, "IDAT", 4 ) == 0)
+		{
+			if (png_get_uint_32( name + 4 + length ) != png_crc32( 0, name, length + 4 ) ||
+				!png_buffer_append( stream, name + 4, length ))
+			{
+				free( b );
+				return 0;
+			}
+		}
+		else if (memcmp( name, "IEND", 4 ) == 0)
+		{
+			break;
+		}
+		offset += (size_t) length + 12;
+	}
+	
+	restarts->stream = stream->data;
+	restarts->size = stream->size;
+	restarts->count = entries + 1;
+	restarts->rows = rows;
+	restarts->offsets = offsets;
+	* bands = b;
+	return 1;
+}
+
+
+static uint8_t png_load_memory( png_image * image, const uint8_t * data, size_t size, uint32_t flags, png_io_call * call )
+{
+	if (size < 16 || png_sig_cmp( (png_bytep) data, 0, 8 ) != 0)
+	{
+		pngio_error( "Not a valid PNG file." );
+		return 0;
+	}
+	
+	#ifdef PNG_APPLE_MODE_SUPPORTED 
+	png_set_apple_mode( memcmp( data + 12, "CgBI", 4 ) == 0 );
+	#endif
+	
+	png_structp readPtr = png_create_reader( call );
+	if (!readPtr) 
+	{
+		pngio_error( "Couldn't initialize PNG read struct." );
+		return 0;
+	}
+	
+	png_memory_source source = { data, size, 8 };
+	png_set_read_fn( readPtr, (png_voidp) & source, png_read_memory_data );
+	
+	png_restarts restarts;
+	png_buffer stream = { NULL, 0, 0 };
+	uint32_t * bands = NULL;
+	const uint8_t indexed = (flags & PNG_IMAGE_PARALLEL) && png_find_restarts( data, size, & restarts, & stream, & bands, call );
+	restarts.threads = png_thread_count( png_call_options( call ) );
+	
+	const uint8_t result = png_read( readPtr, image, flags, NULL, indexed ? & restarts : NULL );
+	free( bands );
+	free( stream.data );
+	png_call_release( call, stream.capacity );
+	return result;
+}
+
+
+// Walks the chunk headers of a file, seeking past their data, for an rsPT
+// chunk, and leaves the file where the format check expects it. size gets
+// the length of the file when there is one.
+static uint8_t png_file_has_restarts( FILE * file, uint64_t * size )
+{
+	uint8_t header[8];
+	uint8_t found = 0;
+	if (fread( header, 8, 1, file ) == 1 && png_sig_cmp( header, 0, 8 ) == 0)
+	{
+		while (!found && fread( header, 8, 1, file ) == 1)
+		{
+			const uint32_t length = png_get_uint_32( header );
+			if (length > PNG_UINT_31_MAX || memcmp( header + 4, "IEND", 4 ) == 0)
+			{
+				break;
+			}
+			found = memcmp( header + 4, png_restart_chunk, 4 ) == 0;
+			if (fseek( file, (long) length + 4, SEEK_CUR ) != 0)
+			{
+				break;
+			}
+		}
+	}
+	
+	const long end = found && fseek( file, 0, SEEK_END ) == 0 ? ftell( file ) : -1;
+	* size = end > 0 ? (uint64_t) end : 0;
+	return fseek( file, 0, SEEK_SET ) == 0 && end > 0;
+}
+
+
+// The file is read whole, its length known from png_file_has_restarts, and
+// counts against the budget until the decode is done.
+static uint8_t png_load_file_parallel( png_image * image, FILE * file, uint64_t size, uint32_t flags, png_io_call * call )
+{
+	if (size > SIZE_MAX || !png_call_charge( call, size ))
+	{
+		pngio_error( "Image is too large for the memory budget." );
+		return 0;
+	}
+	
+	uint8_t * contents = (uint8_t *) malloc( (size_t) size );
+	uint8_t result = contents && fread( contents, 1, (size_t) size, file ) == size;
+	if (!result)
+	{
+		pngio_error( "Couldn't read the PNG file." );
+	}
+	result = result && png_load_memory( image, contents, (size_t) size, flags, call );
+	free( contents );
+	png_call_release( call, size );
+	return result;
+}
+
+
+#define PNG_BATCH_WINDOW		64		// files read ahead of the decoders
+#define PNG_BATCH_IO_THREADS	16		// readers when io_uring isn't there
+
+
+// A batch load: files are read whole, up to PNG_BATCH_WINDOW ahead of the
+// decoders, and queued for them as each read completes.
+struct png_batch
+{
+	const char * const * paths;
+	png_image *        images;
+	uint8_t *          results;
+	size_t             count;
+	uint32_t           flags;
+	png_image_options  options;		// the caller's, less stats
+	const png_image_options * decodeOptions;
+	
+	uint8_t **         data;
+	size_t *           sizes;
+	
+	pthread_mutex_t    lock;
+	pthread_cond_t     changed;
+	size_t             nextRead;		// next file to start reading
+	size_t             buffered;		// started and not yet decoded
+	size_t             retry[PNG_BATCH_WINDOW];	// started on the ring, to read again
+	size_t             retryCount;
+	size_t *           ready;			// read, in the order they finished
+	size_t             readyHead;
+	size_t             readyTail;
+};
+
+
+// Takes the next file to read once the window has room, or returns 0 when
+// all have been taken. With wait clear it returns 0 rather than block.
+// Files the ring gave up on come first; they are already in the window.
+static uint8_t png_batch_claim( png_batch * batch, size_t * index, uint8_t wait )
+{
+	uint8_t claimed = 0;
+	pthread_mutex_lock( & batch->lock );
+	while (wait && !batch->retryCount && batch->nextRead < batch->count && batch->buffered >= PNG_BATCH_WINDOW)
+	{
+		pthread_cond_wait( & batch->changed, & batch->lock );
+	}
+	if (batch->retryCount)
+	{
+		* index = batch->retry[ --batch->retryCount ];
+		claimed = 1;
+	}
+	else if (batch->nextRead < batch->count && batch->buffered < PNG_BATCH_WINDOW)
+	{
+		* index = batch->nextRead++;
+		batch->buffered++;
+		claimed = 1;
+	}
+	pthread_mutex_unlock( & batch->lock );
+	return claimed;
+}
+
+
+// Hands a read file, or one whose data is NULL because it couldn't be
+// read, to the decoders.
+static void png_batch_ready( png_batch * batch, size_t index )
+{
+	pthread_mutex_lock( & batch->lock );
+	batch->ready[ batch->readyTail++ ] = index;
+	pthread_cond_broadcast( & batch->changed );
+	pthread_mutex_unlock( & batch->lock );
+}
+
+
+static uint8_t * png_batch_alloc( int fd, size_t * size )
+{
+	struct stat info;
+	if (fstat( fd, & info ) != 0 || info.st_size < 0 || (uint64_t) info.st_size > SIZE_MAX)
+	{
+		return NULL;
+	}
+	* size = (size_t) info.st_size;
+	return (uint8_t *) malloc( * size ? * size : 1 );
+}
+
+
+// Reads a whole file, or returns NULL if it can't be opened or read. What
+// isn't a regular file, such as a pipe, is read until it ends.
+static uint8_t * png_read_path( const char * path, size_t * size )
+{
+	const int fd = open( path, O_RDONLY | O_CLOEXEC );
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	struct stat info;
+	uint8_t * data = NULL;
+	size_t done = 0;
+	if (fstat( fd, & info ) == 0 && !S_ISREG( info.st_mode ))
+	{
+		png_buffer contents = { NULL, 0, 0 };
+		uint8_t block[65536];
+		ssize_t n;
+		while ((n = read( fd, block, sizeof block )) > 0 && png_buffer_append( & contents, block, (size_t) n ))
+		{
+		}
+		if (n != 0)
+		{
+			free( contents.data );
+			contents.data = NULL;
+		}
+		data = contents.data;
+		done = contents.size;
 	}
 	else
-	#endif
 	{
-		if (flags & PNG_IMAGE_PREMULTIPLY_ALPHA)
+		data = png_batch_alloc( fd, size );
+		while (data && done < * size)
 		{
-			png_set_read_user_transform_fn( readPtr, png_read_premultiply_transform );
+			const ssize_t n = pread( fd, data + done, * size - done, (off_t) done );
+			if (n <= 0)
+			{
+				if (n < 0)
+				{
+					free( data );
+					data = NULL;
+				}
+				break;
+			}
+			done += (size_t) n;
 		}
 	}
+	close( fd );
+	* size = done;
+	return data;
+}
 
-	png_image_alloc( image, w, h );
-	png_bytep p = image->data;
+
+static void png_batch_read_file( png_batch * batch, size_t index )
+{
+	batch->data[index] = png_read_path( batch->paths[index], & batch->sizes[index] );
+}
+
+
+static void * png_batch_reader( void * arg )
+{
+	png_batch * batch = (png_batch *) arg;
+	size_t index;
+	while (png_batch_claim( batch, & index, 1 ))
+	{
+		png_batch_read_file( batch, index );
+		png_batch_ready( batch, index );
+	}
+	return NULL;
+}
+
+
+#ifdef PNGIO_URING
+
+// Just enough of an io_uring to open and read files: one submitter, the
+// batch's reader thread, which also reaps the completions.
+struct png_uring
+{
+	int        fd;
+	unsigned * sqTail;
+	unsigned   sqMask;
+	unsigned * sqArray;
+	unsigned * cqHead;
+	unsigned * cqTail;
+	unsigned   cqMask;
+	struct io_uring_sqe * sqes;
+	struct io_uring_cqe * cqes;
+	void *     sqRing;
+	size_t     sqRingSize;
+	void *     cqRing;
+	size_t     cqRingSize;
+	size_t     sqesSize;
+	unsigned   pending;		// filled in but not yet submitted
+};
+
+
+static uint8_t png_uring_init( png_uring * ring, unsigned entries )
+{
+	struct io_uring_params params;
+	memset( & params, 0, sizeof params );
+	memset( ring, 0, sizeof (png_uring) );
+	ring->fd = (int) syscall( __NR_io_uring_setup, entries, & params );
+	if (ring->fd < 0)
+	{
+		return 0;
+	}
 	
-	const size_t passCount = interlaceType == PNG_INTERLACE_NONE ? 1 : png_set_interlace_handling( readPtr );
-	const size_t bytesPerRow = w * 4;
-	if (flags & PNG_IMAGE_FLIP_VERTICAL)
+	ring->sqRingSize = params.sq_off.array + (params.sq_entries * sizeof (unsigned));
+	ring->cqRingSize = params.cq_off.cqes + (params.cq_entries * sizeof (struct io_uring_cqe));
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
 	{
-		for (size_t pass = 0; pass < passCount; pass++)
+		ring->sqRingSize = ring->cqRingSize = ring->sqRingSize > ring->cqRingSize ? ring->sqRingSize : ring->cqRingSize;
+	}
+	ring->sqesSize = params.sq_entries * sizeof (struct io_uring_sqe);
+	
+	ring->sqRing = mmap( NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING );
+	ring->cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sqRing :
+		mmap( NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING );
+	ring->sqes = (struct io_uring_sqe *) mmap( NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES );
+	if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED)
+	{
+		if (ring->sqRing != MAP_FAILED) munmap( ring->sqRing, ring->sqRingSize );
+		if (ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing) munmap( ring->cqRing, ring->cqRingSize );
+		if (ring->sqes != MAP_FAILED) munmap( ring->sqes, ring->sqesSize );
+		close( ring->fd );
+		return 0;
+	}
+	
+	uint8_t * sq = (uint8_t *) ring->sqRing;
+	uint8_t * cq = (uint8_t *) ring->cqRing;
+	ring->sqTail = (unsigned *) (sq + params.sq_off.tail);
+	ring->sqMask = * (unsigned *) (sq + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned *) (sq + params.sq_off.array);
+	ring->cqHead = (unsigned *) (cq + params.cq_off.head);
+	ring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+	ring->cqMask = * (unsigned *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+	return 1;
+}
+
+
+static void png_uring_destroy( png_uring * ring )
+{
+	munmap( ring->sqes, ring->sqesSize );
+	if (ring->cqRing != ring->sqRing)
+	{
+		munmap( ring->cqRing, ring->cqRingSize );
+	}
+	munmap( ring->sqRing, ring->sqRingSize );
+	close( ring->fd );
+}
+
+
+// The caller keeps no more requests in flight than the ring has entries.
+static struct io_uring_sqe * png_uring_sqe( png_uring * ring )
+{
+	const unsigned tail = * ring->sqTail + ring->pending;
+	const unsigned slot = tail & ring->sqMask;
+	struct io_uring_sqe * sqe = & ring->sqes[slot];
+	memset( sqe, 0, sizeof (struct io_uring_sqe) );
+	ring->sqArray[slot] = slot;
+	ring->pending++;
+	return sqe;
+}
+
+
+static uint8_t png_uring_submit( png_uring * ring, unsigned waitFor )
+{
+	__atomic_store_n( ring->sqTail, * ring->sqTail + ring->pending, __ATOMIC_RELEASE );
+	const unsigned submit = ring->pending;
+	ring->pending = 0;
+	for (;;)
+	{
+		const long n = syscall( __NR_io_uring_enter, ring->fd, submit, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+		if (n >= 0)
 		{
-			for (size_t i = 0; i < h; i++) 
+			return 1;
+		}
+		if (errno == EAGAIN || errno == EBUSY)
+		{
+			sched_yield();
+		}
+		else if (errno != EINTR)
+		{
+			return 0;
+		}
+	}
+}
+
+
+// Per file progress through the ring: opening, then reading.
+struct png_uring_file
+{
+	int     fd;
+	size_t  done;
+	uint8_t busy;
+};
+
+
+static void png_uring_read( png_uring * ring, png_batch * batch, png_uring_file * files, size_t index )
+{
+	struct io_uring_sqe * sqe = png_uring_sqe( ring );
+	const size_t left = batch->sizes[index] - files[index].done;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = files[index].fd;
+	sqe->addr = (uint64_t) (uintptr_t) (batch->data[index] + files[index].done);
+	sqe->len = (uint32_t) (left < (1u << 30) ? left : (1u << 30));
+	sqe->off = files[index].done;
+	sqe->user_data = index;
+}
+
+
+// Reads every file in the batch through the ring. Returns 0 without having
+// claimed anything if the ring can't be set up, or after putting the files
+// it had in flight back for reading again if io_uring_enter fails; either
+// way the files left are for the pread readers.
+static uint8_t png_batch_read_uring( png_batch * batch )
+{
+	png_uring ring;
+	if (!png_uring_init( & ring, PNG_BATCH_WINDOW ))
+	{
+		return 0;
+	}
+	png_uring_file * files = (png_uring_file *) calloc( batch->count, sizeof (png_uring_file) );
+	if (!files)
+	{
+		png_uring_destroy( & ring );
+		return 0;
+	}
+	
+	unsigned inflight = 0;
+	uint8_t claimedAll = 0;
+	uint8_t submitted = 1;
+	while (!claimedAll || inflight)
+	{
+		size_t index;
+		while (png_batch_claim( batch, & index, inflight == 0 ))
+		{
+			files[index].fd = -1;
+			files[index].busy = 1;
+			struct io_uring_sqe * sqe = png_uring_sqe( & ring );
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uint64_t) (uintptr_t) batch->paths[index];
+			sqe->open_flags = O_RDONLY | O_CLOEXEC;
+			sqe->user_data = index;
+			inflight++;
+		}
+		pthread_mutex_lock( & batch->lock );
+		claimedAll = batch->nextRead == batch->count;
+		pthread_mutex_unlock( & batch->lock );
+		if (!inflight)
+		{
+			continue;
+		}
+		
+		if (!png_uring_submit( & ring, 1 ))
+		{
+			submitted = 0;
+			break;
+		}
+		
+		unsigned head = * ring.cqHead;
+		const unsigned tail = __atomic_load_n( ring.cqTail, __ATOMIC_ACQUIRE );
+		for (; head != tail; head++)
+		{
+			const struct io_uring_cqe * cqe = & ring.cqes[head & ring.cqMask];
+			const size_t i = (size_t) cqe->user_data;
+			const int res = cqe->res;
+			png_uring_file & file = files[i];
+			uint8_t finished = 0;
+			if (file.fd < 0)
 			{
-				png_read_row( readPtr, p + (bytesPerRow * (h - i - 1)), NULL );
+				if (res == -EINVAL)
+				{
+					// A kernel too old to open files through the ring.
+					png_batch_read_file( batch, i );
+					finished = 1;
+				}
+				else if (res < 0 || !(batch->data[i] = png_batch_alloc( res, & batch->sizes[i] )))
+				{
+					if (res >= 0)
+					{
+						close( res );
+					}
+					finished = 1;
+				}
+				else
+				{
+					file.fd = res;
+					finished = batch->sizes[i] == 0;
+				}
+			}
+			else if (res < 0)
+			{
+				free( batch->data[i] );
+				batch->data[i] = NULL;
+				finished = 1;
+			}
+			else
+			{
+				file.done += (size_t) res;
+				// A file that shrank ends short; decoding will say so.
+				finished = res == 0 || file.done == batch->sizes[i];
+				batch->sizes[i] = res == 0 ? file.done : batch->sizes[i];
+			}
+			
+			if (finished)
+			{
+				if (file.fd >= 0)
+				{
+					close( file.fd );
+				}
+				file.busy = 0;
+				inflight--;
+				png_batch_ready( batch, i );
+			}
+			else
+			{
+				png_uring_read( & ring, batch, files, i );
 			}
 		}
+		__atomic_store_n( ring.cqHead, head, __ATOMIC_RELEASE );
 	}
-	else
+	
+	// Only a failing io_uring_enter leaves requests in flight. The kernel may
+	// still write to their buffers, so those are given up rather than freed,
+	// and the files are read again into new ones.
+	png_uring_destroy( & ring );
+	pthread_mutex_lock( & batch->lock );
+	for (size_t i = 0; inflight && i < batch->count; i++)
 	{
-//		png_bytep rp[h];
-//		for (size_t i = 0; i < h; i++) 
-//		{
-//			rp[i] = p + (bytesPerRow * i);
-//		}
-//		png_read_image( readPtr, rp );
-		for (size_t pass = 0; pass < passCount; pass++)
+		if (files[i].busy)
 		{
-			for (size_t i = 0; i < h; i++) 
+			if (files[i].fd >= 0)
 			{
-				png_read_row( readPtr, p + (bytesPerRow * i), NULL );
+				close( files[i].fd );
 			}
+			batch->data[i] = NULL;
+			batch->sizes[i] = 0;
+			batch->retry[ batch->retryCount++ ] = i;
+			inflight--;
 		}
 	}
-	
-	png_destroy_read_struct( & readPtr, & infoPtr, NULL );
-	
-	return 1;
+	pthread_mutex_unlock( & batch->lock );
+	free( files );
+	return submitted;
 }
 
+#endif
+
 
-static uint8_t png_write( png_structp writePtr, png_image * image, uint32_t flags )
+static void * png_batch_uring_reader( void * arg )
 {
-	const uint32_t  h = image->height;
-	const uint32_t  w = image->width;
-	const uint8_t * p = image->data;
-	const uint32_t  bitDepth = 8;
-	const uint32_t  channels = 4;
+	png_batch * batch = (png_batch *) arg;
+	#ifdef PNGIO_URING
+	if (png_batch_read_uring( batch ))
+	{
+		return NULL;
+	}
+	#endif
+	pthread_t readers[PNG_BATCH_IO_THREADS];
+	size_t started = 0;
+	for (; started < PNG_BATCH_IO_THREADS && started + 1 < batch->count; started++)
+	{
+		if (pthread_create( & readers[started], NULL, png_batch_reader, batch ) != 0)
+		{
+			break;
+		}
+	}
+	png_batch_reader( batch );
+	for (size_t i = 0; i < started; i++)
+	{
+		pthread_join( readers[i], NULL );
+	}
+	return NULL;
+}
+
+
+// Decodes a file png_read_path read, which counts against the load as the
+// file read for a parallel load does.
+static uint8_t png_load_read_file( png_image * image, const uint8_t * data, size_t size, uint32_t flags, const png_image_options * options )
+{
+	PNGIO_PROBE2( load__start, image, flags );
+	png_io_call storage;
+	png_io_call * call = png_call_begin( & storage, "load", options );
+	const uint8_t fits = png_call_charge( call, size );
+	if (!fits)
+	{
+		pngio_error( "Image is too large for the memory budget." );
+	}
+	const uint8_t result = fits && png_load_memory( image, data, size, flags, call );
+	png_call_release( call, fits ? size : 0 );
+	png_call_end( call, result );
+	PNGIO_PROBE2( load__done, image, result );
+	return result;
+}
+
+
+static void * png_batch_decoder( void * arg )
+{
+	png_batch * batch = (png_batch *) arg;
+	for (;;)
+	{
+		pthread_mutex_lock( & batch->lock );
+		while (batch->readyHead == batch->readyTail && batch->readyHead < batch->count)
+		{
+			pthread_cond_wait( & batch->changed, & batch->lock );
+		}
+		if (batch->readyHead == batch->count)
+		{
+			pthread_mutex_unlock( & batch->lock );
+			return NULL;
+		}
+		const size_t i = batch->ready[ batch->readyHead++ ];
+		pthread_mutex_unlock( & batch->lock );
+		
+		if (batch->data[i])
+		{
+			batch->results[i] = png_load_read_file( & batch->images[i], batch->data[i], batch->sizes[i], batch->flags, batch->decodeOptions );
+			free( batch->data[i] );
+			batch->data[i] = NULL;
+		}
+		else
+		{
+			pngio_error( "Could not open file." );
+			batch->results[i] = 0;
+		}
+		
+		pthread_mutex_lock( & batch->lock );
+		batch->buffered--;
+		pthread_cond_broadcast( & batch->changed );
+		pthread_mutex_unlock( & batch->lock );
+	}
+}
+
+
+uint8_t png_image_load_batch( png_image * images, const char * const * paths, uint8_t * results, size_t count, uint32_t flags, const png_image_options * options )
+{
+	if (count == 0)
+	{
+		return 1;
+	}
 	
-	png_infop infoPtr = png_create_info_struct( writePtr );
-	if (!infoPtr) 
+	png_batch batch;
+	memset( & batch, 0, sizeof batch );
+	batch.paths = paths;
+	batch.images = images;
+	batch.results = results;
+	batch.count = count;
+	batch.flags = flags;
+	if (options)
 	{
-		pngio_error( "Couldn't initialize PNG info struct" );
-		png_destroy_write_struct( & writePtr, NULL );
+		batch.options = * options;
+		batch.options.stats = NULL;
+		batch.options.hashes = NULL;
+		batch.decodeOptions = & batch.options;
+	}
+	batch.data = (uint8_t **) calloc( count, sizeof (uint8_t *) );
+	batch.sizes = (size_t *) calloc( count, sizeof (size_t) );
+	batch.ready = (size_t *) calloc( count, sizeof (size_t) );
+	if (!batch.data || !batch.sizes || !batch.ready)
+	{
+		free( batch.data );
+		free( batch.sizes );
+		free( batch.ready );
+		pngio_error( "Couldn't allocate the batch." );
 		return 0;
 	}
+	pthread_mutex_init( & batch.lock, NULL );
+	pthread_cond_init( & batch.changed, NULL );
 	
-	if (setjmp( png_jmpbuf( writePtr ) )) 
+	// The readers run beside the decoders, one of which is this thread.
+	pthread_t reader;
+	const uint8_t threaded = pthread_create( & reader, NULL, png_batch_uring_reader, & batch ) == 0;
+	if (threaded)
 	{
-		png_destroy_write_struct( & writePtr, & infoPtr );
-		pngio_error( "An error occured while writing the PNG file." );
-		return 0;
+		const uint32_t threads = png_thread_count( options );
+		pthread_t * decoders = (pthread_t *) malloc( sizeof (pthread_t) * threads );
+		size_t started = 0;
+		for (; decoders && started + 1 < threads && started + 1 < count; started++)
+		{
+			if (pthread_create( & decoders[started], NULL, png_batch_decoder, & batch ) != 0)
+			{
+				break;
+			}
+		}
+		png_batch_decoder( & batch );
+		for (size_t i = 0; i < started; i++)
+		{
+			pthread_join( decoders[i], NULL );
+		}
+		pthread_join( reader, NULL );
+		free( decoders );
+	}
+	
+	pthread_cond_destroy( & batch.changed );
+	pthread_mutex_destroy( & batch.lock );
+	free( batch.ready );
+	free( batch.sizes );
+	free( batch.data );
+	
+	uint8_t result = 1;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!threaded)
+		{
+			results[i] = png_image_load_path_ex( & images[i], paths[i], flags, batch.decodeOptions );
+		}
+		result = result && results[i];
 	}
+	return result;
+}
+
+
+#ifdef __cplusplus
+
+static size_t png_pull_stream( void * io, uint8_t * data, size_t size )
+{
+	std::istream * stream = (std::istream *) io;
+	stream->read( (char *) data, size );
+	return (size_t) stream->gcount();
+}
+
+
+static size_t png_push_stream( void * io, const uint8_t * data, size_t size )
+{
+	std::ostream * stream = (std::ostream *) io;
+	stream->write( (const char *) data, size );
+	return stream->good() ? size : 0;
+}
+
+
+// Reading ahead will usually have hit the end of the stream; streams that
+// can't seek back are left cleared, as they would have been without it.
+static void png_unread_stream( void * io, size_t size )
+{
+	std::istream * stream = (std::istream *) io;
+	stream->clear();
+	stream->seekg( -(std::streamoff) size, std::ios::cur );
+	stream->clear();
+}
+
 
-	png_set_filter( writePtr, 0, PNG_FILTER_NONE );
+static uint32_t png_read_stream_format( std::istream & source ) 
+{
+	char sign[8];
+	source.read( (char *) sign, 8 );
+	if (!source.good()) return PNG_FORMAT_INVALID;
 	
-	#ifdef PNG_APPLE_MODE_SUPPORTED
-	if (png_get_apple_mode())
+	if (png_sig_cmp( (png_bytep) sign, 0, 8 ) != 0)
 	{
-		png_write_sig( writePtr );
-		png_set_sig_bytes( writePtr, 8 );
-		png_set_compression_window_bits( writePtr, -15 );
-		png_set_write_user_transform_fn( writePtr, png_write_swap_and_premultiply_transform );
-		png_set_user_transform_info( writePtr, NULL, bitDepth, channels );
+		return PNG_FORMAT_INVALID;
 	}
-	#endif
 	
-	png_set_IHDR( writePtr, infoPtr, w, h, bitDepth, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT );
-	png_set_gAMA( writePtr, infoPtr, 0.45455 );
-	png_set_cHRM( writePtr, infoPtr, 0.312700, 0.329, 0.64, 0.33, 0.3, 0.6, 0.15, 0.06 );
-	png_set_sRGB( writePtr, infoPtr, 0);
+	source.seekg( 12, std::ios_base::beg );
+	if (!source.good()) return PNG_FORMAT_INVALID;
 	
-	#ifdef PNG_APPLE_MODE_SUPPORTED
-	if (png_get_apple_mode())
+	char cgbi[4];
+	source.read( cgbi, 4 );
+	if (!source.good()) return PNG_FORMAT_INVALID;
+
+	
+	source.seekg( 8, std::ios_base::beg );
+	if (!source.good()) return PNG_FORMAT_INVALID;
+	
+	if (strncmp( cgbi, "CgBI", 4 ) == 0)
+	{
+		return PNG_FORMAT_APPLE;
+	}
+
+	return PNG_FORMAT_STANDARD;
+}
+
+
+png_image::png_image( void )
+{
+	png_image_init( this );
+}
+
+
+png_image::~png_image( void )
+{
+	png_image_free( this );
+}
+
+
+#ifdef PNGIO_CXX11
+
+png_image::png_image( png_image && other )
+{
+	png_image_init( this );
+	* this = std::move( other );
+}
+
+
+png_image & png_image::operator=( png_image && other )
+{
+	if (this != & other)
 	{
-		png_byte cname[] = { 'C', 'g', 'B', 'I', '\0' };
-		png_byte cdata[] = { 0x50, 0x00, 0x20, 0x02 };
-		png_write_chunk( writePtr, cname, cdata, 4 );
+		png_image_free( this );
+		width = other.width;
+		height = other.height;
+		data = other.data;
+		mapped = other.mapped;
+		mip_levels = other.mip_levels;
+		png_image_init( & other );
 	}
-	#endif
+	return * this;
+}
+
+#endif
 
-	png_write_info( writePtr, infoPtr );	
 
-	const size_t bytesPerRow = w * 4;
-	if (flags & PNG_IMAGE_FLIP_VERTICAL)
+// As png_file_has_restarts; a stream that can't seek is read sequentially.
+static uint8_t png_stream_has_restarts( std::istream & stream, uint64_t * size )
+{
+	char header[8];
+	uint8_t found = 0;
+	if (stream.read( header, 8 ) && png_sig_cmp( (png_bytep) header, 0, 8 ) == 0)
 	{
-		for (size_t i = 0; i < h; i++) 
+		while (!found && stream.read( header, 8 ))
 		{
-			png_write_row( writePtr, p + (bytesPerRow * (h - i - 1)) );
+			const uint32_t length = png_get_uint_32( (png_bytep) header );
+			if (length > PNG_UINT_31_MAX || memcmp( header + 4, "IEND", 4 ) == 0)
+			{
+				break;
+			}
+			found = memcmp( header + 4, png_restart_chunk, 4 ) == 0;
+			if (!stream.seekg( (std::streamoff) length + 4, std::ios_base::cur ))
+			{
+				break;
+			}
 		}
 	}
-	else
+	
+	stream.clear();
+	const std::streamoff end = found && stream.seekg( 0, std::ios_base::end ) ? (std::streamoff) stream.tellg() : -1;
+	* size = end > 0 ? (uint64_t) end : 0;
+	stream.clear();
+	return stream.seekg( 0, std::ios_base::beg ) && end > 0;
+}
+
+
+static uint8_t png_load_stream_parallel( png_image * image, std::istream & stream, uint64_t size, uint32_t flags, png_io_call * call )
+{
+	if (size > SIZE_MAX || !png_call_charge( call, size ))
 	{
-		for (size_t i = 0; i < h; i++) 
-		{
-			png_write_row( writePtr, p + (bytesPerRow * i) );
-		}
+		pngio_error( "Image is too large for the memory budget." );
+		return 0;
 	}
 	
-	png_write_end( writePtr, infoPtr );
-	png_destroy_write_struct( & writePtr, & infoPtr );
-	
-	return 1;
+	uint8_t * contents = (uint8_t *) malloc( (size_t) size );
+	uint8_t result = contents && stream.read( (char *) contents, (std::streamsize) size ) && (uint64_t) stream.gcount() == size;
+	if (!result)
+	{
+		pngio_error( "Couldn't read the PNG file." );
+	}
+	result = result && png_load_memory( image, contents, (size_t) size, flags, call );
+	free( contents );
+	png_call_release( call, size );
+	return result;
 }
 
 
-uint8_t png_image_load( png_image * image, FILE * file, uint32_t flags )
+static uint8_t png_load_stream( png_image * image, std::istream & stream, uint32_t flags, png_io_call * call )
 {
-	uint32_t format = png_read_file_format( file );
+	uint64_t size = 0;
+	if ((flags & PNG_IMAGE_PARALLEL) && png_stream_has_restarts( stream, & size ))
+	{
+		return png_load_stream_parallel( image, stream, size, flags, call );
+	}
+	
+	uint32_t format = png_read_stream_format( stream );
 	if (format == PNG_FORMAT_INVALID)
 	{
 		pngio_error( "Not a valid PNG file." );
@@ -404,21 +7405,27 @@ uint8_t png_image_load( png_image * image, FILE * file, uint32_t flags )
 	png_set_apple_mode( format == PNG_FORMAT_APPLE );
 	#endif
 	
-	png_structp readPtr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+	png_structp readPtr = png_create_reader( call );
 	if (!readPtr) 
 	{
 		pngio_error( "Couldn't initialize PNG read struct." );
 		return 0;
 	}
 	
-	png_set_read_fn( readPtr, (png_voidp) file, png_read_file_data );
+	png_io_buffer buffer;
+	png_io_buffer_init( & buffer, & stream, png_call_buffer_size( call ), call );
+	buffer.read = png_pull_stream;
+	buffer.unread = png_unread_stream;
+	png_set_read_fn( readPtr, (png_voidp) & buffer, png_read_buffered_data );
 	
-	return png_read( readPtr, image, flags );
+	const png_pull pull = { png_pull_buffered, & buffer };
+	const uint8_t result = png_read( readPtr, image, flags, & pull, NULL );
+	png_io_buffer_release( & buffer );
+	return result;
 }
 
 
-
-uint8_t png_image_save( png_image * image, FILE * file, uint32_t flags )
+static uint8_t png_save_stream( png_image * image, std::ostream & stream, uint32_t flags, png_io_call * call )
 {
 	if (png_image_is_empty( image ))
 	{
@@ -429,218 +7436,398 @@ uint8_t png_image_save( png_image * image, FILE * file, uint32_t flags )
 	png_set_apple_mode( flags & PNG_IMAGE_OPTIMIZE_FOR_IOS );
 	#endif
 	
-	png_structp writePtr = png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+	png_structp writePtr = png_create_writer( call );
 	if (!writePtr) 
 	{
 		pngio_error( "Couldn't initialize PNG write struct." );
 		return 0;
 	}
 	
-	png_set_write_fn( writePtr, (png_voidp) file, png_write_file_data, png_flush_file_data );
+	png_io_buffer buffer;
+	png_io_buffer_init( & buffer, & stream, png_call_buffer_size( call ), call );
+	buffer.write = png_push_stream;
+	png_set_write_fn( writePtr, (png_voidp) & buffer, png_write_buffered_data, png_flush_buffered_data );
+	
+	uint8_t result = png_write( writePtr, image, NULL, flags, png_call_options( call ) ? call->options->restart_rows : 0 );
+	result = png_io_buffer_drain( & buffer ) && stream.flush().good() && result;
+	png_io_buffer_release( & buffer );
+	return result;
+}
+
 
-	return png_write( writePtr, image, flags );
+static uint8_t png_load_stream_ex( png_image * image, std::istream & stream, uint32_t flags, const png_image_options * options )
+{
+	PNGIO_PROBE2( load__start, image, flags );
+	png_io_call storage;
+	png_io_call * call = png_call_begin( & storage, "load", options );
+	uint8_t result = png_load_stream( image, stream, flags, call );
+	png_call_end( call, result );
+	PNGIO_PROBE2( load__done, image, result );
+	return result;
 }
 
 
-uint8_t png_image_load_path( png_image * image, const char * path, uint32_t flags )
-{	
-	FILE * ifile = fopen( path, "r" );
-	if (!ifile) 
-	{
-		pngio_error( "Could not open file." );
-		return false;
-	}
-	uint8_t result = png_image_load( image, ifile, flags );
-	fclose( ifile );
+static uint8_t png_save_stream_ex( png_image * image, std::ostream & stream, uint32_t flags, const png_image_options * options )
+{
+	PNGIO_PROBE2( save__start, image, flags );
+	png_io_call storage;
+	png_io_call * call = png_call_begin( & storage, "save", options );
+	uint8_t result = png_save_stream( image, stream, flags, call );
+	png_call_end( call, result );
+	PNGIO_PROBE2( save__done, image, result );
 	return result;
 }
 
 
+bool png_image::load( std::istream & stream, uint32_t flags )
+{
+	return png_load_stream_ex( this, stream, flags, NULL );
+}
 
-uint8_t png_image_save_path( png_image * image, const char * path, uint32_t flags )
-{	
-	FILE * ofile = fopen( path, "w" );
-	if (!ofile) 
-	{
-		pngio_error( "Could not open file." );
-		return false;
-	}
-	uint8_t result = png_image_save( image, ofile, flags );
-	fclose( ofile );
-	return result;
+
+bool png_image::save( std::ostream & stream, uint32_t flags )
+{
+	return png_save_stream_ex( this, stream, flags, NULL );
 }
 
 
-void png_image_set_pixel( png_image * image, uint32_t x, uint32_t y, png_pixel pixel )
+bool png_image::load( std::istream & stream, uint32_t flags, const png_image_options & options )
 {
-	const uint32_t w = image->width;
-	const uint32_t h = image->height;
-	if (x < w && y < h)
+	return png_load_stream_ex( this, stream, flags, & options );
+}
+
+
+bool png_image::save( std::ostream & stream, uint32_t flags, const png_image_options & options )
+{
+	return png_save_stream_ex( this, stream, flags, & options );
+}
+
+
+bool png_image::load( const std::string & path, uint32_t flags )
+{
+	return png_image_load_path( this, path.c_str(), flags );
+}
+
+
+bool png_image::save( const std::string & path, uint32_t flags )
+{
+	return png_image_save_path( this, path.c_str(), flags );
+}
+
+
+bool png_image::load( const std::string & path, uint32_t flags, const png_image_options & options )
+{
+	return png_image_load_path_ex( this, path.c_str(), flags, & options );
+}
+
+
+bool png_image::save( const std::string & path, uint32_t flags, const png_image_options & options )
+{
+	return png_image_save_path_ex( this, path.c_str(), flags, & options );
+}
+
+
+void png_image::set_pixel( uint32_t x, uint32_t y, png_pixel pixel )
+{
+	png_image_set_pixel( this, x, y, pixel );
+}
+
+
+png_pixel png_image::get_pixel( uint32_t x, uint32_t y )
+{
+	return png_image_get_pixel( this, x, y );
+}
+
+
+uint8_t * png_image::take( size_t * mapped_size )
+{
+	return png_image_take_ex( this, mapped_size );
+}
+
+
+png_span<png_pixel> png_image::row( uint32_t y )
+{
+	png_span<png_pixel> span = { NULL, 0 };
+	if (y < height && data)
 	{
-		((png_pixel *) image->data)[ (y * w) + x ] = pixel;
+		span.data = (png_pixel *) data + ((size_t) y * width);
+		span.size = width;
 	}
+	return span;
 }
 
 
-png_pixel png_image_get_pixel( png_image * image, uint32_t x, uint32_t y )
+png_span<const png_pixel> png_image::row( uint32_t y ) const
 {
-	const uint32_t w = image->width;
-	const uint32_t h = image->height;
-	if (x < w && y < h)
+	png_span<const png_pixel> span = { NULL, 0 };
+	if (y < height && data)
 	{
-		return ((png_pixel *) image->data)[ (y * w) + x ];
+		span.data = (const png_pixel *) data + ((size_t) y * width);
+		span.size = width;
 	}
-	static const png_pixel blank = { 0, 0, 0, 0 };
-	return blank;
+	return span;
 }
 
 
+png_span<png_pixel> png_image::pixels( void )
+{
+	png_span<png_pixel> span = { (png_pixel *) data, data ? (size_t) width * height : 0 };
+	return span;
+}
 
-#ifdef __cplusplus
 
-static void png_read_stream_data( png_structp readPtr, png_bytep data, png_size_t size ) 
+png_image_view png_image::view( void ) const
 {
-	std::istream * stream = (std::istream *) png_get_io_ptr( readPtr );
-	stream->read( (char *) data, size );
+	return png_image_get_view( this );
 }
 
 
-static void png_write_stream_data( png_structp writePtr, png_bytep data, png_size_t size ) 
+png_image_view png_image::mip_level( uint32_t level ) const
 {
-	std::ostream * stream = (std::ostream *) png_get_io_ptr( writePtr );
-	stream->write( (char *) data, size );
+	return png_image_get_mip_level( this, level );
 }
 
 
-static void png_flush_stream_data( png_structp writePtr ) 
+void png_image::fill_rect( uint32_t x, uint32_t y, uint32_t width, uint32_t height, png_pixel pixel )
 {
-	std::ostream * stream = (std::ostream *) png_get_io_ptr( writePtr );
-	stream->flush();
+	png_image_fill_rect( this, x, y, width, height, pixel );
 }
 
 
-static uint32_t png_read_stream_format( std::istream & source ) 
+void png_image::blit( uint32_t x, uint32_t y, const png_image_view & source, uint32_t mode )
 {
-	char sign[8];
-	source.read( (char *) sign, 8 );
-	if (!source.good()) return PNG_FORMAT_INVALID;
-	
-	if (png_sig_cmp( (png_bytep) sign, 0, 8 ) != 0)
-	{
-		return PNG_FORMAT_INVALID;
-	}
-	
-	source.seekg( 12, std::ios_base::beg );
-	if (!source.good()) return PNG_FORMAT_INVALID;
-	
-	char cgbi[4];
-	source.read( cgbi, 4 );
-	if (!source.good()) return PNG_FORMAT_INVALID;
+	png_image_blit( this, x, y, & source, mode );
+}
 
-	
-	source.seekg( 8, std::ios_base::beg );
-	if (!source.good()) return PNG_FORMAT_INVALID;
-	
-	if (strncmp( cgbi, "CgBI", 4 ) == 0)
+
+void png_image::flip_vertical( void )
+{
+	png_image_flip_vertical( this );
+}
+
+
+void png_image::flip_horizontal( void )
+{
+	png_image_flip_horizontal( this );
+}
+
+
+void png_image::rotate_180( void )
+{
+	png_image_rotate_180( this );
+}
+
+
+bool png_image::rotate_90( bool clockwise )
+{
+	return png_image_rotate_90( this, clockwise ) != 0;
+}
+
+
+uint64_t png_image::compare( const png_image_view & other, png_pixel tolerance, png_image_diff * diff ) const
+{
+	const png_image_view mine = png_image_get_view( this );
+	return png_image_compare( & mine, & other, tolerance, diff );
+}
+
+
+png_span<const png_pixel> png_image_view::row( uint32_t y ) const
+{
+	png_span<const png_pixel> span = { NULL, 0 };
+	if (y < height && data)
 	{
-		return PNG_FORMAT_APPLE;
+		span.data = (const png_pixel *) (data + (stride * y));
+		span.size = width;
 	}
+	return span;
+}
 
-	return PNG_FORMAT_STANDARD;
+
+png_image_view png_image_view::crop( uint32_t x, uint32_t y, uint32_t width, uint32_t height ) const
+{
+	return png_image_view_crop( this, x, y, width, height );
 }
 
 
-png_image::png_image( void )
+bool png_image_view::save( const std::string & path, uint32_t flags ) const
 {
-	png_image_init( this );
+	return png_image_save_view_path( this, path.c_str(), flags, NULL );
 }
 
 
-png_image::~png_image( void )
+bool png_image_view::optimize( const std::string & path, uint32_t budget_ms, png_optimize_result * result ) const
 {
-	png_image_free( this );
+	return png_image_optimize_path( this, path.c_str(), PNG_IMAGE_NONE, budget_ms, NULL, result );
 }
 
 
-bool png_image::load( std::istream & stream, uint32_t flags )
+#ifdef PNGIO_FUTURES
+
+struct png_thread_pool : png_executor
 {
-	uint32_t format = png_read_stream_format( stream );
-	if (format == PNG_FORMAT_INVALID)
+	std::mutex                          lock;
+	std::condition_variable             wake;
+	std::deque<std::function<void ()> > queue;
+	std::vector<std::thread>            workers;
+	bool                                stopping;
+	
+	png_thread_pool( uint32_t count ) : stopping( false )
 	{
-		pngio_error( "Not a valid PNG file." );
-		return 0;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			workers.push_back( std::thread( [this]() { run(); } ) );
+		}
 	}
 	
-	#ifdef PNG_APPLE_MODE_SUPPORTED 
-	png_set_apple_mode( format == PNG_FORMAT_APPLE );
-	#endif
-	
-	png_structp readPtr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
-	if (!readPtr) 
+	~png_thread_pool( void )
 	{
-		pngio_error( "Couldn't initialize PNG read struct." );
-		return 0;
+		{
+			std::lock_guard<std::mutex> guard( lock );
+			stopping = true;
+		}
+		wake.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			workers[i].join();
+		}
 	}
 	
-	png_set_read_fn( readPtr, (png_voidp) & stream, png_read_stream_data );
+	void post( std::function<void ()> work )
+	{
+		{
+			std::lock_guard<std::mutex> guard( lock );
+			queue.push_back( std::move( work ) );
+		}
+		wake.notify_one();
+	}
 	
-	return png_read( readPtr, this, flags );
+	// Work already queued when the pool is destroyed still runs.
+	void run( void )
+	{
+		for (;;)
+		{
+			std::unique_lock<std::mutex> guard( lock );
+			wake.wait( guard, [this]() { return stopping || !queue.empty(); } );
+			if (queue.empty())
+			{
+				return;
+			}
+			std::function<void ()> work = std::move( queue.front() );
+			queue.pop_front();
+			guard.unlock();
+			work();
+		}
+	}
+};
+
+
+png_executor & png_default_executor( void )
+{
+	static png_thread_pool pool( png_thread_count( NULL ) );
+	return pool;
 }
 
 
-bool png_image::save( std::ostream & stream, uint32_t flags )
+// Reads for the asynchronous loads, so that the executor only decodes.
+static png_executor & png_read_executor( void )
 {
-	if (png_image_is_empty( this ))
-	{
-		return 0;
-	}
+	static png_thread_pool pool( PNG_BATCH_IO_THREADS );
+	return pool;
+}
 
-	#ifdef PNG_APPLE_MODE_SUPPORTED
-	png_set_apple_mode( flags );
-	#endif
-	
-	png_structp writePtr = png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
-	if (!writePtr) 
+
+typedef std::function<void (std::function<void (bool)>)> png_image_start;
+
+
+// Starts a load or save, which calls done with the result on one of the
+// executor's threads. A load's file is read first on png_read_executor.
+// Copies the options, if any, so the work doesn't depend on the caller's.
+static png_image_start png_image_work( png_executor & executor, png_image * image, const std::string & path, uint32_t flags, const png_image_options * options, bool save )
+{
+	const bool hasOptions = options != NULL;
+	png_image_options copy;
+	png_image_options_init( & copy );
+	if (options)
 	{
-		pngio_error( "Couldn't initialize PNG write struct." );
-		return 0;
+		copy = * options;
 	}
-	
-	png_set_write_fn( writePtr, (png_voidp) & stream, png_write_stream_data, png_flush_stream_data );
+	png_executor * target = & executor;
+	return [=]( std::function<void (bool)> done )
+	{
+		if (save)
+		{
+			target->post( [=]() { done( png_image_save_path_ex( image, path.c_str(), flags, hasOptions ? & copy : NULL ) != 0 ); } );
+			return;
+		}
+		png_read_executor().post( [=]()
+		{
+			size_t size = 0;
+			uint8_t * data = png_read_path( path.c_str(), & size );
+			target->post( [=]()
+			{
+				bool result = false;
+				if (data)
+				{
+					result = png_load_read_file( image, data, size, flags, hasOptions ? & copy : NULL ) != 0;
+				}
+				else
+				{
+					pngio_error( "Could not open file." );
+				}
+				free( data );
+				done( result );
+			} );
+		} );
+	};
+}
 
-	return png_write( writePtr, this, flags );
+
+static std::future<bool> png_image_post( png_image_start start )
+{
+	std::shared_ptr<std::promise<bool> > promise = std::make_shared<std::promise<bool> >();
+	std::future<bool> result = promise->get_future();
+	start( [promise]( bool ok ) { promise->set_value( ok ); } );
+	return result;
 }
 
 
-bool png_image::load( const std::string & path, uint32_t flags )
+std::future<bool> png_image::load_async( const std::string & path, uint32_t flags, const png_image_options * options )
 {
-	return png_image_load_path( this, path.c_str(), flags );
+	return png_image_post( png_image_work( png_default_executor(), this, path, flags, options, false ) );
 }
 
 
-bool png_image::save( const std::string & path, uint32_t flags )
+std::future<bool> png_image::load_async( png_executor & executor, const std::string & path, uint32_t flags, const png_image_options * options )
 {
-	return png_image_save_path( this, path.c_str(), flags );
+	return png_image_post( png_image_work( executor, this, path, flags, options, false ) );
 }
 
 
-void png_image::set_pixel( uint32_t x, uint32_t y, png_pixel pixel )
+std::future<bool> png_image::save_async( const std::string & path, uint32_t flags, const png_image_options * options )
 {
-	png_image_set_pixel( this, x, y, pixel );
+	return png_image_post( png_image_work( png_default_executor(), this, path, flags, options, true ) );
 }
 
+#endif
+
 
-png_pixel png_image::get_pixel( uint32_t x, uint32_t y )
+#ifdef PNGIO_COROUTINES
+
+png_image_awaitable png_image::load_awaitable( png_executor & executor, const std::string & path, uint32_t flags, const png_image_options * options )
 {
-	return png_image_get_pixel( this, x, y );
+	png_image_awaitable awaitable = { png_image_work( executor, this, path, flags, options, false ), false };
+	return awaitable;
 }
 
 
-uint8_t * png_image::take( void )
+png_image_awaitable png_image::save_awaitable( png_executor & executor, const std::string & path, uint32_t flags, const png_image_options * options )
 {
-	return png_image_take( this );
+	png_image_awaitable awaitable = { png_image_work( executor, this, path, flags, options, true ), false };
+	return awaitable;
 }
 
+#endif
+
 
 #endif
 
@@ -19,10 +19,87 @@
 #define PNG_IMAGE_OPTIMIZE_FOR_IOS	1
 #define PNG_IMAGE_PREMULTIPLY_ALPHA	2
 #define PNG_IMAGE_FLIP_VERTICAL		4
+#define PNG_IMAGE_MAPPED			8
+#define PNG_IMAGE_CROP_FRAMES		16
+#define PNG_IMAGE_PIPELINED			32
+#define PNG_IMAGE_PARALLEL			64
+#define PNG_IMAGE_STORED			128		// saves: uncompressed, for scratch files
+#define PNG_IMAGE_FAST				256		// saves: quick single-pass deflate, larger files
+#define PNG_IMAGE_SMALL				512		// saves: adaptive filters and zlib level 9, slower
+#define PNG_IMAGE_FLIP_HORIZONTAL	1024	// loads: mirrored left to right
+#define PNG_IMAGE_TRANSPOSE			2048	// loads: rows become columns
+#define PNG_IMAGE_ROTATE_90			4096	// loads: turned clockwise
+#define PNG_IMAGE_ROTATE_180		8192
+#define PNG_IMAGE_ROTATE_270		16384
+#define PNG_IMAGE_MIPMAPS			32768	// loads: a mip chain after the pixels
+#define PNG_IMAGE_MIPMAPS_KAISER	65536	// loads: the chain through a Kaiser filter rather than a box
+
+
+#define PNG_VIEW_RGBA				0
+#define PNG_VIEW_BGRA				1
+
+
+#define PNG_BLIT_COPY				0
+#define PNG_BLIT_BLEND				1
 
 
 #ifdef __cplusplus
 #include <iostream>
+
+// A run of pixels, such as one row of an image, for indexing or range-for.
+template <typename T>
+struct png_span
+{
+	T *      data;
+	size_t   size;
+	
+	T * begin( void ) const { return data; }
+	T * end( void ) const { return data + size; }
+	T & operator[]( size_t i ) const { return data[i]; }
+};
+
+#if __cplusplus >= 201103L
+#define PNGIO_CXX11 1
+#define PNGIO_FUTURES 1
+#include <functional>
+#include <future>
+#include <string>
+
+// Where the asynchronous loads decode and the saves encode and write; loads
+// read their files on threads of their own first, so the executor never
+// waits on a read. post must run work exactly once, on any thread.
+// png_default_executor is a pool with a thread per CPU, started on first use.
+struct png_executor
+{
+	virtual ~png_executor( void ) {}
+	virtual void post( std::function<void ()> work ) = 0;
+};
+png_executor & png_default_executor( void );
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define PNGIO_COROUTINES 1
+#include <coroutine>
+
+// co_await gives the load or save's result. The coroutine is suspended
+// while start does the work, and resumed on the executor's thread when start
+// calls back with the result.
+struct png_image_awaitable
+{
+	std::function<void (std::function<void (bool)>)> start;
+	bool result;
+	
+	bool await_ready( void ) const { return false; }
+	void await_suspend( std::coroutine_handle<> handle )
+	{
+		start( [this, handle]( bool ok ) { result = ok; handle.resume(); } );
+	}
+	bool await_resume( void ) const { return result; }
+};
+#endif
+#endif
+#endif
+
 extern "C" {
 #endif
 
@@ -34,38 +111,382 @@ struct png_pixel
 typedef struct png_pixel png_pixel;
 
 
+// Where the time and memory went in one load or save.  Times are in
+// nanoseconds; unfilter times are split by PNG filter type (none, sub,
+// up, average, paeth).  Use png_image_stats_add to keep running totals.
+struct png_image_stats
+{
+	uint64_t calls;
+	uint64_t total_ns;
+	uint64_t rows;
+	uint64_t bytes_read;
+	uint64_t idat_bytes;
+	uint64_t inflate_ns;
+	uint64_t unfilter_ns[5];
+	uint64_t unfilter_rows[5];
+	uint64_t transform_ns;
+	uint64_t user_transform_ns;
+	uint64_t filter_ns;
+	uint64_t deflate_ns;
+	uint64_t bytes_written;
+	uint64_t alloc_count;
+	uint64_t alloc_peak_bytes;
+};
+typedef struct png_image_stats png_image_stats;
+
+
+// Content hashes from a load, for spotting duplicates: XXH64 with seed 0 of
+// the pixels as loaded, taken row by row as they are decoded in the file's
+// order (so a flipped load hashes as an unflipped one), and of the IDAT
+// data, the contents of every IDAT chunk in turn, including any after the
+// end of the compressed stream. Both are 0 after a failed load or a call
+// that isn't one.
+struct png_image_hashes
+{
+	uint64_t pixels;
+	uint64_t idat;
+};
+typedef struct png_image_hashes png_image_hashes;
+
+
+// Pixels for png_image_save_source, supplied a band of rows at a time so the
+// whole image never needs to be resident. fill is asked for the rectangle at
+// x, y of width by height pixels, rows stride bytes apart, and returns 0 to
+// abandon the save. With tile_width 0 each call covers whole rows; otherwise
+// each band is put together from tiles at most tile_width wide. Bands are
+// band_rows high (64 when 0), the last one possibly shorter.
+typedef uint8_t (* png_fill_fn)( void * context, uint32_t x, uint32_t y, uint32_t width, uint32_t height, png_pixel * pixels, size_t stride );
+
+struct png_image_source
+{
+	uint32_t    width;
+	uint32_t    height;
+	uint32_t    band_rows;
+	uint32_t    tile_width;
+	png_fill_fn fill;
+	void      * context;
+};
+typedef struct png_image_source png_image_source;
+
+
+// What a png_image_reader's rows hold: width pixels of channels bytes each,
+// RGB or RGBA, or with apple set BGR or BGRA with premultiplied alpha.
+struct png_row_layout
+{
+	uint32_t width;
+	uint32_t height;
+	uint8_t  channels;
+	uint8_t  apple;
+};
+typedef struct png_row_layout png_row_layout;
+
+
+// Files a row at a time, for code that converts pixels itself, such as the
+// templates in pngio.hpp. See png_image_reader_open.
+typedef struct png_image_reader png_image_reader;
+typedef struct png_image_writer png_image_writer;
+
+
+// In-process recorder of load, save, interlace pass, row band and IDAT
+// events, written out as Chrome trace-event JSON (chrome://tracing or
+// Perfetto). One recorder may be shared by calls on several threads.
+typedef struct png_trace png_trace;
+
+
+// Optional settings for the _ex load and save calls.  Start from
+// png_image_options_init so that fields added later get their defaults.
+// Loads of images wider or taller than max_width or max_height fail as soon
+// as the header is read.  max_bytes caps everything one call allocates: the
+// pixels, libpng's row buffers and decompressed zTXt, iCCP and iTXt data.
+// Loads that could not fit fail before the pixels are allocated.
+// Saves with restart_rows set end the compressed data every that many rows
+// so decoding can start over there, and note where in an rsPT chunk; other
+// decoders read the file as usual. Loads with PNG_IMAGE_PARALLEL of a file
+// that has such a chunk read it whole, counted against max_bytes, and decode
+// the stretches between those points on threads.
+// Files and streams are read ahead and written behind io_buffer_size bytes
+// at a time, so libpng's small requests are served from memory; what a load
+// read ahead but didn't use is seeked back over. The buffer counts against
+// max_bytes, and is done without when it doesn't fit. zbuf_size is libpng's
+// compression buffer, which sets the size of the reads from IDAT data and
+// of the IDAT chunks a save writes.
+struct png_image_options
+{
+	png_image_stats * stats;	// overwritten by each call when not NULL
+	png_trace       * trace;	// events are appended when not NULL
+	png_image_hashes * hashes;	// loads: filled in when not NULL
+	uint32_t          max_width;	// 0 keeps libpng's limit of 1000000
+	uint32_t          max_height;	// 0 keeps libpng's limit of 1000000
+	uint64_t          max_bytes;	// 0 for no limit
+	uint32_t          threads;		// for calls that use them; 0 for one per CPU
+	uint32_t          restart_rows;	// saves: rows between restart points, 0 for none
+	uint32_t          io_buffer_size;	// 0 for 256 KB
+	uint32_t          zbuf_size;	// 0 keeps libpng's 8 KB
+};
+typedef struct png_image_options png_image_options;
+
+
+// What png_image_optimize kept: the size written and the encoding that gave
+// it, color_type being the PNG color type (0 gray, 2 RGB, 3 palette, 4 gray
+// with alpha, 6 RGBA) and filters a PNG_FILTER_ mask from libpng, with more
+// than one bit set for the per-row heuristic. trials counts the encodings
+// that ran to the end; abandoned those given up on, as they had outgrown
+// the best so far or the time ran out.
+struct png_optimize_result
+{
+	uint64_t size;
+	uint32_t trials;
+	uint32_t abandoned;
+	uint8_t  color_type;
+	uint8_t  bit_depth;
+	uint8_t  filters;
+	int8_t   level;
+	int8_t   strategy;
+	int8_t   window_bits;
+};
+typedef struct png_optimize_result png_optimize_result;
+
+
+// Pixels owned by someone else: width by height 32-bit pixels with rows
+// stride bytes apart, channels in the order format gives (PNG_VIEW_RGBA or
+// PNG_VIEW_BGRA). A view never frees its data.
+struct png_image_view
+{
+	const uint8_t * data;
+	uint32_t        width;
+	uint32_t        height;
+	size_t          stride;
+	uint32_t        format;
+	
+	#ifdef __cplusplus
+	png_span<const png_pixel> row( uint32_t y ) const;
+	png_image_view crop( uint32_t x, uint32_t y, uint32_t width, uint32_t height ) const;
+	bool save( const std::string & path, uint32_t flags = PNG_IMAGE_NONE ) const;
+	bool optimize( const std::string & path, uint32_t budget_ms = 0, png_optimize_result * result = NULL ) const;
+	#endif
+};
+typedef struct png_image_view png_image_view;
+
+
+// Where two images differ: how many pixels have a channel further apart
+// than the tolerance allows, and the smallest rectangle holding them all
+// (empty when there are none).
+struct png_image_diff
+{
+	uint64_t mismatches;
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+};
+typedef struct png_image_diff png_image_diff;
+
+
 struct png_image
 {
 	uint32_t   width;
 	uint32_t   height;
 	uint8_t  * data;
+	uint8_t    mapped;		// data came from png_image_alloc_mapped
+	uint8_t    mip_levels;	// levels after the pixels in data, from PNG_IMAGE_MIPMAPS
 	
 	#ifdef __cplusplus
 	png_image( void );
 	~png_image( void );
+	#ifdef PNGIO_CXX11
+	png_image( png_image && other );
+	png_image & operator=( png_image && other );
+	png_image( const png_image & ) = delete;
+	png_image & operator=( const png_image & ) = delete;
+	#endif
 	bool load( std::istream & stream, uint32_t flags = PNG_IMAGE_NONE );
 	bool save( std::ostream & stream, uint32_t flags = PNG_IMAGE_NONE );
 	bool load( const std::string & path, uint32_t flags = PNG_IMAGE_NONE );
 	bool save( const std::string & path, uint32_t flags = PNG_IMAGE_NONE );
+	bool load( std::istream & stream, uint32_t flags, const png_image_options & options );
+	bool save( std::ostream & stream, uint32_t flags, const png_image_options & options );
+	bool load( const std::string & path, uint32_t flags, const png_image_options & options );
+	bool save( const std::string & path, uint32_t flags, const png_image_options & options );
 	void set_pixel( uint32_t x, uint32_t y, png_pixel pixel );
 	png_pixel get_pixel( uint32_t x, uint32_t y );
-	uint8_t * take( void );
+	uint8_t * take( size_t * mapped_size = NULL );
+	png_span<png_pixel> row( uint32_t y );
+	png_span<const png_pixel> row( uint32_t y ) const;
+	png_span<png_pixel> pixels( void );
+	png_image_view view( void ) const;
+	png_image_view mip_level( uint32_t level ) const;
+	void fill_rect( uint32_t x, uint32_t y, uint32_t width, uint32_t height, png_pixel pixel );
+	void blit( uint32_t x, uint32_t y, const png_image_view & source, uint32_t mode = PNG_BLIT_COPY );
+	void flip_vertical( void );
+	void flip_horizontal( void );
+	void rotate_180( void );
+	bool rotate_90( bool clockwise = true );
+	uint64_t compare( const png_image_view & other, png_pixel tolerance, png_image_diff * diff = NULL ) const;
+	
+	#ifdef PNGIO_FUTURES
+	// The image must outlive the call; options are copied. Without an
+	// executor the work runs on png_default_executor.
+	std::future<bool> load_async( const std::string & path, uint32_t flags = PNG_IMAGE_NONE, const png_image_options * options = NULL );
+	std::future<bool> load_async( png_executor & executor, const std::string & path, uint32_t flags = PNG_IMAGE_NONE, const png_image_options * options = NULL );
+	std::future<bool> save_async( const std::string & path, uint32_t flags = PNG_IMAGE_NONE, const png_image_options * options = NULL );
+	#endif
+	#ifdef PNGIO_COROUTINES
+	png_image_awaitable load_awaitable( png_executor & executor, const std::string & path, uint32_t flags = PNG_IMAGE_NONE, const png_image_options * options = NULL );
+	png_image_awaitable save_awaitable( png_executor & executor, const std::string & path, uint32_t flags = PNG_IMAGE_NONE, const png_image_options * options = NULL );
+	#endif
+	#ifndef PNGIO_CXX11
+	private:
+	png_image( const png_image & );					// owns data: not copyable
+	png_image & operator=( const png_image & );
+	#endif
 	#endif
 };
 typedef struct png_image png_image;
 
 
+// An animated PNG (APNG) as a series of whole canvases, each what is on
+// screen after that frame is drawn and held for delay_num / delay_den
+// seconds. A still PNG loads as a single frame. When saving, each frame
+// must be the size of the animation; with PNG_IMAGE_CROP_FRAMES only the
+// part that changed since the previous frame is stored.
+struct png_frame
+{
+	png_image image;
+	uint16_t  delay_num;
+	uint16_t  delay_den;
+};
+typedef struct png_frame png_frame;
+
+struct png_animation
+{
+	uint32_t    width;
+	uint32_t    height;
+	uint32_t    plays;			// 0 to loop forever
+	uint32_t    frame_count;
+	png_frame * frames;
+};
+typedef struct png_animation png_animation;
+
+
 void png_image_init ( png_image * image );
 void png_image_alloc( png_image * image, uint32_t width, uint32_t height );
+void png_image_alloc_mapped( png_image * image, uint32_t width, uint32_t height );
 void png_image_free ( png_image * image );
+
+// Hands the pixels, and any mip chain after them, to the caller. Free them
+// with pngio_free, or for a mapped image munmap mapped_size bytes, which
+// png_image_take_ex sets (to 0 when the data isn't mapped).
 uint8_t * png_image_take( png_image * image );
+uint8_t * png_image_take_ex( png_image * image, size_t * mapped_size );
 
+// Loads turn the image as its rows are decoded when given FLIP_HORIZONTAL,
+// TRANSPOSE or the ROTATE_ flags: the flips apply first, then the transpose,
+// then the rotations, whose angles add up. A transpose or a quarter turn
+// swaps the width and height. Animations only take FLIP_VERTICAL.
+//
+// With PNG_IMAGE_MIPMAPS (or PNG_IMAGE_MIPMAPS_KAISER) loads go on to fill in
+// a mip chain, in the same allocation as the pixels and straight after them:
+// each level half the size of the one before, rounded down but at least 1,
+// down to 1 by 1, with its rows packed. Colors are averaged in linear light
+// and weighted by alpha, so transparent pixels don't darken the edges next to
+// them and fully transparent areas come out transparent black; premultiplied
+// loads get premultiplied levels. The box filter averages 2 by 2 pixels; the
+// Kaiser filter weighs 8 by 8 and keeps more detail. Level 1 is built from
+// rows as they are decoded, the others from the level above; with
+// PNG_IMAGE_PARALLEL large levels are split between options->threads.
+// Pixel operations only change the image itself, so they drop the chain,
+// setting mip_levels to 0; load again with the flag for a fresh one.
 uint8_t png_image_load( png_image * image, FILE * file, uint32_t flags );
 uint8_t png_image_save( png_image * image, FILE * file, uint32_t flags );
 
 uint8_t png_image_load_path( png_image * image, const char * path, uint32_t flags );
 uint8_t png_image_save_path( png_image * image, const char * path, uint32_t flags );
 
+void png_image_options_init( png_image_options * options );
+void png_image_stats_add( png_image_stats * total, const png_image_stats * stats );
+
+void png_animation_init( png_animation * animation );
+void png_animation_free( png_animation * animation );
+uint8_t png_animation_load( png_animation * animation, FILE * file, uint32_t flags, const png_image_options * options );
+uint8_t png_animation_save( const png_animation * animation, FILE * file, uint32_t flags, const png_image_options * options );
+
+png_trace * png_trace_create( void );
+void png_trace_destroy( png_trace * trace );
+uint8_t png_trace_write( png_trace * trace, FILE * file );
+
+uint8_t png_image_load_ex( png_image * image, FILE * file, uint32_t flags, const png_image_options * options );
+uint8_t png_image_save_ex( png_image * image, FILE * file, uint32_t flags, const png_image_options * options );
+
+uint8_t png_image_load_path_ex( png_image * image, const char * path, uint32_t flags, const png_image_options * options );
+uint8_t png_image_save_path_ex( png_image * image, const char * path, uint32_t flags, const png_image_options * options );
+
+uint8_t png_image_save_source( const png_image_source * source, FILE * file, uint32_t flags, const png_image_options * options );
+uint8_t png_image_save_source_path( const png_image_source * source, const char * path, uint32_t flags, const png_image_options * options );
+
+// Rewrites a PNG as png_image_save would with flags (Apple's format with
+// PNG_IMAGE_OPTIMIZE_FOR_IOS, the standard one without), the input being
+// in either. Rows are decoded and encoded a few at a time, so memory goes
+// with the width rather than the size of the image; interlaced input, and
+// PNG_IMAGE_FLIP_VERTICAL, need the whole image and are loaded first.
+uint8_t png_image_transcode( FILE * input, FILE * output, uint32_t flags, const png_image_options * options );
+uint8_t png_image_transcode_path( const char * input, const char * output, uint32_t flags, const png_image_options * options );
+
+// Rows in the order the file has them, as it stores them: 8 bit RGB files
+// without a transparent color as 3 byte pixels, everything else expanded to
+// 4, and Apple's format in its own channel order with premultiplied alpha
+// (the layout says which). Interlaced files are decoded whole by open. The
+// writer takes height rows of 4 byte pixels in the order the file stores
+// them, which with PNG_IMAGE_OPTIMIZE_FOR_IOS is BGRA with premultiplied
+// alpha; PNG_IMAGE_SMALL also applies. writer_close returns 0 if a write
+// failed or rows are missing. Neither closes the file.
+png_image_reader * png_image_reader_open( FILE * file, png_row_layout * layout );
+uint8_t png_image_reader_read( png_image_reader * reader, uint8_t * row );
+void png_image_reader_close( png_image_reader * reader );
+png_image_writer * png_image_writer_open( FILE * file, uint32_t width, uint32_t height, uint32_t flags );
+uint8_t png_image_writer_write( png_image_writer * writer, const uint8_t * row );
+uint8_t png_image_writer_close( png_image_writer * writer );
+
+// Loads count files into images, reading a window of them ahead through
+// io_uring on Linux (a pool of reader threads elsewhere) while up to
+// options->threads decode what has arrived. results[i] is what
+// png_image_load_path would have returned for paths[i]; options->stats and
+// options->hashes are not filled in. Returns 1 if every file loaded.
+uint8_t png_image_load_batch( png_image * images, const char * const * paths, uint8_t * results, size_t count, uint32_t flags, const png_image_options * options );
+
+png_image_view png_image_get_view( const png_image * image );
+png_image_view png_image_get_mip_level( const png_image * image, uint32_t level );	// 0 is the image; empty past the chain
+png_image_view png_image_view_crop( const png_image_view * view, uint32_t x, uint32_t y, uint32_t width, uint32_t height );	// clipped to the view
+uint8_t png_image_save_view( const png_image_view * view, FILE * file, uint32_t flags, const png_image_options * options );
+uint8_t png_image_save_view_path( const png_image_view * view, const char * path, uint32_t flags, const png_image_options * options );
+
+// Bulk pixel operations. Rectangles are clipped to the image. A blit
+// copies a view (crop it for a copy_rect) to x, y, or with PNG_BLIT_BLEND
+// draws it over the image as APNG's OVER does; only a copied RGBA view may
+// overlap the image. rotate_90 works in place on square images and
+// otherwise swaps in a new buffer, returning 0 if that can't be allocated.
+// compare checks the area both views cover, counting pixels either has
+// outside it as mismatches, and returns the mismatch count; tolerance is
+// per channel, in RGBA order, and diff may be NULL.
+void png_image_fill_rect( png_image * image, uint32_t x, uint32_t y, uint32_t width, uint32_t height, png_pixel pixel );
+void png_image_blit( png_image * image, uint32_t x, uint32_t y, const png_image_view * source, uint32_t mode );
+void png_image_flip_vertical( png_image * image );
+void png_image_flip_horizontal( png_image * image );
+void png_image_rotate_180( png_image * image );
+uint8_t png_image_rotate_90( png_image * image, uint8_t clockwise );
+uint64_t png_image_compare( const png_image_view * a, const png_image_view * b, png_pixel tolerance, png_image_diff * diff );
+
+// Recompression for shipping. Encodes the view every way there is time for
+// and writes the smallest: each color type the pixels fit (palette, gray,
+// without alpha, at the lowest bit depth that holds them), fixed filters and
+// libpng's per-row heuristic, and zlib levels, strategies and window sizes.
+// Trials run on options->threads threads, most promising first, each given
+// up as soon as it outgrows the best so far. With budget_ms set, trials stop
+// once that much time has passed, except the first, which always finishes.
+// Only FLIP_VERTICAL applies of the flags. The file has an sRGB chunk, as
+// saves do, and nothing else ancillary; result may be NULL.
+uint8_t png_image_optimize( const png_image_view * view, FILE * file, uint32_t flags, uint32_t budget_ms, const png_image_options * options, png_optimize_result * result );
+uint8_t png_image_optimize_path( const png_image_view * view, const char * path, uint32_t flags, uint32_t budget_ms, const png_image_options * options, png_optimize_result * result );
+
 void png_image_set_pixel( png_image * image, uint32_t x, uint32_t y, png_pixel pixel );
 png_pixel png_image_get_pixel( png_image * image, uint32_t x, uint32_t y );
 
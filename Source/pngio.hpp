@@ -0,0 +1,287 @@
+#ifndef _PNG_IO_HPP_
+#define _PNG_IO_HPP_
+
+
+#include "pngio.h"
+
+#ifndef PNGIO_CXX11
+#error pngio.hpp needs C++11
+#endif
+
+#include <stddef.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+
+// Loads and saves for callers that know the pixel format they want when
+// they are built. Rows still go through png_image_reader and
+// png_image_writer in the file's own layout, with the library's run time
+// row kernel. The format and options are template parameters, so the pass
+// after that, with the channel swap, alpha conversion and row order, is a
+// loop built for each instantiation instead of flag checks and libpng user
+// transforms. It is skipped when the file's layout is already the one
+// wanted. Only that layout is looked at when a file is opened, to pick one
+// of a few such loops for the whole image.
+//
+//	pngio::reader<pngio::bgra8, pngio::premultiplied, pngio::flipped> reader;
+//	if (reader.open( path ))
+//	{
+//		uint8_t * pixels = texture( reader.width(), reader.height() );
+//		reader.read( pixels, reader.width() * 4 );
+//	}
+//
+// Pixels come out as the matching png_image_load flags would give them,
+// rounding included.
+namespace pngio
+{
+	// Formats: 32 bit pixels with the channels in this order.
+	struct rgba8 {};
+	struct bgra8 {};
+	
+	// Options, in any order.
+	struct flipped {};			// rows bottom up, as PNG_IMAGE_FLIP_VERTICAL
+	struct premultiplied {};	// color scaled by alpha, as PNG_IMAGE_PREMULTIPLY_ALPHA
+	struct ios {};				// writer: Apple's format, as PNG_IMAGE_OPTIMIZE_FOR_IOS
+	struct small {};			// writer: as PNG_IMAGE_SMALL
+	
+	namespace detail
+	{
+		template <typename T, typename... Options> struct has : std::false_type {};
+		template <typename T, typename... Rest> struct has<T, T, Rest...> : std::true_type {};
+		template <typename T, typename U, typename... Rest> struct has<T, U, Rest...> : has<T, Rest...> {};
+		
+		template <typename... Types> struct list {};
+		template <typename Allowed, typename... Options> struct allows : std::true_type {};
+		template <typename... Allowed, typename U, typename... Rest> struct allows<list<Allowed...>, U, Rest...> :
+			std::integral_constant<bool, has<U, Allowed...>::value && allows<list<Allowed...>, Rest...>::value> {};
+		
+		// Loads premultiply treating alpha 0 as 1 and saves don't, each as
+		// pngio does; unpremultiplying truncates to a byte, also as pngio does.
+		enum alpha_op
+		{
+			keep_alpha,
+			premultiply_load,
+			premultiply_save,
+			unpremultiply
+		};
+		
+		// 3 or 4 byte pixels in, 4 out; in place when both are 4.
+		template <int Channels, bool Swap, int Alpha>
+		inline void convert_row( const uint8_t * s, uint8_t * d, uint32_t width )
+		{
+			for (uint32_t x = 0; x < width; x++, s += Channels, d += 4)
+			{
+				const uint8_t a = Channels == 4 ? s[3] : 0xFF;
+				uint8_t r = s[0];
+				uint8_t g = s[1];
+				uint8_t b = s[2];
+				if (Channels == 4 && (Alpha == premultiply_load || Alpha == premultiply_save))
+				{
+					const unsigned m = (Alpha == premultiply_load && !a) ? 1 : a;
+					r = (uint8_t) ((r * m) / 0xFF);
+					g = (uint8_t) ((g * m) / 0xFF);
+					b = (uint8_t) ((b * m) / 0xFF);
+				}
+				else if (Channels == 4 && Alpha == unpremultiply)
+				{
+					const unsigned m = a ? a : 1;
+					r = (uint8_t) ((r * 0xFF) / m);
+					g = (uint8_t) ((g * 0xFF) / m);
+					b = (uint8_t) ((b * 0xFF) / m);
+				}
+				d[0] = Swap ? b : r;
+				d[1] = g;
+				d[2] = Swap ? r : b;
+				d[3] = a;
+			}
+		}
+	}
+	
+	
+	// open reads the header, so width and height are known before there is
+	// anywhere to put the pixels; read then decodes the whole image into
+	// rows stride bytes apart, and can be called once per open.
+	template <typename Format, typename... Options>
+	class reader
+	{
+	public:
+		static constexpr bool bgra = std::is_same<Format, bgra8>::value;
+		static constexpr bool flip = detail::has<flipped, Options...>::value;
+		static constexpr bool premultiply = detail::has<premultiplied, Options...>::value;
+		
+		static_assert( bgra || std::is_same<Format, rgba8>::value, "pngio::reader formats are rgba8 and bgra8" );
+		static_assert( detail::allows<detail::list<flipped, premultiplied>, Options...>::value, "pngio::reader options are flipped and premultiplied" );
+		
+		reader( void ) : rows( NULL ), file( NULL ) {}
+		~reader( void ) { close(); }
+		reader( const reader & ) = delete;
+		reader & operator=( const reader & ) = delete;
+		
+		bool open( FILE * input )
+		{
+			close();
+			return start( input );
+		}
+		
+		bool open( const std::string & path )
+		{
+			close();
+			file = fopen( path.c_str(), "r" );
+			if (!file || !start( file ))
+			{
+				close();
+				return false;
+			}
+			return true;
+		}
+		
+		uint32_t width( void ) const { return rows ? layout.width : 0; }
+		uint32_t height( void ) const { return rows ? layout.height : 0; }
+		
+		bool read( uint8_t * pixels, size_t stride )
+		{
+			if (!rows)
+			{
+				return false;
+			}
+			bool result;
+			if (layout.channels == 3)
+			{
+				result = layout.apple ? decode<3, true>( pixels, stride ) : decode<3, false>( pixels, stride );
+			}
+			else
+			{
+				result = layout.apple ? decode<4, true>( pixels, stride ) : decode<4, false>( pixels, stride );
+			}
+			close();
+			return result;
+		}
+		
+		// Into a new buffer in the image, which is left empty on failure.
+		bool load( const std::string & path, png_image & image )
+		{
+			png_image_free( & image );
+			if (!open( path ))
+			{
+				return false;
+			}
+			png_image_alloc( & image, layout.width, layout.height );
+			if (!image.data || !read( image.data, (size_t) layout.width * 4 ))
+			{
+				close();
+				png_image_free( & image );
+				return false;
+			}
+			return true;
+		}
+		
+		void close( void )
+		{
+			if (rows)
+			{
+				png_image_reader_close( rows );
+				rows = NULL;
+			}
+			if (file)
+			{
+				fclose( file );
+				file = NULL;
+			}
+		}
+	
+	private:
+		bool start( FILE * input )
+		{
+			rows = png_image_reader_open( input, & layout );
+			return rows != NULL;
+		}
+		
+		// Apple's rows are BGR(A) with premultiplied alpha.
+		template <int Channels, bool Apple>
+		bool decode( uint8_t * pixels, size_t stride )
+		{
+			constexpr detail::alpha_op op = Apple ?
+				(premultiply ? detail::keep_alpha : detail::unpremultiply) :
+				(premultiply ? detail::premultiply_load : detail::keep_alpha);
+			const uint32_t w = layout.width;
+			const uint32_t h = layout.height;
+			std::vector<uint8_t> scratch( Channels == 3 ? (size_t) w * 3 : 0 );
+			uint8_t * row = flip ? pixels + (stride * (h - 1)) : pixels;
+			for (uint32_t y = 0; y < h; y++, row = flip ? row - stride : row + stride)
+			{
+				uint8_t * stored = Channels == 3 ? scratch.data() : row;
+				if (!png_image_reader_read( rows, stored ))
+				{
+					return false;
+				}
+				if (Channels == 3 || Apple != bgra || op != detail::keep_alpha)
+				{
+					detail::convert_row<Channels, Apple != bgra, op>( stored, row, w );
+				}
+			}
+			return true;
+		}
+		
+		png_image_reader * rows;
+		png_row_layout     layout;
+		FILE *             file;
+	};
+	
+	
+	// save writes width by height pixels from rows stride bytes apart.
+	template <typename Format, typename... Options>
+	class writer
+	{
+	public:
+		static constexpr bool bgra = std::is_same<Format, bgra8>::value;
+		static constexpr bool flip = detail::has<flipped, Options...>::value;
+		static constexpr bool premultiply = detail::has<premultiplied, Options...>::value;
+		static constexpr bool apple = detail::has<ios, Options...>::value;
+		static constexpr uint32_t flags = (apple ? PNG_IMAGE_OPTIMIZE_FOR_IOS : 0) | (detail::has<small, Options...>::value ? PNG_IMAGE_SMALL : 0);
+		
+		static_assert( bgra || std::is_same<Format, rgba8>::value, "pngio::writer formats are rgba8 and bgra8" );
+		static_assert( detail::allows<detail::list<flipped, premultiplied, ios, small>, Options...>::value, "pngio::writer options are flipped, premultiplied, ios and small" );
+		
+		// The file wants RGBA, or with ios BGRA premultiplied.
+		static bool save( FILE * file, const uint8_t * pixels, uint32_t width, uint32_t height, size_t stride )
+		{
+			constexpr detail::alpha_op op = apple ?
+				(premultiply ? detail::keep_alpha : detail::premultiply_save) :
+				(premultiply ? detail::unpremultiply : detail::keep_alpha);
+			const bool convert = bgra != apple || op != detail::keep_alpha;
+			
+			png_image_writer * rows = png_image_writer_open( file, width, height, flags );
+			if (!rows)
+			{
+				return false;
+			}
+			std::vector<uint8_t> scratch( convert ? (size_t) width * 4 : 0 );
+			const uint8_t * row = flip ? pixels + (stride * (height - 1)) : pixels;
+			bool result = true;
+			for (uint32_t y = 0; y < height && result; y++, row = flip ? row - stride : row + stride)
+			{
+				if (convert)
+				{
+					detail::convert_row<4, bgra != apple, op>( row, scratch.data(), width );
+				}
+				result = png_image_writer_write( rows, convert ? scratch.data() : row ) != 0;
+			}
+			return png_image_writer_close( rows ) && result;
+		}
+		
+		static bool save( const std::string & path, const uint8_t * pixels, uint32_t width, uint32_t height, size_t stride )
+		{
+			FILE * file = fopen( path.c_str(), "w" );
+			if (!file)
+			{
+				return false;
+			}
+			const bool result = save( file, pixels, width, height, stride );
+			return fclose( file ) == 0 && result;
+		}
+	};
+}
+
+
+#endif
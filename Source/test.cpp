@@ -1,6 +1,22 @@
 #include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include "pngio.h"
+#ifdef PNGIO_CXX11
+#include "pngio.hpp"
+#include <atomic>
+#endif
+#include "libpng/png.h"
+#include <zlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sstream>
+#include <vector>
 #define MIN( a, b ) ((a < b) ? a : b)
+#define MAX( a, b ) ((a > b) ? a : b)
 
 
 static uint8_t png_image_copy( const char * sourceFilePath, const char * targetFilePath, uint32_t saveFlags )
@@ -190,6 +206,2314 @@ static void test_image_save( void )
 }
 
 
+static FILE * write_test_png( uint32_t width, uint32_t height, int bitDepth, int colorType, int interlaceType, bool transparency = false )
+{
+	FILE * file = tmpfile();
+	assert( file );
+	
+	png_set_apple_mode( 0 );
+	png_structp writePtr = png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+	png_infop infoPtr = png_create_info_struct( writePtr );
+	png_init_io( writePtr, file );
+	png_set_IHDR( writePtr, infoPtr, width, height, bitDepth, colorType, interlaceType, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT );
+	
+	png_color palette[256];
+	png_byte alpha[256];
+	if (colorType == PNG_COLOR_TYPE_PALETTE)
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			png_color c = { (png_byte) i, (png_byte) (255 - i), (png_byte) (i * 3) };
+			palette[i] = c;
+			alpha[i] = (png_byte) (i * 7);
+		}
+		png_set_PLTE( writePtr, infoPtr, palette, 1 << bitDepth );
+	}
+	
+	// Keys are picked to match samples that write_test_png produces.
+	if (transparency)
+	{
+		png_color_16 key = { 0, 0, 0, 0, 0 };
+		switch (colorType)
+		{
+			case PNG_COLOR_TYPE_GRAY:
+				key.gray = bitDepth == 16 ? 0x0603 : bitDepth == 8 ? 5 : 1;
+				break;
+			case PNG_COLOR_TYPE_RGB:
+				key.green = bitDepth == 16 ? 0x0201 : 0;
+				key.blue = bitDepth == 16 ? 0x0402 : 2;
+				break;
+		}
+		png_set_tRNS( writePtr, infoPtr, alpha, (1 << bitDepth) / 2, & key );
+	}
+	png_write_info( writePtr, infoPtr );
+	
+	// Even bytes follow the row and odd bytes the column, so a 256 pixel
+	// wide 16 bit gray image holds every possible sample value.
+	const size_t bytesPerRow = png_get_rowbytes( writePtr, infoPtr );
+	png_bytep row = (png_bytep) malloc( bytesPerRow );
+	const int passCount = png_set_interlace_handling( writePtr );
+	for (int pass = 0; pass < passCount; pass++)
+	{
+		for (uint32_t y = 0; y < height; y++)
+		{
+			for (size_t i = 0; i < bytesPerRow; i++)
+			{
+				row[i] = (i % 2) ? (uint8_t) (i / 2) : (uint8_t) (y * 37 + i);
+			}
+			png_write_row( writePtr, row );
+		}
+	}
+	free( row );
+	
+	png_write_end( writePtr, infoPtr );
+	png_destroy_write_struct( & writePtr, & infoPtr );
+	rewind( file );
+	return file;
+}
+
+
+static void read_test_png_with_filler_before( png_structp readPtr )
+{
+	png_set_expand_gray_1_2_4_to_8( readPtr );
+	png_set_filler( readPtr, 0xA55A, PNG_FILLER_BEFORE );
+}
+
+
+static void read_test_png_with_packing( png_structp readPtr )
+{
+	png_set_packing( readPtr );
+}
+
+
+static void read_test_png_with_scale_16( png_structp readPtr )
+{
+	png_set_scale_16( readPtr );
+}
+
+
+static uint8_t * read_test_png( FILE * file, void (* setup)( png_structp ), size_t * size )
+{
+	rewind( file );
+	png_structp readPtr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+	png_infop infoPtr = png_create_info_struct( readPtr );
+	png_init_io( readPtr, file );
+	png_read_info( readPtr, infoPtr );
+	setup( readPtr );
+	const int passCount = png_set_interlace_handling( readPtr );
+	png_read_update_info( readPtr, infoPtr );
+	
+	const uint32_t h = png_get_image_height( readPtr, infoPtr );
+	const size_t bytesPerRow = png_get_rowbytes( readPtr, infoPtr );
+	uint8_t * data = (uint8_t *) calloc( h, bytesPerRow );
+	for (int pass = 0; pass < passCount; pass++)
+	{
+		for (uint32_t y = 0; y < h; y++)
+		{
+			png_read_row( readPtr, data + (bytesPerRow * y), NULL );
+		}
+	}
+	
+	png_destroy_read_struct( & readPtr, & infoPtr, NULL );
+	*size = h * bytesPerRow;
+	return data;
+}
+
+
+static void test_simd_transforms_match_scalar( void )
+{
+	static const int formats[][2] = 
+	{
+		{ 1,  PNG_COLOR_TYPE_GRAY },
+		{ 2,  PNG_COLOR_TYPE_GRAY },
+		{ 4,  PNG_COLOR_TYPE_GRAY },
+		{ 8,  PNG_COLOR_TYPE_GRAY },
+		{ 16, PNG_COLOR_TYPE_GRAY },
+		{ 8,  PNG_COLOR_TYPE_GRAY_ALPHA },
+		{ 16, PNG_COLOR_TYPE_GRAY_ALPHA },
+		{ 8,  PNG_COLOR_TYPE_RGB },
+		{ 16, PNG_COLOR_TYPE_RGB },
+		{ 16, PNG_COLOR_TYPE_RGB_ALPHA },
+	};
+	static const uint32_t widths[] = { 1, 13, 256 };
+	static void (* const setups[])( png_structp ) = 
+	{
+		read_test_png_with_filler_before,
+		read_test_png_with_packing,
+		read_test_png_with_scale_16,
+	};
+	
+	for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+	{
+		for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++)
+		{
+			for (int interlaceType = PNG_INTERLACE_NONE; interlaceType <= PNG_INTERLACE_ADAM7; interlaceType++)
+			{
+				FILE * file = write_test_png( widths[w], 256, formats[f][0], formats[f][1], interlaceType );
+				
+				png_image scalar, vector;
+				png_set_simd_mode( 0 );
+				assert( png_image_load( & scalar, file, PNG_IMAGE_NONE ) );
+				rewind( file );
+				png_set_simd_mode( 1 );
+				assert( png_image_load( & vector, file, PNG_IMAGE_NONE ) );
+				assert( memcmp( scalar.data, vector.data, scalar.width * scalar.height * 4 ) == 0 );
+				
+				for (size_t s = 0; s < sizeof(setups) / sizeof(setups[0]); s++)
+				{
+					size_t scalarSize, vectorSize;
+					png_set_simd_mode( 0 );
+					uint8_t * scalarData = read_test_png( file, setups[s], & scalarSize );
+					png_set_simd_mode( 1 );
+					uint8_t * vectorData = read_test_png( file, setups[s], & vectorSize );
+					assert( scalarSize == vectorSize );
+					assert( memcmp( scalarData, vectorData, scalarSize ) == 0 );
+					free( scalarData );
+					free( vectorData );
+				}
+				
+				fclose( file );
+			}
+		}
+	}
+}
+
+
+static void append_to_vector( png_structp writePtr, png_bytep data, png_size_t length )
+{
+	std::vector<uint8_t> * bytes = (std::vector<uint8_t> *) png_get_io_ptr( writePtr );
+	bytes->insert( bytes->end(), data, data + length );
+}
+
+
+static void flush_nothing( png_structp )
+{
+}
+
+
+// Writes rows with smooth stretches, steps and noise, so every filter wins
+// somewhere, through the given filters and heuristic.
+static std::vector<uint8_t> write_filtered_png( uint32_t width, uint32_t height, int bitDepth, int colorType, int filters, int heuristic )
+{
+	std::vector<uint8_t> bytes;
+	png_set_apple_mode( 0 );
+	png_structp writePtr = png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+	png_infop infoPtr = png_create_info_struct( writePtr );
+	png_set_write_fn( writePtr, & bytes, append_to_vector, flush_nothing );
+	png_set_IHDR( writePtr, infoPtr, width, height, bitDepth, colorType, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT );
+	png_set_filter( writePtr, 0, filters );
+	static const double weights[3] = { 0.5, 0.75, 0.9 };
+	static const double costs[PNG_FILTER_VALUE_LAST] = { 1.0, 1.1, 1.2, 1.5, 2.0 };
+	png_set_filter_heuristics( writePtr, heuristic, 3, weights, costs );
+	png_write_info( writePtr, infoPtr );
+	
+	const size_t bytesPerRow = png_get_rowbytes( writePtr, infoPtr );
+	std::vector<uint8_t> row( bytesPerRow );
+	uint32_t seed = 99;
+	for (uint32_t y = 0; y < height; y++)
+	{
+		for (size_t i = 0; i < bytesPerRow; i++)
+		{
+			seed = (seed * 1103515245) + 12345;
+			const uint32_t band = ((uint32_t) i / 24 + y / 5) % 4;
+			row[i] = band == 0 ? (uint8_t) (i + y) : band == 1 ? (uint8_t) (i * y / 7) : band == 2 ? (uint8_t) (y * 16) : (uint8_t) (seed >> 16);
+		}
+		png_write_row( writePtr, & row[0] );
+	}
+	
+	png_write_end( writePtr, infoPtr );
+	png_destroy_write_struct( & writePtr, & infoPtr );
+	return bytes;
+}
+
+
+static void test_simd_filters_match_scalar( void )
+{
+	static const int formats[][2] = 
+	{
+		{ 8,  PNG_COLOR_TYPE_GRAY },
+		{ 8,  PNG_COLOR_TYPE_GRAY_ALPHA },
+		{ 8,  PNG_COLOR_TYPE_RGB },
+		{ 8,  PNG_COLOR_TYPE_RGB_ALPHA },
+		{ 16, PNG_COLOR_TYPE_RGB_ALPHA },
+	};
+	static const uint32_t widths[] = { 1, 13, 200 };
+	static const int filters[] = 
+	{
+		PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH, 
+		PNG_FILTER_NONE | PNG_FILTER_SUB, PNG_FILTER_UP | PNG_FILTER_PAETH, PNG_ALL_FILTERS,
+	};
+	
+	for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+	{
+		for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++)
+		{
+			for (size_t k = 0; k < sizeof(filters) / sizeof(filters[0]); k++)
+			{
+				for (int heuristic = PNG_FILTER_HEURISTIC_UNWEIGHTED; heuristic <= PNG_FILTER_HEURISTIC_WEIGHTED; heuristic++)
+				{
+					png_set_simd_mode( 0 );
+					const std::vector<uint8_t> scalar = write_filtered_png( widths[w], 40, formats[f][0], formats[f][1], filters[k], heuristic );
+					png_set_simd_mode( 1 );
+					const std::vector<uint8_t> vector = write_filtered_png( widths[w], 40, formats[f][0], formats[f][1], filters[k], heuristic );
+					assert( scalar == vector );
+				}
+			}
+		}
+	}
+	
+	// The small file preset, which picks between all five filters.
+	png_image image;
+	png_image_alloc( & image, 301, 157 );
+	for (uint32_t y = 0; y < 157; y++)
+	{
+		for (uint32_t x = 0; x < 301; x++)
+		{
+			image.set_pixel( x, y, make_pixel( (uint8_t) x, (uint8_t) (y * 3), (uint8_t) ((x * y) >> 4), 255 ) );
+		}
+	}
+	FILE * small = tmpfile();
+	FILE * plain = tmpfile();
+	assert( png_image_save( & image, small, PNG_IMAGE_SMALL ) );
+	assert( png_image_save( & image, plain, PNG_IMAGE_NONE ) );
+	assert( ftell( small ) < ftell( plain ) );
+	
+	png_image loaded;
+	rewind( small );
+	assert( png_image_load( & loaded, small, PNG_IMAGE_NONE ) );
+	assert( loaded.compare( image.view(), make_pixel( 0, 0, 0, 0 ) ) == 0 );
+	fclose( small );
+	fclose( plain );
+}
+
+
+static void test_fused_read_matches_generic( void )
+{
+	static const int formats[][3] = 
+	{
+		{ 1,  PNG_COLOR_TYPE_GRAY,       0 },
+		{ 2,  PNG_COLOR_TYPE_GRAY,       1 },
+		{ 4,  PNG_COLOR_TYPE_GRAY,       1 },
+		{ 8,  PNG_COLOR_TYPE_GRAY,       0 },
+		{ 8,  PNG_COLOR_TYPE_GRAY,       1 },
+		{ 16, PNG_COLOR_TYPE_GRAY,       0 },
+		{ 16, PNG_COLOR_TYPE_GRAY,       1 },
+		{ 8,  PNG_COLOR_TYPE_GRAY_ALPHA, 0 },
+		{ 16, PNG_COLOR_TYPE_GRAY_ALPHA, 0 },
+		{ 1,  PNG_COLOR_TYPE_PALETTE,    0 },
+		{ 2,  PNG_COLOR_TYPE_PALETTE,    1 },
+		{ 4,  PNG_COLOR_TYPE_PALETTE,    0 },
+		{ 8,  PNG_COLOR_TYPE_PALETTE,    1 },
+		{ 8,  PNG_COLOR_TYPE_RGB,        0 },
+		{ 8,  PNG_COLOR_TYPE_RGB,        1 },
+		{ 16, PNG_COLOR_TYPE_RGB,        0 },
+		{ 16, PNG_COLOR_TYPE_RGB,        1 },
+		{ 8,  PNG_COLOR_TYPE_RGB_ALPHA,  0 },
+		{ 16, PNG_COLOR_TYPE_RGB_ALPHA,  0 },
+	};
+	static const uint32_t flags[] = { PNG_IMAGE_NONE, PNG_IMAGE_PREMULTIPLY_ALPHA, PNG_IMAGE_FLIP_VERTICAL };
+	
+	// Interlaced images always take the generic transform chain.
+	for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+	{
+		FILE * progressive = write_test_png( 37, 19, formats[f][0], formats[f][1], PNG_INTERLACE_NONE, formats[f][2] );
+		FILE * interlaced = write_test_png( 37, 19, formats[f][0], formats[f][1], PNG_INTERLACE_ADAM7, formats[f][2] );
+		for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++)
+		{
+			png_image fused, generic;
+			rewind( progressive );
+			rewind( interlaced );
+			assert( png_image_load( & fused, progressive, flags[i] ) );
+			assert( png_image_load( & generic, interlaced, flags[i] ) );
+			assert( memcmp( fused.data, generic.data, fused.width * fused.height * 4 ) == 0 );
+		}
+		fclose( progressive );
+		fclose( interlaced );
+	}
+}
+
+
+static void test_image_stats( void )
+{
+	png_image image;
+	png_image_stats load, save, total;
+	png_image_options options;
+	png_image_options_init( & options );
+	memset( & total, 0, sizeof total );
+	
+	options.stats = & load;
+	FILE * file = write_test_png( 37, 19, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE );
+	assert( png_image_load_ex( & image, file, PNG_IMAGE_NONE, & options ) );
+	fseek( file, 0, SEEK_END );
+	const uint64_t fileSize = ftell( file );
+	fclose( file );
+	
+	uint64_t unfilterRows = 0;
+	for (int i = 0; i < 5; i++)
+	{
+		unfilterRows += load.unfilter_rows[i];
+	}
+	assert( load.calls == 1 );
+	assert( load.bytes_read > 0 && load.bytes_read <= fileSize - 8 );
+	assert( load.idat_bytes > 0 && load.idat_bytes < load.bytes_read );
+	assert( load.rows == image.height );
+	assert( unfilterRows == image.height );
+	assert( load.alloc_count > 0 );
+	assert( load.alloc_peak_bytes >= image.width * image.height * 4 );
+	assert( load.total_ns >= load.inflate_ns + load.transform_ns );
+	assert( load.bytes_written == 0 );
+	png_image_stats_add( & total, & load );
+	
+	options.stats = & save;
+	file = tmpfile();
+	assert( png_image_save_ex( & image, file, PNG_IMAGE_NONE, & options ) );
+	assert( save.bytes_written == (uint64_t) ftell( file ) );
+	assert( save.rows == image.height );
+	assert( save.bytes_read == 0 );
+	fclose( file );
+	png_image_stats_add( & total, & save );
+	
+	assert( total.calls == 2 );
+	assert( total.rows == image.height * 2 );
+	assert( total.alloc_peak_bytes == (load.alloc_peak_bytes > save.alloc_peak_bytes ? load.alloc_peak_bytes : save.alloc_peak_bytes) );
+}
+
+
+static void test_image_trace( void )
+{
+	png_image image;
+	png_image_options options;
+	png_image_options_init( & options );
+	options.trace = png_trace_create();
+	assert( options.trace );
+	
+	assert( image.load( "../../Images/Test24Interlaced.png", PNG_IMAGE_NONE, options ) );
+	assert( image.save( "../../Images/Save24.png", PNG_IMAGE_NONE, options ) );
+	
+	FILE * file = tmpfile();
+	assert( png_trace_write( options.trace, file ) );
+	png_trace_destroy( options.trace );
+	
+	const long size = ftell( file );
+	char * json = (char *) calloc( size + 1, 1 );
+	rewind( file );
+	assert( fread( json, size, 1, file ) == 1 );
+	fclose( file );
+	
+	assert( strncmp( json, "{\"traceEvents\":[", 16 ) == 0 );
+	assert( strstr( json, "\"name\":\"load\",\"cat\":\"pngio\",\"ph\":\"X\"" ) );
+	assert( strstr( json, "\"name\":\"save\"" ) );
+	assert( strstr( json, "\"args\":{\"pass\":6}" ) );
+	assert( strstr( json, "\"name\":\"rows\"" ) );
+	assert( strstr( json, "\"name\":\"IDAT\"" ) );
+	free( json );
+}
+
+
+static FILE * write_header_only_png( uint32_t width, uint32_t height )
+{
+	FILE * file = tmpfile();
+	png_structp writePtr = png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+	png_infop infoPtr = png_create_info_struct( writePtr );
+	png_init_io( writePtr, file );
+	png_set_IHDR( writePtr, infoPtr, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT );
+	png_write_info( writePtr, infoPtr );
+	png_byte idat[] = { 'I', 'D', 'A', 'T', '\0' };
+	png_write_chunk( writePtr, idat, NULL, 0 );
+	png_destroy_write_struct( & writePtr, & infoPtr );
+	rewind( file );
+	return file;
+}
+
+
+static void test_image_limits( void )
+{
+	png_image image;
+	png_image_options options;
+	png_image_options_init( & options );
+	
+	FILE * file = write_test_png( 37, 19, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE );
+	options.max_width = 36;
+	assert( !png_image_load_ex( & image, file, PNG_IMAGE_NONE, & options ) );
+	assert( image.data == NULL );
+	
+	options.max_width = 37;
+	options.max_height = 18;
+	rewind( file );
+	assert( !png_image_load_ex( & image, file, PNG_IMAGE_NONE, & options ) );
+	
+	png_image_stats stats;
+	options.stats = & stats;
+	options.max_width = 0;
+	options.max_height = 0;
+	options.max_bytes = 1 << 20;
+	rewind( file );
+	assert( png_image_load_ex( & image, file, PNG_IMAGE_NONE, & options ) );
+	assert( image.width == 37 && image.height == 19 );
+	png_image_free( & image );
+	
+	options.max_bytes = stats.alloc_peak_bytes - 1;
+	rewind( file );
+	assert( !png_image_load_ex( & image, file, PNG_IMAGE_NONE, & options ) );
+	assert( image.data == NULL );
+	fclose( file );
+	
+	// 100000 x 100000 is within libpng's own limits but needs 40GB of pixels.
+	options.max_bytes = 1 << 26;
+	file = write_header_only_png( 100000, 100000 );
+	assert( !png_image_load_ex( & image, file, PNG_IMAGE_NONE, & options ) );
+	assert( image.data == NULL );
+	assert( stats.alloc_peak_bytes < options.max_bytes );
+	fclose( file );
+}
+
+
+static void test_image_mapped( void )
+{
+	png_image heap, mapped;
+	assert( heap.load( "../../Images/Test24.png" ) );
+	assert( mapped.load( "../../Images/Test24.png", PNG_IMAGE_MAPPED ) );
+	assert( mapped.mapped && !heap.mapped );
+	assert( mapped.width == heap.width && mapped.height == heap.height );
+	assert( memcmp( mapped.data, heap.data, heap.width * heap.height * 4 ) == 0 );
+	assert( mapped.save( "../../Images/Save24.png" ) );
+	
+	// Past 4GB of pixels; only the pages touched are ever backed.
+	png_image large;
+	png_image_alloc_mapped( & large, 70000, 70000 );
+	assert( large.data && large.mapped );
+	large.set_pixel( 69999, 69999, make_pixel( 1, 2, 3, 4 ) );
+	assert( pixel_is( large.get_pixel( 69999, 69999 ), 1, 2, 3, 4 ) );
+	assert( pixel_is( large.get_pixel( 0, 35000 ), 0, 0, 0, 0 ) );
+	png_image_free( & large );
+	assert( !large.data && !large.mapped );
+	
+	// Taken, mapped pixels come with the length to unmap, mip chain included.
+	size_t mappedSize = 1;
+	uint8_t * taken = heap.take( & mappedSize );
+	assert( taken && mappedSize == 0 );
+	pngio_free( taken );
+	png_image chained;
+	assert( chained.load( "../../Images/Test24.png", PNG_IMAGE_MAPPED | PNG_IMAGE_MIPMAPS ) );
+	const size_t pixelBytes = (size_t) chained.width * chained.height * 4;
+	taken = png_image_take_ex( & chained, & mappedSize );
+	assert( taken && !chained.data && mappedSize > pixelBytes );
+	assert( munmap( taken, mappedSize ) == 0 );
+}
+
+
+static png_pixel source_pixel( uint32_t x, uint32_t y )
+{
+	return make_pixel( x * 3, y * 5, x ^ y, 255 - x );
+}
+
+
+static uint8_t fill_from_source_pixel( void * context, uint32_t x, uint32_t y, uint32_t width, uint32_t height, png_pixel * pixels, size_t stride )
+{
+	uint32_t * calls = (uint32_t *) context;
+	(*calls)++;
+	for (uint32_t j = 0; j < height; j++)
+	{
+		png_pixel * row = (png_pixel *) ((uint8_t *) pixels + (stride * j));
+		for (uint32_t i = 0; i < width; i++)
+		{
+			row[i] = source_pixel( x + i, y + j );
+		}
+	}
+	return 1;
+}
+
+
+static uint8_t fill_failing( void *, uint32_t, uint32_t y, uint32_t, uint32_t, png_pixel *, size_t )
+{
+	return y < 16;
+}
+
+
+static void test_image_save_source( void )
+{
+	static const uint32_t flags[] = { PNG_IMAGE_NONE, PNG_IMAGE_FLIP_VERTICAL };
+	for (size_t f = 0; f < 2; f++)
+	{
+		uint32_t calls = 0;
+		png_image_source source = { 53, 41, 8, 20, fill_from_source_pixel, & calls };
+		FILE * file = tmpfile();
+		assert( png_image_save_source( & source, file, flags[f], NULL ) );
+		assert( calls == 6 * 3 );
+		
+		png_image image;
+		rewind( file );
+		assert( png_image_load( & image, file, PNG_IMAGE_NONE ) );
+		fclose( file );
+		assert( image.width == 53 && image.height == 41 );
+		for (uint32_t y = 0; y < 41; y++)
+		{
+			const uint32_t sy = f ? 40 - y : y;
+			for (uint32_t x = 0; x < 53; x++)
+			{
+				assert( image.get_pixel( x, y ) == source_pixel( x, sy ) );
+			}
+		}
+	}
+	
+	png_image_source failing = { 53, 41, 8, 0, fill_failing, NULL };
+	FILE * file = tmpfile();
+	assert( !png_image_save_source( & failing, file, PNG_IMAGE_NONE, NULL ) );
+	fclose( file );
+}
+
+
+static void make_test_animation( png_animation * animation )
+{
+	png_animation_init( animation );
+	animation->width = 8;
+	animation->height = 8;
+	animation->plays = 3;
+	animation->frame_count = 3;
+	animation->frames = (png_frame *) calloc( 3, sizeof (png_frame) );
+	for (uint32_t f = 0; f < 3; f++)
+	{
+		png_image_alloc( & animation->frames[f].image, 8, 8 );
+		animation->frames[f].delay_num = f + 1;
+		animation->frames[f].delay_den = 10;
+		for (uint32_t y = 0; y < 8; y++)
+		{
+			for (uint32_t x = 0; x < 8; x++)
+			{
+				const bool spot = f > 0 && x >= 3 && x < 5 && y >= 2 && y < 4;
+				png_image_set_pixel( & animation->frames[f].image, x, y, spot ? make_pixel( 0, 0, 255, 128 ) : make_pixel( 255, x * 16, y * 16 ) );
+			}
+		}
+	}
+}
+
+
+static void assert_same_animation( const png_animation * a, const png_animation * b )
+{
+	assert( a->width == b->width && a->height == b->height );
+	assert( a->plays == b->plays && a->frame_count == b->frame_count );
+	for (uint32_t f = 0; f < a->frame_count; f++)
+	{
+		assert( a->frames[f].delay_num == b->frames[f].delay_num );
+		assert( a->frames[f].delay_den == b->frames[f].delay_den );
+		assert( memcmp( a->frames[f].image.data, b->frames[f].image.data, a->width * a->height * 4 ) == 0 );
+	}
+}
+
+
+static void test_animation( void )
+{
+	png_animation animation, loaded;
+	make_test_animation( & animation );
+	png_animation_init( & loaded );
+	png_image_options options;
+	png_image_options_init( & options );
+	
+	long sizes[2];
+	for (uint32_t crop = 0; crop < 2; crop++)
+	{
+		for (options.threads = 1; options.threads <= 4; options.threads += 3)
+		{
+			FILE * file = tmpfile();
+			assert( png_animation_save( & animation, file, crop ? PNG_IMAGE_CROP_FRAMES : PNG_IMAGE_NONE, & options ) );
+			sizes[crop] = ftell( file );
+			rewind( file );
+			assert( png_animation_load( & loaded, file, PNG_IMAGE_NONE, & options ) );
+			fclose( file );
+			assert_same_animation( & animation, & loaded );
+		}
+	}
+	assert( sizes[1] < sizes[0] );
+	
+	// The canvas, the frames handed back and their decodes count against
+	// the memory budget.
+	{
+		const uint64_t canvasBytes = (uint64_t) animation.width * animation.height * 4;
+		png_image_stats stats;
+		options.stats = & stats;
+		options.max_bytes = 1 << 20;
+		FILE * file = tmpfile();
+		assert( png_animation_save( & animation, file, PNG_IMAGE_NONE, NULL ) );
+		rewind( file );
+		assert( png_animation_load( & loaded, file, PNG_IMAGE_NONE, & options ) );
+		assert( stats.alloc_peak_bytes > canvasBytes * (animation.frame_count + 2) );
+		options.max_bytes = canvasBytes * 3;
+		rewind( file );
+		assert( !png_animation_load( & loaded, file, PNG_IMAGE_NONE, & options ) );
+		assert( loaded.frame_count == 0 && loaded.frames == NULL );
+		fclose( file );
+		options.stats = NULL;
+		options.max_bytes = 0;
+	}
+	
+	// Still images load as one frame.
+	{
+		FILE * file = fopen( "../../Images/Test24.png", "r" );
+		png_image still;
+		assert( still.load( "../../Images/Test24.png" ) );
+		assert( png_animation_load( & loaded, file, PNG_IMAGE_NONE, NULL ) );
+		fclose( file );
+		assert( loaded.frame_count == 1 && loaded.width == still.width );
+		assert( memcmp( loaded.frames[0].image.data, still.data, still.width * still.height * 4 ) == 0 );
+	}
+	
+	// Cropped, frame 1 is just the 2x2 spot and frame 2 a single unchanged
+	// pixel. Make frame 1 blend over and dispose to previous: frame 1 then
+	// shows the spot blended onto frame 0, and frame 2 is frame 0 again.
+	FILE * file = tmpfile();
+	assert( png_animation_save( & animation, file, PNG_IMAGE_CROP_FRAMES, NULL ) );
+	const long size = ftell( file );
+	uint8_t * contents = (uint8_t *) malloc( size );
+	rewind( file );
+	assert( fread( contents, size, 1, file ) == 1 );
+	fclose( file );
+	
+	uint8_t * fctl = NULL;
+	for (long i = 0, seen = 0; i + 4 <= size && !fctl; i++)
+	{
+		if (memcmp( contents + i, "fcTL", 4 ) == 0 && seen++ == 1)
+		{
+			fctl = contents + i;
+		}
+	}
+	assert( fctl && png_get_uint_32( fctl + 8 ) == 2 && png_get_uint_32( fctl + 16 ) == 3 );
+	fctl[28] = 2;
+	fctl[29] = 1;
+	png_save_uint_32( fctl + 30, (png_uint_32) crc32( crc32( 0, NULL, 0 ), fctl, 30 ) );
+	
+	file = tmpfile();
+	fwrite( contents, size, 1, file );
+	free( contents );
+	rewind( file );
+	assert( png_animation_load( & loaded, file, PNG_IMAGE_NONE, NULL ) );
+	fclose( file );
+	
+	assert( loaded.frame_count == 3 );
+	png_image * frame0 = & animation.frames[0].image;
+	for (uint32_t y = 0; y < 8; y++)
+	{
+		for (uint32_t x = 0; x < 8; x++)
+		{
+			const png_pixel under = png_image_get_pixel( frame0, x, y );
+			const png_pixel p1 = png_image_get_pixel( & loaded.frames[1].image, x, y );
+			if (x >= 3 && x < 5 && y >= 2 && y < 4)
+			{
+				// Half transparent blue over opaque
+				assert( pixel_is( p1, 127, (under.g * 127) / 255, (255 * 128 + under.b * 127) / 255, 255 ) );
+			}
+			else
+			{
+				assert( p1 == under );
+			}
+			assert( png_image_get_pixel( & loaded.frames[2].image, x, y ) == under );
+		}
+	}
+	
+	png_animation_free( & loaded );
+	png_animation_free( & animation );
+}
+
+
+static void test_image_pipelined( void )
+{
+	static const int formats[][2] = 
+	{
+		{ 1,  PNG_COLOR_TYPE_GRAY },
+		{ 8,  PNG_COLOR_TYPE_PALETTE },
+		{ 8,  PNG_COLOR_TYPE_RGB },
+		{ 16, PNG_COLOR_TYPE_RGB_ALPHA },
+	};
+	static const uint32_t flags[] = { PNG_IMAGE_NONE, PNG_IMAGE_PREMULTIPLY_ALPHA, PNG_IMAGE_FLIP_VERTICAL };
+	
+	// Tall enough for many IDAT chunks and several trips round the row ring.
+	for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+	{
+		FILE * file = write_test_png( 301, 157, formats[f][0], formats[f][1], PNG_INTERLACE_NONE );
+		for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++)
+		{
+			png_image pipelined, sequential;
+			rewind( file );
+			assert( png_image_load( & pipelined, file, flags[i] | PNG_IMAGE_PIPELINED ) );
+			rewind( file );
+			assert( png_image_load( & sequential, file, flags[i] ) );
+			assert( memcmp( pipelined.data, sequential.data, pipelined.width * pipelined.height * 4 ) == 0 );
+		}
+		fclose( file );
+	}
+	
+	// A damaged IDAT fails its CRC check on the reader thread.
+	FILE * file = write_test_png( 301, 157, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE );
+	fseek( file, 0, SEEK_END );
+	const long size = ftell( file );
+	fseek( file, size / 2, SEEK_SET );
+	const int byte = fgetc( file );
+	fseek( file, size / 2, SEEK_SET );
+	fputc( byte ^ 0x55, file );
+	rewind( file );
+	png_image image;
+	assert( !png_image_load( & image, file, PNG_IMAGE_PIPELINED ) );
+	assert( image.data == NULL );
+	fclose( file );
+}
+
+
+// Returns the offset of the first chunk called name in file, or -1.
+static long find_chunk( FILE * file, const char * name )
+{
+	uint8_t header[8];
+	fseek( file, 8, SEEK_SET );
+	while (fread( header, 8, 1, file ) == 1)
+	{
+		const long length = png_get_uint_32( header );
+		if (memcmp( header + 4, name, 4 ) == 0)
+		{
+			return ftell( file ) - 8;
+		}
+		fseek( file, length + 4, SEEK_CUR );
+	}
+	return -1;
+}
+
+
+static void test_image_restarts( void )
+{
+	png_image_options options;
+	png_image_options_init( & options );
+	options.restart_rows = 16;
+	options.threads = 3;
+	
+	uint32_t calls = 0;
+	png_image_source source = { 301, 203, 8, 0, fill_from_source_pixel, & calls };
+	FILE * file = tmpfile();
+	assert( png_image_save_source( & source, file, PNG_IMAGE_NONE, & options ) );
+	
+	// 12 restart points, after rows 16, 32 ... 192.
+	const long index = find_chunk( file, "rsPT" );
+	assert( index > 0 );
+	uint8_t length[4];
+	fseek( file, index, SEEK_SET );
+	assert( fread( length, 4, 1, file ) == 1 && png_get_uint_32( length ) == 12 * 8 );
+	
+	static const uint32_t flags[] = { PNG_IMAGE_NONE, PNG_IMAGE_PREMULTIPLY_ALPHA, PNG_IMAGE_FLIP_VERTICAL };
+	for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++)
+	{
+		png_image parallel, sequential;
+		rewind( file );
+		assert( png_image_load_ex( & parallel, file, flags[i] | PNG_IMAGE_PARALLEL, & options ) );
+		rewind( file );
+		assert( png_image_load( & sequential, file, flags[i] ) );
+		assert( memcmp( parallel.data, sequential.data, parallel.width * parallel.height * 4 ) == 0 );
+	}
+	
+	// The file read whole for the parallel decode counts against the load.
+	png_image_stats stats;
+	png_image counted;
+	options.stats = & stats;
+	fseek( file, 0, SEEK_END );
+	const uint64_t fileSize = ftell( file );
+	rewind( file );
+	assert( png_image_load_ex( & counted, file, PNG_IMAGE_PARALLEL, & options ) );
+	assert( stats.alloc_peak_bytes >= 301 * 203 * 4 + fileSize );
+	std::string bytes( (size_t) fileSize, '\0' );
+	rewind( file );
+	assert( fread( & bytes[0], 1, bytes.size(), file ) == bytes.size() );
+	std::istringstream stream( bytes );
+	png_image streamed;
+	assert( streamed.load( stream, PNG_IMAGE_PARALLEL, options ) );
+	assert( stats.alloc_peak_bytes >= 301 * 203 * 4 + fileSize );
+	assert( memcmp( streamed.data, counted.data, 301 * 203 * 4 ) == 0 );
+	options.stats = NULL;
+	
+	png_image image;
+	rewind( file );
+	assert( png_image_load( & image, file, PNG_IMAGE_NONE ) );
+	for (uint32_t y = 0; y < 203; y++)
+	{
+		for (uint32_t x = 0; x < 301; x++)
+		{
+			assert( image.get_pixel( x, y ) == source_pixel( x, y ) );
+		}
+	}
+	
+	// An index that doesn't match the data falls back to a serial decode.
+	uint8_t chunk[4 + 12 * 8 + 4];
+	fseek( file, index + 4, SEEK_SET );
+	assert( fread( chunk, sizeof chunk, 1, file ) == 1 );
+	png_save_uint_32( chunk + 8, png_get_uint_32( chunk + 8 ) - 1 );
+	png_save_uint_32( chunk + sizeof chunk - 4, (png_uint_32) crc32( 0, chunk, sizeof chunk - 4 ) );
+	fseek( file, index + 4, SEEK_SET );
+	assert( fwrite( chunk, sizeof chunk, 1, file ) == 1 );
+	png_image fallback;
+	rewind( file );
+	assert( png_image_load_ex( & fallback, file, PNG_IMAGE_PARALLEL, & options ) );
+	assert( memcmp( fallback.data, image.data, image.width * image.height * 4 ) == 0 );
+	fclose( file );
+}
+
+
+static void test_image_load_batch( void )
+{
+	// More files than the read-ahead window, one missing and one damaged.
+	const size_t count = 100;
+	char dir[] = "/tmp/pngio-batch-XXXXXX";
+	assert( mkdtemp( dir ) );
+	char paths[count][64];
+	const char * pointers[count];
+	for (size_t i = 0; i < count; i++)
+	{
+		snprintf( paths[i], sizeof paths[i], "%s/%zu.png", dir, i );
+		pointers[i] = paths[i];
+		if (i == 17)
+		{
+			continue;
+		}
+		png_image image;
+		png_image_alloc( & image, 5 + (uint32_t) i, 3 + (uint32_t) (i % 7) );
+		for (uint32_t y = 0; y < image.height; y++)
+		{
+			for (uint32_t x = 0; x < image.width; x++)
+			{
+				image.set_pixel( x, y, make_pixel( x + i, y, x ^ y, 255 ) );
+			}
+		}
+		assert( png_image_save_path( & image, paths[i], PNG_IMAGE_NONE ) );
+	}
+	FILE * damaged = fopen( paths[42], "r+" );
+	fseek( damaged, 0, SEEK_END );
+	assert( ftruncate( fileno( damaged ), ftell( damaged ) / 2 ) == 0 );
+	fclose( damaged );
+	
+	png_image_options options;
+	png_image_options_init( & options );
+	options.threads = 3;
+	png_image * images = new png_image[count];
+	uint8_t results[count];
+	assert( !png_image_load_batch( images, pointers, results, count, PNG_IMAGE_FLIP_VERTICAL, & options ) );
+	for (size_t i = 0; i < count; i++)
+	{
+		png_image expected;
+		const uint8_t loaded = png_image_load_path( & expected, paths[i], PNG_IMAGE_FLIP_VERTICAL );
+		assert( results[i] == loaded );
+		assert( loaded == (i != 17 && i != 42) );
+		if (loaded)
+		{
+			assert( images[i].width == expected.width && images[i].height == expected.height );
+			assert( memcmp( images[i].data, expected.data, expected.width * expected.height * 4 ) == 0 );
+		}
+		unlink( paths[i] );
+	}
+	delete [] images;
+	rmdir( dir );
+}
+
+
+#ifdef PNGIO_COROUTINES
+
+// Just enough of a coroutine type to start one and let it run to the end.
+struct test_task
+{
+	struct promise_type
+	{
+		test_task get_return_object( void ) { return test_task(); }
+		std::suspend_never initial_suspend( void ) { return std::suspend_never(); }
+		std::suspend_never final_suspend( void ) noexcept { return std::suspend_never(); }
+		void return_void( void ) {}
+		void unhandled_exception( void ) { abort(); }
+	};
+};
+
+
+static test_task save_and_load( png_image & saved, png_image & loaded, std::string path, std::promise<bool> & done )
+{
+	const bool ok = co_await saved.save_awaitable( png_default_executor(), path ) && 
+		co_await loaded.load_awaitable( png_default_executor(), path );
+	done.set_value( ok );
+}
+
+#endif
+
+
+#ifdef PNGIO_FUTURES
+
+// Counts the work posted to it, which runs on the default executor.
+struct test_executor : png_executor
+{
+	std::atomic<int> posted;
+	
+	test_executor( void ) : posted( 0 ) {}
+	void post( std::function<void ()> work )
+	{
+		posted++;
+		png_default_executor().post( work );
+	}
+};
+
+#endif
+
+
+static void test_image_async( void )
+{
+	#ifdef PNGIO_FUTURES
+	char path[] = "/tmp/pngio-async-XXXXXX";
+	const int fd = mkstemp( path );
+	assert( fd >= 0 );
+	close( fd );
+	
+	png_image image, loaded;
+	png_image_alloc( & image, 19, 11 );
+	for (uint32_t y = 0; y < 11; y++)
+	{
+		for (uint32_t x = 0; x < 19; x++)
+		{
+			image.set_pixel( x, y, source_pixel( x, y ) );
+		}
+	}
+	assert( image.save_async( path ).get() );
+	assert( loaded.load_async( path, PNG_IMAGE_FLIP_VERTICAL ).get() );
+	assert( loaded.width == 19 && loaded.height == 11 );
+	assert( loaded.get_pixel( 3, 10 ) == source_pixel( 3, 0 ) );
+	
+	png_image missing;
+	assert( !missing.load_async( "/nonexistent/pngio.png" ).get() );
+	
+	// While the read waits for a pipe's writer, neither this thread nor the
+	// executor is held up; the executor only gets the decode.
+	const std::string fifo = std::string( path ) + ".fifo";
+	assert( mkfifo( fifo.c_str(), 0600 ) == 0 );
+	test_executor executor;
+	png_image piped;
+	std::future<bool> pending = piped.load_async( executor, fifo );
+	assert( pending.wait_for( std::chrono::milliseconds( 50 ) ) == std::future_status::timeout );
+	assert( executor.posted == 0 );
+	FILE * saved = fopen( path, "rb" );
+	FILE * writer = fopen( fifo.c_str(), "wb" );
+	assert( saved && writer );
+	char block[4096];
+	size_t size;
+	while ((size = fread( block, 1, sizeof block, saved )) > 0)
+	{
+		assert( fwrite( block, 1, size, writer ) == size );
+	}
+	fclose( saved );
+	fclose( writer );
+	assert( pending.get() );
+	assert( executor.posted == 1 );
+	assert( memcmp( piped.data, image.data, 19 * 11 * 4 ) == 0 );
+	unlink( fifo.c_str() );
+	
+	#ifdef PNGIO_COROUTINES
+	png_image awaited;
+	std::promise<bool> done;
+	save_and_load( image, awaited, path, done );
+	assert( done.get_future().get() );
+	assert( memcmp( awaited.data, image.data, 19 * 11 * 4 ) == 0 );
+	#endif
+	
+	unlink( path );
+	#endif
+}
+
+
+static void test_image_move_and_view( void )
+{
+	#ifdef PNGIO_CXX11
+	std::vector<png_image> images;
+	for (uint32_t i = 0; i < 4; i++)
+	{
+		png_image image;
+		png_image_alloc( & image, 9 + i, 7 );
+		images.push_back( std::move( image ) );
+		assert( image.data == NULL && image.width == 0 );
+	}
+	png_image moved = std::move( images[2] );
+	assert( moved.width == 11 && images[2].data == NULL );
+	images[0] = std::move( moved );
+	assert( images[0].width == 11 && moved.data == NULL );
+	#endif
+	
+	png_image image;
+	png_image_alloc( & image, 23, 17 );
+	for (uint32_t y = 0; y < 17; y++)
+	{
+		png_span<png_pixel> row = image.row( y );
+		assert( row.size == 23 );
+		for (uint32_t x = 0; x < row.size; x++)
+		{
+			row[x] = source_pixel( x, y );
+		}
+	}
+	assert( image.row( 17 ).size == 0 );
+	assert( image.pixels().size == 23 * 17 );
+	
+	// A cropped view saves just its part, in either channel order.
+	const png_image_view crop = image.view().crop( 5, 4, 30, 6 );
+	assert( crop.width == 18 && crop.height == 6 );
+	assert( crop.row( 1 )[2] == source_pixel( 7, 5 ) );
+	
+	png_image bgra;
+	png_image_alloc( & bgra, 23, 17 );
+	for (uint32_t y = 0; y < 17; y++)
+	{
+		for (uint32_t x = 0; x < 23; x++)
+		{
+			const png_pixel p = source_pixel( x, y );
+			bgra.set_pixel( x, y, make_pixel( p.b, p.g, p.r, p.a ) );
+		}
+	}
+	png_image_view swapped = bgra.view().crop( 5, 4, 30, 6 );
+	swapped.format = PNG_VIEW_BGRA;
+	
+	const png_image_view * views[] = { & crop, & swapped };
+	for (size_t v = 0; v < 2; v++)
+	{
+		FILE * file = tmpfile();
+		assert( png_image_save_view( views[v], file, PNG_IMAGE_NONE, NULL ) );
+		png_image loaded;
+		rewind( file );
+		assert( png_image_load( & loaded, file, PNG_IMAGE_NONE ) );
+		fclose( file );
+		assert( loaded.width == 18 && loaded.height == 6 );
+		for (uint32_t y = 0; y < 6; y++)
+		{
+			for (uint32_t x = 0; x < 18; x++)
+			{
+				assert( loaded.get_pixel( x, y ) == source_pixel( x + 5, y + 4 ) );
+			}
+		}
+	}
+}
+
+
+static void test_image_pixel_ops( void )
+{
+	// Fill and copy, clipped at the edges.
+	png_image image;
+	png_image_alloc( & image, 37, 29 );
+	image.fill_rect( 0, 0, 37, 29, make_pixel( 1, 2, 3, 4 ) );
+	image.fill_rect( 30, 20, 100, 100, make_pixel( 9, 9, 9 ) );
+	assert( image.get_pixel( 29, 28 ) == make_pixel( 1, 2, 3, 4 ) );
+	assert( image.get_pixel( 30, 20 ) == make_pixel( 9, 9, 9 ) && image.get_pixel( 36, 28 ) == make_pixel( 9, 9, 9 ) );
+	
+	png_image source;
+	png_image_alloc( & source, 23, 17 );
+	for (uint32_t y = 0; y < 17; y++)
+	{
+		for (uint32_t x = 0; x < 23; x++)
+		{
+			source.set_pixel( x, y, source_pixel( x, y ) );
+		}
+	}
+	image.blit( 20, 3, source.view().crop( 2, 1, 21, 16 ), PNG_BLIT_COPY );
+	assert( image.get_pixel( 19, 3 ) == make_pixel( 1, 2, 3, 4 ) );
+	assert( image.get_pixel( 20, 3 ) == source_pixel( 2, 1 ) && image.get_pixel( 36, 18 ) == source_pixel( 18, 16 ) );
+	assert( image.get_pixel( 20, 19 ) == make_pixel( 1, 2, 3, 4 ) );
+	
+	// Copies within the image, in both directions.
+	image.blit( 0, 10, image.view().crop( 20, 3, 17, 16 ), PNG_BLIT_COPY );
+	assert( image.get_pixel( 0, 10 ) == source_pixel( 2, 1 ) && image.get_pixel( 16, 25 ) == source_pixel( 18, 16 ) );
+	image.blit( 1, 0, image.view().crop( 0, 10, 17, 16 ), PNG_BLIT_COPY );
+	assert( image.get_pixel( 1, 0 ) == source_pixel( 2, 1 ) && image.get_pixel( 17, 15 ) == source_pixel( 18, 16 ) );
+	
+	// Blends match APNG's OVER exactly, from either channel order.
+	uint32_t seed = 1;
+	png_pixel under[61];
+	png_pixel over[61];
+	for (uint32_t i = 0; i < 61; i++)
+	{
+		uint8_t bytes[8];
+		for (uint32_t k = 0; k < 8; k++)
+		{
+			seed = seed * 1103515245 + 12345;
+			bytes[k] = (uint8_t) (seed >> 16);
+		}
+		const uint8_t alphas[] = { 0, 255, bytes[3], bytes[7] };
+		under[i] = make_pixel( bytes[0], bytes[1], bytes[2], alphas[(i / 4) % 4] );
+		over[i] = make_pixel( bytes[4], bytes[5], bytes[6], alphas[i % 4] );
+	}
+	for (uint32_t order = 0; order < 2; order++)
+	{
+		png_image canvas;
+		png_image_alloc( & canvas, 61, 1 );
+		memcpy( canvas.data, under, sizeof under );
+		png_pixel drawn[61];
+		for (uint32_t i = 0; i < 61; i++)
+		{
+			drawn[i] = order ? make_pixel( over[i].b, over[i].g, over[i].r, over[i].a ) : over[i];
+		}
+		const png_image_view view = { (const uint8_t *) drawn, 61, 1, sizeof drawn, (uint32_t) (order ? PNG_VIEW_BGRA : PNG_VIEW_RGBA) };
+		canvas.blit( 0, 0, view, PNG_BLIT_BLEND );
+		for (uint32_t i = 0; i < 61; i++)
+		{
+			const png_pixel s = over[i];
+			const png_pixel d = under[i];
+			png_pixel expected = d;
+			if (s.a == 255 || d.a == 0)
+			{
+				expected = s;
+			}
+			else if (s.a != 0)
+			{
+				const uint32_t u = s.a * 255;
+				const uint32_t v = (255 - s.a) * d.a;
+				const uint32_t a = u + v;
+				expected = make_pixel( (s.r * u + d.r * v) / a, (s.g * u + d.g * v) / a, (s.b * u + d.b * v) / a, a / 255 );
+			}
+			assert( canvas.get_pixel( i, 0 ) == expected );
+		}
+	}
+	
+	// Flips and rotations, square and not, against get_pixel.
+	const uint32_t sizes[][2] = { { 23, 17 }, { 40, 40 }, { 35, 35 }, { 1, 9 } };
+	for (size_t n = 0; n < sizeof sizes / sizeof sizes[0]; n++)
+	{
+		const uint32_t w = sizes[n][0];
+		const uint32_t h = sizes[n][1];
+		png_image original;
+		png_image_alloc( & original, w, h );
+		for (uint32_t y = 0; y < h; y++)
+		{
+			for (uint32_t x = 0; x < w; x++)
+			{
+				original.set_pixel( x, y, make_pixel( x, y, x + y, x * y ) );
+			}
+		}
+		png_image turned;
+		png_image_alloc( & turned, w, h );
+		turned.blit( 0, 0, original.view() );
+		
+		turned.flip_vertical();
+		turned.flip_horizontal();
+		for (uint32_t y = 0; y < h; y++)
+		{
+			for (uint32_t x = 0; x < w; x++)
+			{
+				assert( turned.get_pixel( x, y ) == original.get_pixel( w - x - 1, h - y - 1 ) );
+			}
+		}
+		turned.rotate_180();
+		assert( turned.compare( original.view(), make_pixel( 0, 0, 0, 0 ) ) == 0 );
+		
+		assert( turned.rotate_90( true ) );
+		assert( turned.width == h && turned.height == w );
+		for (uint32_t y = 0; y < w; y++)
+		{
+			for (uint32_t x = 0; x < h; x++)
+			{
+				assert( turned.get_pixel( x, y ) == original.get_pixel( y, h - x - 1 ) );
+			}
+		}
+		assert( turned.rotate_90( false ) );
+		assert( turned.compare( original.view(), make_pixel( 0, 0, 0, 0 ) ) == 0 );
+		assert( turned.rotate_90( false ) );
+		for (uint32_t y = 0; y < w; y++)
+		{
+			for (uint32_t x = 0; x < h; x++)
+			{
+				assert( turned.get_pixel( x, y ) == original.get_pixel( w - y - 1, x ) );
+			}
+		}
+	}
+	
+	// Compare counts what is past the tolerance and bounds it.
+	png_image other;
+	png_image_alloc( & other, 23, 17 );
+	other.blit( 0, 0, source.view() );
+	png_pixel p = other.get_pixel( 3, 2 );
+	p.g += 2;
+	other.set_pixel( 3, 2, p );
+	p = other.get_pixel( 19, 11 );
+	p.b ^= 0x40;
+	other.set_pixel( 19, 11, p );
+	p = other.get_pixel( 21, 14 );
+	p.a ^= 1;
+	other.set_pixel( 21, 14, p );
+	png_image_diff diff;
+	assert( source.compare( other.view(), make_pixel( 0, 0, 0, 0 ), & diff ) == 3 );
+	assert( diff.mismatches == 3 && diff.x == 3 && diff.y == 2 && diff.width == 19 && diff.height == 13 );
+	assert( source.compare( other.view(), make_pixel( 2, 2, 2, 2 ), & diff ) == 1 );
+	assert( diff.x == 19 && diff.y == 11 && diff.width == 1 && diff.height == 1 );
+	assert( source.compare( other.view(), make_pixel( 2, 2, 0x40, 2 ) ) == 0 );
+	
+	png_image swapped;
+	png_image_alloc( & swapped, 23, 17 );
+	png_image_view bgra = source.view();
+	bgra.format = PNG_VIEW_BGRA;
+	swapped.blit( 0, 0, bgra );
+	png_image_view swappedView = swapped.view();
+	swappedView.format = PNG_VIEW_BGRA;
+	assert( source.compare( swappedView, make_pixel( 0, 0, 0, 0 ) ) == 0 );
+	
+	// Pixels only one side has are mismatches.
+	assert( source.compare( other.view().crop( 0, 0, 23, 15 ), make_pixel( 0, 0, 0, 0 ), & diff ) == (23 * 2) + 3 );
+	assert( diff.x == 0 && diff.y == 2 && diff.width == 23 && diff.height == 15 );
+	assert( source.compare( other.view().crop( 0, 0, 20, 15 ), make_pixel( 0, 0, 0, 0 ), & diff ) == (23 * 17) - (20 * 15) + 2 );
+	assert( diff.x == 0 && diff.y == 0 && diff.width == 23 && diff.height == 17 );
+}
+
+
+static void test_image_buffered_io( void )
+{
+	png_image image;
+	png_image_alloc( & image, 301, 157 );
+	for (uint32_t y = 0; y < 157; y++)
+	{
+		for (uint32_t x = 0; x < 301; x++)
+		{
+			image.set_pixel( x, y, source_pixel( x, y ) );
+		}
+	}
+	
+	// A small zbuf gives small IDAT chunks, written through a buffer
+	// smaller than some of them.
+	png_image_options options;
+	png_image_options_init( & options );
+	options.zbuf_size = 1000;
+	options.io_buffer_size = 700;
+	FILE * file = tmpfile();
+	assert( png_image_save_ex( & image, file, PNG_IMAGE_NONE, & options ) );
+	const long end = ftell( file );
+	
+	uint32_t chunks = 0;
+	uint8_t header[8];
+	fseek( file, 8, SEEK_SET );
+	while (fread( header, 8, 1, file ) == 1)
+	{
+		const uint32_t length = png_get_uint_32( header );
+		if (memcmp( header + 4, "IDAT", 4 ) == 0)
+		{
+			assert( length <= 1000 );
+			chunks++;
+		}
+		fseek( file, length + 4, SEEK_CUR );
+	}
+	assert( chunks > 10 );
+	
+	// What a load read ahead but didn't use is given back, so the file is
+	// left where decoding stopped, at most the IDAT CRC and IEND short.
+	char junk[5000];
+	memset( junk, 'x', sizeof junk );
+	fseek( file, 0, SEEK_END );
+	fwrite( junk, sizeof junk, 1, file );
+	const uint32_t sizes[] = { 0, 700, 13 };
+	for (uint32_t i = 0; i < 3; i++)
+	{
+		options.io_buffer_size = sizes[i];
+		options.zbuf_size = sizes[i] * 3;
+		png_image loaded;
+		rewind( file );
+		assert( png_image_load_ex( & loaded, file, i == 1 ? PNG_IMAGE_PIPELINED : PNG_IMAGE_NONE, & options ) );
+		assert( ftell( file ) <= end && ftell( file ) >= end - 16 );
+		assert( loaded.compare( image.view(), make_pixel( 0, 0, 0, 0 ) ) == 0 );
+	}
+	
+	std::stringstream stream;
+	assert( image.save( stream, PNG_IMAGE_NONE, options ) );
+	const std::streamoff streamEnd = stream.tellp();
+	stream.write( junk, sizeof junk );
+	png_image streamed;
+	assert( streamed.load( stream, PNG_IMAGE_NONE, options ) );
+	assert( stream.tellg() <= streamEnd && stream.tellg() >= streamEnd - 16 );
+	assert( streamed.compare( image.view(), make_pixel( 0, 0, 0, 0 ) ) == 0 );
+	
+	// The buffer counts against the load; one that doesn't fit the budget
+	// is done without.
+	png_image_stats stats;
+	options.stats = & stats;
+	options.io_buffer_size = 1 << 20;
+	png_image counted;
+	rewind( file );
+	assert( png_image_load_ex( & counted, file, PNG_IMAGE_NONE, & options ) );
+	assert( stats.alloc_peak_bytes >= (1 << 20) + 301 * 157 * 4 );
+	options.max_bytes = stats.alloc_peak_bytes - (1 << 19);
+	png_image unbuffered;
+	rewind( file );
+	assert( png_image_load_ex( & unbuffered, file, PNG_IMAGE_NONE, & options ) );
+	assert( stats.alloc_peak_bytes < options.max_bytes );
+	assert( unbuffered.compare( image.view(), make_pixel( 0, 0, 0, 0 ) ) == 0 );
+	
+	// A file cut short fails rather than decoding past its end.
+	FILE * truncated = tmpfile();
+	std::vector<char> contents( end / 2 );
+	rewind( file );
+	assert( fread( & contents[0], contents.size(), 1, file ) == 1 );
+	fwrite( & contents[0], contents.size(), 1, truncated );
+	rewind( truncated );
+	png_image partial;
+	assert( !png_image_load( & partial, truncated, PNG_IMAGE_NONE ) );
+	fclose( truncated );
+	fclose( file );
+}
+
+
+static void test_image_stored( void )
+{
+	// The checksums match zlib's at every length and alignment, with and
+	// without the vector versions.
+	std::vector<uint8_t> bytes( 20000 );
+	for (size_t i = 0; i < bytes.size(); i++)
+	{
+		bytes[i] = (uint8_t) ((i * 7919) >> 3);
+	}
+	const size_t lengths[] = { 0, 1, 15, 16, 63, 64, 65, 127, 1000, 5536, 5552, 5553, 19990 };
+	for (int simd = 1; simd >= 0; simd--)
+	{
+		png_set_simd_mode( (png_byte) simd );
+		for (size_t l = 0; l < sizeof lengths / sizeof lengths[0]; l++)
+		{
+			for (size_t offset = 0; offset < 4; offset++)
+			{
+				const uint8_t * data = & bytes[offset];
+				const uInt n = (uInt) lengths[l];
+				assert( png_crc32( 0, data, n ) == crc32( 0, data, n ) );
+				assert( png_crc32( 0x12345678, data, n ) == crc32( 0x12345678, data, n ) );
+				assert( png_adler32( 1, data, n ) == adler32( 1, data, n ) );
+				assert( png_adler32( 0xfff0fff0, data, n ) == adler32( 0xfff0fff0, data, n ) );
+			}
+		}
+	}
+	png_set_simd_mode( 1 );
+	
+	png_image image;
+	png_image_alloc( & image, 301, 157 );
+	for (uint32_t y = 0; y < 157; y++)
+	{
+		for (uint32_t x = 0; x < 301; x++)
+		{
+			image.set_pixel( x, y, source_pixel( x, y ) );
+		}
+	}
+	
+	// Stored blocks of up to 65535 bytes, one to an IDAT, hold the rows
+	// with a filter byte each, and inflate back to them.
+	const uint32_t flags[] = { PNG_IMAGE_STORED, PNG_IMAGE_STORED | PNG_IMAGE_FLIP_VERTICAL };
+	for (size_t f = 0; f < 2; f++)
+	{
+		FILE * file = tmpfile();
+		assert( png_image_save( & image, file, flags[f] ) );
+		
+		const size_t raw = 157 * (1 + (301 * 4));
+		std::vector<uint8_t> stream;
+		uint8_t header[8];
+		fseek( file, 8, SEEK_SET );
+		while (fread( header, 8, 1, file ) == 1)
+		{
+			const uint32_t length = png_get_uint_32( header );
+			if (memcmp( header + 4, "IDAT", 4 ) == 0)
+			{
+				assert( length <= 65535 + 5 + 2 + 4 );
+				const size_t at = stream.size();
+				stream.resize( at + length );
+				assert( fread( & stream[at], length, 1, file ) == 1 );
+				fseek( file, 4, SEEK_CUR );
+			}
+			else
+			{
+				fseek( file, length + 4, SEEK_CUR );
+			}
+		}
+		assert( stream.size() == 2 + (5 * 3) + raw + 4 );
+		
+		std::vector<uint8_t> rows( raw );
+		uLongf size = raw;
+		assert( uncompress( & rows[0], & size, & stream[0], stream.size() ) == Z_OK && size == raw );
+		assert( rows[0] == 0 && memcmp( & rows[1], image.data + (flags[f] & PNG_IMAGE_FLIP_VERTICAL ? 156 * 301 * 4 : 0), 301 * 4 ) == 0 );
+		
+		png_image loaded;
+		rewind( file );
+		assert( png_image_load( & loaded, file, flags[f] & PNG_IMAGE_FLIP_VERTICAL ) );
+		assert( loaded.compare( image.view(), make_pixel( 0, 0, 0, 0 ) ) == 0 );
+		fclose( file );
+	}
+	
+	// Sources too.
+	uint32_t calls = 0;
+	png_image_source source = { 301, 157, 16, 0, fill_from_source_pixel, & calls };
+	FILE * file = tmpfile();
+	assert( png_image_save_source( & source, file, PNG_IMAGE_STORED, NULL ) );
+	png_image loaded;
+	rewind( file );
+	assert( png_image_load( & loaded, file, PNG_IMAGE_NONE ) );
+	assert( loaded.compare( image.view(), make_pixel( 0, 0, 0, 0 ) ) == 0 );
+	fclose( file );
+}
+
+
+// Gathers the IDAT data of a saved file.
+static std::vector<uint8_t> idat_stream( FILE * file )
+{
+	std::vector<uint8_t> stream;
+	uint8_t header[8];
+	fseek( file, 8, SEEK_SET );
+	while (fread( header, 8, 1, file ) == 1)
+	{
+		const uint32_t length = png_get_uint_32( header );
+		if (memcmp( header + 4, "IDAT", 4 ) == 0)
+		{
+			const size_t at = stream.size();
+			stream.resize( at + length );
+			assert( length == 0 || fread( & stream[at], length, 1, file ) == 1 );
+			fseek( file, 4, SEEK_CUR );
+		}
+		else
+		{
+			fseek( file, length + 4, SEEK_CUR );
+		}
+	}
+	return stream;
+}
+
+
+static void test_image_fast( void )
+{
+	// Something like a screenshot, flat with repeats, several blocks' worth;
+	// noise, which the encoder has to store; and a single column.
+	png_image flat;
+	png_image_alloc( & flat, 640, 300 );
+	for (uint32_t y = 0; y < 300; y++)
+	{
+		for (uint32_t x = 0; x < 640; x++)
+		{
+			const uint8_t text = ((x / 3) % 7 == 0 || (y % 11) == 5) && (y / 40) % 2 == 1;
+			flat.set_pixel( x, y, text ? make_pixel( 20, 20, 20, 255 ) : make_pixel( (uint8_t) (x / 80 * 30), 200, (uint8_t) (y / 60 * 40), 255 ) );
+		}
+	}
+	png_image noise;
+	png_image_alloc( & noise, 257, 129 );
+	uint32_t seed = 12345;
+	for (size_t i = 0; i < (size_t) 257 * 129 * 4; i++)
+	{
+		seed = (seed * 1103515245) + 12345;
+		noise.data[i] = (uint8_t) (seed >> 16);
+	}
+	png_image column;
+	png_image_alloc( & column, 1, 50 );
+	for (uint32_t y = 0; y < 50; y++)
+	{
+		column.set_pixel( 0, y, source_pixel( 0, y ) );
+	}
+	
+	png_image * images[] = { & flat, & noise, & column };
+	for (size_t n = 0; n < 3; n++)
+	{
+		png_image & image = * images[n];
+		const size_t raw = (size_t) image.height * (1 + (image.width * 4));
+		for (uint32_t flip = 0; flip <= PNG_IMAGE_FLIP_VERTICAL; flip += PNG_IMAGE_FLIP_VERTICAL)
+		{
+			FILE * file = tmpfile();
+			assert( png_image_save( & image, file, PNG_IMAGE_FAST | flip ) );
+			
+			// A zlib stream of rows filtered None, Sub or Up.
+			std::vector<uint8_t> stream = idat_stream( file );
+			assert( stream.size() <= raw + 64 );
+			std::vector<uint8_t> rows( raw );
+			uLongf size = raw;
+			assert( uncompress( & rows[0], & size, & stream[0], stream.size() ) == Z_OK && size == raw );
+			for (uint32_t y = 0; y < image.height; y++)
+			{
+				const uint8_t filter = rows[y * (1 + (image.width * 4))];
+				assert( filter == PNG_FILTER_VALUE_SUB || (y > 0 && filter == PNG_FILTER_VALUE_UP) );
+			}
+			if (n == 0)
+			{
+				assert( stream.size() < raw / 20 );
+			}
+			
+			png_image loaded;
+			rewind( file );
+			assert( png_image_load( & loaded, file, flip ) );
+			assert( loaded.compare( image.view(), make_pixel( 0, 0, 0, 0 ) ) == 0 );
+			fclose( file );
+		}
+	}
+	
+	// Stored wins when both are asked for.
+	FILE * file = tmpfile();
+	assert( png_image_save( & flat, file, PNG_IMAGE_FAST | PNG_IMAGE_STORED ) );
+	assert( idat_stream( file ).size() > (size_t) 300 * 640 * 4 );
+	fclose( file );
+	
+	// Sources too.
+	png_image image;
+	png_image_alloc( & image, 301, 157 );
+	for (uint32_t y = 0; y < 157; y++)
+	{
+		for (uint32_t x = 0; x < 301; x++)
+		{
+			image.set_pixel( x, y, source_pixel( x, y ) );
+		}
+	}
+	uint32_t calls = 0;
+	png_image_source source = { 301, 157, 16, 0, fill_from_source_pixel, & calls };
+	file = tmpfile();
+	assert( png_image_save_source( & source, file, PNG_IMAGE_FAST, NULL ) );
+	png_image loaded;
+	rewind( file );
+	assert( png_image_load( & loaded, file, PNG_IMAGE_NONE ) );
+	assert( loaded.compare( image.view(), make_pixel( 0, 0, 0, 0 ) ) == 0 );
+	fclose( file );
+}
+
+static void test_image_optimize( void )
+{
+	// A few colors, which should end up as a palette; gray, which should lose
+	// its color channels; and translucent noise, which has to stay RGBA.
+	png_image few, gray, noise;
+	png_image_alloc( & few, 200, 120 );
+	png_image_alloc( & gray, 150, 90 );
+	png_image_alloc( & noise, 97, 61 );
+	uint32_t seed = 777;
+	for (uint32_t y = 0; y < 120; y++)
+	{
+		for (uint32_t x = 0; x < 200; x++)
+		{
+			few.set_pixel( x, y, ((x / 20) + (y / 30)) % 3 == 0 ? make_pixel( 255, 0, 0, 128 ) : make_pixel( (uint8_t) (x / 50 * 60), 100, 30, 255 ) );
+			if (x < 150 && y < 90)
+			{
+				const uint8_t level = (uint8_t) ((x * 2) + (y / 3));
+				gray.set_pixel( x, y, make_pixel( level, level, level, 255 ) );
+			}
+			if (x < 97 && y < 61)
+			{
+				seed = (seed * 1103515245) + 12345;
+				noise.set_pixel( x, y, make_pixel( (uint8_t) (seed >> 8), (uint8_t) (seed >> 16), (uint8_t) (seed >> 24), (uint8_t) (seed >> 12) ) );
+			}
+		}
+	}
+	
+	png_image * images[] = { & few, & gray, & noise };
+	const uint8_t colorTypes[] = { 3, 0, 6 };
+	for (size_t n = 0; n < 3; n++)
+	{
+		const png_image_view view = images[n]->view();
+		png_optimize_result result;
+		FILE * file = tmpfile();
+		assert( png_image_optimize( & view, file, PNG_IMAGE_NONE, 0, NULL, & result ) );
+		assert( result.color_type == colorTypes[n] );
+		assert( result.trials > 1 );
+		fseek( file, 0, SEEK_END );
+		assert( (uint64_t) ftell( file ) == result.size );
+		
+		// Exactly the same pixels, and no bigger than the smallest preset.
+		png_image loaded;
+		rewind( file );
+		assert( png_image_load( & loaded, file, PNG_IMAGE_NONE ) );
+		assert( loaded.compare( view, make_pixel( 0, 0, 0, 0 ) ) == 0 );
+		fclose( file );
+		file = tmpfile();
+		assert( png_image_save( images[n], file, PNG_IMAGE_SMALL ) );
+		fseek( file, 0, SEEK_END );
+		assert( result.size <= (uint64_t) ftell( file ) );
+		fclose( file );
+	}
+	
+	// Out of time straight away, it still writes the first candidate.
+	png_image_options options;
+	png_image_options_init( & options );
+	options.threads = 2;
+	const png_image_view view = few.view();
+	png_optimize_result result;
+	FILE * file = tmpfile();
+	assert( png_image_optimize( & view, file, PNG_IMAGE_NONE, 1, & options, & result ) );
+	png_image loaded;
+	rewind( file );
+	assert( png_image_load( & loaded, file, PNG_IMAGE_NONE ) );
+	assert( loaded.compare( view, make_pixel( 0, 0, 0, 0 ) ) == 0 );
+	fclose( file );
+}
+
+static std::vector<uint8_t> file_bytes( FILE * file )
+{
+	std::vector<uint8_t> bytes;
+	rewind( file );
+	uint8_t block[4096];
+	size_t n;
+	while ((n = fread( block, 1, sizeof block, file )) > 0)
+	{
+		bytes.insert( bytes.end(), block, block + n );
+	}
+	return bytes;
+}
+
+
+static void test_image_transcode( void )
+{
+	// The same file as a load and a save, either way between the formats;
+	// the interlaced file and the flip take the load and save path.
+	const char * paths[] = { "../../Images/Test24.png", "../../Images/Test8.png", "../../Images/Test8Grayscale.png", "../../Images/TestApple.png", "../../Images/Test24Interlaced.png" };
+	const uint32_t flags[] = { PNG_IMAGE_NONE, PNG_IMAGE_OPTIMIZE_FOR_IOS, PNG_IMAGE_FAST, PNG_IMAGE_FLIP_VERTICAL | PNG_IMAGE_OPTIMIZE_FOR_IOS };
+	for (size_t n = 0; n < 5; n++)
+	{
+		for (size_t f = 0; f < 4; f++)
+		{
+			png_image image;
+			assert( image.load( paths[n] ) );
+			FILE * saved = tmpfile();
+			assert( png_image_save( & image, saved, flags[f] ) );
+			
+			FILE * transcoded = tmpfile();
+			assert( png_image_transcode_path( paths[n], "../../Images/Save24.png", flags[f], NULL ) );
+			FILE * input = fopen( paths[n], "r" );
+			assert( png_image_transcode( input, transcoded, flags[f], NULL ) );
+			fclose( input );
+			assert( file_bytes( transcoded ) == file_bytes( saved ) );
+			fclose( transcoded );
+			fclose( saved );
+		}
+	}
+	
+	// Memory goes with the width: a tall image transcodes in a fraction of
+	// what its pixels would take, while the budget still applies. The I/O
+	// buffers, which count too, are kept small.
+	uint32_t calls = 0;
+	png_image_source source = { 512, 2048, 0, 0, fill_from_source_pixel, & calls };
+	FILE * tall = tmpfile();
+	assert( png_image_save_source( & source, tall, PNG_IMAGE_FAST, NULL ) );
+	png_image_stats stats;
+	png_image_options options;
+	png_image_options_init( & options );
+	options.stats = & stats;
+	options.io_buffer_size = 16384;
+	FILE * output = tmpfile();
+	rewind( tall );
+	assert( png_image_transcode( tall, output, PNG_IMAGE_SMALL, & options ) );
+	assert( stats.rows > 0 );
+	assert( stats.alloc_peak_bytes < (uint64_t) 512 * 2048 * 4 / 8 );
+	
+	png_image image;
+	rewind( output );
+	assert( png_image_load( & image, output, PNG_IMAGE_NONE ) );
+	assert( image.width == 512 && image.height == 2048 );
+	assert( image.get_pixel( 100, 1500 ) == source_pixel( 100, 1500 ) );
+	fclose( output );
+	
+	options.stats = NULL;
+	options.max_bytes = 1024;
+	output = tmpfile();
+	rewind( tall );
+	assert( !png_image_transcode( tall, output, PNG_IMAGE_NONE, & options ) );
+	fclose( output );
+	
+	// A file cut short fails part way through the rows.
+	std::vector<uint8_t> bytes = file_bytes( tall );
+	FILE * cut = tmpfile();
+	fwrite( & bytes[0], 1, bytes.size() / 2, cut );
+	rewind( cut );
+	output = tmpfile();
+	assert( !png_image_transcode( cut, output, PNG_IMAGE_NONE, NULL ) );
+	fclose( output );
+	fclose( cut );
+	fclose( tall );
+}
+
+static void test_image_hashes( void )
+{
+	// The pixel hash is XXH64 of the pixels as loaded.
+	uint32_t calls = 0;
+	png_image_source small = { 11, 3, 0, 0, fill_from_source_pixel, & calls };
+	FILE * file = tmpfile();
+	assert( png_image_save_source( & small, file, PNG_IMAGE_NONE, NULL ) );
+	png_image_hashes hashes;
+	png_image_options options;
+	png_image_options_init( & options );
+	options.hashes = & hashes;
+	png_image image;
+	rewind( file );
+	assert( png_image_load_ex( & image, file, PNG_IMAGE_NONE, & options ) );
+	assert( hashes.pixels == 0xFEFA4B7C04E6B18BULL );
+	assert( hashes.idat != 0 );
+	png_image_free( & image );
+	fclose( file );
+	
+	// The same pixels saved three ways, with their IDAT chunks cut up
+	// differently, compressed differently, and with restart points.
+	png_image_source source = { 300, 200, 0, 0, fill_from_source_pixel, & calls };
+	png_image_options saveOptions;
+	png_image_options_init( & saveOptions );
+	FILE * plain = tmpfile();
+	assert( png_image_save_source( & source, plain, PNG_IMAGE_NONE, NULL ) );
+	saveOptions.zbuf_size = 1000;
+	FILE * chunked = tmpfile();
+	assert( png_image_save_source( & source, chunked, PNG_IMAGE_NONE, & saveOptions ) );
+	saveOptions.zbuf_size = 0;
+	saveOptions.restart_rows = 16;
+	FILE * restarts = tmpfile();
+	assert( png_image_save_source( & source, restarts, PNG_IMAGE_NONE, & saveOptions ) );
+	FILE * fast = tmpfile();
+	assert( png_image_save_source( & source, fast, PNG_IMAGE_FAST, NULL ) );
+	
+	// Every way of decoding them hashes the pixels the same, flipped or not;
+	// the IDAT hash follows the compressed data, not the chunks.
+	FILE * files[] = { plain, chunked, restarts, fast };
+	const uint32_t flags[] = { PNG_IMAGE_NONE, PNG_IMAGE_FLIP_VERTICAL, PNG_IMAGE_PIPELINED, PNG_IMAGE_PARALLEL, PNG_IMAGE_MAPPED };
+	png_image_hashes first = { 0, 0 };
+	uint64_t idat[4];
+	for (size_t f = 0; f < 4; f++)
+	{
+		for (size_t n = 0; n < 5; n++)
+		{
+			rewind( files[f] );
+			assert( png_image_load_ex( & image, files[f], flags[n], & options ) );
+			png_image_free( & image );
+			if (f == 0 && n == 0)
+			{
+				first = hashes;
+			}
+			assert( hashes.pixels == first.pixels );
+			if (n == 0)
+			{
+				idat[f] = hashes.idat;
+			}
+			assert( hashes.idat == idat[f] );
+		}
+	}
+	assert( idat[1] == idat[0] );
+	assert( idat[2] != idat[0] && idat[3] != idat[0] );
+	
+	// Interlacing changes the IDAT data but not the pixels.
+	assert( image.load( "../../Images/Test24.png", PNG_IMAGE_NONE, options ) );
+	png_image_free( & image );
+	const png_image_hashes progressive = hashes;
+	assert( image.load( "../../Images/Test24Interlaced.png", PNG_IMAGE_NONE, options ) );
+	png_image_free( & image );
+	assert( hashes.pixels == progressive.pixels && hashes.idat != progressive.idat );
+	
+	// A change to the pixels changes the hash; failures and saves zero it.
+	rewind( plain );
+	assert( png_image_load_ex( & image, plain, PNG_IMAGE_PREMULTIPLY_ALPHA, & options ) );
+	png_image_free( & image );
+	assert( hashes.pixels != first.pixels && hashes.idat == first.idat );
+	assert( !png_image_load_path_ex( & image, "../../Images/TestAppleError.png", PNG_IMAGE_NONE, & options ) );
+	assert( hashes.pixels == 0 && hashes.idat == 0 );
+	hashes = first;
+	rewind( plain );
+	assert( png_image_load_ex( & image, plain, PNG_IMAGE_NONE, NULL ) );
+	FILE * saved = tmpfile();
+	assert( png_image_save_ex( & image, saved, PNG_IMAGE_NONE, & options ) );
+	assert( hashes.pixels == 0 && hashes.idat == 0 );
+	fclose( saved );
+	png_image_free( & image );
+	
+	// Data after the end of the zlib stream, in an IDAT chunk of its own,
+	// is hashed whichever way the rows are decoded.
+	const std::vector<uint8_t> contents = file_bytes( restarts );
+	const long end = find_chunk( restarts, "rsPT" );
+	assert( end > 0 );
+	uint8_t extra[4 + 4 + 10 + 4] = { 0, 0, 0, 10, 'I', 'D', 'A', 'T', 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+	png_save_uint_32( extra + 18, (png_uint_32) crc32( 0, extra + 4, 14 ) );
+	FILE * trailing = tmpfile();
+	fwrite( & contents[0], end, 1, trailing );
+	fwrite( extra, sizeof extra, 1, trailing );
+	fwrite( & contents[end], contents.size() - end, 1, trailing );
+	uint64_t trailingIdat = 0;
+	for (size_t n = 0; n < 5; n++)
+	{
+		rewind( trailing );
+		assert( png_image_load_ex( & image, trailing, flags[n], & options ) );
+		png_image_free( & image );
+		assert( hashes.pixels == first.pixels );
+		trailingIdat = n == 0 ? hashes.idat : trailingIdat;
+		assert( hashes.idat == trailingIdat && hashes.idat != idat[2] );
+	}
+	fclose( trailing );
+	
+	for (size_t f = 0; f < 4; f++)
+	{
+		fclose( files[f] );
+	}
+}
+
+
+#ifdef PNGIO_CXX11
+// What png_image_load gives with flags, with red and blue swapped for BGRA.
+template <typename Reader>
+static void check_reader( const char * path, uint32_t flags, bool bgra )
+{
+	png_image expected;
+	assert( expected.load( path, flags ) );
+	if (bgra)
+	{
+		for (png_pixel & p : expected.pixels())
+		{
+			p = make_pixel( p.b, p.g, p.r, p.a );
+		}
+	}
+	
+	Reader reader;
+	assert( reader.open( path ) );
+	assert( reader.width() == expected.width && reader.height() == expected.height );
+	
+	// Rows wider than the image, to check the stride is kept to.
+	const size_t stride = (size_t) expected.width * 4 + 12;
+	std::vector<uint8_t> pixels( stride * expected.height, 0xEE );
+	assert( reader.read( & pixels[0], stride ) );
+	for (uint32_t y = 0; y < expected.height; y++)
+	{
+		assert( memcmp( & pixels[stride * y], expected.row( y ).data, (size_t) expected.width * 4 ) == 0 );
+		assert( pixels[stride * y + expected.width * 4] == 0xEE );
+	}
+	assert( !reader.read( & pixels[0], stride ) );
+}
+
+
+template <typename Writer>
+static void check_writer( const png_image & image, const std::vector<uint8_t> & pixels, uint32_t flags )
+{
+	FILE * saved = tmpfile();
+	assert( png_image_save( const_cast<png_image *>( & image ), saved, flags ) );
+	FILE * written = tmpfile();
+	assert( Writer::save( written, & pixels[0], image.width, image.height, (size_t) image.width * 4 ) );
+	assert( file_bytes( written ) == file_bytes( saved ) );
+	fclose( written );
+	fclose( saved );
+}
+#endif
+
+
+static void test_image_templates( void )
+{
+	#ifdef PNGIO_CXX11
+	// An RGBA file with every alpha, alongside the RGB, palette, gray, Apple
+	// and interlaced ones.
+	uint32_t calls = 0;
+	png_image_source source = { 64, 48, 0, 0, fill_from_source_pixel, & calls };
+	assert( png_image_save_source_path( & source, "../../Images/Save24.png", PNG_IMAGE_NONE, NULL ) );
+	const char * paths[] = { "../../Images/Test24.png", "../../Images/Test8.png", "../../Images/Test8Grayscale.png", "../../Images/TestApple.png", "../../Images/Test24Interlaced.png", "../../Images/Save24.png" };
+	for (size_t n = 0; n < 6; n++)
+	{
+		check_reader< pngio::reader<pngio::rgba8> >( paths[n], PNG_IMAGE_NONE, false );
+		check_reader< pngio::reader<pngio::rgba8, pngio::flipped> >( paths[n], PNG_IMAGE_FLIP_VERTICAL, false );
+		check_reader< pngio::reader<pngio::rgba8, pngio::premultiplied> >( paths[n], PNG_IMAGE_PREMULTIPLY_ALPHA, false );
+		check_reader< pngio::reader<pngio::bgra8> >( paths[n], PNG_IMAGE_NONE, true );
+		check_reader< pngio::reader<pngio::bgra8, pngio::premultiplied, pngio::flipped> >( paths[n], PNG_IMAGE_PREMULTIPLY_ALPHA | PNG_IMAGE_FLIP_VERTICAL, true );
+	}
+	
+	// Writers match png_image_save byte for byte, from RGBA or BGRA rows.
+	png_image image;
+	assert( image.load( "../../Images/Save24.png" ) );
+	const std::vector<uint8_t> rgba( image.data, image.data + (size_t) image.width * image.height * 4 );
+	std::vector<uint8_t> bgra( rgba );
+	for (size_t i = 0; i < bgra.size(); i += 4)
+	{
+		std::swap( bgra[i], bgra[i + 2] );
+	}
+	check_writer< pngio::writer<pngio::rgba8> >( image, rgba, PNG_IMAGE_NONE );
+	check_writer< pngio::writer<pngio::bgra8, pngio::small> >( image, bgra, PNG_IMAGE_SMALL );
+	check_writer< pngio::writer<pngio::rgba8, pngio::ios, pngio::flipped> >( image, rgba, PNG_IMAGE_OPTIMIZE_FOR_IOS | PNG_IMAGE_FLIP_VERTICAL );
+	check_writer< pngio::writer<pngio::bgra8, pngio::ios> >( image, bgra, PNG_IMAGE_OPTIMIZE_FOR_IOS );
+	
+	// Premultiplied rows are taken back to straight alpha as pngio does for
+	// Apple's files: what png_image_load gives for them stored that way is
+	// what png_image_save must match.
+	png_image premultiplied;
+	assert( premultiplied.load( "../../Images/Save24.png", PNG_IMAGE_PREMULTIPLY_ALPHA ) );
+	std::vector<uint8_t> premultipliedRgba( premultiplied.data, premultiplied.data + rgba.size() );
+	FILE * stored = tmpfile();
+	assert( (pngio::writer<pngio::rgba8, pngio::premultiplied, pngio::ios>::save( stored, & premultipliedRgba[0], image.width, image.height, (size_t) image.width * 4 )) );
+	png_image straight;
+	rewind( stored );
+	assert( png_image_load( & straight, stored, PNG_IMAGE_NONE ) );
+	fclose( stored );
+	assert( straight.compare( image.view(), make_pixel( 0, 0, 0, 0 ) ) != 0 );
+	std::vector<uint8_t> premultipliedBgra( premultipliedRgba );
+	for (size_t i = 0; i < premultipliedBgra.size(); i += 4)
+	{
+		std::swap( premultipliedBgra[i], premultipliedBgra[i + 2] );
+	}
+	check_writer< pngio::writer<pngio::rgba8, pngio::premultiplied> >( straight, premultipliedRgba, PNG_IMAGE_NONE );
+	check_writer< pngio::writer<pngio::bgra8, pngio::premultiplied, pngio::small> >( straight, premultipliedBgra, PNG_IMAGE_SMALL );
+	
+	// Apple's own pixels, BGRA and premultiplied, go out and back unchanged.
+	pngio::reader<pngio::bgra8, pngio::premultiplied> apple;
+	assert( apple.open( "../../Images/TestApple.png" ) );
+	const uint32_t w = apple.width();
+	const uint32_t h = apple.height();
+	std::vector<uint8_t> pixels( (size_t) w * h * 4 );
+	assert( apple.read( & pixels[0], (size_t) w * 4 ) );
+	typedef pngio::writer<pngio::bgra8, pngio::premultiplied, pngio::ios> apple_writer;
+	assert( apple_writer::save( "../../Images/Save24.png", & pixels[0], w, h, (size_t) w * 4 ) );
+	FILE * saved = fopen( "../../Images/Save24.png", "r" );
+	assert( memcmp( & file_bytes( saved )[12], "CgBI", 4 ) == 0 );
+	fclose( saved );
+	png_image reloaded;
+	assert( apple.load( "../../Images/Save24.png", reloaded ) );
+	assert( memcmp( reloaded.data, & pixels[0], pixels.size() ) == 0 );
+	
+	// Missing and truncated files fail, leaving nothing behind.
+	assert( !apple.open( "/nonexistent/pngio.png" ) );
+	assert( !apple.load( "/nonexistent/pngio.png", reloaded ) && reloaded.data == NULL );
+	png_image_source large = { 256, 256, 0, 0, fill_from_source_pixel, & calls };
+	FILE * file = tmpfile();
+	assert( png_image_save_source( & large, file, PNG_IMAGE_NONE, NULL ) );
+	std::vector<uint8_t> bytes = file_bytes( file );
+	fclose( file );
+	FILE * cut = tmpfile();
+	fwrite( & bytes[0], 1, bytes.size() / 2, cut );
+	rewind( cut );
+	assert( apple.open( cut ) );
+	pixels.assign( (size_t) apple.width() * apple.height() * 4, 0 );
+	assert( !apple.read( & pixels[0], (size_t) apple.width() * 4 ) );
+	fclose( cut );
+	#endif
+}
+
+
+// The orientation flags done the slow way, after loading.
+static void turn_image( png_image & image, uint32_t flags )
+{
+	if (flags & PNG_IMAGE_FLIP_VERTICAL)
+	{
+		image.flip_vertical();
+	}
+	if (flags & PNG_IMAGE_FLIP_HORIZONTAL)
+	{
+		image.flip_horizontal();
+	}
+	if (flags & PNG_IMAGE_TRANSPOSE)
+	{
+		assert( image.rotate_90( true ) );
+		image.flip_horizontal();
+	}
+	if (flags & PNG_IMAGE_ROTATE_90)
+	{
+		assert( image.rotate_90( true ) );
+	}
+	if (flags & PNG_IMAGE_ROTATE_180)
+	{
+		image.rotate_180();
+	}
+	if (flags & PNG_IMAGE_ROTATE_270)
+	{
+		assert( image.rotate_90( false ) );
+	}
+}
+
+
+static void test_image_orientation( void )
+{
+	// Sizes that aren't a multiple of the tiles, with restart points that
+	// don't fall on them either.
+	png_image_options options;
+	png_image_options_init( & options );
+	options.restart_rows = 10;
+	options.threads = 3;
+	uint32_t calls = 0;
+	png_image_source source = { 75, 53, 0, 0, fill_from_source_pixel, & calls };
+	FILE * file = tmpfile();
+	assert( png_image_save_source( & source, file, PNG_IMAGE_NONE, & options ) );
+	
+	png_image_hashes hashes, expectedHashes;
+	options.hashes = & expectedHashes;
+	png_image plain;
+	rewind( file );
+	assert( png_image_load_ex( & plain, file, PNG_IMAGE_NONE, & options ) );
+	
+	static const uint32_t turns[] =
+	{
+		PNG_IMAGE_FLIP_HORIZONTAL,
+		PNG_IMAGE_FLIP_HORIZONTAL | PNG_IMAGE_FLIP_VERTICAL,
+		PNG_IMAGE_TRANSPOSE,
+		PNG_IMAGE_ROTATE_90,
+		PNG_IMAGE_ROTATE_180,
+		PNG_IMAGE_ROTATE_270,
+		PNG_IMAGE_ROTATE_90 | PNG_IMAGE_FLIP_VERTICAL,
+		PNG_IMAGE_ROTATE_270 | PNG_IMAGE_FLIP_HORIZONTAL | PNG_IMAGE_PREMULTIPLY_ALPHA,
+		PNG_IMAGE_TRANSPOSE | PNG_IMAGE_ROTATE_180,
+		PNG_IMAGE_ROTATE_90 | PNG_IMAGE_ROTATE_180 | PNG_IMAGE_ROTATE_270,
+	};
+	static const uint32_t paths[] = { PNG_IMAGE_NONE, PNG_IMAGE_PIPELINED, PNG_IMAGE_PARALLEL };
+	for (size_t t = 0; t < sizeof turns / sizeof turns[0]; t++)
+	{
+		png_image expected;
+		rewind( file );
+		assert( png_image_load_ex( & expected, file, turns[t] & PNG_IMAGE_PREMULTIPLY_ALPHA, & options ) );
+		turn_image( expected, turns[t] );
+		
+		// Every way of decoding turns the rows the same, and hashes them
+		// as they're stored.
+		options.hashes = & hashes;
+		for (size_t p = 0; p < 3; p++)
+		{
+			png_image image;
+			rewind( file );
+			assert( png_image_load_ex( & image, file, turns[t] | paths[p], & options ) );
+			assert( image.width == expected.width && image.height == expected.height );
+			assert( memcmp( image.data, expected.data, (size_t) image.width * image.height * 4 ) == 0 );
+			assert( hashes.idat == expectedHashes.idat );
+			if (!(turns[t] & PNG_IMAGE_PREMULTIPLY_ALPHA))
+			{
+				assert( hashes.pixels == expectedHashes.pixels );
+			}
+		}
+		options.hashes = & expectedHashes;
+		
+		// Interlaced rows are turned once the last pass is in.
+		png_image interlaced, turned;
+		assert( turned.load( "../../Images/Test24Interlaced.png", turns[t] & PNG_IMAGE_PREMULTIPLY_ALPHA ) );
+		turn_image( turned, turns[t] );
+		assert( interlaced.load( "../../Images/Test24Interlaced.png", turns[t] ) );
+		assert( interlaced.width == turned.width && interlaced.height == turned.height );
+		assert( memcmp( interlaced.data, turned.data, (size_t) turned.width * turned.height * 4 ) == 0 );
+	}
+	
+	// Each decoding thread turns its rows in a band of its own, 32 rows
+	// deep, counted against the load. A budget without room for them all
+	// decodes the rows in sequence instead.
+	png_image_stats stats;
+	options.stats = & stats;
+	options.hashes = NULL;
+	png_image threaded, sequential;
+	rewind( file );
+	assert( png_image_load_ex( & threaded, file, PNG_IMAGE_ROTATE_90 | PNG_IMAGE_PARALLEL, & options ) );
+	const uint64_t band = 75 * 4 * 32;
+	assert( stats.alloc_peak_bytes >= (75 * 53 * 4) + (3 * band) );
+	options.max_bytes = stats.alloc_peak_bytes - band;
+	rewind( file );
+	assert( png_image_load_ex( & sequential, file, PNG_IMAGE_ROTATE_90 | PNG_IMAGE_PARALLEL, & options ) );
+	assert( stats.alloc_peak_bytes <= options.max_bytes );
+	assert( memcmp( sequential.data, threaded.data, 75 * 53 * 4 ) == 0 );
+	fclose( file );
+}
+
+
+// A mip level made by hand from the one above: 2 by 2 averages in linear
+// light, weighted by alpha, in double precision.
+static png_image_view expected_mip_level( const png_image_view & above, std::vector<png_pixel> & pixels, bool premultiplied )
+{
+	const uint32_t w = above.width > 1 ? above.width / 2 : 1;
+	const uint32_t h = above.height > 1 ? above.height / 2 : 1;
+	pixels.resize( (size_t) w * h );
+	for (uint32_t y = 0; y < h; y++)
+	{
+		for (uint32_t x = 0; x < w; x++)
+		{
+			double sums[4] = { 0, 0, 0, 0 };
+			for (uint32_t i = 0; i < 4; i++)
+			{
+				const uint32_t sx = MIN( (x * 2) + (i & 1), above.width - 1 );
+				const uint32_t sy = MIN( (y * 2) + (i >> 1), above.height - 1 );
+				png_pixel p = above.row( sy )[sx];
+				if (premultiplied && p.a != 0xFF)
+				{
+					const unsigned a = p.a ? p.a : 1;
+					p = make_pixel( MIN( (p.r * 255u) / a, 255u ), MIN( (p.g * 255u) / a, 255u ), MIN( (p.b * 255u) / a, 255u ), p.a );
+				}
+				const uint8_t c[3] = { p.r, p.g, p.b };
+				for (int k = 0; k < 3; k++)
+				{
+					const double v = c[k] / 255.0;
+					sums[k] += (v <= 0.04045 ? v / 12.92 : pow( (v + 0.055) / 1.055, 2.4 )) * p.a / 255.0 / 4;
+				}
+				sums[3] += p.a / 255.0 / 4;
+			}
+			png_pixel & d = pixels[((size_t) w * y) + x];
+			d = make_pixel( 0, 0, 0, (uint8_t) ((sums[3] * 255) + 0.5) );
+			if (d.a == 0)
+			{
+				continue;
+			}
+			uint8_t c[3];
+			for (int k = 0; k < 3; k++)
+			{
+				const double l = sums[k] / sums[3];
+				c[k] = (uint8_t) (((l <= 0.0031308 ? l * 12.92 : (1.055 * pow( l, 1 / 2.4 )) - 0.055) * 255) + 0.5);
+				c[k] = premultiplied ? (uint8_t) ((c[k] * d.a) / 255) : c[k];
+			}
+			d = make_pixel( c[0], c[1], c[2], d.a );
+		}
+	}
+	png_image_view view = { (const uint8_t *) & pixels[0], w, h, (size_t) w * 4, PNG_VIEW_RGBA };
+	return view;
+}
+
+
+static void assert_box_chain( const png_image & image, bool premultiplied )
+{
+	uint32_t levels = 0;
+	for (uint32_t size = MAX( image.width, image.height ); size > 1; size /= 2)
+	{
+		levels++;
+	}
+	assert( image.mip_levels == levels );
+	for (uint32_t level = 1; level <= levels; level++)
+	{
+		const png_image_view above = image.mip_level( level - 1 );
+		const png_image_view actual = image.mip_level( level );
+		std::vector<png_pixel> pixels;
+		const png_image_view expected = expected_mip_level( above, pixels, premultiplied );
+		assert( actual.width == expected.width && actual.height == expected.height );
+		assert( actual.data == above.data + (above.stride * above.height) );
+		assert( png_image_compare( & actual, & expected, make_pixel( 1, 1, 1, 1 ), NULL ) == 0 );
+	}
+	assert( image.mip_level( levels + 1 ).data == NULL );
+}
+
+
+static bool same_chain( const png_image & a, const png_image & b )
+{
+	const png_image_view last = a.mip_level( a.mip_levels );
+	return a.width == b.width && a.height == b.height && a.mip_levels == b.mip_levels &&
+		memcmp( a.data, b.data, (size_t) (last.data + 4 - a.data) ) == 0;
+}
+
+
+static void test_image_mipmaps( void )
+{
+	// Black and white average to sRGB's middle gray rather than 128, and a
+	// clear pixel's color doesn't count.
+	png_image small;
+	png_image_alloc( & small, 4, 2 );
+	small.set_pixel( 0, 0, make_pixel( 0, 0, 0 ) );
+	small.set_pixel( 1, 0, make_pixel( 255, 255, 255 ) );
+	small.set_pixel( 0, 1, make_pixel( 255, 255, 255 ) );
+	small.set_pixel( 1, 1, make_pixel( 0, 0, 0 ) );
+	small.fill_rect( 2, 0, 1, 2, make_pixel( 255, 0, 0 ) );
+	small.fill_rect( 3, 0, 1, 2, make_pixel( 0, 255, 0, 0 ) );
+	FILE * file = tmpfile();
+	assert( png_image_save( & small, file, PNG_IMAGE_NONE ) );
+	png_image chain;
+	rewind( file );
+	assert( png_image_load( & chain, file, PNG_IMAGE_MIPMAPS ) );
+	assert( chain.mip_levels == 2 );
+	assert( chain.mip_level( 1 ).width == 2 && chain.mip_level( 1 ).height == 1 );
+	assert( chain.mip_level( 1 ).row( 0 )[0] == make_pixel( 188, 188, 188 ) );
+	assert( chain.mip_level( 1 ).row( 0 )[1] == make_pixel( 255, 0, 0, 128 ) );
+	png_image premultiplied;
+	rewind( file );
+	assert( png_image_load( & premultiplied, file, PNG_IMAGE_MIPMAPS | PNG_IMAGE_PREMULTIPLY_ALPHA ) );
+	assert( premultiplied.mip_level( 1 ).row( 0 )[1] == make_pixel( 128, 0, 0, 128 ) );
+	fclose( file );
+	
+	// Every way of decoding and turning the rows gives the chain for the
+	// pixels as loaded, whether level 1 follows the rows or comes after.
+	png_image_options options;
+	png_image_options_init( & options );
+	options.restart_rows = 10;
+	options.threads = 3;
+	uint32_t calls = 0;
+	png_image_source source = { 75, 53, 0, 0, fill_from_source_pixel, & calls };
+	file = tmpfile();
+	assert( png_image_save_source( & source, file, PNG_IMAGE_NONE, & options ) );
+	static const uint32_t loads[] =
+	{
+		PNG_IMAGE_NONE,
+		PNG_IMAGE_FLIP_VERTICAL,
+		PNG_IMAGE_PREMULTIPLY_ALPHA,
+		PNG_IMAGE_ROTATE_90,
+		PNG_IMAGE_FLIP_HORIZONTAL | PNG_IMAGE_FLIP_VERTICAL | PNG_IMAGE_PREMULTIPLY_ALPHA,
+	};
+	static const uint32_t paths[] = { PNG_IMAGE_NONE, PNG_IMAGE_PIPELINED, PNG_IMAGE_PARALLEL };
+	for (size_t l = 0; l < sizeof loads / sizeof loads[0]; l++)
+	{
+		png_image plain, expected;
+		rewind( file );
+		assert( png_image_load_ex( & plain, file, loads[l], & options ) );
+		rewind( file );
+		assert( png_image_load_ex( & expected, file, loads[l] | PNG_IMAGE_MIPMAPS, & options ) );
+		assert( expected.mip_levels == 6 && memcmp( expected.data, plain.data, (size_t) plain.width * plain.height * 4 ) == 0 );
+		assert_box_chain( expected, (loads[l] & PNG_IMAGE_PREMULTIPLY_ALPHA) != 0 );
+		
+		png_image kaiser;
+		rewind( file );
+		assert( png_image_load_ex( & kaiser, file, loads[l] | PNG_IMAGE_MIPMAPS_KAISER, & options ) );
+		assert( kaiser.mip_levels == 6 && !same_chain( kaiser, expected ) );
+		for (size_t p = 0; p < 3; p++)
+		{
+			png_image image;
+			rewind( file );
+			assert( png_image_load_ex( & image, file, loads[l] | paths[p] | PNG_IMAGE_MIPMAPS, & options ) );
+			assert( same_chain( image, expected ) );
+			png_image_free( & image );
+			rewind( file );
+			assert( png_image_load_ex( & image, file, loads[l] | paths[p] | PNG_IMAGE_MIPMAPS_KAISER, & options ) );
+			assert( same_chain( image, kaiser ) );
+		}
+	}
+	fclose( file );
+	
+	// Interlaced rows only finish with the last pass.
+	png_image interlaced;
+	assert( interlaced.load( "../../Images/Test24Interlaced.png", PNG_IMAGE_MIPMAPS ) );
+	assert_box_chain( interlaced, false );
+	
+	// Flat color stays flat through the Kaiser filter's lobes.
+	png_image flat;
+	png_image_alloc( & flat, 40, 30 );
+	flat.fill_rect( 0, 0, 40, 30, make_pixel( 200, 100, 50, 160 ) );
+	file = tmpfile();
+	assert( png_image_save( & flat, file, PNG_IMAGE_NONE ) );
+	png_image flatChain;
+	rewind( file );
+	assert( png_image_load( & flatChain, file, PNG_IMAGE_MIPMAPS_KAISER ) );
+	fclose( file );
+	for (uint32_t level = 0; level <= flatChain.mip_levels; level++)
+	{
+		const png_image_view view = flatChain.mip_level( level );
+		for (uint32_t y = 0; y < view.height; y++)
+		{
+			for (uint32_t x = 0; x < view.width; x++)
+			{
+				assert( view.row( y )[x] == make_pixel( 200, 100, 50, 160 ) );
+			}
+		}
+	}
+	
+	// Large levels are split between threads, mapped or not, to the same
+	// result; the chain is dropped when rotating swaps the buffer.
+	png_image_source large = { 1100, 1030, 0, 0, fill_from_source_pixel, & calls };
+	file = tmpfile();
+	assert( png_image_save_source( & large, file, PNG_IMAGE_STORED, NULL ) );
+	png_image serial, threaded, mapped;
+	rewind( file );
+	assert( png_image_load_ex( & serial, file, PNG_IMAGE_MIPMAPS, & options ) );
+	assert_box_chain( serial, false );
+	rewind( file );
+	assert( png_image_load_ex( & threaded, file, PNG_IMAGE_MIPMAPS | PNG_IMAGE_PARALLEL, & options ) );
+	assert( same_chain( threaded, serial ) );
+	rewind( file );
+	assert( png_image_load_ex( & mapped, file, PNG_IMAGE_MIPMAPS | PNG_IMAGE_PARALLEL | PNG_IMAGE_MAPPED, & options ) );
+	assert( mapped.mapped && same_chain( mapped, serial ) );
+	
+	// Each thread building the Kaiser chain has scratch of its own, counted
+	// against the load; a budget without room for it builds the levels on
+	// the loading thread.
+	png_image_stats stats;
+	options.stats = & stats;
+	png_image kaiser, kaiserSerial;
+	rewind( file );
+	assert( png_image_load_ex( & kaiser, file, PNG_IMAGE_MIPMAPS_KAISER | PNG_IMAGE_PARALLEL, & options ) );
+	const uint64_t scratch = (uint64_t) 1100 * 16 * 9;
+	const uint64_t threadedPeak = stats.alloc_peak_bytes;
+	options.max_bytes = threadedPeak - scratch;
+	rewind( file );
+	assert( png_image_load_ex( & kaiserSerial, file, PNG_IMAGE_MIPMAPS_KAISER | PNG_IMAGE_PARALLEL, & options ) );
+	assert( stats.alloc_peak_bytes + (2 * scratch) <= threadedPeak && same_chain( kaiserSerial, kaiser ) );
+	options.stats = NULL;
+	options.max_bytes = 0;
+	fclose( file );
+	assert( mapped.rotate_90() && mapped.mip_levels == 0 && mapped.mip_level( 1 ).data == NULL );
+	
+	// Changing the pixels in place drops the chain as well, after a level
+	// of it has been drawn onto the image if need be. Mapped, only the
+	// pixels are left to unmap.
+	const png_image_view half = serial.mip_level( 1 );
+	serial.blit( 0, 0, half );
+	assert( serial.mip_levels == 0 && serial.row( 0 )[0] == half.row( 0 )[0] );
+	threaded.flip_vertical();
+	assert( threaded.mip_levels == 0 && threaded.mip_level( 1 ).data == NULL );
+	png_image_source square = { 1030, 1030, 0, 0, fill_from_source_pixel, & calls };
+	file = tmpfile();
+	assert( png_image_save_source( & square, file, PNG_IMAGE_STORED, NULL ) );
+	png_image turned;
+	rewind( file );
+	assert( png_image_load_ex( & turned, file, PNG_IMAGE_MIPMAPS | PNG_IMAGE_MAPPED, & options ) );
+	fclose( file );
+	assert( turned.mip_levels == 10 && turned.rotate_90() && turned.mip_levels == 0 );
+	size_t mappedSize = 0;
+	uint8_t * taken = png_image_take_ex( & turned, & mappedSize );
+	assert( mappedSize == (size_t) 1030 * 1030 * 4 && munmap( taken, mappedSize ) == 0 );
+}
+
+
 int main( int argc, const char * argv[] )
 {
 	test_24_bit_image();
@@ -200,6 +2524,30 @@ int main( int argc, const char * argv[] )
 	test_8_bit_image_grayscale();
 	test_image_apple();
 	test_image_save();
+	test_simd_transforms_match_scalar();
+	test_simd_filters_match_scalar();
+	test_fused_read_matches_generic();
+	test_image_stats();
+	test_image_trace();
+	test_image_limits();
+	test_image_mapped();
+	test_image_save_source();
+	test_animation();
+	test_image_pipelined();
+	test_image_restarts();
+	test_image_load_batch();
+	test_image_async();
+	test_image_move_and_view();
+	test_image_pixel_ops();
+	test_image_buffered_io();
+	test_image_stored();
+	test_image_fast();
+	test_image_optimize();
+	test_image_transcode();
+	test_image_hashes();
+	test_image_templates();
+	test_image_orientation();
+	test_image_mipmaps();
 	
 	return 0;
 }